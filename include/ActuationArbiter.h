@@ -0,0 +1,125 @@
+#ifndef ACTUATION_ARBITER_H
+#define ACTUATION_ARBITER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "RelayManager.h"
+#include "LeaseStore.h"
+
+// Nguồn điều khiển relay
+enum ActuationSource : uint8_t {
+    SOURCE_SCHEDULE = 0,    // Bộ lập lịch tưới
+    SOURCE_RULE,            // Luật tự động (server/cục bộ)
+    SOURCE_MANUAL,          // Điều khiển thủ công qua MQTT
+    SOURCE_COUNT
+};
+
+// Mẫu xung của lease bật (onMs = 0: bật liên tục)
+struct LeasePattern {
+    uint32_t onMs;
+    uint32_t offMs;
+    uint16_t repeat;             // Số xung (0 = đến khi lease hết hạn)
+};
+
+// Lease của một nguồn trên một vùng
+struct ZoneLease {
+    bool active;                 // Lease có hiệu lực
+    bool state;                  // Trạng thái yêu cầu (true = bật, false = giữ tắt)
+    bool hasExpiry;              // Có thời hạn hay không
+    int64_t expiresAt;           // Thời điểm hết hạn (DeadlineTimer::nowUs())
+    LeasePattern pattern;        // Chỉ áp dụng xuống relay khi lease này thắng
+};
+
+class ActuationArbiter {
+public:
+    ActuationArbiter(RelayManager& relayManager);
+
+    // Khởi tạo cho số vùng tương ứng với số relay, khôi phục lease còn hạn từ lần chạy trước
+    void begin(int numZones);
+
+    // Các vùng có lease của nguồn được khôi phục khi khởi động
+    RelayMask getRestoredZones(ActuationSource source) const;
+
+    // Khôi phục lease có hạn của bản flash khi đã có giờ hợp lệ (gọi định kỳ, rẻ khi không có gì chờ).
+    // Trả về các vùng lịch tưới vừa khôi phục để báo cho TaskScheduler
+    RelayMask restoreDeferred();
+
+    // Cấp hoặc gia hạn lease (durationMs = 0: không hết hạn)
+    void acquire(ActuationSource source, int relayIndex, bool state, unsigned long durationMs = 0);
+
+    // Trả lại lease của một nguồn
+    void release(ActuationSource source, int relayIndex);
+
+    // Cấp/trả lease cho cả nhóm vùng; thay đổi được áp dụng xuống RelayManager
+    // trong một lần setRelays(). durationsMs theo chỉ số vùng (nullptr = không hết hạn)
+    void acquireMany(ActuationSource source, RelayMask zones, bool state, const unsigned long* durationsMs = nullptr);
+    void releaseMany(ActuationSource source, RelayMask zones);
+
+    // Như acquireMany nhưng nhận hạn chót tuyệt đối (µs, 0 = không hết hạn), để bên gọi
+    // dùng chung mốc thời gian với lease và timer relay
+    void acquireManyUntil(ActuationSource source, RelayMask zones, bool state, const int64_t* deadlinesUs);
+
+    // Độ ưu tiên của từng nguồn (cao hơn = thắng)
+    void setSourcePriority(ActuationSource source, uint8_t priority);
+
+    // Bản sao lease của một nguồn trên một vùng (false nếu không có lease)
+    bool getLease(ActuationSource source, int relayIndex, ZoneLease& out);
+
+    // Nguồn đang quyết định trạng thái vùng (SOURCE_COUNT nếu không có)
+    ActuationSource getOwner(int relayIndex);
+
+    // Xử lý lease hết hạn, gọi khi hạn chót đến (không cần gọi định kỳ)
+    void update();
+
+    // Task nhận thông báo khi lease hết hạn; task đó gọi update()
+    void setWorkerTask(TaskHandle_t task);
+
+    // Xử lý JSON lệnh điều khiển thủ công (topic control)
+    bool processCommand(const char* json);
+
+    // Lệnh cho nhiều vùng với cùng ngữ nghĩa như topic control: bit trong states = bật
+    // (durationsMs theo chỉ số vùng, nullptr/0 = không hết hạn), bit tắt = giữ tắt đến khi
+    // lease bật của nguồn khác kết thúc. Áp dụng trong một lần khóa và một lần ghi relay.
+    void command(ActuationSource source, RelayMask zones, RelayMask states, const unsigned long* durationsMs = nullptr);
+
+    static const char* sourceToString(ActuationSource source);
+
+private:
+    RelayManager& _relayManager;
+    int _numZones;
+    ZoneLease (*_leases)[SOURCE_COUNT];  // Lease theo [vùng][nguồn]
+    uint8_t* _owner;                     // Nguồn thắng hiện tại của từng vùng
+    ZoneLease* _applied;                 // Trạng thái đã áp dụng xuống RelayManager
+    uint8_t _priority[SOURCE_COUNT];
+    bool _hasNextExpiry;
+    int64_t _nextExpiry;                 // Lease hết hạn sớm nhất
+    DeadlineTimer _expiryTimer;          // Timer đặt theo _nextExpiry
+    TaskHandle_t _workerTask;
+    SemaphoreHandle_t _mutex;
+
+    // Thay đổi relay gom lại trong một thao tác, ghi xuống một lần bằng _flush()
+    RelayMask _batchMask;
+    RelayMask _batchState;
+    int64_t _batchDeadlines[IRRIGATION_MAX_ZONES];
+    RelayMask _batchPatternMask;         // Vùng cần đặt lại mẫu xung trước khi ghi relay
+    LeasePattern _batchPatterns[IRRIGATION_MAX_ZONES];
+
+    // Lưu bảng lease để khôi phục sau reset
+    LeaseStore _store;
+    StoredLease _storeBuffer[LEASE_STORE_CAPACITY];  // Giữ ngoài stack, dùng khi giữ _mutex
+    RelayMask _restored[SOURCE_COUNT];
+    StoredLease* _deferred;              // Lease có hạn từ bản flash chờ có giờ (nullptr = không có)
+
+    void _setLease(ActuationSource source, int relayIndex, bool state, int64_t expiresAt,
+                   const LeasePattern* pattern = nullptr);
+    void _recompute(int relayIndex);     // Tính lại trạng thái hiệu lực của một vùng
+    void _flush();                       // Áp dụng các thay đổi đã gom (gọi khi giữ _mutex)
+    void _recomputeNextExpiry();
+    int64_t _latestOtherLease(int relayIndex, ActuationSource source, int64_t now);
+    void _holdOff(ActuationSource source, int relayIndex);
+    static void _onExpiry(void* arg);
+    void _persist();                     // Lưu bảng lease (gọi khi giữ _mutex)
+    void _restore();
+};
+
+#endif // ACTUATION_ARBITER_H
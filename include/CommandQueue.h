@@ -0,0 +1,73 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "ZoneConfig.h"
+
+// Số slot lệnh cấp phát sẵn
+#define COMMAND_QUEUE_SLOTS 8
+// Độ dài tối đa của topic và payload; lệnh lớn hơn bị bỏ ngay khi nhận (đếm oversized).
+// Payload theo lệnh hợp lệ lớn nhất chứ không theo bộ đệm MQTT (bộ đệm đó tính cho bản tin
+// trạng thái gửi đi): lệnh control cho mọi vùng, mỗi vùng đủ id/state/duration/pattern
+// khoảng 80 byte, tối thiểu 1024 cho lệnh lịch tưới.
+#define COMMAND_TOPIC_MAX 64
+#define COMMAND_CONTROL_ESTIMATE (64 + IRRIGATION_MAX_ZONES * 80)
+#ifndef COMMAND_PAYLOAD_MAX
+#define COMMAND_PAYLOAD_MAX (COMMAND_CONTROL_ESTIMATE > 1024 ? COMMAND_CONTROL_ESTIMATE : 1024)
+#endif
+
+// Một lệnh MQTT đã chép khỏi buffer của PubSubClient
+struct CommandSlot {
+    char topic[COMMAND_TOPIC_MAX];
+    char payload[COMMAND_PAYLOAD_MAX + 1];  // Luôn kết thúc bằng '\0'
+    uint16_t length;
+    int64_t arrivalUs;                      // esp_timer_get_time() lúc nhận
+};
+
+// Bộ đếm của hàng đợi
+struct CommandQueueStats {
+    uint32_t received;      // Số lệnh đã nhận vào hàng đợi
+    uint32_t processed;     // Số lệnh worker đã xử lý
+    uint32_t dropped;       // Bỏ do hết slot (backpressure)
+    uint32_t oversized;     // Bỏ do topic/payload quá dài
+    uint32_t depth;         // Số lệnh đang chờ
+    uint32_t maxDepth;      // Số lệnh chờ lớn nhất từng ghi nhận
+};
+
+// Hàng đợi lệnh có giới hạn: callback MQTT chỉ chép lệnh vào một slot cấp phát
+// sẵn rồi trả về, worker task xử lý lệnh ngoài vòng lặp mạng.
+class CommandQueue {
+public:
+    typedef void (*Handler)(const char* topic, char* payload, unsigned int length);
+
+    CommandQueue();
+
+    // Tạo hàng đợi và worker task
+    bool begin(Handler handler, const char* taskName, uint32_t stackSize, UBaseType_t priority, BaseType_t core);
+
+    // Chép lệnh vào hàng đợi, không chặn. Trả về false nếu lệnh bị bỏ.
+    bool enqueue(const char* topic, const uint8_t* payload, unsigned int length);
+
+    CommandQueueStats getStats() const;
+
+private:
+    CommandSlot _slots[COMMAND_QUEUE_SLOTS];
+    QueueHandle_t _freeSlots;     // Chỉ số slot trống
+    QueueHandle_t _readySlots;    // Chỉ số slot chờ xử lý, theo thứ tự đến
+    Handler _handler;
+    TaskHandle_t _worker;
+
+    std::atomic<uint32_t> _received;
+    std::atomic<uint32_t> _processed;
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _oversized;
+    std::atomic<uint32_t> _maxDepth;
+
+    static void _workerTask(void* parameter);
+};
+
+// Hàng đợi lệnh MQTT dùng chung
+extern CommandQueue MqttCommands;
+
+#endif // COMMAND_QUEUE_H
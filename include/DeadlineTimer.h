@@ -0,0 +1,39 @@
+#ifndef DEADLINE_TIMER_H
+#define DEADLINE_TIMER_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+// Hẹn giờ một lần theo thời điểm tuyệt đối trên esp_timer (µs, 64 bit).
+// Dùng chung cho RelayManager, ActuationArbiter và TaskScheduler để mọi hạn
+// chót cùng một gốc thời gian; 64 bit µs không tràn trong thực tế.
+class DeadlineTimer {
+public:
+    typedef void (*Callback)(void* arg);
+
+    DeadlineTimer();
+
+    // Tạo timer, gọi trong begin() của module sở hữu
+    bool begin(const char* name, Callback callback, void* arg);
+
+    // Đặt lại hạn chót (hạn đã qua sẽ kích hoạt ngay)
+    void armAt(int64_t deadlineUs);
+
+    // Hủy hạn chót đang chờ
+    void cancel();
+
+    // Hạn chót đang chờ (0 = không có)
+    int64_t getDeadline() const { return _deadlineUs; }
+
+    // Thời gian hiện tại theo esp_timer
+    static int64_t nowUs() { return esp_timer_get_time(); }
+
+    // Hạn chót cách hiện tại ms mili giây
+    static int64_t afterMs(unsigned long ms) { return nowUs() + (int64_t)ms * 1000; }
+
+private:
+    esp_timer_handle_t _handle;
+    int64_t _deadlineUs;
+};
+
+#endif // DEADLINE_TIMER_H
@@ -0,0 +1,65 @@
+#ifndef DECISION_TRACE_H
+#define DECISION_TRACE_H
+
+#include <Arduino.h>
+
+// Số bản ghi tối đa trong vòng đệm (lũy thừa của 2)
+#define DECISION_TRACE_CAPACITY 64
+
+// Mã quyết định của bộ lập lịch
+enum TraceDecision : uint8_t {
+    TRACE_TIME_MATCH = 0,       // Đến giờ chạy
+    TRACE_STARTED,              // Đã bắt đầu chạy
+    TRACE_COMPLETED,            // Hết thời lượng, hoàn thành
+    TRACE_SKIP_TEMPERATURE,     // Bỏ qua do nhiệt độ ngoài ngưỡng
+    TRACE_SKIP_HUMIDITY,        // Bỏ qua do độ ẩm không khí ngoài ngưỡng
+    TRACE_SKIP_SOIL_MOISTURE,   // Bỏ qua do độ ẩm đất trên ngưỡng
+    TRACE_SKIP_RAIN,            // Bỏ qua do đang mưa
+    TRACE_SKIP_LIGHT,           // Bỏ qua do ánh sáng ngoài ngưỡng
+    TRACE_BLOCKED_PRIORITY,     // Không chạy được, vùng bận bởi lịch ưu tiên cao hơn/bằng
+    TRACE_PREEMPTED,            // Bị dừng bởi lịch ưu tiên cao hơn
+    TRACE_DELETED,              // Bị dừng do lịch bị xóa
+    TRACE_RESUMED,              // Vùng của lịch được khôi phục sau khi khởi động lại
+    TRACE_DECISION_COUNT
+};
+
+// Bản ghi nhị phân cố định (24 byte)
+struct TraceRecord {
+    uint32_t uptimeMs;          // millis() tại thời điểm ghi
+    int16_t taskId;             // Lịch liên quan
+    int16_t otherTaskId;        // Lịch gây ra quyết định (ngắt/chặn), -1 nếu không có
+    uint8_t decision;           // TraceDecision
+    uint8_t zone;               // Vùng liên quan (0 = không áp dụng)
+    uint16_t reserved;
+    float value;                // Giá trị đo được gây ra quyết định
+    float threshold;            // Ngưỡng so sánh
+    uint32_t sequence;          // Số thứ tự bản ghi
+};
+
+class DecisionTrace {
+public:
+    DecisionTrace();
+
+    // Ghi một quyết định - không cấp phát, chỉ giữ spinlock trong lúc chép bản ghi
+    void record(TraceDecision decision, int taskId, float value = 0, float threshold = 0,
+                int otherTaskId = -1, uint8_t zone = 0);
+
+    // Xuất tối đa maxRecords bản ghi mới nhất dưới dạng JSON. maxBytes > 0: bỏ bớt bản ghi
+    // cũ nhất cho tới khi chuỗi JSON không dài quá maxBytes (vd. vừa bộ đệm MQTT)
+    String toJson(const char* apiKey, size_t maxRecords, size_t maxBytes = 0);
+
+    // Tổng số bản ghi đã ghi kể từ khi khởi động
+    uint32_t getTotalRecords();
+
+    static const char* decisionToString(uint8_t decision);
+
+private:
+    TraceRecord _ring[DECISION_TRACE_CAPACITY];
+    uint32_t _sequence;         // Số bản ghi đã ghi (vị trí ghi = _sequence % capacity)
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+// Vòng đệm quyết định dùng chung cho bộ lập lịch
+extern DecisionTrace SchedulerTrace;
+
+#endif // DECISION_TRACE_H
@@ -2,8 +2,8 @@
 #define ENVIRONMENT_MANAGER_H
 
 #include <Arduino.h>
-#include <map>
 #include "SensorManager.h"
+#include "ZoneConfig.h"
 
 class EnvironmentManager {
 public:
@@ -30,6 +30,13 @@ public:
     void setCurrentHumidity(float hum);
     void setCurrentHeatIndex(float hi);
     
+    // Ước tính bốc thoát hơi nước tham chiếu ET0 (Hargreaves), cập nhật dần theo từng mẫu
+    void setLatitude(float latitudeDeg);           // Vĩ độ lắp đặt (độ, dương = Bắc)
+    void setReferenceEt0(float et0MmPerDay);       // ET0 ứng với thời lượng tưới gốc (mm/ngày)
+    void setCropCoefficient(int zone, float kc);   // Hệ số cây trồng Kc cho từng vùng
+    float getEt0();                                // ET0 hiện tại (mm/ngày), 0 nếu chưa có dữ liệu
+    float getDurationScale(int zone);              // Hệ số nhân thời lượng tưới cho vùng
+    
 private:
     SensorManager& _sensorManager;
     
@@ -37,12 +44,35 @@ private:
     float _temperature;
     float _humidity;
     float _heatIndex;
-    std::map<int, float> _soilMoisture;  // <zone_id, moisture_value>
+    float _soilMoisture[IRRIGATION_MAX_ZONES];  // Theo zone_id - 1
     bool _isRaining;
     int _lightLevel;
     
     // Thời điểm cập nhật gần nhất
     unsigned long _lastUpdateTime;
+    
+    // Bộ tích lũy ET0 trong ngày (không lưu lịch sử mẫu)
+    struct Et0Accumulator {
+        int dayOfYear;               // Ngày đang tích lũy (-1 = chưa bắt đầu)
+        float tMin;                  // Nhiệt độ thấp nhất trong ngày (°C)
+        float tMax;                  // Nhiệt độ cao nhất trong ngày (°C)
+        float tSum;                  // Tổng nhiệt độ các mẫu
+        uint32_t samples;            // Số mẫu nhiệt độ
+        float solarMJ;               // Bức xạ tích lũy từ cảm biến ánh sáng (MJ/m²)
+        bool lightSeen;              // Có dữ liệu ánh sáng trong ngày không
+        unsigned long lastSampleMs;  // Thời điểm mẫu trước (để tích phân ánh sáng)
+    };
+    Et0Accumulator _et0Acc;
+    float _extraterrestrialRad;      // Ra của ngày đang tích lũy (MJ/m²/ngày)
+    float _et0Today;                 // ET0 tạm tính cho ngày hiện tại
+    float _et0LastDay;               // ET0 của ngày đã kết thúc gần nhất (0 = chưa có)
+    float _latitudeDeg;
+    float _referenceEt0;
+    float _cropCoefficient[IRRIGATION_MAX_ZONES];  // Kc theo zone_id - 1 (mặc định 1.0)
+    
+    void _accumulateEt0Sample(float temp);
+    float _computeEt0(const Et0Accumulator& acc) const;
+    static float _extraterrestrialRadiation(float latitudeDeg, int dayOfYear);
 };
 
 #endif // ENVIRONMENT_MANAGER_H 
\ No newline at end of file
@@ -0,0 +1,92 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <Arduino.h>
+#include "ZoneConfig.h"
+
+// Số sự kiện giữ trong RTC slow memory (lũy thừa của 2, 16 byte mỗi sự kiện)
+#define FLIGHT_RECORDER_CAPACITY 128
+
+// Số sự kiện trong một bản tin MQTT khi gửi lại sau khởi động (dưới bộ đệm 1024 byte)
+#define FLIGHT_RECORDER_PAGE 6
+
+// Chu kỳ lấy mẫu heap/stack (ms); chỉ ghi khi xuống mức thấp mới
+#define FLIGHT_WATERMARK_INTERVAL_MS 5000
+#define FLIGHT_HEAP_STEP 1024       // Heap phải giảm thêm ít nhất chừng này byte mới ghi lại
+#define FLIGHT_STACK_STEP 64        // Tương tự cho stack còn trống
+
+// Loại sự kiện
+enum FlightEventType : uint8_t {
+    FLIGHT_BOOT = 0,            // Khởi động: arg = esp_reset_reason(), a = số lần khởi động
+    FLIGHT_RELAY,               // Relay đổi trạng thái: arg = nửa mặt nạ (0: relay 0-31, 1: 32-63), a = bật, b = tắt
+    FLIGHT_DECISION,            // Quyết định lập lịch: arg = task, a = quyết định | vùng << 8 | task gây ra << 16, b = giá trị (float)
+    FLIGHT_NETWORK,             // Trạng thái mạng đổi: arg = FLIGHT_NET_*, a = WiFi.status(), b = trạng thái MQTT client
+    FLIGHT_WATERMARK,           // Mức thấp mới: arg = FlightWatermark, a = giá trị (byte), b = giá trị phụ
+    FLIGHT_EVENT_COUNT
+};
+
+// Cờ trạng thái mạng của FLIGHT_NETWORK
+#define FLIGHT_NET_WIFI   0x01
+#define FLIGHT_NET_MQTT   0x02
+#define FLIGHT_NET_PORTAL 0x04
+
+// Nguồn của FLIGHT_WATERMARK
+enum FlightWatermark : uint8_t {
+    FLIGHT_WM_HEAP = 0,         // a = heap trống thấp nhất, b = heap trống hiện tại
+    FLIGHT_WM_CORE0_STACK,      // a = stack còn trống thấp nhất của Core0Task
+    FLIGHT_WM_CORE1_STACK,      // a = stack còn trống thấp nhất của Core1Task
+    FLIGHT_WM_COUNT
+};
+
+// Bản ghi nhị phân cố định (16 byte)
+struct FlightEvent {
+    uint32_t uptimeMs;          // millis() của lần chạy đã ghi sự kiện
+    uint32_t a;
+    uint32_t b;
+    uint16_t arg;
+    uint8_t type;               // FlightEventType
+    uint8_t check;              // Tổng kiểm tra các byte phía trên, loại bản ghi hỏng
+};
+
+// Hộp đen: vòng đệm các sự kiện điều khiển gần nhất trong RTC slow memory, giữ được
+// qua watchdog, panic, brown-out và reset mềm. Ghi chỉ tốn một spinlock và 16 byte nên
+// gọi được từ đường nóng. Sau khởi động, các sự kiện chưa gửi của những lần chạy trước
+// được chép ra và gửi qua MQTT kèm esp_reset_reason() khi có kết nối.
+class FlightRecorder {
+public:
+    FlightRecorder();
+
+    // Gọi một lần sớm trong setup(), trước khi có sự kiện nào
+    void begin();
+
+    void record(FlightEventType type, uint16_t arg, uint32_t a = 0, uint32_t b = 0);
+    void recordRelays(RelayMask onMask, RelayMask offMask);
+    void recordDecision(uint8_t decision, int taskId, uint8_t zone, int otherTaskId, float value);
+    void recordNetwork(uint8_t state, int wifiStatus, int mqttState);
+    // Chỉ ghi khi value thấp hơn lần ghi trước ít nhất step (lần đầu luôn ghi)
+    void recordWatermark(FlightWatermark source, uint32_t value, uint32_t extra, uint32_t step);
+
+    // Bản sao các sự kiện chưa gửi của những lần chạy trước
+    bool hasDump() const { return _dumpCount > 0; }
+    size_t dumpPages() const { return (_dumpCount + FLIGHT_RECORDER_PAGE - 1) / FLIGHT_RECORDER_PAGE; }
+    String dumpJson(const char* apiKey, size_t page);
+    // Đánh dấu đã gửi xong: lần khởi động sau không gửi lại các sự kiện này
+    void markDumped();
+
+    uint8_t getResetReason() const { return _resetReason; }
+    static const char* resetReasonToString(uint8_t reason);
+
+private:
+    FlightEvent* _dump;         // Cấp phát trong begin(), giải phóng sau khi gửi
+    size_t _dumpCount;
+    uint32_t _dumpEnd;          // Số thứ tự ngay sau sự kiện cuối của bản sao
+    uint8_t _resetReason;
+    uint32_t _watermarks[FLIGHT_WM_COUNT]; // Giá trị đã ghi gần nhất (RAM, tính lại mỗi lần chạy)
+    volatile bool _ready;       // Vùng RTC đã được kiểm tra; trước đó bỏ qua mọi sự kiện
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+// Hộp đen dùng chung
+extern FlightRecorder FlightLog;
+
+#endif // FLIGHT_RECORDER_H
@@ -0,0 +1,77 @@
+#ifndef LATENCY_MONITOR_H
+#define LATENCY_MONITOR_H
+
+#include <Arduino.h>
+
+// Số bucket của histogram: 2 bucket mỗi bậc lũy thừa 2, phủ 0 µs .. 2^32 µs
+#define LATENCY_BUCKETS 64
+
+// Histogram độ trễ với bucket cố định, không cấp phát
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint32_t us);
+    void reset();
+
+    uint32_t getCount() const { return _count; }
+    uint32_t getMax() const { return _max; }
+
+    // Phân vị (0-100), trả về cận trên của bucket chứa phân vị (µs)
+    uint32_t percentile(float p) const;
+
+private:
+    uint32_t _buckets[LATENCY_BUCKETS];
+    uint32_t _count;
+    uint32_t _max;
+
+    static uint8_t _bucketIndex(uint32_t us);
+    static uint32_t _bucketUpperBound(uint8_t index);
+};
+
+// Các chặng của một lệnh điều khiển relay
+enum LatencyStage : uint8_t {
+    LATENCY_QUEUE = 0,      // Nhận MQTT -> worker lấy ra khỏi hàng đợi
+    LATENCY_PROCESS,        // Worker lấy ra -> ghi GPIO
+    LATENCY_PUBLISH,        // Ghi GPIO -> công bố trạng thái
+    LATENCY_END_TO_END,     // Nhận MQTT -> công bố trạng thái
+    LATENCY_STAGE_COUNT
+};
+
+// Đo độ trễ điều khiển từ lúc nhận lệnh đến lúc trạng thái được công bố
+class ActuationLatencyMonitor {
+public:
+    ActuationLatencyMonitor();
+
+    // Worker bắt đầu/kết thúc xử lý một lệnh nhận lúc arrivalUs (esp_timer)
+    void beginCommand(int64_t arrivalUs);
+    void endCommand();
+
+    // RelayManager gọi khi ghi GPIO; chỉ ghi nhận khi đang trong ngữ cảnh lệnh
+    void markGpioWrite();
+
+    // Gọi sau khi công bố trạng thái relay
+    void markStatusPublished();
+
+    // Xuất phân vị của chu kỳ hiện tại rồi bắt đầu chu kỳ mới
+    String toJson(const char* apiKey, bool reset = true);
+
+    static const char* stageToString(uint8_t stage);
+
+private:
+    LatencyHistogram _stages[LATENCY_STAGE_COUNT];
+    TaskHandle_t _commandTask;       // Task đang xử lý lệnh (nullptr nếu không có)
+    int64_t _arrivalUs;
+    int64_t _dequeueUs;
+    bool _gpioSeen;                  // Lệnh hiện tại đã ghi GPIO
+    int64_t _pendingArrivalUs;       // Lệnh đã ghi GPIO, chờ công bố trạng thái
+    int64_t _pendingGpioUs;
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+    void _record(LatencyStage stage, int64_t us);
+};
+
+// Bộ đo độ trễ điều khiển dùng chung
+extern ActuationLatencyMonitor ActuationLatency;
+
+#endif // LATENCY_MONITOR_H
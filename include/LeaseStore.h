@@ -0,0 +1,57 @@
+#ifndef LEASE_STORE_H
+#define LEASE_STORE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "ZoneConfig.h"
+
+// Số lease tối đa lưu được (vùng x 3 nguồn điều khiển)
+#define LEASE_STORE_CAPACITY (IRRIGATION_MAX_ZONES * 3)
+
+// Ghi thêm bản sao vào NVS để khôi phục sau mất điện (mặc định tắt để tránh hao mòn flash).
+// Bản flash chỉ giữ endUnix (remainingMs = 0): lease có hạn được khôi phục khi đã có giờ
+// hợp lệ, lease lưu lúc chưa có giờ thì không khôi phục được
+#ifndef LEASE_STORE_FLASH_FALLBACK
+#define LEASE_STORE_FLASH_FALLBACK 0
+#endif
+
+// Cờ của một lease đã lưu
+#define STORED_LEASE_ACTIVE  0x01
+#define STORED_LEASE_ON      0x02
+#define STORED_LEASE_EXPIRES 0x04
+
+// Lease ở dạng độc lập với lần khởi động (esp_timer bắt đầu lại từ 0 sau reset)
+struct StoredLease {
+    uint32_t endUnix;           // Thời điểm hết hạn theo Unix time (0 = chưa có giờ)
+    uint32_t remainingMs;       // Thời gian còn lại tại lúc lưu, dùng khi không có giờ
+    uint32_t patternOnMs;       // Mẫu xung của lease bật (0 = bật liên tục)
+    uint32_t patternOffMs;
+    uint16_t patternRepeat;
+    uint8_t flags;              // STORED_LEASE_*
+    uint8_t reserved;
+};
+
+// Lưu bảng lease vào RTC memory (giữ qua reset mềm, watchdog, panic) và tùy chọn NVS
+class LeaseStore {
+public:
+    LeaseStore();
+
+    void begin();
+
+    // Lưu toàn bộ bảng lease (count = số vùng x số nguồn)
+    void save(const StoredLease* leases, uint16_t count);
+
+    // Đọc bảng lease đã lưu; false nếu không có bản hợp lệ cho đúng count
+    bool load(StoredLease* out, uint16_t count);
+
+    // Xóa bản đã lưu
+    void clear();
+
+private:
+#if LEASE_STORE_FLASH_FALLBACK
+    Preferences _preferences;
+    uint32_t _lastFlashCrc;
+#endif
+};
+
+#endif // LEASE_STORE_H
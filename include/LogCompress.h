@@ -0,0 +1,23 @@
+#ifndef LOG_COMPRESS_H
+#define LOG_COMPRESS_H
+
+#include <Arduino.h>
+
+// Byte-aligned LZSS for MQTT log frames (decoder: tools/logdecode.py).
+// Each control byte covers the next 8 items, LSB first: bit 0 = literal byte,
+// bit 1 = 2-byte match, offset - 1 in 12 bits and length - 3 in 4 bits:
+//   b0 = (offset - 1) & 0xFF, b1 = ((offset - 1) >> 8) << 4 | (length - 3)
+// The window is the input itself, so only the hash table (LOG_LZ_HASH_SIZE x 2 bytes,
+// on the stack) is needed.
+#define LOG_LZ_HASH_SIZE  256
+#define LOG_LZ_MIN_MATCH  3
+#define LOG_LZ_MAX_MATCH  18
+#define LOG_LZ_WINDOW     4096
+
+class LogCompress {
+public:
+    // Returns the compressed size, or 0 if the output would not be smaller than the input
+    static size_t compress(const uint8_t* in, size_t len, uint8_t* out, size_t cap);
+};
+
+#endif // LOG_COMPRESS_H
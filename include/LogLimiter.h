@@ -0,0 +1,84 @@
+#ifndef LOG_LIMITER_H
+#define LOG_LIMITER_H
+
+#include <Arduino.h>
+#include <limits.h>
+
+// Flood control for the log drain task.
+//
+// 1. A record identical to the previous one (level, tag and text) is not printed again;
+//    "Last message repeated N times" is reported instead when a different record
+//    arrives or the repeats stop.
+// 2. Each call site gets a token bucket: LOG_LIMIT_BURST records at once, then one
+//    per LOG_LIMIT_REFILL_MS. A call site is the tag plus the format token for macro
+//    records, or the tag plus the text with digits ignored for String records, so
+//    "Attempt 3" and "Attempt 4" count as the same message. Suppressed records are
+//    counted and reported once the burst is over.
+#define LOG_LIMIT_SLOTS     32     // Call sites tracked at once (power of two)
+#define LOG_LIMIT_BURST     10
+#define LOG_LIMIT_REFILL_MS 1000
+#define LOG_LIMIT_QUIET_MS  5000   // A burst is over after this long without suppression
+#define LOG_LIMIT_REPORT_MS 30000  // Longest wait for a report while a burst goes on
+#define LOG_LIMIT_TAG_MAX   16
+#define LOG_LIMIT_TEXT_MAX  48     // Excerpt of the suppressed message in the report
+
+struct LogLimitReport {
+    uint8_t level;
+    bool repeated;                 // true: identical repeats, false: call site rate limit
+    uint32_t count;
+    uint32_t durationMs;           // From the first to the last suppressed record
+    char tag[LOG_LIMIT_TAG_MAX];
+    char text[LOG_LIMIT_TEXT_MAX];
+};
+
+// Not thread-safe: used only by the log drain task.
+class LogLimiter {
+public:
+    LogLimiter();
+
+    // Returns false if the record is suppressed. If repeats of the previous record end
+    // here, their report is returned in repeat (repeat.count > 0); it belongs before
+    // this record in the output.
+    bool allow(uint8_t level, const char* tag, uint16_t formatToken, const char* text,
+               unsigned long now, LogLimitReport& repeat);
+
+    // Reports of finished bursts; call until it returns false
+    bool poll(unsigned long now, LogLimitReport& report);
+    // Milliseconds until poll() has something to report, ULONG_MAX if nothing is pending
+    unsigned long nextPoll(unsigned long now) const;
+
+    uint32_t suppressed() const { return _suppressed; }
+
+private:
+    struct Slot {
+        uint32_t key;              // 0 = empty
+        uint32_t refilled;         // millis() of the last token refill
+        uint32_t firstSuppressed;
+        uint32_t lastSuppressed;
+        uint16_t tokens;
+        uint16_t count;            // Suppressed since the last report
+        uint8_t level;
+        char tag[LOG_LIMIT_TAG_MAX];
+        char text[LOG_LIMIT_TEXT_MAX];
+    };
+
+    Slot _slots[LOG_LIMIT_SLOTS];
+
+    // Identical-repeat state
+    uint32_t _lastIdentity;
+    uint32_t _repeats;
+    uint32_t _firstRepeat;
+    uint32_t _lastRepeat;
+    uint8_t _repeatLevel;
+    char _repeatTag[LOG_LIMIT_TAG_MAX];
+    char _repeatText[LOG_LIMIT_TEXT_MAX];
+
+    uint32_t _suppressed;          // Total since boot
+
+    Slot* _find(uint32_t key, unsigned long now);
+    void _refill(Slot& slot, unsigned long now);
+    void _takeRepeats(LogLimitReport& report);
+    static void _takeSlot(Slot& slot, LogLimitReport& report);
+};
+
+#endif // LOG_LIMITER_H
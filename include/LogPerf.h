@@ -0,0 +1,58 @@
+#ifndef LOG_PERF_H
+#define LOG_PERF_H
+
+#include <Arduino.h>
+
+// Per-event performance aggregation for the perf log path. Each event name gets one
+// slot in a fixed table with count, failures, min, max, total and a log-scale histogram
+// for percentiles; the logger publishes the table once per window and then resets it.
+#define LOG_PERF_EVENTS   16   // Distinct event names tracked; later names are only counted
+#define LOG_PERF_NAME_MAX 32
+#define LOG_PERF_TAG_MAX  16
+// Histogram: 0 and 1 ms get one bucket each, then every power of two is split in two
+// halves (2, 3, 4-5, 6-7, 8-11, 12-15, ...), so a reported percentile is at most 50%
+// above the true value. Durations past the last bucket (~13 min) are counted in it.
+#define LOG_PERF_BUCKETS  40
+
+struct LogPerfEvent {
+    uint16_t token;                  // LogToken hash of the name
+    char name[LOG_PERF_NAME_MAX];
+    char tag[LOG_PERF_TAG_MAX];
+    uint32_t count;
+    uint32_t failures;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint16_t buckets[LOG_PERF_BUCKETS]; // Saturating counts
+};
+
+// Not thread-safe: used only by the log drain task.
+class LogPerf {
+public:
+    LogPerf();
+
+    // Returns false if the table is full and the event has no slot
+    bool add(uint16_t token, const char* tag, const char* name, uint32_t durationMs, bool success);
+
+    // Duration (ms) below which pct percent of the window's measurements fall:
+    // upper edge of the bucket, clamped to the observed min/max
+    static uint32_t percentile(const LogPerfEvent& event, uint8_t pct);
+
+    size_t size() const { return _size; }
+    const LogPerfEvent& at(size_t index) const { return _events[index]; }
+    bool hasData() const;
+    uint32_t untracked() const { return _untracked; }
+
+    // Start a new window: counters are cleared, slots keep their names
+    void reset();
+
+private:
+    LogPerfEvent _events[LOG_PERF_EVENTS];
+    size_t _size;
+    uint32_t _untracked; // Measurements of events that found no free slot, this window
+
+    static uint8_t _bucket(uint32_t durationMs);
+    static uint32_t _bucketUpper(uint8_t bucket);
+};
+
+#endif // LOG_PERF_H
@@ -0,0 +1,74 @@
+#ifndef LOG_STORE_H
+#define LOG_STORE_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+
+// Append-only log ring in a dedicated flash partition ("logs" in partitions.csv).
+// Sectors are used round-robin, so every sector is erased once per lap of the ring
+// (wear levelling); when the ring is full the oldest sector is overwritten.
+//
+// Sector: header (magic, u32 sequence, u8 state 0xFF = may hold pending entries,
+// 0x00 = drained), then entries: u8 marker, u16 length (LE), payload. The marker is
+// LOG_STORE_PENDING when written and is cleared to LOG_STORE_SENT in place (NOR flash
+// can clear bits without an erase) once the entry has been replayed.
+#define LOG_STORE_PARTITION   "logs"
+#define LOG_STORE_SECTOR_SIZE 4096
+#define LOG_STORE_HEADER_SIZE 16
+#define LOG_STORE_MAGIC       0x53474F4C  // "LOGS"
+#define LOG_STORE_PENDING     0xA5
+#define LOG_STORE_SENT        0x25
+#define LOG_STORE_BUFFER      512         // RAM write buffer; flash is written in these batches
+#define LOG_STORE_ENTRY_MAX   384
+
+struct LogStoreStats {
+    uint32_t sectors;        // Sectors in the partition (0 = not available)
+    uint32_t stored;         // Entries written since boot
+    uint32_t replayed;       // Entries marked as sent since boot
+    uint32_t lostSectors;    // Sectors overwritten while still holding pending entries
+};
+
+// Not thread-safe: used only by the log drain task.
+class LogStore {
+public:
+    LogStore();
+
+    // Finds the partition, locates the oldest pending entry and opens a fresh sector
+    bool begin(const char* label = LOG_STORE_PARTITION);
+    bool isReady() const { return _partition != nullptr; }
+
+    bool append(const uint8_t* payload, size_t len);
+    void flush();                                  // Write the RAM buffer to flash
+    bool hasBufferedData() const { return _bufferLen > 0; }
+
+    // Next pending entry, oldest first. address identifies it for markSent()/seek().
+    bool readNext(uint8_t* payload, size_t cap, size_t& len, uint32_t& address);
+    bool hasPending() const;
+    void markSent(uint32_t address);
+    void seek(uint32_t address);                   // Re-read from address (e.g. after a failed send)
+
+    LogStoreStats getStats() const;
+
+private:
+    const esp_partition_t* _partition;
+    uint32_t _sectorCount;
+
+    uint32_t _writeSector;
+    uint32_t _writeOffset;    // Flash offset within the sector where the buffer starts
+    uint32_t _writeSequence;
+    uint8_t _buffer[LOG_STORE_BUFFER];
+    size_t _bufferLen;
+
+    uint32_t _readSector;
+    uint32_t _readOffset;
+
+    uint32_t _stored;
+    uint32_t _replayed;
+    uint32_t _lostSectors;
+
+    bool _readHeader(uint32_t sector, uint32_t& sequence, uint8_t& state);
+    void _openSector(uint32_t sector);
+    void _setDrained(uint32_t sector);
+};
+
+#endif // LOG_STORE_H
@@ -0,0 +1,66 @@
+#ifndef LOG_TAG_LEVELS_H
+#define LOG_TAG_LEVELS_H
+
+#include <Arduino.h>
+#include <atomic>
+
+// Per-tag overrides of the Serial and MQTT log levels, keyed by the 16-bit tag token
+// (LOG_TOKEN / LogToken::hash of the tag). Open addressing with linear probing over a
+// fixed table, so a lookup is a few loads and never allocates or locks.
+//
+// Each slot is one packed word, written atomically:
+//   bits 0-15 tag token (0 = empty slot), 16-19 Serial level, 20-23 MQTT level
+//   (LOG_TAG_LEVEL_UNSET = no override for that target)
+// Slots are never emptied again, which keeps probe chains intact; a slot with no
+// override left is reused for the next new tag on its chain.
+#define LOG_TAG_LEVEL_SLOTS 16   // Power of two
+#define LOG_TAG_LEVEL_UNSET 0xF
+
+enum LogTarget {
+    LOG_TARGET_SERIAL = 0,
+    LOG_TARGET_MQTT = 1
+};
+
+class LogTagLevels {
+public:
+    LogTagLevels();
+
+    // Packed slot of the tag, 0 if it has no override. Safe from any task.
+    uint32_t find(uint16_t tagToken) const {
+        if (_count.load(std::memory_order_relaxed) == 0) {
+            return 0; // Common case: no overrides at all
+        }
+        for (uint32_t i = 0; i < LOG_TAG_LEVEL_SLOTS; i++) {
+            uint32_t slot = _slots[(tagToken + i) & (LOG_TAG_LEVEL_SLOTS - 1)].load(std::memory_order_acquire);
+            if (slot == 0) {
+                return 0;
+            }
+            if ((slot & 0xFFFF) == tagToken) {
+                return slot;
+            }
+        }
+        return 0;
+    }
+
+    // Level for target from a slot returned by find(), or fallback without an override
+    static uint8_t level(uint32_t slot, LogTarget target, uint8_t fallback) {
+        uint8_t value = (slot >> (16 + 4 * target)) & 0xF;
+        return slot != 0 && value != LOG_TAG_LEVEL_UNSET ? value : fallback;
+    }
+
+    // Writers must not run concurrently (the logconfig command handler is the only one).
+    // level LOG_TAG_LEVEL_UNSET removes the override. Returns false if the table is full.
+    bool set(uint16_t tagToken, LogTarget target, uint8_t level);
+    void clear();
+    uint32_t count() const { return _count.load(); }
+
+private:
+    std::atomic<uint32_t> _slots[LOG_TAG_LEVEL_SLOTS];
+    std::atomic<uint32_t> _count; // Slots holding at least one override
+
+    static bool _hasOverride(uint32_t slot) {
+        return slot != 0 && (slot & 0x00FF0000) != 0x00FF0000;
+    }
+};
+
+#endif // LOG_TAG_LEVELS_H
@@ -0,0 +1,55 @@
+#ifndef LOG_TOKEN_H
+#define LOG_TOKEN_H
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <type_traits>
+
+// Tokenized log encoding. Format strings, tags and perf event names are identified by a
+// 16-bit FNV-1a hash; tools/log_dictionary.py computes the same IDs from the sources and
+// tools/logdecode.py rebuilds the text on the host.
+//
+// Arguments are encoded in format order:
+//   %d %i            zigzag varint
+//   %u %x %X %o %c %p  varint
+//   %f %e %g %a      float32 little-endian
+//   %s               u8 length + bytes
+//   * width/precision  zigzag varint before the value
+// Length modifiers (h, l, ll, z...) only select the C type; the encoding is the same.
+
+#define LOG_TOKEN_FNV_OFFSET 2166136261u
+#define LOG_TOKEN_FNV_PRIME  16777619u
+
+constexpr uint32_t logTokenHash(const char* s, uint32_t h) {
+    return *s ? logTokenHash(s + 1, (h ^ (uint8_t)*s) * LOG_TOKEN_FNV_PRIME) : h;
+}
+
+constexpr uint16_t logTokenFold(uint32_t h) {
+    return (uint16_t)((h >> 16) ^ h) != 0 ? (uint16_t)((h >> 16) ^ h) : 1; // 0 = untokenized text
+}
+
+constexpr uint16_t logToken(const char* s) {
+    return logTokenFold(logTokenHash(s, LOG_TOKEN_FNV_OFFSET));
+}
+
+// Token of a string literal, evaluated by the compiler
+#define LOG_TOKEN(literal) (std::integral_constant<uint16_t, logToken(literal)>::value)
+
+class LogToken {
+public:
+    // Same value as logToken(), for strings only known at runtime (tags, String perf events)
+    static uint16_t hash(const char* s);
+
+    // Encodes the arguments described by format; returns bytes written. truncated is set
+    // when cap was reached (string arguments keep their prefix, the rest is dropped).
+    static size_t encodeArgs(uint8_t* out, size_t cap, const char* format, va_list args, bool& truncated);
+
+    // Renders format with encoded arguments into text (always '\0'-terminated)
+    static size_t format(char* out, size_t cap, const char* format, const uint8_t* args, size_t len);
+
+    // LEB128 varint; writeVarint returns 0 if it does not fit
+    static size_t writeVarint(uint8_t* out, size_t cap, uint64_t value);
+    static bool readVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value);
+};
+
+#endif // LOG_TOKEN_H
@@ -0,0 +1,75 @@
+#ifndef LOG_WEB_SINK_H
+#define LOG_WEB_SINK_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+// Live log tail over WebSocket (ws://<device>/ws/logs), served by the local web server
+// so it works without the MQTT broker. Each client receives the Serial-format lines of
+// the records that pass its filter; it sets the filter by sending
+//   {"level":"DEBUG","tag":"NetMgr"}     (tag "" or missing = all tags)
+//
+// Memory is bounded per client: lines are collected in a LOG_WS_BUFFER byte buffer and
+// sent as one message when the client's queue has room (the library queue itself is
+// limited by WS_MAX_QUEUED_MESSAGES). If a client cannot take data for
+// LOG_WS_STALL_MS, lines are dropped meanwhile and the client is disconnected;
+// the logger never waits for it.
+#define LOG_WS_PATH          "/ws/logs"
+#define LOG_WS_MAX_CLIENTS   3
+#define LOG_WS_BUFFER        1024
+#define LOG_WS_STALL_MS      5000
+#define LOG_WS_RETRY_MS      50     // Drain task re-check while a buffer waits for its client
+#define LOG_WS_DEFAULT_LEVEL 4      // INFO
+#define LOG_WS_TAG_MAX       16
+
+class LogWebSink {
+public:
+    LogWebSink();
+
+    // Handler to register with the AsyncWebServer
+    AsyncWebSocket* handler() { return &_ws; }
+
+    // Highest level any connected client wants (0 = no client); safe from any task
+    uint8_t level() const { return _level; }
+
+    // Drain task only:
+    bool wants(uint8_t level, uint16_t tagToken) const;
+    void send(uint8_t level, uint16_t tagToken, const char* line, size_t len);
+    void flush();                                  // Send buffered lines to clients that can take them
+    bool hasPending() const;
+
+    uint32_t clients() const { return _clientCount; }
+    uint32_t droppedClients() const { return _droppedClients; }
+
+private:
+    // Written by the web server task (connect, filter, disconnect) under _lock
+    struct Client {
+        uint32_t id;                 // 0 = free
+        uint8_t level;
+        uint16_t tagToken;           // 0 = all tags
+        char tag[LOG_WS_TAG_MAX];
+    };
+    // Drain task only
+    struct Buffer {
+        uint32_t owner;              // Client id the buffered lines belong to
+        uint32_t stalledSince;       // millis() of the first line that did not fit, 0 = not stalled
+        size_t length;
+        char data[LOG_WS_BUFFER];
+    };
+
+    AsyncWebSocket _ws;
+    Client _clients[LOG_WS_MAX_CLIENTS];
+    Buffer _buffers[LOG_WS_MAX_CLIENTS];
+    volatile uint8_t _level;
+    volatile uint32_t _clientCount;
+    volatile uint32_t _droppedClients;
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+    void _onEvent(AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, size_t len);
+    void _setFilter(AsyncWebSocketClient* client, const char* level, const char* tag);
+    void _updateLevel(); // Caller holds _lock
+    bool _flushClient(size_t index, uint32_t id);
+    void _drop(size_t index, uint32_t id);
+};
+
+#endif // LOG_WEB_SINK_H
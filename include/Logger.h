@@ -3,7 +3,45 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include <atomic>
+#include <stdarg.h>
 #include "NetworkManager.h" // Required for the Logger to send logs via MQTT
+#include "LogToken.h"
+#include "LogCompress.h"
+#include "LogStore.h"
+#include "LogPerf.h"
+#include "LogLimiter.h"
+#include "LogTagLevels.h"
+#include "LogWebSink.h"
+
+// Ring buffer sizing (slot count must be a power of two)
+#define LOG_RING_SLOTS 64
+#define LOG_TAG_MAX 16          // Including the terminating '\0'
+#define LOG_MESSAGE_MAX 160     // Including the terminating '\0'; longer messages are truncated
+
+// MQTT frames: records are batched and published when the frame is full, when the
+// oldest record is LOG_BATCH_INTERVAL_MS old, or at once for ERROR/CRITICAL
+#define LOG_BATCH_FRAME_MAX 896       // Whole payload; must fit MQTT_BUFFER_SIZE with the topic
+#define LOG_BATCH_INTERVAL_MS 2000
+#ifndef LOG_BATCH_COMPRESS
+#define LOG_BATCH_COMPRESS 1          // LZSS-compress binary frames when it saves space
+#endif
+
+// Records that cannot be sent (MQTT down) go to the flash log store and are replayed
+// after reconnect, at most LOG_REPLAY_BATCH records per LOG_REPLAY_INTERVAL_MS
+#define LOG_STORE_FLUSH_MS 5000         // Longest time buffered records wait for a flash write
+#define LOG_REPLAY_INTERVAL_MS 500
+#define LOG_REPLAY_BATCH 8
+
+// Perf events are aggregated per event name (LogPerf.h) and published as one summary
+// per window; only events at or above the threshold are also sent on their own
+#define LOG_PERF_WINDOW_MS 60000
+#define LOG_PERF_THRESHOLD_MS 1000
+
+// Drain task settings
+#define LOG_DRAIN_STACK_SIZE 6144
+#define LOG_DRAIN_PRIORITY 1    // Below every control task
+#define LOG_DRAIN_CORE 0
 
 // Define log levels
 enum LogLevel {
@@ -15,20 +53,78 @@ enum LogLevel {
     LOG_LEVEL_DEBUG = 5    // Detailed information for debugging (e.g., variable values, minor steps)
 };
 
-// Structure to store a single log record
-struct LogEntry {
-    unsigned long timestamp; // Log timestamp (Unix time or millis() if NTP not synced)
-    LogLevel level;          // Log level
-    String tag;              // Tag to identify the log source (e.g., "RelayMgr", "Core0Task")
-    String message;          // Log message content
-    // Other fields can be added if needed: coreId, freeHeap, etc.
+// Compile-time minimum level for the LOG* macros below (numeric LogLevel value, e.g.
+// -DLOG_COMPILE_LEVEL=3 keeps WARNING and above). Calls above it are removed by the
+// preprocessor together with their arguments.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL 5
+#endif
+
+// MQTT log payload: one JSON object per record, or tokenized binary frames
+enum LogMqttFormat {
+    LOG_MQTT_JSON = 0,
+    LOG_MQTT_BINARY = 1
+};
+
+// Binary frame: magic, version, u8 flags (0x01 = body compressed, LogCompress),
+// u8 API key length + key, varint sequence, then the body: one or more entries
+//   u8  level (bits 0-2) | perf 0x08 | success 0x10 | truncated 0x20 | core 1 0x40 | replayed 0x80
+//   varint timestamp, u16 tag token, u16 format/event token (0 = plain text), u8 length + arguments
+// Arguments: LogToken encoding for tokenized records, raw text for plain records,
+// varint duration + varint free heap + details text for perf records.
+// JSON frame: {"api_key": ..., "seq": n, "logs": [record objects]}
+#define LOG_BINARY_MAGIC   0x4C  // 'L'
+#define LOG_BINARY_VERSION 2
+#define LOG_BINARY_FLAG_COMPRESSED 0x01
+#define LOG_BINARY_ENTRY_MAX (16 + LOG_MESSAGE_MAX)
+#define LOG_API_KEY_MAX 64       // Longer keys are cut in binary frames
+
+// Record flags
+#define LOG_FLAG_PERF       0x01  // message = event name, value = duration (ms)
+#define LOG_FLAG_SUCCESS    0x02  // Perf event succeeded
+#define LOG_FLAG_NO_MQTT    0x04  // Produced by the drain task itself, never forwarded to MQTT
+#define LOG_FLAG_TRUNCATED  0x08  // Message did not fit in LOG_MESSAGE_MAX
+#define LOG_FLAG_REPLAYED   0x10  // Read back from the flash log store
+
+// Fixed-size log record, copied into the ring by the producer
+struct LogRecord {
+    uint32_t timestamp;      // Unix time, or millis() if NTP not synced
+    uint32_t freeHeap;       // Free heap at the time of the call
+    uint32_t value;          // Perf duration (ms)
+    const char* format;      // Tokenized records: literal format, message holds encoded arguments
+    uint16_t token;          // Format or perf event token, 0 for plain text
+    uint16_t tagToken;       // LogToken hash of tag (per-tag levels, binary frames)
+    uint8_t level;           // LogLevel
+    uint8_t coreId;          // Core of the calling task
+    uint8_t flags;           // LOG_FLAG_*
+    uint8_t length;          // Encoded argument bytes (tokenized records)
+    char tag[LOG_TAG_MAX];
+    char message[LOG_MESSAGE_MAX];
+};
+
+// Ring buffer counters
+struct LoggerStats {
+    uint32_t queued;         // Records accepted into the ring
+    uint32_t dropped;        // Records lost because the ring was full
+    uint32_t truncated;      // Messages cut to LOG_MESSAGE_MAX
+    uint32_t depth;          // Records waiting for the drain task
+    uint32_t maxDepth;       // Highest depth seen
+    uint32_t frames;         // MQTT frames published
+    uint32_t frameBytes;     // Payload bytes of those frames
+    uint32_t stored;         // Records written to the flash log store (MQTT down)
+    uint32_t replayed;       // Stored records sent after reconnect
+    uint32_t replaySkipped;  // Stored records discarded as unreadable or too large for any frame
+    uint32_t storeLost;      // Flash sectors overwritten before they were replayed
+    uint32_t suppressed;     // Records held back as repeats or by the call-site rate limit
+    uint32_t webClients;     // Browsers connected to the live log WebSocket
+    uint32_t webDropped;     // Of those, disconnected for falling behind
 };
 
 class Logger {
 public:
     Logger();
 
-    // Initialize the Logger
+    // Initialize the Logger and start the drain task
     // networkManager: pointer to the NetworkManager object for sending MQTT logs
     // initialSerialLogLevel: Initial log level for Serial output
     // initialMqttLogLevel: Initial log level for MQTT output
@@ -41,11 +137,41 @@ public:
     void info(const String& tag, const String& message);
     void debug(const String& tag, const String& message);
 
-    // General logging function, more flexible
+    // General logging function, more flexible. Never blocks: the record is copied into
+    // the ring and formatted/sent later by the drain task.
     void log(LogLevel level, const String& tag, const String& message);
-    // Logging function with printf-style formatting
+    // Logging function with printf-style formatting (formats straight into the ring slot)
     void logf(LogLevel level, const String& tag, const char* format, ...);
 
+    // Allocation-free path used by the LOG* macros: tag and format are literals, the
+    // arguments are binary-encoded into the ring slot and formatted by the drain task.
+    void write(LogLevel level, const char* tag, uint16_t tagToken, uint16_t token, const char* format, ...) __attribute__((format(printf, 6, 7)));
+    void writePerf(const char* tag, uint16_t token, const char* eventName, unsigned long durationMs, bool success, const char* details = "");
+
+    // True if Serial, MQTT or a live log client currently records this level; the macros
+    // test it before evaluating any argument
+    bool enabled(LogLevel level) const {
+        LogLevel serialLevel = _serialLogLevel;
+        LogLevel mqttLevel = _mqttLogLevel;
+        return (level <= serialLevel && serialLevel != LOG_LEVEL_NONE) ||
+               (level <= mqttLevel && mqttLevel != LOG_LEVEL_NONE) || _webEnabled(level);
+    }
+    // Same, with the per-tag overrides of the tag (O(1) table lookup, no allocation)
+    bool enabled(LogLevel level, uint16_t tagToken) const {
+        uint32_t slot = _tagLevels.find(tagToken);
+        if (slot == 0) {
+            return enabled(level);
+        }
+        uint8_t serialLevel = LogTagLevels::level(slot, LOG_TARGET_SERIAL, _serialLogLevel);
+        uint8_t mqttLevel = LogTagLevels::level(slot, LOG_TARGET_MQTT, _mqttLogLevel);
+        return (level <= serialLevel && serialLevel != LOG_LEVEL_NONE) ||
+               (level <= mqttLevel && mqttLevel != LOG_LEVEL_NONE) || _webEnabled(level);
+    }
+    // Perf events feed the MQTT summary whenever MQTT logging is on at all
+    bool perfEnabled() const {
+        return enabled(LOG_LEVEL_INFO) || _mqttLogLevel != LOG_LEVEL_NONE;
+    }
+
     // --- NEW: Performance Logging Function ---
     // Logs an event with a specific duration and optional additional metrics.
     // eventName: A descriptive name for the event being measured (e.g., "SensorRead", "TaskXExecution").
@@ -60,24 +186,162 @@ public:
     void setMqttLogLevel(LogLevel level);
     LogLevel getSerialLogLevel() const;
     LogLevel getMqttLogLevel() const;
+    void setMqttFormat(LogMqttFormat format);
+    LogMqttFormat getMqttFormat() const;
+    // Per-tag level for one target, overriding the global level in both directions
+    // (e.g. DEBUG for "NetMgr" only, or NONE to silence one tag). Returns false if
+    // LOG_TAG_LEVEL_SLOTS tags already have overrides.
+    bool setTagLevel(const String& tag, LogTarget target, LogLevel level);
+    void clearTagLevel(const String& tag, LogTarget target);
+    void clearTagLevels();
+    // Perf events at or above thresholdMs are sent individually (as WARNING records);
+    // the summary of all events is published every windowMs
+    void setPerfThreshold(uint32_t thresholdMs);
+    void setPerfWindow(uint32_t windowMs);
+
+    // Wait until the drain task has emptied the ring and sent the pending MQTT frame
+    // (e.g. before a restart)
+    void flush(uint32_t timeoutMs = 1000);
+
+    LoggerStats getStats() const;
+
+    // Live log WebSocket handler, registered by NetworkManager with its web server
+    AsyncWebSocket* webSocket() { return _web.handler(); }
 
 private:
     NetworkManager* _networkManager; // Pointer to use NetworkManager for MQTT publishing
-    LogLevel _serialLogLevel;        // Current log level for Serial
-    LogLevel _mqttLogLevel;          // Current log level for MQTT
+    volatile LogLevel _serialLogLevel; // Current log level for Serial
+    volatile LogLevel _mqttLogLevel;   // Current log level for MQTT
+    volatile LogMqttFormat _mqttFormat;
+    LogTagLevels _tagLevels;         // Per-tag overrides of the two levels above
     String _apiKey;                  // API key for authentication (Changed to String)
 
     const char* _mqttLogTopic = "irrigation/esp32_6relay/logs"; // MQTT topic for logs
+    const char* _mqttBinaryLogTopic = "irrigation/esp32_6relay/logs/bin"; // Tokenized frames
+    const char* _mqttPerfTopic = "irrigation/esp32_6relay/logs/perf";     // Perf window summaries
+
+    // Bounded multi-producer/single-consumer ring: each slot carries a sequence number,
+    // producers claim a slot with one CAS on _head, the drain task is the only consumer.
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        LogRecord record;
+    };
+    Slot _ring[LOG_RING_SLOTS];
+    std::atomic<uint32_t> _head;     // Next position to claim (producers)
+    std::atomic<uint32_t> _tail;     // Next position to drain (written by the drain task only)
+    TaskHandle_t _drainTask;
+
+    std::atomic<uint32_t> _queued;
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _truncated;
+    std::atomic<uint32_t> _maxDepth;
+    std::atomic<uint32_t> _frames;
+    std::atomic<uint32_t> _frameBytes;
+
+    // Pending MQTT frame body (drain task only)
+    uint8_t _batch[LOG_BATCH_FRAME_MAX];
+    uint8_t _frame[LOG_BATCH_FRAME_MAX];
+    size_t _batchLen;
+    uint16_t _batchCount;
+    LogMqttFormat _batchFormat;
+    unsigned long _batchStarted;
+    uint32_t _batchSeq;
+    std::atomic<bool> _flushRequested;
+
+    // Flash backlog (drain task only)
+    LogStore _store;
+    unsigned long _storeDirtySince;  // 0 = nothing buffered
+    unsigned long _lastReplay;
+    std::atomic<uint32_t> _stored;
+    std::atomic<uint32_t> _replayed;
+    std::atomic<uint32_t> _replaySkipped;
+    std::atomic<uint32_t> _storeLost;
 
-    // Internal functions for formatting and outputting logs
-    void processLogEntry(const LogEntry& entry);
-    // Function to format LogEntry into a JSON string
-    String formatToJson(const LogEntry& entry);
+    // Perf aggregation (table owned by the drain task)
+    LogPerf _perf;
+    unsigned long _perfWindowStart;
+    volatile uint32_t _perfThresholdMs;
+    volatile uint32_t _perfWindowMs;
+
+    // Repeat collapse and per-call-site rate limit (drain task only)
+    LogLimiter _limiter;
+    std::atomic<uint32_t> _suppressed;
+
+    // Live log tail for browsers; clients filter by level and tag themselves
+    LogWebSink _web;
+    bool _webEnabled(LogLevel level) const {
+        uint8_t webLevel = _web.level();
+        return webLevel != LOG_LEVEL_NONE && level <= webLevel;
+    }
+
+    LogRecord* _claim(LogLevel level, const char* tag, uint16_t tagToken, uint8_t flags, uint32_t& position);
+    void _commit(uint32_t position);
+    bool _pop(LogRecord& out);
+    static void _drainTaskCode(void* parameter);
+
+    // Internal functions for formatting and outputting logs (drain task only)
+    void processLogEntry(const LogRecord& entry);
+    void _emit(const LogRecord& entry, const char* message);
+    void _emitReport(const LogLimitReport& report);
+    // Function to format a record into a JSON object; returns its length
+    size_t formatToJson(const LogRecord& entry, const char* message, char* out, size_t cap);
+    // Message text of a record (renders tokenized records into buffer)
+    const char* _messageText(const LogRecord& entry, char* buffer, size_t size);
+    size_t _encodeBinary(const LogRecord& entry, uint8_t* out, size_t cap);
+    bool _appendBatch(const LogRecord& entry, const char* message);
+    bool _flushBatch();
+    void _storeRecord(const LogRecord& entry, const char* message);
+    bool _loadRecord(const uint8_t* data, size_t len, LogRecord& out);
+    void _replay();
+    void _publishPerfSummary();
+    TickType_t _nextWakeup();
+    size_t _batchLimit() const;
     // Function to convert LogLevel enum to string
-    String levelToString(LogLevel level);
+    static const char* levelToString(LogLevel level);
 };
 
 // Declare a global AppLogger variable for easy access from anywhere in the code
 extern Logger AppLogger;
 
-#endif // LOGGER_H 
\ No newline at end of file
+// Logging macros: LOGI("NetMgr", "Publish to %s failed, state %d", topic, state);
+// Disabled levels compile to nothing; enabled ones check the runtime level first, so
+// arguments are only evaluated when the record will be emitted. The tag and the format
+// must be string literals: their tokens are computed by the compiler.
+#define LOG_AT(level, tag, format, ...) \
+    do { \
+        if (AppLogger.enabled(level, LOG_TOKEN(tag))) \
+            AppLogger.write(level, tag, LOG_TOKEN(tag), LOG_TOKEN(format), format, ##__VA_ARGS__); \
+    } while (0)
+
+#if LOG_COMPILE_LEVEL >= 1
+#define LOGC(tag, ...) LOG_AT(LOG_LEVEL_CRITICAL, tag, __VA_ARGS__)
+#else
+#define LOGC(tag, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= 2
+#define LOGE(tag, ...) LOG_AT(LOG_LEVEL_ERROR, tag, __VA_ARGS__)
+#else
+#define LOGE(tag, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= 3
+#define LOGW(tag, ...) LOG_AT(LOG_LEVEL_WARNING, tag, __VA_ARGS__)
+#else
+#define LOGW(tag, ...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= 4
+#define LOGI(tag, ...) LOG_AT(LOG_LEVEL_INFO, tag, __VA_ARGS__)
+// Performance events are logged at INFO
+#define LOG_PERF(tag, eventName, durationMs, success) \
+    do { if (AppLogger.perfEnabled()) AppLogger.writePerf(tag, LOG_TOKEN(eventName), eventName, durationMs, success); } while (0)
+#else
+#define LOGI(tag, ...) do { } while (0)
+// sizeof keeps the measured values "used" without evaluating them
+#define LOG_PERF(tag, eventName, durationMs, success) do { (void)sizeof(durationMs); (void)sizeof(success); } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= 5
+#define LOGD(tag, ...) LOG_AT(LOG_LEVEL_DEBUG, tag, __VA_ARGS__)
+#else
+#define LOGD(tag, ...) do { } while (0)
+#endif
+
+#endif // LOGGER_H
@@ -0,0 +1,94 @@
+#ifndef MODBUS_RELAY_BACKEND_H
+#define MODBUS_RELAY_BACKEND_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "ModbusRtu.h"
+#include "RelayExpansion.h"
+
+// Số module relay Modbus tối đa trên bus
+#define MODBUS_RELAY_MAX_SLAVES 8
+// Chu kỳ đọc lại trạng thái coil của mỗi module (ms)
+#define MODBUS_RELAY_POLL_MS 1000
+// Thời gian chờ phản hồi của một yêu cầu (ms)
+#define MODBUS_RELAY_TIMEOUT_MS 100
+// Số lần lỗi liên tiếp trước khi coi module là mất kết nối
+#define MODBUS_RELAY_OFFLINE_AFTER 3
+
+// Một module relay trên bus RS485
+struct ModbusRelaySlave {
+    uint8_t address;            // Địa chỉ slave (1-247)
+    uint8_t coilCount;          // Số relay (coil) của module, tối đa 32
+    uint16_t firstCoil;         // Địa chỉ coil của relay đầu tiên (thường là 0)
+};
+
+// Bộ đếm của bus
+struct ModbusBusStats {
+    uint32_t writes;            // Số yêu cầu ghi coil (FC15) thành công
+    uint32_t polls;             // Số lần đọc coil (FC01) thành công
+    uint32_t timeouts;          // Không có phản hồi hoặc phản hồi thiếu byte
+    uint32_t crcErrors;         // Phản hồi sai CRC/địa chỉ/mã hàm
+    uint32_t exceptions;        // Phản hồi ngoại lệ Modbus
+    uint32_t mismatches;        // Trạng thái đọc về khác trạng thái đã ghi (ghi lại)
+    uint32_t onlineMask;        // Bit i = module thứ i đang phản hồi
+};
+
+// Backend relay qua Modbus RTU (master) trên UART1. Mọi giao dịch bus chạy trong
+// một task riêng: thay đổi relay được gom lại và ghi bằng một FC15 cho mỗi module
+// mỗi lượt, sau đó các module đến hạn được đọc lại nối tiếp nhau không nghỉ.
+class ModbusRelayBackend : public RelayExpansion {
+public:
+    ModbusRelayBackend(const ModbusRelaySlave* slaves, uint8_t slaveCount);
+
+    // Mở UART và tạo task bus (gọi trước RelayManager::begin). maxRelays: số vùng còn lại
+    // sau relay GPIO; module vượt quá bị cắt bớt coil hoặc bỏ qua
+    bool begin(HardwareSerial& port, uint32_t baud, int rxPin, int txPin,
+               uint32_t stackSize, UBaseType_t priority, BaseType_t core,
+               int maxRelays = IRRIGATION_MAX_ZONES);
+
+    int getRelayCount() const override;
+    void writeRelays(RelayMask onMask, RelayMask offMask) override;
+
+    ModbusBusStats getStats() const;
+
+private:
+    struct SlaveState {
+        ModbusRelaySlave config;
+        uint8_t offset;         // Vị trí relay đầu tiên của module trong mặt nạ mở rộng
+        uint32_t coilMask;      // Các bit coil hợp lệ của module
+        uint32_t written;       // Trạng thái đã ghi thành công
+        bool resync;            // Cần ghi lại toàn bộ (khởi động, sau mất kết nối, lệch trạng thái)
+        bool online;
+        uint8_t failures;       // Số lỗi liên tiếp
+        uint32_t lastPollMs;
+    };
+
+    SlaveState _slaves[MODBUS_RELAY_MAX_SLAVES];
+    uint8_t _slaveCount;
+    int _relayCount;
+    std::atomic<RelayMask> _desired;  // Trạng thái mong muốn của mọi relay mở rộng
+
+    HardwareSerial* _port;
+    uint32_t _gapUs;                  // Khoảng lặng 3,5 ký tự giữa hai khung
+    int64_t _lastFrameUs;             // Thời điểm kết thúc khung gần nhất trên bus
+    TaskHandle_t _task;
+    uint8_t _request[MODBUS_RTU_MAX_FRAME];
+    uint8_t _response[MODBUS_RTU_MAX_FRAME];
+
+    std::atomic<uint32_t> _writes;
+    std::atomic<uint32_t> _polls;
+    std::atomic<uint32_t> _timeouts;
+    std::atomic<uint32_t> _crcErrors;
+    std::atomic<uint32_t> _exceptions;
+    std::atomic<uint32_t> _mismatches;
+    std::atomic<uint32_t> _onlineMask;
+
+    void _layout(int maxRelays);                            // Xếp vị trí module, giới hạn tổng số relay
+    static void _busTask(void* parameter);
+    void _writePending();                                   // FC15 cho các module có thay đổi
+    void _pollDue();                                        // FC01 cho các module đến hạn
+    bool _transact(SlaveState& slave, size_t requestLen);   // Gửi _request, nhận vào _response
+    void _markResult(SlaveState& slave, bool ok);
+};
+
+#endif // MODBUS_RELAY_BACKEND_H
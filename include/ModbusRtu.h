@@ -0,0 +1,56 @@
+#ifndef MODBUS_RTU_H
+#define MODBUS_RTU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Mã hàm Modbus dùng trong dự án
+#define MODBUS_FC_READ_COILS             0x01
+#define MODBUS_FC_READ_HOLDING_REGISTERS 0x03
+#define MODBUS_FC_READ_INPUT_REGISTERS   0x04
+#define MODBUS_FC_WRITE_SINGLE_COIL      0x05
+#define MODBUS_FC_WRITE_SINGLE_REGISTER  0x06
+#define MODBUS_FC_WRITE_MULTIPLE_COILS   0x0F
+#define MODBUS_FC_WRITE_MULTIPLE_REGISTERS 0x10
+
+// Mã ngoại lệ
+#define MODBUS_EX_ILLEGAL_FUNCTION     0x01
+#define MODBUS_EX_ILLEGAL_ADDRESS      0x02
+#define MODBUS_EX_ILLEGAL_VALUE        0x03
+#define MODBUS_EX_DEVICE_FAILURE       0x04
+
+// Khung RTU dài nhất: địa chỉ + PDU 253 byte + CRC
+#define MODBUS_RTU_MAX_FRAME 256
+
+// Đóng gói/kiểm tra khung Modbus RTU, không phụ thuộc UART (dùng chung cho master và slave)
+class ModbusRtu {
+public:
+    // CRC-16/MODBUS (đa thức 0xA001, khởi tạo 0xFFFF), tra bảng
+    static uint16_t crc16(const uint8_t* data, size_t len);
+
+    // Thêm CRC vào cuối khung, trả về độ dài mới
+    static size_t appendCrc(uint8_t* frame, size_t len);
+
+    // Khung có CRC hợp lệ (len >= 4)
+    static bool checkCrc(const uint8_t* frame, size_t len);
+
+    // Yêu cầu FC15: ghi count coil bắt đầu từ start, bit i của coils = coil start + i
+    static size_t buildWriteCoils(uint8_t* out, uint8_t slave, uint16_t start, uint16_t count, uint32_t coils);
+
+    // Yêu cầu FC01: đọc count coil bắt đầu từ start
+    static size_t buildReadCoils(uint8_t* out, uint8_t slave, uint16_t start, uint16_t count);
+
+    // Độ dài phản hồi bình thường của yêu cầu đã đóng gói (0 nếu không hỗ trợ)
+    static size_t expectedResponseLength(const uint8_t* request);
+
+    // Phản hồi ngoại lệ (function | 0x80), trả về độ dài khung
+    static size_t buildException(uint8_t* out, uint8_t slave, uint8_t function, uint8_t code);
+
+    // Khoảng lặng giữa hai khung (3,5 ký tự; cố định 1750 µs khi baud > 19200)
+    static uint32_t frameGapUs(uint32_t baud);
+
+    static uint16_t readU16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+    static void writeU16(uint8_t* p, uint16_t v) { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; }
+};
+
+#endif // MODBUS_RTU_H
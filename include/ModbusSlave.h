@@ -0,0 +1,93 @@
+#ifndef MODBUS_SLAVE_H
+#define MODBUS_SLAVE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "ModbusRtu.h"
+#include "RelayManager.h"
+#include "ActuationArbiter.h"
+#include "EnvironmentManager.h"
+
+// Bảng thanh ghi holding (FC03/FC04 đọc, FC06/FC16 ghi):
+//   0..31    thông tin chung và môi trường (MODBUS_REG_* bên dưới)
+//   100 + (zone - 1) * 4 + ZONE_REG_*   thanh ghi theo vùng
+#define MODBUS_REG_FIXED_COUNT   32
+#define MODBUS_REG_ZONE_BASE     100
+#define MODBUS_REG_ZONE_STRIDE   4
+
+#define MODBUS_REG_MAP_VERSION   0    // Phiên bản bảng thanh ghi
+#define MODBUS_REG_ZONE_COUNT    1    // Số vùng/relay
+#define MODBUS_REG_RELAY_BITS    2    // 4 thanh ghi: bit trạng thái vùng 1-16, 17-32, 33-48, 49-64
+#define MODBUS_REG_STATUS_VER    6    // Số phiên bản trạng thái relay (16 bit thấp)
+#define MODBUS_REG_UPTIME_MIN    7    // Thời gian chạy (phút)
+#define MODBUS_REG_TEMPERATURE   16   // Nhiệt độ x10 (°C, có dấu)
+#define MODBUS_REG_HUMIDITY      17   // Độ ẩm x10 (%)
+#define MODBUS_REG_HEAT_INDEX    18   // Chỉ số nhiệt x10 (°C, có dấu)
+#define MODBUS_REG_RAIN          19   // Mưa (0/1)
+#define MODBUS_REG_LIGHT         20   // Ánh sáng (lux, tối đa 65535)
+#define MODBUS_REG_ET0           21   // ET0 x100 (mm/ngày)
+
+#define MODBUS_ZONE_REG_STATE     0   // Đọc: trạng thái relay; ghi 1 = bật, 0 = tắt (nguồn manual)
+#define MODBUS_ZONE_REG_DURATION  1   // Thời lượng bật (giây) dùng cho lệnh bật kế tiếp, 0 = không hẹn giờ
+#define MODBUS_ZONE_REG_REMAINING 2   // Thời gian bật còn lại (giây)
+#define MODBUS_ZONE_REG_SOIL      3   // Độ ẩm đất x10 (%)
+
+// Chu kỳ làm mới ảnh thanh ghi cho giá trị cảm biến (trạng thái relay làm mới theo số phiên bản)
+#define MODBUS_SLAVE_REFRESH_MS 200
+// Thời gian chờ tối đa giữa các byte trong một khung (ms)
+#define MODBUS_SLAVE_BYTE_TIMEOUT_MS 20
+
+// Bộ đếm của slave
+struct ModbusSlaveStats {
+    uint32_t requests;          // Yêu cầu hợp lệ gửi tới địa chỉ của thiết bị
+    uint32_t exceptions;        // Phản hồi ngoại lệ
+    uint32_t crcErrors;         // Khung sai CRC (bỏ qua)
+    uint32_t writes;            // Lệnh ghi vùng đã áp dụng
+};
+
+// Modbus RTU slave trên UART1 cho PLC/SCADA tại chỗ. Yêu cầu đọc được trả từ một ảnh
+// thanh ghi dựng sẵn (không khóa RelayManager); lệnh ghi đi qua ActuationArbiter như
+// điều khiển thủ công qua MQTT.
+class ModbusSlave {
+public:
+    ModbusSlave(RelayManager& relayManager, ActuationArbiter& arbiter, EnvironmentManager& envManager);
+
+    bool begin(HardwareSerial& port, uint32_t baud, int rxPin, int txPin, uint8_t address,
+               uint32_t stackSize, UBaseType_t priority, BaseType_t core);
+
+    ModbusSlaveStats getStats() const;
+
+private:
+    RelayManager& _relayManager;
+    ActuationArbiter& _arbiter;
+    EnvironmentManager& _envManager;
+
+    HardwareSerial* _port;
+    uint8_t _address;
+    uint32_t _gapUs;
+    TaskHandle_t _task;
+    int _zoneCount;
+
+    // Ảnh thanh ghi: MODBUS_REG_FIXED_COUNT thanh ghi chung, sau đó các thanh ghi vùng
+    uint16_t _image[MODBUS_REG_FIXED_COUNT + IRRIGATION_MAX_ZONES * MODBUS_REG_ZONE_STRIDE];
+    uint16_t _durationSec[IRRIGATION_MAX_ZONES];
+    uint32_t _imageVersion;
+    unsigned long _lastRefresh;
+
+    uint8_t _request[MODBUS_RTU_MAX_FRAME];
+    uint8_t _response[MODBUS_RTU_MAX_FRAME];
+
+    std::atomic<uint32_t> _requests;
+    std::atomic<uint32_t> _exceptions;
+    std::atomic<uint32_t> _crcErrors;
+    std::atomic<uint32_t> _writes;
+
+    static void _slaveTask(void* parameter);
+    void _refresh(bool force);
+    size_t _readFrame();                     // Nhận một khung vào _request, 0 nếu lỗi/hết giờ
+    size_t _handle(size_t len);              // Xử lý _request, dựng phản hồi vào _response
+    int _imageIndex(uint16_t address) const; // -1 nếu địa chỉ không có trong bảng
+    uint8_t _write(uint16_t address, const uint8_t* values, uint16_t count);  // 0 hoặc mã ngoại lệ
+};
+
+#endif // MODBUS_SLAVE_H
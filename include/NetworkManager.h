@@ -13,11 +13,13 @@
 #include <SPIFFS.h>
 // #include <ArduinoJson.h> // Removing as it seems unused by NetworkManager now
 #include <Preferences.h> // THÊM VÀO: Thư viện Preferences cho NVS
+#include "ZoneConfig.h"
 
-// For FreeRTOS task and semaphores - SẼ BỊ XÓA NẾU KHÔNG CÒN CẦN
-// #include <freertos/FreeRTOS.h> 
-// #include <freertos/task.h>
-// #include <freertos/semphr.h>
+// Task mạng: loop() chạy trong task riêng, kết nối WiFi/MQTT (có thể block hàng chục giây
+// khi broker chết) không làm chậm cảm biến, lập lịch hay gửi trạng thái
+#define NET_TASK_INTERVAL_MS 10
+// Mỗi lượt publish chờ khóa MQTT client; hết lượt mà vẫn còn kết nối thì chờ tiếp
+#define NET_PUBLISH_LOCK_MS 50
 
 // THÊM VÀO: Enum for WiFi connection states
 enum WifiConnectionState {
@@ -55,13 +57,17 @@ extern const char* ADMIN_LOGIN_PASSWORD;
 class NetworkManager {
 public:
     NetworkManager();
-    bool begin(const char* initial_ssid, const char* initial_password);
+    // Không block: chỉ nạp cấu hình, khởi động web server và bắt đầu kết nối WiFi
+    void begin(const char* initial_ssid, const char* initial_password);
+    // Tạo task chạy loop(); gọi sau khi đã đăng ký callback và các topic
+    bool startTask(const char* taskName, uint32_t stackSize, UBaseType_t priority, BaseType_t core);
     // void addSubscriptionTopic(const char* topic); // Suggestion for more flexible topic management
     bool publish(const char* topic, const char* payload);
+    bool publish(const char* topic, const uint8_t* payload, size_t length); // Binary payload (tokenized logs)
     bool subscribe(const char* topic); // Will add to list and attempt to subscribe if connected
     void setCallback(MqttCallback callback);
     
-    void loop(); // Main loop for handling connections and retries
+    void loop(); // Main loop for handling connections and retries (network task)
     bool syncTime();
 
     // Status getters
@@ -98,8 +104,8 @@ private:
     char _apiKey[64]; // New member for API Key
     char _clientId[32];
 
-    bool _wifiConnected;
-    bool _mqttConnected;
+    volatile bool _wifiConnected;   // Đọc từ nhiều task
+    volatile bool _mqttConnected;
     bool _timeSync;
     
     // Retry and state variables
@@ -127,6 +133,11 @@ private:
     // THÊM VÀO: AsyncWebServer object
     AsyncWebServer _server;
     bool _configPortalActive;
+    uint8_t _flightNetState; // Trạng thái mạng ghi gần nhất vào hộp đen (FLIGHT_NET_*)
+
+    // PubSubClient không an toàn đa luồng: mọi thao tác trên _mqttClient giữ khóa này
+    TaskHandle_t _task;
+    SemaphoreHandle_t _mqttMutex;
 
     // THÊM VÀO: Đối tượng Preferences
     Preferences _preferences;
@@ -137,12 +148,17 @@ private:
     void _executeMqttSubscriptions();
     void _handleWifiDisconnect();
     void _handleMqttDisconnect();
+    void _recordNetworkState();
+    bool _lockMqtt(TickType_t wait);
+    void _unlockMqtt();
+    static void _taskCode(void* parameter);
 
     // THÊM VÀO: Web server request handlers
     void _handleRoot(AsyncWebServerRequest *request);
     void _handleSave(AsyncWebServerRequest *request);
     void _handleGetConfig(AsyncWebServerRequest *request);
     void _handleGetSystemInfo(AsyncWebServerRequest *request);
+    void _handleGetTrace(AsyncWebServerRequest *request);
     // void _handleScanWifi(AsyncWebServerRequest *request); // XÓA BỎ
     void _handleNotFound(AsyncWebServerRequest *request);
     void _serveStaticFile(AsyncWebServerRequest *request, const char* path, const char* contentType);
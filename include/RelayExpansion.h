@@ -0,0 +1,21 @@
+#ifndef RELAY_EXPANSION_H
+#define RELAY_EXPANSION_H
+
+#include "ZoneConfig.h"
+
+// Backend relay mở rộng cho các relay không có chân GPIO trên board (vd: module
+// relay RS485 Modbus). RelayManager đánh số các relay này nối tiếp sau relay GPIO
+// và vẫn áp dụng hẹn giờ, giãn cách, mẫu xung và hạn mức như với relay GPIO.
+class RelayExpansion {
+public:
+    virtual ~RelayExpansion() {}
+
+    // Số relay do backend điều khiển
+    virtual int getRelayCount() const = 0;
+
+    // Đặt trạng thái mong muốn (bit 0 = relay mở rộng đầu tiên). Gọi khi RelayManager
+    // giữ mutex của nó, nên phải trả về ngay; backend tự ghi xuống thiết bị sau đó.
+    virtual void writeRelays(RelayMask onMask, RelayMask offMask) = 0;
+};
+
+#endif // RELAY_EXPANSION_H
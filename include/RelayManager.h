@@ -3,53 +3,151 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include <atomic>
+#include "DeadlineTimer.h"
+#include "RelayUsage.h"
+#include "ZoneConfig.h"
+#include "RelayExpansion.h"
+
+// Mẫu bật/tắt theo chu kỳ khi relay đang bật (xung tưới)
+struct RelayPattern {
+    uint32_t onMs;               // Thời gian bật mỗi chu kỳ (0 = không có mẫu)
+    uint32_t offMs;              // Thời gian nghỉ mỗi chu kỳ
+    uint16_t repeat;             // Số chu kỳ (0 = lặp đến khi relay hết giờ/bị tắt)
+    uint16_t cycle;              // Số chu kỳ đã hoàn thành
+    bool running;                // Mẫu đang chạy
+    bool phaseOn;                // Pha hiện tại (true = bật)
+    int64_t phaseEnd;            // Thời điểm kết thúc pha hiện tại (µs)
+};
 
 // Struct để lưu trạng thái relay
 struct RelayStatus {
     bool state;                  // Trạng thái hiện tại (true = bật, false = tắt)
-    unsigned long endTime;       // Thời điểm kết thúc (0 = không có thời gian)
+    int64_t endTime;             // Thời điểm kết thúc theo esp_timer (µs, 0 = không có thời gian)
+    RelayPattern pattern;        // Mẫu xung; khi chạy, state vẫn là true trong pha nghỉ
+    
+    // Mức thực tế trên chân relay (tắt trong pha nghỉ của mẫu xung)
+    bool outputOn() const { return state && !(pattern.running && !pattern.phaseOn); }
 };
 
 class RelayManager {
 public:
     RelayManager();
     
-    // Khởi tạo relays
-    void begin(const int* relayPins, int numRelays);
+    // Khởi tạo relays: numRelays relay GPIO, sau đó là các relay của backend mở rộng (nếu có)
+    void begin(const int* relayPins, int numRelays, RelayExpansion* expansion = nullptr);
+    
+    // Tổng số relay (GPIO + mở rộng)
+    int getRelayCount() const;
     
     // Điều khiển relay
     void setRelay(int relayIndex, bool state, unsigned long duration = 0);
     
+    // Điều khiển cả nhóm relay trong một vùng găng, ghi thanh ghi GPIO một lần
+    // mask: các relay cần áp dụng; stateMask: trạng thái mong muốn (bit = 1 là bật)
+    // durations: thời lượng bật (ms) theo chỉ số relay, nullptr hoặc 0 = không hẹn giờ
+    void setRelays(RelayMask mask, RelayMask stateMask, const unsigned long* durations = nullptr);
+    
+    // Như setRelays nhưng nhận thời điểm kết thúc tuyệt đối (DeadlineTimer::nowUs(), 0 = không hẹn giờ)
+    void setRelaysUntil(RelayMask mask, RelayMask stateMask, const int64_t* deadlinesUs);
+    
+    // Giãn cách các lần bật relay để hạn chế dòng khởi động bơm/van (0 = tắt)
+    // Thời điểm kết thúc vẫn tính từ lúc nhận lệnh, chỉ thời điểm bật bị lùi lại
+    void setInrushStagger(unsigned long intervalMs);
+    
     // Bật relay
     void turnOn(int relayIndex, unsigned long duration = 0);
     
     // Tắt relay
     void turnOff(int relayIndex);
     
-    // Lấy trạng thái relay
+    // Đặt mẫu xung cho relay: bật onMs, nghỉ offMs, lặp repeat lần (0 = đến khi hết giờ).
+    // Mẫu áp dụng cho lần bật hiện tại (hoặc lần bật kế tiếp) và bị xóa khi relay tắt.
+    // onMs = 0 xóa mẫu, relay đang bật sẽ bật liên tục.
+    void setPattern(int relayIndex, uint32_t onMs, uint32_t offMs, uint16_t repeat = 0);
+    
+    // Hạn mức thời gian bật mỗi ngày của relay (giây, 0 = không giới hạn).
+    // Khi hết hạn mức, lệnh bật bị chặn và relay đang bật bị tắt tại thời điểm hết hạn mức.
+    void setDailyLimit(int relayIndex, uint32_t seconds);
+    uint32_t getDailyLimit(int relayIndex);
+    
+    // Lưu thống kê thời gian chạy vào NVS nếu đến hạn (gọi định kỳ từ Core0)
+    void flushUsageIfDue();
+    
+    // Lấy trạng thái relay (không khóa, đọc từ snapshot)
     bool getState(int relayIndex);
     
-    // Lấy thời gian còn lại
+    // Lấy thời gian còn lại (không khóa, đọc từ snapshot)
     unsigned long getRemainingTime(int relayIndex);
     
-    // Xử lý các relay có timer
+    // Chép snapshot nhất quán của tất cả relay, trả về số relay đã chép
+    // version (tùy chọn) nhận số phiên bản tương ứng với snapshot
+    int getSnapshot(RelayStatus* out, int maxRelays, uint32_t* version = nullptr);
+    
+    // Số phiên bản trạng thái, tăng mỗi khi có relay thay đổi
+    uint32_t getStatusVersion() const;
+    
+    // Xử lý các relay có timer, gọi khi hạn chót đến (không cần gọi định kỳ)
     void update();
     
+    // Task nhận thông báo khi có hạn chót relay; task đó gọi update().
+    // Khi chưa đặt, update() chạy trực tiếp trong task esp_timer.
+    void setWorkerTask(TaskHandle_t task);
+    
     // Tạo payload JSON cho trạng thái relay
     String getStatusJson(const char* apiKey);
     
-    // Xử lý JSON lệnh điều khiển
-    bool processCommand(const char* json);
-    
     // Kiểm tra xem trạng thái có thay đổi không và reset cờ
     bool hasStatusChangedAndReset();
     
 private:
     const int* _relayPins;        // Con trỏ đến mảng chân GPIO relay
-    int _numRelays;               // Số lượng relay
-    RelayStatus* _relayStatus;    // Mảng trạng thái relay
-    SemaphoreHandle_t _mutex;     // Mutex để bảo vệ truy cập
-    bool _statusChanged;          // Cờ đánh dấu thay đổi trạng thái
+    int _numRelays;               // Số lượng relay (GPIO + mở rộng)
+    int _numLocal;                // Số relay GPIO, relay mở rộng bắt đầu từ chỉ số này
+    RelayExpansion* _expansion;   // Backend cho relay không có chân GPIO
+    RelayStatus* _relayStatus;    // Mảng trạng thái relay (chỉ bên ghi, giữ _mutex)
+    SemaphoreHandle_t _mutex;     // Mutex tuần tự hóa các bên ghi
+    std::atomic<bool> _statusChanged; // Cờ đánh dấu thay đổi trạng thái
+    
+    // Seqlock cho bên đọc: số lẻ = đang ghi, số chẵn = snapshot ổn định
+    RelayStatus* _snapshot;       // Bản sao công bố cho bên đọc
+    std::atomic<uint32_t> _seq;
+    portMUX_TYPE _seqLock = portMUX_INITIALIZER_UNLOCKED; // Chặn tranh chấp giữa hai core khi công bố
+    
+    // Ánh xạ relay sang thanh ghi GPIO (bank 0: GPIO0-31, bank 1: GPIO32-48)
+    uint32_t _gpioBit[IRRIGATION_MAX_ZONES];
+    bool _gpioBank1[IRRIGATION_MAX_ZONES];
+    RelayMask _allMask;
+    
+    // Bật trễ theo chính sách giãn cách
+    unsigned long _staggerMs;
+    int64_t _nextActivationSlot;                 // Thời điểm sớm nhất được bật relay tiếp theo (µs)
+    std::atomic<RelayMask> _pendingOnMask;       // Relay đang chờ đến lượt bật
+    int64_t _pendingAt[IRRIGATION_MAX_ZONES];         // Thời điểm bật dự kiến (µs)
+    int64_t _pendingEnd[IRRIGATION_MAX_ZONES];        // Thời điểm kết thúc (µs, 0 = không hẹn giờ)
+    
+    // Một timer esp_timer đặt theo hạn chót sớm nhất (tắt relay hoặc bật theo lượt)
+    DeadlineTimer _deadline;
+    TaskHandle_t _workerTask;
+    
+    // Thống kê thời gian chạy và hạn mức ngày
+    RelayUsage _usage;
+    
+    void _rearm();                               // Đặt lại timer (gọi khi giữ _mutex)
+    void _engage(int relayIndex, int64_t endTime, int64_t now);  // Bật relay, khởi động mẫu nếu có
+    void _disengage(int relayIndex);             // Tắt relay và xóa mẫu
+    static void _onDeadline(void* arg);
+    
+    // Hạn chót theo hạn mức ngày khi relay chạy theo mẫu xung (chỉ pha bật tính hạn mức)
+    static int64_t _patternBudgetEnd(const RelayPattern& pattern, int64_t now, int64_t budgetUs);
+    
+    // Ghi GPIO (một lần w1ts/w1tc cho mỗi bank) và công bố snapshot các relay trong
+    // publishMask trong cùng một vùng găng, rồi chuyển phần relay mở rộng cho backend
+    // (gọi khi giữ _mutex)
+    void _commit(RelayMask onMask, RelayMask offMask, RelayMask publishMask, RelayMask pulseMask = 0);
+    void _publish(RelayMask mask); // Công bố snapshot không ghi GPIO
+    String _maskToList(RelayMask mask);
+    RelayStatus _readSnapshot(int relayIndex);
 };
 
 #endif // RELAY_MANAGER_H 
\ No newline at end of file
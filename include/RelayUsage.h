@@ -0,0 +1,65 @@
+#ifndef RELAY_USAGE_H
+#define RELAY_USAGE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "ZoneConfig.h"
+
+// Khoảng tối thiểu giữa hai lần ghi NVS (ms) để hạn chế hao mòn flash
+#define RELAY_USAGE_FLUSH_INTERVAL (15UL * 60 * 1000)
+
+// Hạn mức ngày không giới hạn
+#define RELAY_USAGE_UNLIMITED 0xFFFFFFFFUL
+
+// Thống kê thời gian chạy của một relay (lưu nguyên khối vào NVS)
+struct RelayUsageRecord {
+    uint64_t totalMs;           // Tổng thời gian bật từ trước tới nay
+    uint32_t switches;          // Số lần bật (một lần chạy theo mẫu xung tính một lần)
+    uint32_t dayMs;             // Thời gian bật trong ngày (giờ địa phương)
+    uint32_t weekMs;            // Thời gian bật trong tuần (bắt đầu thứ Hai)
+    int32_t dayKey;             // Số ngày kể từ 1970-01-01 của dayMs (-1 = chưa có giờ)
+    int32_t weekKey;            // Số tuần tương ứng của weekMs
+    uint32_t dailyLimitSec;     // Hạn mức bật mỗi ngày (0 = không giới hạn)
+};
+
+// Ghi nhận thời gian chạy của relay: cập nhật O(1) khi relay đổi trạng thái,
+// gom nhiều thay đổi rồi mới ghi NVS
+class RelayUsage {
+public:
+    RelayUsage();
+
+    // Cấp phát và nạp thống kê đã lưu
+    void begin(int numRelays);
+
+    // Gọi khi relay bật/tắt (RelayManager gọi khi giữ mutex của nó). Bit trong pulseMask là
+    // cạnh pha của mẫu xung: tính thời gian bật nhưng không tính thêm một lần bật
+    void onSwitch(RelayMask onMask, RelayMask offMask, int64_t nowUs, RelayMask pulseMask = 0);
+
+    // Số giây còn được bật trong ngày (RELAY_USAGE_UNLIMITED nếu không giới hạn)
+    uint32_t remainingToday(int relayIndex, int64_t nowUs);
+
+    // Đặt hạn mức ngày (giây, 0 = không giới hạn)
+    void setDailyLimit(int relayIndex, uint32_t seconds);
+
+    // Thống kê hiện tại, kể cả phần đang bật chưa cộng dồn
+    bool getStats(int relayIndex, RelayUsageRecord& out, int64_t nowUs);
+
+    // Ghi NVS nếu có thay đổi và đã qua khoảng tối thiểu (hoặc force)
+    void flushIfDue(bool force = false);
+
+private:
+    int _numRelays;
+    RelayUsageRecord* _records;
+    int64_t* _onSinceUs;            // Thời điểm bật (0 = đang tắt)
+    volatile uint32_t _changes;     // Tăng mỗi lần thống kê/hạn mức đổi (dưới _lock)
+    uint32_t _savedChanges;         // Giá trị _changes của bản đã ghi NVS
+    SemaphoreHandle_t _flushMutex;  // Một bên ghi NVS tại một thời điểm
+    unsigned long _lastFlush;
+    Preferences _preferences;
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+    void _rollover(RelayUsageRecord& rec, int32_t dayKey, int32_t weekKey);
+    static bool _currentKeys(int32_t& dayKey, int32_t& weekKey);
+};
+
+#endif // RELAY_USAGE_H
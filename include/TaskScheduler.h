@@ -7,8 +7,15 @@
 #include <ArduinoJson.h>
 #include <time.h>
 #include <bitset>
-#include "RelayManager.h"
+#include <atomic>
+#include "ActuationArbiter.h"
 #include "EnvironmentManager.h"
+#include "DeadlineTimer.h"
+#include "ZoneConfig.h"
+
+// Dung lượng JSON của một lịch: các trường cố định, mảng ngày, mảng vùng và điều kiện cảm biến
+#define TASK_JSON_SIZE (JSON_OBJECT_SIZE(14) + JSON_ARRAY_SIZE(7) + JSON_ARRAY_SIZE(IRRIGATION_MAX_ZONES) + \
+                        JSON_OBJECT_SIZE(6) + 5 * JSON_OBJECT_SIZE(3) + 64)
 
 // Trạng thái của lịch tưới
 enum TaskState {
@@ -53,13 +60,16 @@ struct IrrigationTask {
     uint8_t hour;               // Giờ bắt đầu (0-23)
     uint8_t minute;             // Phút bắt đầu (0-59)
     uint16_t duration;          // Thời lượng tưới (phút)
-    std::vector<uint8_t> zones; // Các vùng tưới (tương ứng relay 1-6)
+    std::vector<uint8_t> zones; // Các vùng tưới (1..IRRIGATION_MAX_ZONES, vùng i = relay i)
     uint8_t priority;           // Mức ưu tiên (1-10, cao hơn = quan trọng hơn)
+    bool et_adjust;             // Điều chỉnh thời lượng theo ET0 khi bắt đầu chạy
     
     // Thông tin trạng thái cơ bản
     TaskState state;            // Trạng thái hiện tại
     time_t start_time;          // Thời gian bắt đầu thực tế
     time_t next_run;            // Thời gian chạy kế tiếp
+    uint32_t run_seconds;       // Thời lượng thực tế của lần chạy (giây, dài nhất trong các vùng)
+    int64_t end_us;             // Hạn chót kết thúc theo DeadlineTimer (0 = chưa chạy)
     
     // Điều kiện cảm biến
     SensorCondition sensor_condition;
@@ -67,7 +77,7 @@ struct IrrigationTask {
 
 class TaskScheduler {
 public:
-    TaskScheduler(RelayManager& relayManager, EnvironmentManager& envManager);
+    TaskScheduler(ActuationArbiter& arbiter, EnvironmentManager& envManager);
     
     // Phương thức cơ bản
     void begin();
@@ -83,18 +93,32 @@ public:
     // Lấy thời điểm sớm nhất cần kiểm tra lịch
     time_t getEarliestNextCheckTime() const;
     
+    // Có lịch đang chạy đã đến hạn chót kết thúc, cần gọi update() ngay
+    bool isDeadlineDue() const;
+    
+    // Báo các vùng có lease lịch tưới được khôi phục sau khi khởi động lại; các vùng này
+    // được coi là bận đến khi lease hết hạn đúng thời điểm cũ, lịch mới đến giờ sẽ ghi đè lease này
+    void notifyRestoredZones(RelayMask zones);
+    
     // Kiểm tra xem lịch trình có thay đổi không và reset cờ
     bool hasScheduleStatusChangedAndReset();
     
 private:
-    RelayManager& _relayManager;
+    ActuationArbiter& _arbiter;              // Mọi lệnh relay đi qua bộ phân xử (nguồn SCHEDULE)
     EnvironmentManager& _envManager;
     std::vector<IrrigationTask> _tasks;      // Danh sách lịch
-    std::bitset<6> _activeZonesBits;         // Các vùng đang hoạt động (bit 0-5 đại diện zone 1-6)
+    std::bitset<IRRIGATION_MAX_ZONES> _activeZonesBits; // Các vùng đang hoạt động (bit i đại diện zone i + 1)
+    RelayMask _restoredZones;                // Vùng bận do lease khôi phục, chưa thuộc lịch nào
+    int64_t _restoredEndUs[IRRIGATION_MAX_ZONES]; // Hạn chót lease khôi phục (0 = không hết hạn)
     SemaphoreHandle_t _mutex;
     unsigned long _lastCheckTime;            // Thời điểm kiểm tra gần nhất
     time_t _earliestNextCheckTime;           // Thời điểm sớm nhất cần kiểm tra lại lịch
     bool _scheduleStatusChanged;             // Cờ đánh dấu thay đổi lịch trình
+    DeadlineTimer _completionTimer;          // Hạn chót sớm nhất của các lịch đang chạy và lease khôi phục
+    std::atomic<bool> _deadlineDue;
+    
+    void _rearmCompletion();                 // Đặt lại timer kết thúc (gọi khi giữ _mutex)
+    static void _onCompletionDeadline(void* arg);
     
     // Phương thức đơn giản
     void checkTasks();                       // Kiểm tra lịch đến giờ
@@ -0,0 +1,36 @@
+#ifndef ZONE_CONFIG_H
+#define ZONE_CONFIG_H
+
+#include <stdint.h>
+
+// Số vùng tưới tối đa, dùng chung cho RelayManager, ActuationArbiter, TaskScheduler
+// và EnvironmentManager. Đặt qua build_flags (vd: -DIRRIGATION_MAX_ZONES=64) khi
+// mở rộng relay; mọi bảng theo vùng được cấp phát tĩnh theo giá trị này.
+#ifndef IRRIGATION_MAX_ZONES
+#define IRRIGATION_MAX_ZONES 6
+#endif
+
+#if IRRIGATION_MAX_ZONES < 1 || IRRIGATION_MAX_ZONES > 64
+#error "IRRIGATION_MAX_ZONES must be in range 1..64"
+#endif
+
+// Mặt nạ bit relay (bit i = relay index i), chọn kiểu nhỏ nhất đủ chứa số vùng
+#if IRRIGATION_MAX_ZONES <= 32
+typedef uint32_t RelayMask;
+#else
+typedef uint64_t RelayMask;
+#endif
+
+// Kích thước bộ đệm MQTT: payload trạng thái relay tăng khoảng 240 byte mỗi vùng, tối thiểu 1024.
+// Dùng chung cho NetworkManager (setBufferSize) và CommandQueue (độ dài lệnh tối đa)
+#define MQTT_STATUS_PAYLOAD_ESTIMATE (128 + IRRIGATION_MAX_ZONES * 240)
+#ifndef MQTT_BUFFER_SIZE
+#define MQTT_BUFFER_SIZE (MQTT_STATUS_PAYLOAD_ESTIMATE > 1024 ? MQTT_STATUS_PAYLOAD_ESTIMATE : 1024)
+#endif
+
+// Mã vùng hợp lệ (bắt đầu từ 1, vùng i ứng với relay index i - 1)
+inline bool isValidZoneId(int zoneId) {
+    return zoneId >= 1 && zoneId <= IRRIGATION_MAX_ZONES;
+}
+
+#endif // ZONE_CONFIG_H
@@ -0,0 +1,658 @@
+#include "../include/ActuationArbiter.h"
+#include "../include/Logger.h"
+#include <time.h>
+
+static const char* SOURCE_NAMES[SOURCE_COUNT] = { "schedule", "rule", "manual" };
+
+static bool samePattern(const LeasePattern& a, const LeasePattern& b) {
+    return a.onMs == b.onMs && a.offMs == b.offMs && a.repeat == b.repeat;
+}
+
+static_assert(LEASE_STORE_CAPACITY >= IRRIGATION_MAX_ZONES * SOURCE_COUNT, "LeaseStore too small for all zones");
+
+ActuationArbiter::ActuationArbiter(RelayManager& relayManager) : _relayManager(relayManager) {
+    _numZones = 0;
+    _leases = nullptr;
+    _owner = nullptr;
+    _applied = nullptr;
+    _hasNextExpiry = false;
+    _nextExpiry = 0;
+    _batchMask = 0;
+    _batchState = 0;
+    _batchPatternMask = 0;
+    _deferred = nullptr;
+    _workerTask = nullptr;
+    for (int s = 0; s < SOURCE_COUNT; s++) {
+        _restored[s] = 0;
+    }
+    _mutex = xSemaphoreCreateMutex();
+
+    // Mặc định: thủ công > luật > lịch
+    _priority[SOURCE_SCHEDULE] = 1;
+    _priority[SOURCE_RULE] = 2;
+    _priority[SOURCE_MANUAL] = 3;
+}
+
+void ActuationArbiter::begin(int numZones) {
+    if (numZones > IRRIGATION_MAX_ZONES) {
+        numZones = IRRIGATION_MAX_ZONES;
+    }
+    _numZones = numZones;
+    _leases = new ZoneLease[numZones][SOURCE_COUNT];
+    _owner = new uint8_t[numZones];
+    _applied = new ZoneLease[numZones];
+
+    for (int i = 0; i < numZones; i++) {
+        for (int s = 0; s < SOURCE_COUNT; s++) {
+            _leases[i][s] = { false, false, false, 0, { 0, 0, 0 } };
+        }
+        _owner[i] = SOURCE_COUNT;
+        _applied[i] = { false, false, false, 0, { 0, 0, 0 } };
+    }
+
+    _expiryTimer.begin("lease_expiry", _onExpiry, this);
+    _store.begin();
+
+    AppLogger.info("Arbiter", "Initialized with " + String(numZones) + " zones");
+
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        _restore();
+        xSemaphoreGive(_mutex);
+    }
+}
+
+RelayMask ActuationArbiter::getRestoredZones(ActuationSource source) const {
+    return source < SOURCE_COUNT ? _restored[source] : 0;
+}
+
+// Chuyển bảng lease sang dạng không phụ thuộc lần khởi động và lưu lại
+void ActuationArbiter::_persist() {
+    uint16_t count = _numZones * SOURCE_COUNT;
+    if (count == 0 || count > LEASE_STORE_CAPACITY) {
+        return;
+    }
+
+    int64_t nowUs = DeadlineTimer::nowUs();
+    time_t nowUnix = time(NULL);
+    bool timeValid = nowUnix > 1000000000L;
+
+    StoredLease* stored = _storeBuffer;
+    for (int i = 0; i < _numZones; i++) {
+        for (int s = 0; s < SOURCE_COUNT; s++) {
+            const ZoneLease& lease = _leases[i][s];
+            StoredLease& out = stored[i * SOURCE_COUNT + s];
+            memset(&out, 0, sizeof(out));
+            if (!lease.active) {
+                continue;
+            }
+            out.flags = STORED_LEASE_ACTIVE | (lease.state ? STORED_LEASE_ON : 0);
+            out.patternOnMs = lease.pattern.onMs;
+            out.patternOffMs = lease.pattern.offMs;
+            out.patternRepeat = lease.pattern.repeat;
+            if (lease.hasExpiry) {
+                int64_t remainingMs = (lease.expiresAt - nowUs) / 1000;
+                if (remainingMs < 1) {
+                    remainingMs = 1;
+                }
+                out.flags |= STORED_LEASE_EXPIRES;
+                out.remainingMs = (uint32_t)remainingMs;
+                out.endUnix = timeValid ? (uint32_t)(nowUnix + (remainingMs + 999) / 1000) : 0;
+            }
+        }
+    }
+    _store.save(stored, count);
+}
+
+// Khôi phục lease còn hạn và đóng lease đã hết hạn trong lúc thiết bị khởi động lại.
+// Unix time được giữ qua reset mềm nhờ RTC; nếu chưa có giờ thì dùng thời gian còn lại
+// tại lần lưu cuối. Bản flash không có thời gian còn lại: lease có hạn của nó chờ
+// restoreDeferred() khi đã có giờ.
+void ActuationArbiter::_restore() {
+    uint16_t count = _numZones * SOURCE_COUNT;
+    if (count == 0 || count > LEASE_STORE_CAPACITY) {
+        return;
+    }
+
+    StoredLease* stored = _storeBuffer;
+    if (!_store.load(stored, count)) {
+        return;
+    }
+
+    int64_t nowUs = DeadlineTimer::nowUs();
+    time_t nowUnix = time(NULL);
+    bool timeValid = nowUnix > 1000000000L;
+    int resumed = 0;
+    int closed = 0;
+    int deferred = 0;
+
+    for (int i = 0; i < _numZones; i++) {
+        for (int s = 0; s < SOURCE_COUNT; s++) {
+            const StoredLease& in = stored[i * SOURCE_COUNT + s];
+            if (!(in.flags & STORED_LEASE_ACTIVE)) {
+                continue;
+            }
+
+            int64_t expiresAt = 0;
+            if ((in.flags & STORED_LEASE_EXPIRES) && !timeValid && in.remainingMs == 0 && in.endUnix != 0) {
+                // Lease có hạn từ bản flash (sau mất điện): giữ lại đến khi NTP cho giờ hợp lệ
+                if (_deferred == nullptr) {
+                    _deferred = new StoredLease[count];
+                    memset(_deferred, 0, sizeof(StoredLease) * count);
+                }
+                _deferred[i * SOURCE_COUNT + s] = in;
+                deferred++;
+                continue;
+            }
+            if (in.flags & STORED_LEASE_EXPIRES) {
+                int64_t remainingMs;
+                if (timeValid && in.endUnix != 0) {
+                    remainingMs = ((int64_t)in.endUnix - (int64_t)nowUnix) * 1000;
+                } else {
+                    remainingMs = in.remainingMs;
+                }
+                if (remainingMs <= 0) {
+                    closed++;
+                    continue;
+                }
+                expiresAt = nowUs + remainingMs * 1000;
+            }
+
+            // Mẫu xung bắt đầu lại từ pha bật, trong phần thời gian còn lại của lease
+            LeasePattern pattern = { in.patternOnMs, in.patternOffMs, in.patternRepeat };
+            _setLease((ActuationSource)s, i, (in.flags & STORED_LEASE_ON) != 0, expiresAt, &pattern);
+            _restored[s] |= (RelayMask)1 << i;
+            resumed++;
+        }
+        _recompute(i);
+    }
+
+    _recomputeNextExpiry();
+    _flush();
+
+    if (deferred > 0) {
+        AppLogger.info("Arbiter", String(deferred) + " timed leases from flash wait for a valid clock");
+    }
+    if (resumed > 0 || closed > 0) {
+        AppLogger.info("Arbiter", "Restored " + String(resumed) + " leases, closed " + String(closed) + " expired");
+    }
+}
+
+RelayMask ActuationArbiter::restoreDeferred() {
+    if (_deferred == nullptr) {
+        return 0;
+    }
+    time_t nowUnix = time(NULL);
+    if (nowUnix <= 1000000000L) {
+        return 0;
+    }
+
+    RelayMask scheduleZones = 0;
+    int resumed = 0;
+    int dropped = 0;
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        int64_t nowUs = DeadlineTimer::nowUs();
+        for (int i = 0; i < _numZones; i++) {
+            for (int s = 0; s < SOURCE_COUNT; s++) {
+                const StoredLease& in = _deferred[i * SOURCE_COUNT + s];
+                if (!(in.flags & STORED_LEASE_ACTIVE)) {
+                    continue;
+                }
+                // Hết hạn trong lúc mất điện, hoặc nguồn đã ra lệnh mới trong lúc chờ giờ
+                int64_t remainingMs = ((int64_t)in.endUnix - (int64_t)nowUnix) * 1000;
+                if (remainingMs <= 0 || _leases[i][s].active) {
+                    dropped++;
+                    continue;
+                }
+                LeasePattern pattern = { in.patternOnMs, in.patternOffMs, in.patternRepeat };
+                _setLease((ActuationSource)s, i, (in.flags & STORED_LEASE_ON) != 0, nowUs + remainingMs * 1000, &pattern);
+                _restored[s] |= (RelayMask)1 << i;
+                if (s == SOURCE_SCHEDULE) {
+                    scheduleZones |= (RelayMask)1 << i;
+                }
+                resumed++;
+                _recompute(i);
+            }
+        }
+        _recomputeNextExpiry();
+        _flush();
+
+        delete[] _deferred;
+        _deferred = nullptr;
+        xSemaphoreGive(_mutex);
+    }
+
+    AppLogger.info("Arbiter", "Clock valid: restored " + String(resumed) + " timed leases from flash, dropped " + String(dropped));
+    return scheduleZones;
+}
+
+void ActuationArbiter::acquire(ActuationSource source, int relayIndex, bool state, unsigned long durationMs) {
+    if (relayIndex < 0 || relayIndex >= _numZones || source >= SOURCE_COUNT) {
+        AppLogger.error("Arbiter", "Invalid lease request: zone index " + String(relayIndex));
+        return;
+    }
+
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        _setLease(source, relayIndex, state, durationMs > 0 ? DeadlineTimer::afterMs(durationMs) : 0);
+        _recompute(relayIndex);
+        _recomputeNextExpiry();
+        _flush();
+
+        xSemaphoreGive(_mutex);
+    }
+}
+
+void ActuationArbiter::acquireMany(ActuationSource source, RelayMask zones, bool state, const unsigned long* durationsMs) {
+    int64_t now = DeadlineTimer::nowUs();
+    int64_t deadlines[IRRIGATION_MAX_ZONES];
+    for (int i = 0; i < _numZones; i++) {
+        unsigned long duration = durationsMs ? durationsMs[i] : 0;
+        deadlines[i] = ((zones & ((RelayMask)1 << i)) && duration > 0) ? now + (int64_t)duration * 1000 : 0;
+    }
+    acquireManyUntil(source, zones, state, deadlines);
+}
+
+void ActuationArbiter::acquireManyUntil(ActuationSource source, RelayMask zones, bool state, const int64_t* deadlinesUs) {
+    if (source >= SOURCE_COUNT) {
+        return;
+    }
+
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        for (int i = 0; i < _numZones; i++) {
+            if (zones & ((RelayMask)1 << i)) {
+                _setLease(source, i, state, deadlinesUs ? deadlinesUs[i] : 0);
+                _recompute(i);
+            }
+        }
+        _recomputeNextExpiry();
+        _flush();
+
+        xSemaphoreGive(_mutex);
+    }
+}
+
+void ActuationArbiter::releaseMany(ActuationSource source, RelayMask zones) {
+    if (source >= SOURCE_COUNT) {
+        return;
+    }
+
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        for (int i = 0; i < _numZones; i++) {
+            if ((zones & ((RelayMask)1 << i)) && _leases[i][source].active) {
+                _leases[i][source].active = false;
+                _recompute(i);
+            }
+        }
+        _recomputeNextExpiry();
+        _flush();
+
+        xSemaphoreGive(_mutex);
+    }
+}
+
+void ActuationArbiter::_setLease(ActuationSource source, int relayIndex, bool state, int64_t expiresAt,
+                                 const LeasePattern* pattern) {
+    ZoneLease& lease = _leases[relayIndex][source];
+    lease.active = true;
+    lease.state = state;
+    lease.hasExpiry = expiresAt > 0;
+    lease.expiresAt = expiresAt;
+    // Lease mới thay cả mẫu xung: không kèm mẫu là bật liên tục
+    if (pattern != nullptr && state) {
+        lease.pattern = *pattern;
+    } else {
+        memset(&lease.pattern, 0, sizeof(LeasePattern));
+    }
+}
+
+void ActuationArbiter::release(ActuationSource source, int relayIndex) {
+    if (relayIndex < 0 || relayIndex >= _numZones || source >= SOURCE_COUNT) {
+        return;
+    }
+
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        if (_leases[relayIndex][source].active) {
+            _leases[relayIndex][source].active = false;
+            _recompute(relayIndex);
+            _recomputeNextExpiry();
+            _flush();
+        }
+        xSemaphoreGive(_mutex);
+    }
+}
+
+void ActuationArbiter::setSourcePriority(ActuationSource source, uint8_t priority) {
+    if (source >= SOURCE_COUNT) {
+        return;
+    }
+
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        _priority[source] = priority;
+        // Thứ tự ưu tiên thay đổi ảnh hưởng tới mọi vùng
+        for (int i = 0; i < _numZones; i++) {
+            _recompute(i);
+        }
+        _flush();
+        xSemaphoreGive(_mutex);
+    }
+}
+
+bool ActuationArbiter::getLease(ActuationSource source, int relayIndex, ZoneLease& out) {
+    if (relayIndex < 0 || relayIndex >= _numZones || source >= SOURCE_COUNT) {
+        return false;
+    }
+
+    bool active = false;
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        out = _leases[relayIndex][source];
+        active = out.active;
+        xSemaphoreGive(_mutex);
+    }
+    return active;
+}
+
+ActuationSource ActuationArbiter::getOwner(int relayIndex) {
+    if (relayIndex < 0 || relayIndex >= _numZones) {
+        return SOURCE_COUNT;
+    }
+    return (ActuationSource)_owner[relayIndex];
+}
+
+void ActuationArbiter::setWorkerTask(TaskHandle_t task) {
+    _workerTask = task;
+}
+
+// Chạy trong task esp_timer: chỉ đánh thức task điều khiển relay
+void ActuationArbiter::_onExpiry(void* arg) {
+    ActuationArbiter* self = static_cast<ActuationArbiter*>(arg);
+    if (self->_workerTask != nullptr) {
+        xTaskNotifyGive(self->_workerTask);
+    } else {
+        self->update();
+    }
+}
+
+void ActuationArbiter::update() {
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        // Không có lease nào hết hạn trước thời điểm này thì không cần duyệt
+        // (_nextExpiry 64 bit chỉ đọc khi giữ _mutex)
+        int64_t now = DeadlineTimer::nowUs();
+        if (!_hasNextExpiry || now < _nextExpiry) {
+            xSemaphoreGive(_mutex);
+            return;
+        }
+        for (int i = 0; i < _numZones; i++) {
+            bool changed = false;
+            for (int s = 0; s < SOURCE_COUNT; s++) {
+                ZoneLease& lease = _leases[i][s];
+                if (lease.active && lease.hasExpiry && now >= lease.expiresAt) {
+                    lease.active = false;
+                    changed = true;
+                    LOGD("Arbiter", "Lease expired: zone %d, source %s", i + 1, sourceToString((ActuationSource)s));
+                }
+            }
+            if (changed) {
+                _recompute(i);
+            }
+        }
+        _recomputeNextExpiry();
+        _flush();
+        xSemaphoreGive(_mutex);
+    }
+}
+
+// Chọn lease thắng của một vùng và gom thay đổi khi kết quả khác với trạng thái đã áp dụng
+void ActuationArbiter::_recompute(int relayIndex) {
+    uint8_t winner = SOURCE_COUNT;
+    for (int s = 0; s < SOURCE_COUNT; s++) {
+        if (_leases[relayIndex][s].active &&
+            (winner == SOURCE_COUNT || _priority[s] > _priority[winner])) {
+            winner = s;
+        }
+    }
+
+    ZoneLease target = { false, false, false, 0, { 0, 0, 0 } };
+    if (winner != SOURCE_COUNT) {
+        target = _leases[relayIndex][winner];
+    }
+
+    if (winner != _owner[relayIndex]) {
+        LOGD("Arbiter", "Zone %d owner: %s", relayIndex + 1,
+             winner == SOURCE_COUNT ? "none" : sourceToString((ActuationSource)winner));
+        _owner[relayIndex] = winner;
+    }
+
+    ZoneLease& applied = _applied[relayIndex];
+    bool targetOn = winner != SOURCE_COUNT && target.state;
+    RelayMask bit = (RelayMask)1 << relayIndex;
+
+    if (targetOn) {
+        // RelayManager có thể tự tắt relay (hết số xung, chạm hạn mức ngày) và xóa mẫu mà
+        // không báo lại: khi đó coi như chưa áp dụng, gửi lại cả lệnh bật lẫn mẫu xung
+        bool relayOn = applied.state && _relayManager.getState(relayIndex);
+        bool patternChanged = relayOn
+            ? !samePattern(applied.pattern, target.pattern)
+            : target.pattern.onMs > 0 || applied.pattern.onMs > 0;
+        if (patternChanged) {
+            _batchPatternMask |= bit;
+            _batchPatterns[relayIndex] = target.pattern;
+        }
+        if (!relayOn || patternChanged || applied.hasExpiry != target.hasExpiry ||
+            (target.hasExpiry && applied.expiresAt != target.expiresAt)) {
+            // Relay dùng đúng hạn chót của lease, cùng gốc thời gian esp_timer
+            _batchMask |= bit;
+            _batchState |= bit;
+            _batchDeadlines[relayIndex] = target.hasExpiry ? target.expiresAt : 0;
+            applied = target;
+        }
+    } else if (applied.state) {
+        // Relay có thể đã tự tắt theo timer của RelayManager, setRelays() bỏ qua khi đó
+        _batchMask |= bit;
+        _batchState &= ~bit;
+        applied = { false, false, false, 0, { 0, 0, 0 } };
+    }
+}
+
+void ActuationArbiter::_flush() {
+    // Mọi thay đổi lease đều đi qua đây
+    _persist();
+
+    if (_batchMask == 0) {
+        return;
+    }
+    // Đặt mẫu trước khi bật để mẫu áp dụng ngay cho lần bật này
+    for (int i = 0; i < _numZones && _batchPatternMask != 0; i++) {
+        RelayMask bit = (RelayMask)1 << i;
+        if (_batchPatternMask & bit) {
+            const LeasePattern& pattern = _batchPatterns[i];
+            _relayManager.setPattern(i, pattern.onMs, pattern.offMs, pattern.repeat);
+            _batchPatternMask &= ~bit;
+        }
+    }
+    _relayManager.setRelaysUntil(_batchMask, _batchState, _batchDeadlines);
+    _batchMask = 0;
+    _batchState = 0;
+}
+
+void ActuationArbiter::_recomputeNextExpiry() {
+    _hasNextExpiry = false;
+    for (int i = 0; i < _numZones; i++) {
+        for (int s = 0; s < SOURCE_COUNT; s++) {
+            const ZoneLease& lease = _leases[i][s];
+            if (lease.active && lease.hasExpiry &&
+                (!_hasNextExpiry || lease.expiresAt < _nextExpiry)) {
+                _nextExpiry = lease.expiresAt;
+                _hasNextExpiry = true;
+            }
+        }
+    }
+
+    if (_hasNextExpiry) {
+        _expiryTimer.armAt(_nextExpiry);
+    } else {
+        _expiryTimer.cancel();
+    }
+}
+
+// Thời điểm kết thúc muộn nhất của các lease BẬT thuộc nguồn khác trên cùng vùng
+// (0 nếu không có, hoặc có lease không thời hạn)
+int64_t ActuationArbiter::_latestOtherLease(int relayIndex, ActuationSource source, int64_t now) {
+    int64_t latest = 0;
+    for (int s = 0; s < SOURCE_COUNT; s++) {
+        const ZoneLease& lease = _leases[relayIndex][s];
+        if (s == source || !lease.active || !lease.state) {
+            continue;
+        }
+        if (!lease.hasExpiry) {
+            return 0; // Lease không thời hạn: lệnh tắt giữ đến khi có lệnh mới
+        }
+        if (lease.expiresAt > now && lease.expiresAt > latest) {
+            latest = lease.expiresAt;
+        }
+    }
+    return latest;
+}
+
+bool ActuationArbiter::processCommand(const char* json) {
+    // Mỗi phần tử relays: id, state, duration, pattern {on, off, repeat}
+    DynamicJsonDocument doc(256 + JSON_ARRAY_SIZE(IRRIGATION_MAX_ZONES) +
+                            IRRIGATION_MAX_ZONES * (JSON_OBJECT_SIZE(4) + JSON_OBJECT_SIZE(3)));
+    DeserializationError error = deserializeJson(doc, json);
+
+    if (error) {
+        AppLogger.error("Arbiter", "JSON parsing failed: " + String(error.c_str()));
+        return false;
+    }
+
+    if (!doc.containsKey("relays")) {
+        AppLogger.error("Arbiter", "Command missing 'relays' field");
+        return false;
+    }
+
+    // Nguồn mặc định là thủ công; server luật tự động gửi "source": "rule"
+    ActuationSource source = SOURCE_MANUAL;
+    const char* sourceStr = doc["source"];
+    if (sourceStr && strcmp(sourceStr, "rule") == 0) {
+        source = SOURCE_RULE;
+    }
+
+    JsonArray relays = doc["relays"];
+    bool anyChanges = false;
+
+    // Toàn bộ lệnh được áp dụng trong một lần khóa và một lần ghi relay
+    if (!xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        return false;
+    }
+
+    for (JsonObject relay : relays) {
+        if (!relay.containsKey("id") || !relay.containsKey("state")) {
+            continue;
+        }
+
+        int id = relay["id"];
+        bool state = relay["state"];
+        if (id < 1 || id > _numZones) {
+            AppLogger.error("Arbiter", "Invalid relay ID: " + String(id));
+            continue;
+        }
+        int relayIndex = id - 1;
+
+        if (state) {
+            unsigned long duration = 0;
+            if (relay.containsKey("duration")) {
+                duration = relay["duration"];
+                // Convert seconds to milliseconds if needed
+                if (duration < 10000) {
+                    duration *= 1000;
+                }
+            }
+            LeasePattern pattern = { 0, 0, 0 };
+            if (relay.containsKey("pattern")) {
+                // Mẫu xung: on/off tính bằng giây, repeat = số xung (0 = đến khi hết duration).
+                // Mẫu thuộc lease, chỉ chạy trên relay khi nguồn này thắng vùng
+                JsonObject p = relay["pattern"];
+                pattern.onMs = (uint32_t)(p["on"].as<float>() * 1000);
+                pattern.offMs = (uint32_t)(p["off"].as<float>() * 1000);
+                pattern.repeat = p["repeat"] | 0;
+                if (pattern.onMs > 0 && pattern.offMs == 0) {
+                    AppLogger.warning("Arbiter", "Pattern without off time ignored for zone " + String(id));
+                    pattern = { 0, 0, 0 };
+                }
+                // Không có duration: lease kết thúc cùng xung cuối
+                if (duration == 0 && pattern.repeat > 0 && pattern.onMs > 0) {
+                    duration = (unsigned long)pattern.repeat * pattern.onMs +
+                               (unsigned long)(pattern.repeat - 1) * pattern.offMs;
+                }
+            }
+            _setLease(source, relayIndex, true, duration > 0 ? DeadlineTimer::afterMs(duration) : 0, &pattern);
+        } else if (relay.containsKey("release") && relay["release"].as<bool>()) {
+            // Trả quyền điều khiển cho các nguồn khác
+            _leases[relayIndex][source].active = false;
+        } else {
+            // Lệnh TẮT: giữ tắt trong "hold" giây, hoặc đến khi lease BẬT dài nhất của nguồn khác kết thúc
+            if (relay.containsKey("hold")) {
+                unsigned long hold = relay["hold"].as<unsigned long>() * 1000;
+                _setLease(source, relayIndex, false, hold > 0 ? DeadlineTimer::afterMs(hold) : 0);
+            } else {
+                _holdOff(source, relayIndex);
+            }
+        }
+        _recompute(relayIndex);
+        anyChanges = true;
+    }
+
+    _recomputeNextExpiry();
+    _flush();
+    xSemaphoreGive(_mutex);
+
+    return anyChanges;
+}
+
+void ActuationArbiter::command(ActuationSource source, RelayMask zones, RelayMask states, const unsigned long* durationsMs) {
+    if (!xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        return;
+    }
+
+    for (int i = 0; i < _numZones; i++) {
+        RelayMask bit = (RelayMask)1 << i;
+        if (!(zones & bit)) {
+            continue;
+        }
+        if (states & bit) {
+            unsigned long duration = durationsMs ? durationsMs[i] : 0;
+            _setLease(source, i, true, duration > 0 ? DeadlineTimer::afterMs(duration) : 0);
+        } else {
+            _holdOff(source, i);
+        }
+        _recompute(i);
+    }
+
+    _recomputeNextExpiry();
+    _flush();
+    xSemaphoreGive(_mutex);
+}
+
+// Lệnh TẮT không kèm thời hạn: giữ tắt đến khi lease BẬT dài nhất của nguồn khác kết thúc,
+// hoặc chỉ trả lease nếu không nguồn nào khác đang bật vùng (gọi khi giữ _mutex)
+void ActuationArbiter::_holdOff(ActuationSource source, int relayIndex) {
+    int64_t holdUntil = _latestOtherLease(relayIndex, source, DeadlineTimer::nowUs());
+    bool hasUnboundedOn = false;
+    for (int s = 0; s < SOURCE_COUNT; s++) {
+        const ZoneLease& lease = _leases[relayIndex][s];
+        if (s != source && lease.active && lease.state && !lease.hasExpiry) {
+            hasUnboundedOn = true;
+        }
+    }
+    if (holdUntil == 0 && !hasUnboundedOn) {
+        // Không có nguồn nào khác đang bật vùng này, chỉ cần trả lease
+        _leases[relayIndex][source].active = false;
+    } else {
+        _setLease(source, relayIndex, false, holdUntil);
+    }
+}
+
+const char* ActuationArbiter::sourceToString(ActuationSource source) {
+    if (source < SOURCE_COUNT) {
+        return SOURCE_NAMES[source];
+    }
+    return "none";
+}
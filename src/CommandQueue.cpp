@@ -0,0 +1,115 @@
+#include "../include/CommandQueue.h"
+#include "../include/Logger.h"
+#include "../include/LatencyMonitor.h"
+#include <esp_timer.h>
+
+static_assert(COMMAND_PAYLOAD_MAX <= MQTT_BUFFER_SIZE, "Larger commands would never arrive through the MQTT buffer");
+static_assert(COMMAND_PAYLOAD_MAX <= UINT16_MAX, "CommandSlot::length is 16-bit");
+
+// Định nghĩa hàng đợi lệnh toàn cục
+CommandQueue MqttCommands;
+
+CommandQueue::CommandQueue() {
+    _freeSlots = nullptr;
+    _readySlots = nullptr;
+    _handler = nullptr;
+    _worker = nullptr;
+    _received = 0;
+    _processed = 0;
+    _dropped = 0;
+    _oversized = 0;
+    _maxDepth = 0;
+}
+
+bool CommandQueue::begin(Handler handler, const char* taskName, uint32_t stackSize, UBaseType_t priority, BaseType_t core) {
+    _handler = handler;
+    _freeSlots = xQueueCreate(COMMAND_QUEUE_SLOTS, sizeof(uint8_t));
+    _readySlots = xQueueCreate(COMMAND_QUEUE_SLOTS, sizeof(uint8_t));
+    if (_freeSlots == nullptr || _readySlots == nullptr) {
+        AppLogger.critical("CmdQueue", "Failed to create command queues");
+        return false;
+    }
+
+    for (uint8_t i = 0; i < COMMAND_QUEUE_SLOTS; i++) {
+        xQueueSend(_freeSlots, &i, 0);
+    }
+
+    if (xTaskCreatePinnedToCore(_workerTask, taskName, stackSize, this, priority, &_worker, core) != pdPASS) {
+        AppLogger.critical("CmdQueue", "Failed to create command worker task");
+        return false;
+    }
+
+    AppLogger.info("CmdQueue", "Initialized with " + String(COMMAND_QUEUE_SLOTS) + " slots");
+    return true;
+}
+
+bool CommandQueue::enqueue(const char* topic, const uint8_t* payload, unsigned int length) {
+    _received++;
+
+    size_t topicLen = strlen(topic);
+    if (topicLen >= COMMAND_TOPIC_MAX || length > COMMAND_PAYLOAD_MAX) {
+        _oversized++;
+        return false;
+    }
+
+    // Không chờ slot: nếu worker chưa theo kịp thì bỏ lệnh để vòng lặp mạng không bị chặn
+    uint8_t index;
+    if (_freeSlots == nullptr || xQueueReceive(_freeSlots, &index, 0) != pdTRUE) {
+        _dropped++;
+        return false;
+    }
+
+    CommandSlot& slot = _slots[index];
+    memcpy(slot.topic, topic, topicLen + 1);
+    memcpy(slot.payload, payload, length);
+    slot.payload[length] = '\0';
+    slot.length = (uint16_t)length;
+    slot.arrivalUs = esp_timer_get_time();
+
+    xQueueSend(_readySlots, &index, 0);
+
+    uint32_t depth = uxQueueMessagesWaiting(_readySlots);
+    uint32_t seen = _maxDepth.load();
+    while (depth > seen && !_maxDepth.compare_exchange_weak(seen, depth)) {
+    }
+    return true;
+}
+
+CommandQueueStats CommandQueue::getStats() const {
+    CommandQueueStats stats;
+    stats.received = _received.load();
+    stats.processed = _processed.load();
+    stats.dropped = _dropped.load();
+    stats.oversized = _oversized.load();
+    stats.depth = _readySlots ? uxQueueMessagesWaiting(_readySlots) : 0;
+    stats.maxDepth = _maxDepth.load();
+    return stats;
+}
+
+void CommandQueue::_workerTask(void* parameter) {
+    CommandQueue* self = static_cast<CommandQueue*>(parameter);
+    AppLogger.info("CmdQueue", "Worker started on core " + String(xPortGetCoreID()));
+
+    uint32_t reportedDrops = 0;
+    for (;;) {
+        uint8_t index;
+        if (xQueueReceive(self->_readySlots, &index, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        CommandSlot& slot = self->_slots[index];
+        ActuationLatency.beginCommand(slot.arrivalUs);
+        self->_handler(slot.topic, slot.payload, slot.length);
+        ActuationLatency.endCommand();
+        self->_processed++;
+
+        xQueueSend(self->_freeSlots, &index, 0);
+
+        // Báo lệnh bị bỏ từ ngữ cảnh worker, không ghi log trong callback mạng
+        uint32_t lost = self->_dropped.load() + self->_oversized.load();
+        if (lost != reportedDrops) {
+            AppLogger.warning("CmdQueue", "Commands dropped so far: " + String(lost));
+            reportedDrops = lost;
+        }
+    }
+}
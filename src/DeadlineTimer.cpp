@@ -0,0 +1,52 @@
+#include "../include/DeadlineTimer.h"
+#include "../include/Logger.h"
+
+DeadlineTimer::DeadlineTimer() {
+    _handle = nullptr;
+    _deadlineUs = 0;
+}
+
+bool DeadlineTimer::begin(const char* name, Callback callback, void* arg) {
+    if (_handle != nullptr) {
+        return true;
+    }
+
+    esp_timer_create_args_t args = {};
+    args.callback = callback;
+    args.arg = arg;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = name;
+
+    esp_err_t err = esp_timer_create(&args, &_handle);
+    if (err != ESP_OK) {
+        _handle = nullptr;
+        AppLogger.error("Deadline", String("Failed to create timer ") + name + ": " + esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+void DeadlineTimer::armAt(int64_t deadlineUs) {
+    if (_handle == nullptr) {
+        return;
+    }
+    if (deadlineUs == _deadlineUs && esp_timer_is_active(_handle)) {
+        return;
+    }
+
+    esp_timer_stop(_handle); // Trả về lỗi nếu timer không chạy, bỏ qua
+    int64_t delayUs = deadlineUs - nowUs();
+    if (delayUs < 1) {
+        delayUs = 1;
+    }
+    _deadlineUs = deadlineUs;
+    esp_timer_start_once(_handle, (uint64_t)delayUs);
+}
+
+void DeadlineTimer::cancel() {
+    if (_handle == nullptr) {
+        return;
+    }
+    esp_timer_stop(_handle);
+    _deadlineUs = 0;
+}
@@ -0,0 +1,132 @@
+#include "../include/DecisionTrace.h"
+#include "../include/FlightRecorder.h"
+#include <ArduinoJson.h>
+#include <time.h>
+
+// Định nghĩa vòng đệm quyết định toàn cục
+DecisionTrace SchedulerTrace;
+
+static const char* TRACE_DECISION_NAMES[TRACE_DECISION_COUNT] = {
+    "time_match",
+    "started",
+    "completed",
+    "skip_temperature",
+    "skip_humidity",
+    "skip_soil_moisture",
+    "skip_rain",
+    "skip_light",
+    "blocked_priority",
+    "preempted",
+    "deleted",
+    "resumed"
+};
+
+DecisionTrace::DecisionTrace() {
+    _sequence = 0;
+    memset(_ring, 0, sizeof(_ring));
+}
+
+void DecisionTrace::record(TraceDecision decision, int taskId, float value, float threshold,
+                           int otherTaskId, uint8_t zone) {
+    // Chuẩn bị bản ghi ngoài vùng khóa để giữ spinlock ngắn nhất có thể
+    TraceRecord rec;
+    rec.uptimeMs = millis();
+    rec.taskId = (int16_t)taskId;
+    rec.otherTaskId = (int16_t)otherTaskId;
+    rec.decision = (uint8_t)decision;
+    rec.zone = zone;
+    rec.reserved = 0;
+    rec.value = value;
+    rec.threshold = threshold;
+
+    portENTER_CRITICAL(&_lock);
+    rec.sequence = _sequence;
+    _ring[_sequence & (DECISION_TRACE_CAPACITY - 1)] = rec;
+    _sequence++;
+    portEXIT_CRITICAL(&_lock);
+
+    FlightLog.recordDecision(decision, taskId, zone, otherTaskId, value);
+}
+
+uint32_t DecisionTrace::getTotalRecords() {
+    portENTER_CRITICAL(&_lock);
+    uint32_t total = _sequence;
+    portEXIT_CRITICAL(&_lock);
+    return total;
+}
+
+const char* DecisionTrace::decisionToString(uint8_t decision) {
+    if (decision < TRACE_DECISION_COUNT) {
+        return TRACE_DECISION_NAMES[decision];
+    }
+    return "unknown";
+}
+
+String DecisionTrace::toJson(const char* apiKey, size_t maxRecords, size_t maxBytes) {
+    if (maxRecords > DECISION_TRACE_CAPACITY) {
+        maxRecords = DECISION_TRACE_CAPACITY;
+    }
+
+    // Chép nhanh các bản ghi mới nhất ra khỏi vòng đệm rồi mới định dạng JSON
+    TraceRecord* snapshot = new TraceRecord[maxRecords > 0 ? maxRecords : 1];
+    size_t count = 0;
+    uint32_t total;
+
+    portENTER_CRITICAL(&_lock);
+    total = _sequence;
+    count = total < maxRecords ? total : maxRecords;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t seq = total - count + i;
+        snapshot[i] = _ring[seq & (DECISION_TRACE_CAPACITY - 1)];
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    DynamicJsonDocument doc(256 + count * JSON_OBJECT_SIZE(8));
+
+    if (apiKey) {
+        doc["api_key"] = apiKey;
+    }
+    time_t nowUnix = time(NULL);
+    unsigned long nowMs = millis();
+    bool timeValid = nowUnix > 1000000000L;
+    doc["timestamp"] = (uint32_t)nowUnix;
+    doc["total"] = total;
+
+    JsonArray records = doc.createNestedArray("records");
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord& rec = snapshot[i];
+        JsonObject obj = records.createNestedObject();
+        obj["seq"] = rec.sequence;
+        // Quy đổi uptime sang Unix time khi xuất, tránh gọi time() trên đường ghi
+        if (timeValid) {
+            obj["time"] = (uint32_t)(nowUnix - (time_t)((nowMs - rec.uptimeMs) / 1000));
+        } else {
+            obj["uptime_ms"] = rec.uptimeMs;
+        }
+        obj["task"] = rec.taskId;
+        obj["decision"] = decisionToString(rec.decision);
+        if (rec.zone > 0) {
+            obj["zone"] = rec.zone;
+        }
+        if (rec.value != 0 || rec.threshold != 0) {
+            obj["value"] = rec.value;
+            obj["threshold"] = rec.threshold;
+        }
+        if (rec.otherTaskId >= 0) {
+            obj["by_task"] = rec.otherTaskId;
+        }
+    }
+
+    delete[] snapshot;
+
+    // Giữ các bản ghi mới nhất vừa giới hạn độ dài
+    if (maxBytes > 0) {
+        while (records.size() > 0 && measureJson(doc) > maxBytes) {
+            records.remove(0);
+        }
+    }
+
+    String payload;
+    serializeJson(doc, payload);
+    return payload;
+}
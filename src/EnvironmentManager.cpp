@@ -1,5 +1,17 @@
 #include "../include/EnvironmentManager.h"
 #include "../include/Logger.h"
+#include <math.h>
+#include <time.h>
+
+// Hằng số cho ước tính ET0 (FAO-56)
+static const float ET0_SOLAR_CONSTANT = 0.0820f;      // Gsc (MJ/m²/phút)
+static const float ET0_MJ_TO_MM = 0.408f;             // Quy đổi bức xạ MJ/m² sang mm nước bốc hơi
+static const float ET0_LUX_TO_WM2 = 0.0079f;          // Quy đổi lux ánh sáng mặt trời sang W/m²
+static const float ET0_DEFAULT_LATITUDE = 10.8f;      // Mặc định: TP.HCM
+static const float ET0_DEFAULT_REFERENCE = 5.0f;      // mm/ngày ứng với thời lượng gốc của lịch
+static const float ET0_SCALE_MIN = 0.25f;             // Giới hạn hệ số nhân thời lượng
+static const float ET0_SCALE_MAX = 2.0f;
+static const unsigned long ET0_MAX_SAMPLE_GAP_MS = 10UL * 60UL * 1000UL; // Bỏ qua tích phân khi mất mẫu quá lâu
 
 EnvironmentManager::EnvironmentManager(SensorManager& sensorManager) : _sensorManager(sensorManager) {
     _temperature = 0.0;
@@ -9,9 +21,18 @@ EnvironmentManager::EnvironmentManager(SensorManager& sensorManager) : _sensorMa
     _lightLevel = 0;
     _lastUpdateTime = 0;
     
+    _et0Acc.dayOfYear = -1;
+    _et0Acc.samples = 0;
+    _extraterrestrialRad = 0.0;
+    _et0Today = 0.0;
+    _et0LastDay = 0.0;
+    _latitudeDeg = ET0_DEFAULT_LATITUDE;
+    _referenceEt0 = ET0_DEFAULT_REFERENCE;
+    
     // Thiết lập giá trị mặc định cho độ ẩm đất (50% - giá trị trung bình)
-    for (int i = 1; i <= 6; i++) {
+    for (int i = 0; i < IRRIGATION_MAX_ZONES; i++) {
         _soilMoisture[i] = 50.0;
+        _cropCoefficient[i] = 1.0;
     }
 }
 
@@ -43,9 +64,8 @@ float EnvironmentManager::getHeatIndex() {
 }
 
 float EnvironmentManager::getSoilMoisture(int zone) {
-    // Kiểm tra xem zone có trong map không
-    if (_soilMoisture.find(zone) != _soilMoisture.end()) {
-        return _soilMoisture[zone];
+    if (isValidZoneId(zone)) {
+        return _soilMoisture[zone - 1];
     }
     
     // Trả về giá trị mặc định nếu không tìm thấy zone
@@ -63,6 +83,7 @@ int EnvironmentManager::getLightLevel() {
 // Setter cho nhiệt độ từ bên ngoài
 void EnvironmentManager::setCurrentTemperature(float temp) {
     _temperature = temp;
+    _accumulateEt0Sample(temp);
 }
 
 // Setter cho độ ẩm từ bên ngoài
@@ -76,8 +97,8 @@ void EnvironmentManager::setCurrentHeatIndex(float hi) {
 }
 
 void EnvironmentManager::setSoilMoisture(int zone, float value) {
-    if (zone >= 1 && zone <= 6) {
-        _soilMoisture[zone] = value;
+    if (isValidZoneId(zone)) {
+        _soilMoisture[zone - 1] = value;
         AppLogger.info("EnvMgr", "Set soil moisture for zone " + String(zone) + " to " + String(value) + "%");
     }
 }
@@ -90,4 +111,134 @@ void EnvironmentManager::setRainStatus(bool isRaining) {
 void EnvironmentManager::setLightLevel(int level) {
     _lightLevel = level;
     AppLogger.info("EnvMgr", "Set light level to " + String(level) + " lux");
-} 
\ No newline at end of file
+}
+
+void EnvironmentManager::setLatitude(float latitudeDeg) {
+    if (latitudeDeg < -66.0 || latitudeDeg > 66.0) {
+        AppLogger.warning("EnvMgr", "Latitude out of supported range: " + String(latitudeDeg));
+        return;
+    }
+    _latitudeDeg = latitudeDeg;
+    if (_et0Acc.dayOfYear >= 0) {
+        _extraterrestrialRad = _extraterrestrialRadiation(_latitudeDeg, _et0Acc.dayOfYear);
+    }
+    AppLogger.info("EnvMgr", "Set ET0 latitude to " + String(latitudeDeg));
+}
+
+void EnvironmentManager::setReferenceEt0(float et0MmPerDay) {
+    if (et0MmPerDay <= 0.0) {
+        AppLogger.warning("EnvMgr", "Invalid reference ET0: " + String(et0MmPerDay));
+        return;
+    }
+    _referenceEt0 = et0MmPerDay;
+    AppLogger.info("EnvMgr", "Set reference ET0 to " + String(et0MmPerDay) + " mm/day");
+}
+
+void EnvironmentManager::setCropCoefficient(int zone, float kc) {
+    if (isValidZoneId(zone) && kc > 0.0) {
+        _cropCoefficient[zone - 1] = kc;
+        AppLogger.info("EnvMgr", "Set crop coefficient for zone " + String(zone) + " to " + String(kc));
+    }
+}
+
+float EnvironmentManager::getEt0() {
+    // Ưu tiên ET0 của ngày đã kết thúc (đủ Tmin/Tmax), nếu chưa có thì dùng giá trị tạm tính
+    if (_et0LastDay > 0.0) {
+        return _et0LastDay;
+    }
+    return _et0Today;
+}
+
+float EnvironmentManager::getDurationScale(int zone) {
+    float et0 = getEt0();
+    if (et0 <= 0.0) {
+        return 1.0; // Chưa có dữ liệu, giữ nguyên thời lượng
+    }
+    
+    float kc = isValidZoneId(zone) ? _cropCoefficient[zone - 1] : 1.0;
+    
+    float scale = (et0 * kc) / _referenceEt0;
+    if (scale < ET0_SCALE_MIN) scale = ET0_SCALE_MIN;
+    if (scale > ET0_SCALE_MAX) scale = ET0_SCALE_MAX;
+    return scale;
+}
+
+// Cập nhật bộ tích lũy với một mẫu nhiệt độ mới - O(1), không đọc lại lịch sử
+void EnvironmentManager::_accumulateEt0Sample(float temp) {
+    if (isnan(temp)) {
+        return;
+    }
+    
+    time_t now = time(nullptr);
+    if (now < 1000000000L) {
+        return; // Chưa đồng bộ NTP, không xác định được ngày trong năm
+    }
+    struct tm timeinfo;
+    localtime_r(&now, &timeinfo);
+    int dayOfYear = timeinfo.tm_yday + 1;
+    unsigned long currentMs = millis();
+    
+    // Sang ngày mới: chốt ET0 của ngày cũ và khởi tạo lại bộ tích lũy
+    if (dayOfYear != _et0Acc.dayOfYear) {
+        if (_et0Acc.dayOfYear >= 0 && _et0Acc.samples >= 2) {
+            _et0LastDay = _computeEt0(_et0Acc);
+            AppLogger.info("EnvMgr", "ET0 for day " + String(_et0Acc.dayOfYear) + ": " + String(_et0LastDay) +
+                           " mm (Tmin=" + String(_et0Acc.tMin) + ", Tmax=" + String(_et0Acc.tMax) + ")");
+        }
+        _et0Acc.dayOfYear = dayOfYear;
+        _et0Acc.tMin = temp;
+        _et0Acc.tMax = temp;
+        _et0Acc.tSum = 0.0;
+        _et0Acc.samples = 0;
+        _et0Acc.solarMJ = 0.0;
+        _et0Acc.lightSeen = false;
+        _et0Acc.lastSampleMs = currentMs;
+        _extraterrestrialRad = _extraterrestrialRadiation(_latitudeDeg, dayOfYear);
+    }
+    
+    if (temp < _et0Acc.tMin) _et0Acc.tMin = temp;
+    if (temp > _et0Acc.tMax) _et0Acc.tMax = temp;
+    _et0Acc.tSum += temp;
+    _et0Acc.samples++;
+    
+    // Tích phân bức xạ từ mức ánh sáng hiện tại trong khoảng giữa hai mẫu
+    unsigned long elapsedMs = currentMs - _et0Acc.lastSampleMs;
+    if (_lightLevel > 0) {
+        _et0Acc.lightSeen = true;
+        if (elapsedMs <= ET0_MAX_SAMPLE_GAP_MS) {
+            _et0Acc.solarMJ += (_lightLevel * ET0_LUX_TO_WM2) * (elapsedMs / 1000.0f) / 1000000.0f;
+        }
+    }
+    _et0Acc.lastSampleMs = currentMs;
+    
+    if (_et0Acc.samples >= 2) {
+        _et0Today = _computeEt0(_et0Acc);
+    }
+}
+
+float EnvironmentManager::_computeEt0(const Et0Accumulator& acc) const {
+    float tMean = acc.tSum / acc.samples;
+    float et0;
+    
+    if (acc.lightSeen && acc.solarMJ > 0.0) {
+        // Hargreaves (1985) với bức xạ đo được: ET0 = 0.0135 * (Tmean + 17.8) * Rs
+        et0 = 0.0135f * (tMean + 17.8f) * acc.solarMJ * ET0_MJ_TO_MM;
+    } else {
+        // Hargreaves-Samani: ET0 = 0.0023 * Ra * (Tmean + 17.8) * sqrt(Tmax - Tmin)
+        float range = acc.tMax - acc.tMin;
+        if (range < 0.0) range = 0.0;
+        et0 = 0.0023f * _extraterrestrialRad * ET0_MJ_TO_MM * (tMean + 17.8f) * sqrtf(range);
+    }
+    
+    return et0 > 0.0 ? et0 : 0.0;
+}
+
+// Bức xạ ngoài khí quyển Ra (FAO-56, phương trình 21), chỉ tính một lần mỗi ngày
+float EnvironmentManager::_extraterrestrialRadiation(float latitudeDeg, int dayOfYear) {
+    float phi = latitudeDeg * PI / 180.0;
+    float dr = 1.0 + 0.033 * cosf(2.0 * PI * dayOfYear / 365.0);
+    float delta = 0.409 * sinf(2.0 * PI * dayOfYear / 365.0 - 1.39);
+    float ws = acosf(-tanf(phi) * tanf(delta));
+    return (24.0 * 60.0 / PI) * ET0_SOLAR_CONSTANT * dr *
+           (ws * sinf(phi) * sinf(delta) + cosf(phi) * cosf(delta) * sinf(ws));
+}
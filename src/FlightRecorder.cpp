@@ -0,0 +1,265 @@
+#include "../include/FlightRecorder.h"
+#include "../include/DecisionTrace.h"
+#include "../include/Logger.h"
+#include <ArduinoJson.h>
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <rom/crc.h>
+#include <atomic>
+
+#define FLIGHT_RECORDER_MAGIC 0x464C5431UL   // "FLT1"
+
+// Hộp đen dùng chung
+FlightRecorder FlightLog;
+
+struct FlightRing {
+    uint32_t magic;
+    uint32_t boots;             // Số lần khởi động kể từ khi vùng RTC được khởi tạo
+    uint32_t dumped;            // Các sự kiện có số thứ tự nhỏ hơn đã được gửi
+    uint32_t crc;               // CRC32 của ba trường phía trên
+    uint32_t sequence;          // Số sự kiện đã ghi (vị trí ghi = sequence % capacity)
+    FlightEvent events[FLIGHT_RECORDER_CAPACITY];
+};
+
+// Vùng RTC không bị khởi tạo lại khi reset mềm. sequence nằm ngoài CRC để mỗi lần ghi
+// chỉ là một lần chép bản ghi và một lần ghi 32 bit; bản ghi tự kiểm bằng check.
+RTC_NOINIT_ATTR static FlightRing s_ring;
+
+static const char* FLIGHT_EVENT_NAMES[FLIGHT_EVENT_COUNT] = {
+    "boot",
+    "relay",
+    "decision",
+    "network",
+    "watermark"
+};
+
+static const char* FLIGHT_WATERMARK_NAMES[FLIGHT_WM_COUNT] = {
+    "heap",
+    "core0_stack",
+    "core1_stack"
+};
+
+static uint32_t headerCrc(const FlightRing& ring) {
+    return crc32_le(0, (const uint8_t*)&ring, offsetof(FlightRing, crc));
+}
+
+static uint8_t eventCheck(const FlightEvent& event) {
+    const uint8_t* bytes = (const uint8_t*)&event;
+    uint8_t sum = 0xA5;
+    for (size_t i = 0; i < offsetof(FlightEvent, check); i++) {
+        sum = (uint8_t)((sum << 1 | sum >> 7) ^ bytes[i]);
+    }
+    return sum;
+}
+
+FlightRecorder::FlightRecorder() {
+    _dump = nullptr;
+    _dumpCount = 0;
+    _dumpEnd = 0;
+    _resetReason = ESP_RST_UNKNOWN;
+    _ready = false;
+    for (size_t i = 0; i < FLIGHT_WM_COUNT; i++) {
+        _watermarks[i] = UINT32_MAX;
+    }
+}
+
+void FlightRecorder::begin() {
+    _resetReason = (uint8_t)esp_reset_reason();
+
+    bool valid = s_ring.magic == FLIGHT_RECORDER_MAGIC && s_ring.crc == headerCrc(s_ring) &&
+                 s_ring.sequence - s_ring.dumped <= s_ring.sequence;
+    if (!valid) {
+        // Mất nguồn hoặc lần đầu chạy: nội dung RTC là rác
+        memset(&s_ring, 0, sizeof(s_ring));
+        s_ring.magic = FLIGHT_RECORDER_MAGIC;
+    } else {
+        // Chép các sự kiện chưa gửi ra RAM; vòng đệm RTC tiếp tục ghi nối tiếp
+        uint32_t end = s_ring.sequence;
+        uint32_t pending = end - s_ring.dumped;
+        if (pending > FLIGHT_RECORDER_CAPACITY) {
+            pending = FLIGHT_RECORDER_CAPACITY;
+        }
+        if (pending > 0) {
+            _dump = new FlightEvent[pending];
+            for (uint32_t seq = end - pending; seq != end; seq++) {
+                const FlightEvent& event = s_ring.events[seq & (FLIGHT_RECORDER_CAPACITY - 1)];
+                if (event.type < FLIGHT_EVENT_COUNT && event.check == eventCheck(event)) {
+                    _dump[_dumpCount++] = event;
+                }
+            }
+            _dumpEnd = end;
+            if (_dumpCount == 0) {
+                delete[] _dump;     // Không còn bản ghi hợp lệ
+                _dump = nullptr;
+                s_ring.dumped = end;
+            }
+        }
+    }
+    s_ring.boots++;
+    s_ring.crc = headerCrc(s_ring);
+    _ready = true;
+
+    record(FLIGHT_BOOT, _resetReason, s_ring.boots);
+
+    if (_resetReason == ESP_RST_PANIC || _resetReason == ESP_RST_INT_WDT || _resetReason == ESP_RST_TASK_WDT ||
+        _resetReason == ESP_RST_WDT || _resetReason == ESP_RST_BROWNOUT) {
+        LOGW("Flight", "Boot %lu after %s reset, %u events from before it will be sent over MQTT",
+             (unsigned long)s_ring.boots, resetReasonToString(_resetReason), (unsigned)_dumpCount);
+    } else {
+        LOGI("Flight", "Boot %lu after %s reset, %u unsent events kept", (unsigned long)s_ring.boots,
+             resetReasonToString(_resetReason), (unsigned)_dumpCount);
+    }
+}
+
+void FlightRecorder::record(FlightEventType type, uint16_t arg, uint32_t a, uint32_t b) {
+    if (!_ready) {
+        return;
+    }
+    // Chuẩn bị bản ghi ngoài vùng khóa để giữ spinlock ngắn nhất có thể
+    FlightEvent event;
+    event.uptimeMs = millis();
+    event.a = a;
+    event.b = b;
+    event.arg = arg;
+    event.type = (uint8_t)type;
+    event.check = eventCheck(event);
+
+    portENTER_CRITICAL(&_lock);
+    uint32_t seq = s_ring.sequence;
+    s_ring.events[seq & (FLIGHT_RECORDER_CAPACITY - 1)] = event;
+    // Bản ghi phải nằm trong RTC trước khi sequence tăng, kể cả khi reset ngay sau đó
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    s_ring.sequence = seq + 1;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void FlightRecorder::recordRelays(RelayMask onMask, RelayMask offMask) {
+    record(FLIGHT_RELAY, 0, (uint32_t)onMask, (uint32_t)offMask);
+#if IRRIGATION_MAX_ZONES > 32
+    if ((onMask | offMask) >> 32) {
+        record(FLIGHT_RELAY, 1, (uint32_t)(onMask >> 32), (uint32_t)(offMask >> 32));
+    }
+#endif
+}
+
+void FlightRecorder::recordDecision(uint8_t decision, int taskId, uint8_t zone, int otherTaskId, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    record(FLIGHT_DECISION, (uint16_t)taskId, decision | (uint32_t)zone << 8 | (uint32_t)(uint16_t)otherTaskId << 16, bits);
+}
+
+void FlightRecorder::recordNetwork(uint8_t state, int wifiStatus, int mqttState) {
+    record(FLIGHT_NETWORK, state, (uint32_t)wifiStatus, (uint32_t)mqttState);
+}
+
+void FlightRecorder::recordWatermark(FlightWatermark source, uint32_t value, uint32_t extra, uint32_t step) {
+    uint32_t last = _watermarks[source];
+    if (last != UINT32_MAX && value + step > last) {
+        return;
+    }
+    _watermarks[source] = value;
+    record(FLIGHT_WATERMARK, source, value, extra);
+}
+
+String FlightRecorder::dumpJson(const char* apiKey, size_t page) {
+    size_t first = page * FLIGHT_RECORDER_PAGE;
+    size_t count = 0;
+    if (first < _dumpCount) {
+        count = _dumpCount - first < FLIGHT_RECORDER_PAGE ? _dumpCount - first : FLIGHT_RECORDER_PAGE;
+    }
+
+    DynamicJsonDocument doc(256 + count * JSON_OBJECT_SIZE(8));
+    if (apiKey) {
+        doc["api_key"] = apiKey;
+    }
+    doc["reset_reason"] = resetReasonToString(_resetReason);
+    doc["page"] = page;
+    doc["pages"] = dumpPages();
+
+    JsonArray records = doc.createNestedArray("records");
+    for (size_t i = first; i < first + count; i++) {
+        const FlightEvent& event = _dump[i];
+        JsonObject obj = records.createNestedObject();
+        // uptime của lần chạy đã ghi; các sự kiện "boot" tách các lần chạy
+        obj["uptime_ms"] = event.uptimeMs;
+        obj["event"] = FLIGHT_EVENT_NAMES[event.type];
+        switch (event.type) {
+            case FLIGHT_BOOT:
+                obj["reset_reason"] = resetReasonToString((uint8_t)event.arg);
+                obj["boot"] = event.a;
+                break;
+            case FLIGHT_RELAY:
+                if (event.arg > 0) {
+                    obj["first_relay"] = event.arg * 32;
+                }
+                obj["on"] = event.a;
+                obj["off"] = event.b;
+                break;
+            case FLIGHT_DECISION: {
+                float value;
+                memcpy(&value, &event.b, sizeof(value));
+                obj["task"] = (int16_t)event.arg;
+                obj["decision"] = DecisionTrace::decisionToString(event.a & 0xFF);
+                if ((event.a >> 8) & 0xFF) {
+                    obj["zone"] = (event.a >> 8) & 0xFF;
+                }
+                if ((int16_t)(event.a >> 16) >= 0) {
+                    obj["by_task"] = (int16_t)(event.a >> 16);
+                }
+                if (value != 0) {
+                    obj["value"] = value;
+                }
+                break;
+            }
+            case FLIGHT_NETWORK:
+                obj["wifi"] = (event.arg & FLIGHT_NET_WIFI) != 0;
+                obj["mqtt"] = (event.arg & FLIGHT_NET_MQTT) != 0;
+                obj["portal"] = (event.arg & FLIGHT_NET_PORTAL) != 0;
+                obj["wifi_status"] = (int32_t)event.a;
+                obj["mqtt_state"] = (int32_t)event.b;
+                break;
+            case FLIGHT_WATERMARK:
+                obj["source"] = event.arg < FLIGHT_WM_COUNT ? FLIGHT_WATERMARK_NAMES[event.arg] : "unknown";
+                obj["min_free"] = event.a;
+                if (event.arg == FLIGHT_WM_HEAP) {
+                    obj["free"] = event.b;
+                }
+                break;
+        }
+    }
+
+    String payload;
+    serializeJson(doc, payload);
+    return payload;
+}
+
+void FlightRecorder::markDumped() {
+    if (_dump == nullptr) {
+        return;
+    }
+    portENTER_CRITICAL(&_lock);
+    s_ring.dumped = _dumpEnd;
+    s_ring.crc = headerCrc(s_ring);
+    portEXIT_CRITICAL(&_lock);
+
+    delete[] _dump;
+    _dump = nullptr;
+    _dumpCount = 0;
+    LOGI("Flight", "Flight recorder events from previous runs sent");
+}
+
+const char* FlightRecorder::resetReasonToString(uint8_t reason) {
+    switch (reason) {
+        case ESP_RST_POWERON:   return "power_on";
+        case ESP_RST_EXT:       return "external";
+        case ESP_RST_SW:        return "software";
+        case ESP_RST_PANIC:     return "panic";
+        case ESP_RST_INT_WDT:   return "int_wdt";
+        case ESP_RST_TASK_WDT:  return "task_wdt";
+        case ESP_RST_WDT:       return "wdt";
+        case ESP_RST_DEEPSLEEP: return "deep_sleep";
+        case ESP_RST_BROWNOUT:  return "brownout";
+        case ESP_RST_SDIO:      return "sdio";
+        default:                return "unknown";
+    }
+}
@@ -0,0 +1,171 @@
+#include "../include/LatencyMonitor.h"
+#include <ArduinoJson.h>
+#include <esp_timer.h>
+#include <time.h>
+
+// Định nghĩa bộ đo toàn cục
+ActuationLatencyMonitor ActuationLatency;
+
+static const char* LATENCY_STAGE_NAMES[LATENCY_STAGE_COUNT] = {
+    "queue",
+    "process",
+    "publish",
+    "end_to_end"
+};
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::reset() {
+    memset(_buckets, 0, sizeof(_buckets));
+    _count = 0;
+    _max = 0;
+}
+
+// Bucket 2m và 2m+1 chia đôi khoảng [2^m, 2^(m+1)); 0 và 1 µs có bucket riêng
+uint8_t LatencyHistogram::_bucketIndex(uint32_t us) {
+    if (us < 2) {
+        return (uint8_t)us;
+    }
+    uint8_t msb = 31 - __builtin_clz(us);
+    uint8_t half = (us >> (msb - 1)) & 1;
+    return 2 * msb + half;
+}
+
+uint32_t LatencyHistogram::_bucketUpperBound(uint8_t index) {
+    if (index < 2) {
+        return index;
+    }
+    uint8_t msb = index / 2;
+    uint64_t lower = (1ULL << msb) + (uint64_t)(index & 1) * (1ULL << (msb - 1));
+    uint64_t upper = lower + (1ULL << (msb - 1)) - 1;
+    return upper > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (uint32_t)upper;
+}
+
+void LatencyHistogram::record(uint32_t us) {
+    _buckets[_bucketIndex(us)]++;
+    _count++;
+    if (us > _max) {
+        _max = us;
+    }
+}
+
+uint32_t LatencyHistogram::percentile(float p) const {
+    if (_count == 0) {
+        return 0;
+    }
+    uint32_t target = (uint32_t)((p / 100.0f) * _count + 0.5f);
+    if (target < 1) {
+        target = 1;
+    }
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += _buckets[i];
+        if (seen >= target) {
+            // Cận trên của bucket, không vượt quá giá trị lớn nhất đã ghi
+            uint32_t bound = _bucketUpperBound(i);
+            return bound < _max ? bound : _max;
+        }
+    }
+    return _max;
+}
+
+ActuationLatencyMonitor::ActuationLatencyMonitor() {
+    _commandTask = nullptr;
+    _arrivalUs = 0;
+    _dequeueUs = 0;
+    _gpioSeen = false;
+    _pendingArrivalUs = 0;
+    _pendingGpioUs = 0;
+}
+
+void ActuationLatencyMonitor::_record(LatencyStage stage, int64_t us) {
+    if (us < 0) {
+        us = 0;
+    }
+    _stages[stage].record(us > 0xFFFFFFFFLL ? 0xFFFFFFFFUL : (uint32_t)us);
+}
+
+void ActuationLatencyMonitor::beginCommand(int64_t arrivalUs) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&_lock);
+    _commandTask = xTaskGetCurrentTaskHandle();
+    _arrivalUs = arrivalUs;
+    _dequeueUs = now;
+    _gpioSeen = false;
+    _record(LATENCY_QUEUE, now - arrivalUs);
+    portEXIT_CRITICAL(&_lock);
+}
+
+void ActuationLatencyMonitor::endCommand() {
+    portENTER_CRITICAL(&_lock);
+    _commandTask = nullptr;
+    portEXIT_CRITICAL(&_lock);
+}
+
+void ActuationLatencyMonitor::markGpioWrite() {
+    // Ghi GPIO do timer hoặc lịch tưới không thuộc lệnh nào, bỏ qua
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&_lock);
+    if (_commandTask == current && !_gpioSeen) {
+        _gpioSeen = true;
+        _record(LATENCY_PROCESS, now - _dequeueUs);
+        _pendingArrivalUs = _arrivalUs;
+        _pendingGpioUs = now;
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+void ActuationLatencyMonitor::markStatusPublished() {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&_lock);
+    if (_pendingGpioUs != 0) {
+        _record(LATENCY_PUBLISH, now - _pendingGpioUs);
+        _record(LATENCY_END_TO_END, now - _pendingArrivalUs);
+        _pendingGpioUs = 0;
+        _pendingArrivalUs = 0;
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+const char* ActuationLatencyMonitor::stageToString(uint8_t stage) {
+    if (stage < LATENCY_STAGE_COUNT) {
+        return LATENCY_STAGE_NAMES[stage];
+    }
+    return "unknown";
+}
+
+String ActuationLatencyMonitor::toJson(const char* apiKey, bool reset) {
+    // Chép nhanh histogram ra khỏi vùng khóa rồi mới tính phân vị
+    LatencyHistogram snapshot[LATENCY_STAGE_COUNT];
+    portENTER_CRITICAL(&_lock);
+    for (uint8_t i = 0; i < LATENCY_STAGE_COUNT; i++) {
+        snapshot[i] = _stages[i];
+        if (reset) {
+            _stages[i].reset();
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    StaticJsonDocument<512> doc;
+    if (apiKey) {
+        doc["api_key"] = apiKey;
+    }
+    doc["timestamp"] = (uint32_t)time(NULL);
+
+    JsonObject stages = doc.createNestedObject("stages");
+    for (uint8_t i = 0; i < LATENCY_STAGE_COUNT; i++) {
+        JsonObject stage = stages.createNestedObject(stageToString(i));
+        stage["count"] = snapshot[i].getCount();
+        stage["p50_us"] = snapshot[i].percentile(50);
+        stage["p95_us"] = snapshot[i].percentile(95);
+        stage["p99_us"] = snapshot[i].percentile(99);
+        stage["max_us"] = snapshot[i].getMax();
+    }
+
+    String payload;
+    serializeJson(doc, payload);
+    return payload;
+}
@@ -0,0 +1,97 @@
+#include "../include/LeaseStore.h"
+#include "../include/Logger.h"
+#include <esp_attr.h>
+#include <rom/crc.h>
+
+#define LEASE_STORE_MAGIC 0x4C534532UL   // "LSE2" (thêm mẫu xung vào StoredLease)
+
+struct PersistedLeaseTable {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+    StoredLease leases[LEASE_STORE_CAPACITY];
+    uint32_t crc;                       // CRC32 của các trường phía trên
+};
+
+// Vùng RTC không bị khởi tạo lại khi reset mềm; nội dung được kiểm bằng magic + CRC
+RTC_NOINIT_ATTR static PersistedLeaseTable s_rtcTable;
+
+static uint32_t tableCrc(const PersistedLeaseTable& table) {
+    return crc32_le(0, (const uint8_t*)&table, offsetof(PersistedLeaseTable, crc));
+}
+
+static bool tableValid(const PersistedLeaseTable& table, uint16_t count) {
+    return table.magic == LEASE_STORE_MAGIC && table.count == count && table.crc == tableCrc(table);
+}
+
+LeaseStore::LeaseStore() {
+#if LEASE_STORE_FLASH_FALLBACK
+    _lastFlashCrc = 0;
+#endif
+}
+
+void LeaseStore::begin() {
+#if LEASE_STORE_FLASH_FALLBACK
+    if (!_preferences.begin("lease-store", false)) {
+        AppLogger.warning("LeaseStore", "NVM: Failed to open namespace, flash fallback disabled");
+    }
+#endif
+}
+
+void LeaseStore::save(const StoredLease* leases, uint16_t count) {
+    if (count > LEASE_STORE_CAPACITY) {
+        return;
+    }
+
+    s_rtcTable.magic = LEASE_STORE_MAGIC;
+    s_rtcTable.count = count;
+    s_rtcTable.reserved = 0;
+    memcpy(s_rtcTable.leases, leases, sizeof(StoredLease) * count);
+    memset(&s_rtcTable.leases[count], 0, sizeof(StoredLease) * (LEASE_STORE_CAPACITY - count));
+    s_rtcTable.crc = tableCrc(s_rtcTable);
+
+#if LEASE_STORE_FLASH_FALLBACK
+    // Chỉ ghi flash khi nội dung thay đổi; remainingMs chỉ có ý nghĩa trong RTC nên bỏ qua
+    static StoredLease flashCopy[LEASE_STORE_CAPACITY];   // Bên gọi đã tuần tự hóa
+    memcpy(flashCopy, leases, sizeof(StoredLease) * count);
+    for (uint16_t i = 0; i < count; i++) {
+        flashCopy[i].remainingMs = 0;
+    }
+    uint32_t crc = crc32_le(0, (const uint8_t*)flashCopy, sizeof(StoredLease) * count);
+    if (crc != _lastFlashCrc) {
+        _preferences.putBytes("leases", flashCopy, sizeof(StoredLease) * count);
+        _lastFlashCrc = crc;
+    }
+#endif
+}
+
+bool LeaseStore::load(StoredLease* out, uint16_t count) {
+    if (count > LEASE_STORE_CAPACITY) {
+        return false;
+    }
+
+    if (tableValid(s_rtcTable, count)) {
+        memcpy(out, s_rtcTable.leases, sizeof(StoredLease) * count);
+        return true;
+    }
+
+#if LEASE_STORE_FLASH_FALLBACK
+    // Mất nội dung RTC (mất điện): dùng bản flash, chỉ lease có endUnix mới khôi phục được
+    size_t size = sizeof(StoredLease) * count;
+    if (_preferences.getBytesLength("leases") == size) {
+        _preferences.getBytes("leases", out, size);
+        _lastFlashCrc = crc32_le(0, (const uint8_t*)out, size);
+        AppLogger.info("LeaseStore", "Restoring leases from flash fallback");
+        return true;
+    }
+#endif
+    return false;
+}
+
+void LeaseStore::clear() {
+    s_rtcTable.magic = 0;
+#if LEASE_STORE_FLASH_FALLBACK
+    _preferences.remove("leases");
+    _lastFlashCrc = 0;
+#endif
+}
@@ -0,0 +1,66 @@
+#include "../include/LogCompress.h"
+
+static inline uint8_t lzHash(const uint8_t* p) {
+    return (uint8_t)((p[0] * 33u + p[1]) * 33u + p[2]) & (LOG_LZ_HASH_SIZE - 1);
+}
+
+size_t LogCompress::compress(const uint8_t* in, size_t len, uint8_t* out, size_t cap) {
+    uint16_t head[LOG_LZ_HASH_SIZE];
+    memset(head, 0xFF, sizeof(head));
+
+    if (cap > len) {
+        cap = len; // Not worth it unless it shrinks
+    }
+
+    size_t i = 0;
+    size_t o = 0;
+    size_t control = 0;
+    uint8_t bit = 8;
+
+    while (i < len) {
+        if (bit == 8) {
+            if (o >= cap) {
+                return 0;
+            }
+            control = o++;
+            out[control] = 0;
+            bit = 0;
+        }
+
+        size_t matchLen = 0;
+        size_t matchOffset = 0;
+        if (i + LOG_LZ_MIN_MATCH <= len) {
+            uint8_t h = lzHash(in + i);
+            uint16_t candidate = head[h];
+            head[h] = (uint16_t)i;
+            if (candidate != 0xFFFF && i - candidate <= LOG_LZ_WINDOW) {
+                size_t limit = len - i < LOG_LZ_MAX_MATCH ? len - i : LOG_LZ_MAX_MATCH;
+                while (matchLen < limit && in[candidate + matchLen] == in[i + matchLen]) {
+                    matchLen++;
+                }
+                matchOffset = i - candidate;
+            }
+        }
+
+        if (matchLen >= LOG_LZ_MIN_MATCH) {
+            if (o + 2 > cap) {
+                return 0;
+            }
+            out[control] |= 1 << bit;
+            out[o++] = (matchOffset - 1) & 0xFF;
+            out[o++] = (uint8_t)((((matchOffset - 1) >> 8) << 4) | (matchLen - LOG_LZ_MIN_MATCH));
+            // Index the skipped positions so later matches can refer to them
+            for (size_t k = i + 1; k < i + matchLen && k + LOG_LZ_MIN_MATCH <= len; k++) {
+                head[lzHash(in + k)] = (uint16_t)k;
+            }
+            i += matchLen;
+        } else {
+            if (o >= cap) {
+                return 0;
+            }
+            out[o++] = in[i++];
+        }
+        bit++;
+    }
+    return o < len ? o : 0;
+}
@@ -0,0 +1,182 @@
+#include "../include/LogLimiter.h"
+#include "../include/LogToken.h"
+
+namespace {
+
+inline uint32_t fnv(uint32_t h, uint8_t b) {
+    return (h ^ b) * LOG_TOKEN_FNV_PRIME;
+}
+
+uint32_t fnvString(uint32_t h, const char* s, bool skipDigits) {
+    for (; *s; s++) {
+        if (skipDigits && *s >= '0' && *s <= '9') {
+            continue;
+        }
+        h = fnv(h, (uint8_t)*s);
+    }
+    return fnv(h, 0);
+}
+
+// Time until a suppression that started at first and was last seen at last is reported
+unsigned long reportDue(uint32_t first, uint32_t last, unsigned long now) {
+    unsigned long quiet = now - last;
+    unsigned long age = now - first;
+    if (quiet >= LOG_LIMIT_QUIET_MS || age >= LOG_LIMIT_REPORT_MS) {
+        return 0;
+    }
+    unsigned long toQuiet = LOG_LIMIT_QUIET_MS - quiet;
+    unsigned long toReport = LOG_LIMIT_REPORT_MS - age;
+    return toQuiet < toReport ? toQuiet : toReport;
+}
+
+} // namespace
+
+LogLimiter::LogLimiter()
+    : _lastIdentity(0), _repeats(0), _firstRepeat(0), _lastRepeat(0), _repeatLevel(0), _suppressed(0) {
+    memset(_slots, 0, sizeof(_slots));
+    _repeatTag[0] = '\0';
+    _repeatText[0] = '\0';
+}
+
+void LogLimiter::_refill(Slot& slot, unsigned long now) {
+    uint32_t steps = (now - slot.refilled) / LOG_LIMIT_REFILL_MS;
+    if (steps == 0) {
+        return;
+    }
+    uint32_t tokens = slot.tokens + steps;
+    slot.tokens = tokens < LOG_LIMIT_BURST ? tokens : LOG_LIMIT_BURST;
+    slot.refilled += steps * LOG_LIMIT_REFILL_MS;
+}
+
+// Open addressing with linear probing. Idle slots (bucket full again, nothing left to
+// report) are reused, so the table never needs clearing.
+LogLimiter::Slot* LogLimiter::_find(uint32_t key, unsigned long now) {
+    Slot* reusable = nullptr;
+    for (uint32_t i = 0; i < LOG_LIMIT_SLOTS; i++) {
+        Slot& slot = _slots[(key + i) & (LOG_LIMIT_SLOTS - 1)];
+        if (slot.key == key) {
+            return &slot;
+        }
+        if (slot.key == 0) {
+            reusable = reusable ? reusable : &slot;
+            break;
+        }
+        if (reusable == nullptr && slot.count == 0 &&
+            now - slot.refilled >= (unsigned long)LOG_LIMIT_BURST * LOG_LIMIT_REFILL_MS) {
+            reusable = &slot;
+        }
+    }
+    if (reusable == nullptr) {
+        return nullptr;
+    }
+    memset(reusable, 0, sizeof(*reusable));
+    reusable->key = key;
+    reusable->tokens = LOG_LIMIT_BURST;
+    reusable->refilled = now;
+    return reusable;
+}
+
+bool LogLimiter::allow(uint8_t level, const char* tag, uint16_t formatToken, const char* text,
+                       unsigned long now, LogLimitReport& repeat) {
+    repeat.count = 0;
+
+    uint32_t identity = fnv(LOG_TOKEN_FNV_OFFSET, level);
+    identity = fnvString(identity, tag, false);
+    identity = fnvString(identity, text, false);
+    if (identity == _lastIdentity) {
+        if (_repeats == 0) {
+            _firstRepeat = now;
+            _repeatLevel = level;
+            strlcpy(_repeatTag, tag, sizeof(_repeatTag));
+            strlcpy(_repeatText, text, sizeof(_repeatText));
+        }
+        _repeats++;
+        _lastRepeat = now;
+        _suppressed++;
+        return false;
+    }
+    _takeRepeats(repeat);
+    _lastIdentity = identity;
+
+    uint32_t key = fnvString(LOG_TOKEN_FNV_OFFSET, tag, false);
+    if (formatToken != 0) {
+        key = fnv(fnv(key, formatToken & 0xFF), formatToken >> 8);
+    } else {
+        key = fnvString(key, text, true);
+    }
+    key = key ? key : 1;
+
+    Slot* slot = _find(key, now);
+    if (slot == nullptr) {
+        return true; // Table full of active call sites: let it through
+    }
+    _refill(*slot, now);
+    if (slot->tokens > 0) {
+        slot->tokens--;
+        return true;
+    }
+
+    if (slot->count == 0) {
+        slot->firstSuppressed = now;
+        slot->level = level;
+        strlcpy(slot->tag, tag, sizeof(slot->tag));
+        strlcpy(slot->text, text, sizeof(slot->text));
+    }
+    if (slot->count < UINT16_MAX) {
+        slot->count++;
+    }
+    slot->lastSuppressed = now;
+    _suppressed++;
+    return false;
+}
+
+void LogLimiter::_takeRepeats(LogLimitReport& report) {
+    report.count = _repeats;
+    if (_repeats == 0) {
+        return;
+    }
+    report.level = _repeatLevel;
+    report.repeated = true;
+    report.durationMs = _lastRepeat - _firstRepeat;
+    strlcpy(report.tag, _repeatTag, sizeof(report.tag));
+    strlcpy(report.text, _repeatText, sizeof(report.text));
+    _repeats = 0;
+}
+
+void LogLimiter::_takeSlot(Slot& slot, LogLimitReport& report) {
+    report.level = slot.level;
+    report.repeated = false;
+    report.count = slot.count;
+    report.durationMs = slot.lastSuppressed - slot.firstSuppressed;
+    strlcpy(report.tag, slot.tag, sizeof(report.tag));
+    strlcpy(report.text, slot.text, sizeof(report.text));
+    slot.count = 0;
+}
+
+bool LogLimiter::poll(unsigned long now, LogLimitReport& report) {
+    if (_repeats > 0 && reportDue(_firstRepeat, _lastRepeat, now) == 0) {
+        _takeRepeats(report);
+        _lastIdentity = 0; // The next identical record is printed again
+        return true;
+    }
+    for (uint32_t i = 0; i < LOG_LIMIT_SLOTS; i++) {
+        Slot& slot = _slots[i];
+        if (slot.count > 0 && reportDue(slot.firstSuppressed, slot.lastSuppressed, now) == 0) {
+            _takeSlot(slot, report);
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned long LogLimiter::nextPoll(unsigned long now) const {
+    unsigned long wait = _repeats > 0 ? reportDue(_firstRepeat, _lastRepeat, now) : ULONG_MAX;
+    for (uint32_t i = 0; i < LOG_LIMIT_SLOTS && wait > 0; i++) {
+        const Slot& slot = _slots[i];
+        if (slot.count > 0) {
+            unsigned long due = reportDue(slot.firstSuppressed, slot.lastSuppressed, now);
+            wait = due < wait ? due : wait;
+        }
+    }
+    return wait;
+}
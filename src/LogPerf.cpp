@@ -0,0 +1,107 @@
+#include "../include/LogPerf.h"
+
+LogPerf::LogPerf() : _size(0), _untracked(0) {
+}
+
+uint8_t LogPerf::_bucket(uint32_t durationMs) {
+    if (durationMs < 2) {
+        return (uint8_t)durationMs;
+    }
+    uint8_t exponent = 31 - __builtin_clz(durationMs);      // >= 1
+    uint8_t half = (durationMs >> (exponent - 1)) & 1;      // Upper or lower half of the octave
+    uint8_t bucket = 2 * exponent + half;
+    return bucket < LOG_PERF_BUCKETS ? bucket : LOG_PERF_BUCKETS - 1;
+}
+
+uint32_t LogPerf::_bucketUpper(uint8_t bucket) {
+    if (bucket < 2) {
+        return bucket;
+    }
+    uint8_t exponent = bucket / 2;
+    uint32_t step = 1UL << (exponent - 1);
+    uint32_t lower = (2 + (bucket & 1)) * step;
+    return lower + step - 1;
+}
+
+bool LogPerf::add(uint16_t token, const char* tag, const char* name, uint32_t durationMs, bool success) {
+    LogPerfEvent* event = nullptr;
+    for (size_t i = 0; i < _size; i++) {
+        if (_events[i].token == token && strcmp(_events[i].name, name) == 0) {
+            event = &_events[i];
+            break;
+        }
+    }
+    if (event == nullptr) {
+        if (_size >= LOG_PERF_EVENTS) {
+            _untracked++;
+            return false;
+        }
+        event = &_events[_size++];
+        memset(event, 0, sizeof(*event));
+        event->token = token;
+        strlcpy(event->name, name, LOG_PERF_NAME_MAX);
+        strlcpy(event->tag, tag, LOG_PERF_TAG_MAX);
+    }
+
+    if (event->count == 0 || durationMs < event->min) {
+        event->min = durationMs;
+    }
+    if (durationMs > event->max) {
+        event->max = durationMs;
+    }
+    event->count++;
+    event->total += durationMs;
+    if (!success) {
+        event->failures++;
+    }
+    uint16_t& bucket = event->buckets[_bucket(durationMs)];
+    if (bucket < UINT16_MAX) {
+        bucket++;
+    }
+    return true;
+}
+
+uint32_t LogPerf::percentile(const LogPerfEvent& event, uint8_t pct) {
+    uint32_t total = 0;
+    for (uint8_t b = 0; b < LOG_PERF_BUCKETS; b++) {
+        total += event.buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    // Rank of the wanted measurement, rounded up (p100 = the last one)
+    uint32_t rank = (uint32_t)(((uint64_t)total * pct + 99) / 100);
+    rank = rank > 0 ? rank : 1;
+    uint32_t seen = 0;
+    for (uint8_t b = 0; b < LOG_PERF_BUCKETS; b++) {
+        seen += event.buckets[b];
+        if (seen >= rank) {
+            uint32_t value = _bucketUpper(b);
+            value = value > event.max || b == LOG_PERF_BUCKETS - 1 ? event.max : value;
+            return value < event.min ? event.min : value;
+        }
+    }
+    return event.max;
+}
+
+bool LogPerf::hasData() const {
+    for (size_t i = 0; i < _size; i++) {
+        if (_events[i].count > 0) {
+            return true;
+        }
+    }
+    return _untracked > 0;
+}
+
+void LogPerf::reset() {
+    for (size_t i = 0; i < _size; i++) {
+        LogPerfEvent& event = _events[i];
+        event.count = 0;
+        event.failures = 0;
+        event.min = 0;
+        event.max = 0;
+        event.total = 0;
+        memset(event.buckets, 0, sizeof(event.buckets));
+    }
+    _untracked = 0;
+}
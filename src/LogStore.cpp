@@ -0,0 +1,208 @@
+#include "../include/LogStore.h"
+
+LogStore::LogStore()
+    : _partition(nullptr), _sectorCount(0), _writeSector(0), _writeOffset(LOG_STORE_HEADER_SIZE),
+      _writeSequence(1), _bufferLen(0), _readSector(0), _readOffset(LOG_STORE_HEADER_SIZE),
+      _stored(0), _replayed(0), _lostSectors(0) {
+}
+
+bool LogStore::begin(const char* label) {
+    _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (_partition == nullptr) {
+        return false;
+    }
+    _sectorCount = _partition->size / LOG_STORE_SECTOR_SIZE;
+    if (_sectorCount < 2) {
+        _partition = nullptr;
+        return false;
+    }
+
+    // Newest sector continues the ring; the oldest one still marked pending is where replay starts
+    bool found = false;
+    bool pending = false;
+    uint32_t newestSequence = 0;
+    uint32_t newestSector = 0;
+    uint32_t oldestSequence = 0;
+    uint32_t oldestSector = 0;
+    for (uint32_t s = 0; s < _sectorCount; s++) {
+        uint32_t sequence;
+        uint8_t state;
+        if (!_readHeader(s, sequence, state)) {
+            continue;
+        }
+        if (!found || sequence > newestSequence) {
+            found = true;
+            newestSequence = sequence;
+            newestSector = s;
+        }
+        if (state != 0x00 && (!pending || sequence < oldestSequence)) {
+            pending = true;
+            oldestSequence = sequence;
+            oldestSector = s;
+        }
+    }
+
+    // Always continue in a fresh sector: the tail of the last one may hold a torn write
+    uint32_t next = found ? (newestSector + 1) % _sectorCount : 0;
+    _writeSequence = found ? newestSequence + 1 : 1;
+    _readSector = pending ? oldestSector : next;
+    _readOffset = LOG_STORE_HEADER_SIZE;
+    _openSector(next);
+    return true;
+}
+
+bool LogStore::_readHeader(uint32_t sector, uint32_t& sequence, uint8_t& state) {
+    uint8_t header[9];
+    if (esp_partition_read(_partition, sector * LOG_STORE_SECTOR_SIZE, header, sizeof(header)) != ESP_OK) {
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    memcpy(&sequence, header + 4, 4);
+    state = header[8];
+    return magic == LOG_STORE_MAGIC;
+}
+
+// Erase a sector and make it the write sector. If the reader has not finished it yet,
+// its pending entries are lost and replay continues with the next (now oldest) sector.
+void LogStore::_openSector(uint32_t sector) {
+    if (sector == _readSector) {
+        uint32_t sequence;
+        uint8_t state;
+        if (_readHeader(sector, sequence, state) && state != 0x00) {
+            _lostSectors++;
+            _readSector = (sector + 1) % _sectorCount;
+        }
+        _readOffset = LOG_STORE_HEADER_SIZE;
+    }
+
+    uint32_t base = sector * LOG_STORE_SECTOR_SIZE;
+    esp_partition_erase_range(_partition, base, LOG_STORE_SECTOR_SIZE);
+    uint8_t header[8];
+    uint32_t magic = LOG_STORE_MAGIC;
+    memcpy(header, &magic, 4);
+    memcpy(header + 4, &_writeSequence, 4);
+    esp_partition_write(_partition, base, header, sizeof(header)); // State byte stays 0xFF (pending)
+
+    _writeSector = sector;
+    _writeOffset = LOG_STORE_HEADER_SIZE;
+    _writeSequence++;
+}
+
+void LogStore::_setDrained(uint32_t sector) {
+    uint8_t state = 0x00;
+    esp_partition_write(_partition, sector * LOG_STORE_SECTOR_SIZE + 8, &state, 1);
+}
+
+bool LogStore::append(const uint8_t* payload, size_t len) {
+    if (_partition == nullptr || len > LOG_STORE_ENTRY_MAX) {
+        return false;
+    }
+    size_t need = 3 + len;
+    if (_writeOffset + _bufferLen + need > LOG_STORE_SECTOR_SIZE) {
+        flush();
+        _openSector((_writeSector + 1) % _sectorCount);
+    }
+    if (_bufferLen + need > sizeof(_buffer)) {
+        flush();
+    }
+
+    _buffer[_bufferLen++] = LOG_STORE_PENDING;
+    _buffer[_bufferLen++] = len & 0xFF;
+    _buffer[_bufferLen++] = len >> 8;
+    memcpy(_buffer + _bufferLen, payload, len);
+    _bufferLen += len;
+    _stored++;
+    return true;
+}
+
+void LogStore::flush() {
+    if (_partition == nullptr || _bufferLen == 0) {
+        return;
+    }
+    esp_partition_write(_partition, _writeSector * LOG_STORE_SECTOR_SIZE + _writeOffset, _buffer, _bufferLen);
+    _writeOffset += _bufferLen;
+    _bufferLen = 0;
+}
+
+bool LogStore::hasPending() const {
+    return _partition != nullptr &&
+           (_readSector != _writeSector || _readOffset < _writeOffset + _bufferLen);
+}
+
+bool LogStore::readNext(uint8_t* payload, size_t cap, size_t& len, uint32_t& address) {
+    if (_partition == nullptr) {
+        return false;
+    }
+
+    for (;;) {
+        if (_readSector == _writeSector && _readOffset >= _writeOffset) {
+            if (_bufferLen == 0) {
+                return false;
+            }
+            flush(); // Make the buffered entries readable
+        }
+
+        uint32_t base = _readSector * LOG_STORE_SECTOR_SIZE;
+        uint8_t head[3] = { 0xFF, 0, 0 };
+        bool end = _readOffset + sizeof(head) > LOG_STORE_SECTOR_SIZE ||
+                   esp_partition_read(_partition, base + _readOffset, head, sizeof(head)) != ESP_OK ||
+                   (head[0] != LOG_STORE_PENDING && head[0] != LOG_STORE_SENT);
+        uint16_t entryLen = head[1] | (head[2] << 8);
+        if (!end) {
+            end = entryLen > LOG_STORE_ENTRY_MAX || _readOffset + sizeof(head) + entryLen > LOG_STORE_SECTOR_SIZE;
+        }
+
+        if (end) {
+            if (_readSector == _writeSector) {
+                _readOffset = _writeOffset; // Corrupt entry in the current sector: skip what was written
+                continue;
+            }
+            // Sector finished: never replay it again, move to the next sector that may hold entries
+            _setDrained(_readSector);
+            uint32_t sequence;
+            uint8_t state;
+            do {
+                _readSector = (_readSector + 1) % _sectorCount;
+                _readOffset = LOG_STORE_HEADER_SIZE;
+            } while (_readSector != _writeSector &&
+                     !(_readHeader(_readSector, sequence, state) && state != 0x00));
+            continue;
+        }
+
+        uint32_t entryAddress = base + _readOffset;
+        _readOffset += sizeof(head) + entryLen;
+        if (head[0] != LOG_STORE_PENDING || entryLen > cap) {
+            continue;
+        }
+        if (esp_partition_read(_partition, entryAddress + sizeof(head), payload, entryLen) != ESP_OK) {
+            continue;
+        }
+        len = entryLen;
+        address = entryAddress;
+        return true;
+    }
+}
+
+void LogStore::markSent(uint32_t address) {
+    if (_partition == nullptr) {
+        return;
+    }
+    uint8_t marker = LOG_STORE_SENT;
+    esp_partition_write(_partition, address, &marker, 1);
+    _replayed++;
+}
+
+void LogStore::seek(uint32_t address) {
+    _readSector = address / LOG_STORE_SECTOR_SIZE;
+    _readOffset = address % LOG_STORE_SECTOR_SIZE;
+}
+
+LogStoreStats LogStore::getStats() const {
+    LogStoreStats stats;
+    stats.sectors = _partition != nullptr ? _sectorCount : 0;
+    stats.stored = _stored;
+    stats.replayed = _replayed;
+    stats.lostSectors = _lostSectors;
+    return stats;
+}
@@ -0,0 +1,59 @@
+#include "../include/LogTagLevels.h"
+
+LogTagLevels::LogTagLevels() {
+    for (uint32_t i = 0; i < LOG_TAG_LEVEL_SLOTS; i++) {
+        _slots[i].store(0, std::memory_order_relaxed);
+    }
+    _count.store(0, std::memory_order_relaxed);
+}
+
+bool LogTagLevels::set(uint16_t tagToken, LogTarget target, uint8_t level) {
+    std::atomic<uint32_t>* found = nullptr;
+    std::atomic<uint32_t>* reusable = nullptr;
+    for (uint32_t i = 0; i < LOG_TAG_LEVEL_SLOTS; i++) {
+        std::atomic<uint32_t>& slot = _slots[(tagToken + i) & (LOG_TAG_LEVEL_SLOTS - 1)];
+        uint32_t value = slot.load();
+        if (value != 0 && (value & 0xFFFF) == tagToken) {
+            found = &slot;
+            break;
+        }
+        if (value == 0 || !_hasOverride(value)) {
+            reusable = reusable ? reusable : &slot;
+            if (value == 0) {
+                break; // End of the chain: the tag is not in the table
+            }
+        }
+    }
+
+    if (found == nullptr) {
+        if (level == LOG_TAG_LEVEL_UNSET) {
+            return true; // Nothing to remove
+        }
+        if (reusable == nullptr) {
+            return false;
+        }
+        found = reusable;
+        found->store(tagToken | 0x00FF0000); // No override yet; filled in below
+    }
+
+    uint32_t value = found->load();
+    bool before = _hasOverride(value);
+    uint32_t shift = 16 + 4 * target;
+    value = (value & ~(0xFUL << shift)) | ((uint32_t)(level & 0xF) << shift);
+    bool after = _hasOverride(value);
+    if (after && !before) {
+        _count++;
+    }
+    found->store(value, std::memory_order_release);
+    if (before && !after) {
+        _count--;
+    }
+    return true;
+}
+
+void LogTagLevels::clear() {
+    _count = 0;
+    for (uint32_t i = 0; i < LOG_TAG_LEVEL_SLOTS; i++) {
+        _slots[i].store(0, std::memory_order_release);
+    }
+}
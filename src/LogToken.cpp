@@ -0,0 +1,356 @@
+#include "../include/LogToken.h"
+
+namespace {
+
+enum ArgLength : uint8_t {
+    ARG_INT,
+    ARG_LONG,
+    ARG_LLONG,
+    ARG_LDOUBLE
+};
+
+// One printf conversion, with the length modifier stripped from spec
+struct Conversion {
+    char spec[16];      // '%', flags, width, precision
+    uint8_t specLen;
+    uint8_t stars;      // '*' width/precision, passed as extra int arguments
+    uint8_t length;     // ArgLength
+    char conversion;
+};
+
+void appendSpec(Conversion& c, char ch) {
+    if (c.specLen < sizeof(c.spec) - 4) { // Room for "ll", the conversion and '\0'
+        c.spec[c.specLen++] = ch;
+    }
+}
+
+// p points just after '%'; returns the position after the conversion character
+const char* parseConversion(const char* p, Conversion& c) {
+    c.specLen = 0;
+    c.stars = 0;
+    c.length = ARG_INT;
+    appendSpec(c, '%');
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+        appendSpec(c, *p++);
+    }
+    if (*p == '*') {
+        c.stars++;
+        appendSpec(c, *p++);
+    }
+    while (*p >= '0' && *p <= '9') {
+        appendSpec(c, *p++);
+    }
+    if (*p == '.') {
+        appendSpec(c, *p++);
+        if (*p == '*') {
+            c.stars++;
+            appendSpec(c, *p++);
+        }
+        while (*p >= '0' && *p <= '9') {
+            appendSpec(c, *p++);
+        }
+    }
+
+    switch (*p) {
+        case 'h':
+            p++;
+            if (*p == 'h') p++;
+            break;
+        case 'l':
+            p++;
+            c.length = ARG_LONG;
+            if (*p == 'l') {
+                p++;
+                c.length = ARG_LLONG;
+            }
+            break;
+        case 'j':
+            p++;
+            c.length = ARG_LLONG;
+            break;
+        case 'z':
+        case 't':
+            p++;
+            c.length = ARG_LONG; // size_t/ptrdiff_t have the width of long on ESP32 and LP64 hosts
+            break;
+        case 'L':
+            p++;
+            c.length = ARG_LDOUBLE;
+            break;
+    }
+
+    c.conversion = *p;
+    if (*p) {
+        p++;
+    }
+    return p;
+}
+
+inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+template <typename T>
+int printArg(char* out, size_t cap, const char* spec, uint8_t stars, const int* star, T value) {
+    switch (stars) {
+        case 0:  return snprintf(out, cap, spec, value);
+        case 1:  return snprintf(out, cap, spec, star[0], value);
+        default: return snprintf(out, cap, spec, star[0], star[1], value);
+    }
+}
+
+} // namespace
+
+uint16_t LogToken::hash(const char* s) {
+    uint32_t h = LOG_TOKEN_FNV_OFFSET;
+    while (*s) {
+        h = (h ^ (uint8_t)*s++) * LOG_TOKEN_FNV_PRIME;
+    }
+    return logTokenFold(h);
+}
+
+size_t LogToken::writeVarint(uint8_t* out, size_t cap, uint64_t value) {
+    size_t n = 0;
+    do {
+        if (n >= cap) {
+            return 0;
+        }
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        out[n++] = value ? (b | 0x80) : b;
+    } while (value);
+    return n;
+}
+
+bool LogToken::readVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t LogToken::encodeArgs(uint8_t* out, size_t cap, const char* format, va_list args, bool& truncated) {
+    size_t n = 0;
+    truncated = false;
+
+    for (const char* p = format; *p;) {
+        if (*p++ != '%') {
+            continue;
+        }
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+
+        Conversion c;
+        p = parseConversion(p, c);
+
+        size_t written = 1;
+        for (uint8_t i = 0; i < c.stars && written; i++) {
+            written = writeVarint(out + n, cap - n, zigzag(va_arg(args, int)));
+            n += written;
+        }
+        if (!written) {
+            truncated = true;
+            return n;
+        }
+
+        switch (c.conversion) {
+            case 'd':
+            case 'i': {
+                int64_t v = c.length == ARG_LLONG ? va_arg(args, long long)
+                          : c.length == ARG_LONG  ? va_arg(args, long)
+                                                  : va_arg(args, int);
+                written = writeVarint(out + n, cap - n, zigzag(v));
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o': {
+                uint64_t v = c.length == ARG_LLONG ? va_arg(args, unsigned long long)
+                           : c.length == ARG_LONG  ? va_arg(args, unsigned long)
+                                                   : va_arg(args, unsigned int);
+                written = writeVarint(out + n, cap - n, v);
+                break;
+            }
+            case 'c':
+                written = writeVarint(out + n, cap - n, (uint8_t)va_arg(args, int));
+                break;
+            case 'p':
+                written = writeVarint(out + n, cap - n, (uintptr_t)va_arg(args, void*));
+                break;
+            case 'f': case 'F':
+            case 'e': case 'E':
+            case 'g': case 'G':
+            case 'a': case 'A': {
+                float v = c.length == ARG_LDOUBLE ? (float)va_arg(args, long double) : (float)va_arg(args, double);
+                written = 0;
+                if (cap - n >= sizeof(v)) {
+                    memcpy(out + n, &v, sizeof(v)); // Xtensa and host decoders are both little-endian
+                    written = sizeof(v);
+                }
+                break;
+            }
+            case 's': {
+                const char* s = va_arg(args, const char*);
+                if (s == nullptr) {
+                    s = "(null)";
+                }
+                size_t len = strlen(s);
+                written = 0;
+                if (cap - n >= 1) {
+                    size_t room = cap - n - 1;
+                    size_t stored = len < room ? len : room;
+                    stored = stored < 255 ? stored : 255;
+                    if (stored < len) {
+                        truncated = true; // Keep the prefix, later arguments may still fit
+                    }
+                    out[n] = (uint8_t)stored;
+                    memcpy(out + n + 1, s, stored);
+                    written = stored + 1;
+                }
+                break;
+            }
+            case 'n':
+                va_arg(args, int*);
+                break;
+            default:
+                return n; // Unknown conversion: the remaining arguments cannot be located
+        }
+
+        if (!written && c.conversion != 'n') {
+            truncated = true;
+            return n;
+        }
+        n += c.conversion == 'n' ? 0 : written;
+    }
+    return n;
+}
+
+size_t LogToken::format(char* out, size_t cap, const char* format, const uint8_t* args, size_t len) {
+    if (cap == 0) {
+        return 0;
+    }
+    const uint8_t* a = args;
+    const uint8_t* end = args + len;
+    size_t n = 0;
+    out[0] = '\0';
+
+    for (const char* p = format; *p && n < cap - 1;) {
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        p++;
+        if (*p == '%') {
+            out[n++] = '%';
+            p++;
+            continue;
+        }
+
+        Conversion c;
+        p = parseConversion(p, c);
+
+        bool ok = true;
+        int star[2] = { 0, 0 };
+        uint64_t raw = 0;
+        for (uint8_t i = 0; i < c.stars && i < 2 && ok; i++) {
+            ok = readVarint(a, end, raw);
+            star[i] = (int)unzigzag(raw);
+        }
+
+        int w = 0;
+        char* dst = out + n;
+        size_t room = cap - n;
+        switch (c.conversion) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                ok = ok && readVarint(a, end, raw);
+                if (ok) {
+                    c.spec[c.specLen++] = 'l';
+                    c.spec[c.specLen++] = 'l';
+                    c.spec[c.specLen++] = c.conversion;
+                    c.spec[c.specLen] = '\0';
+                    if (c.conversion == 'd' || c.conversion == 'i') {
+                        w = printArg(dst, room, c.spec, c.stars, star, (long long)unzigzag(raw));
+                    } else {
+                        w = printArg(dst, room, c.spec, c.stars, star, (unsigned long long)raw);
+                    }
+                }
+                break;
+            case 'c':
+            case 'p':
+                ok = ok && readVarint(a, end, raw);
+                if (ok) {
+                    c.spec[c.specLen++] = c.conversion;
+                    c.spec[c.specLen] = '\0';
+                    if (c.conversion == 'c') {
+                        w = printArg(dst, room, c.spec, c.stars, star, (int)raw);
+                    } else {
+                        w = printArg(dst, room, c.spec, c.stars, star, (void*)(uintptr_t)raw);
+                    }
+                }
+                break;
+            case 'f': case 'F':
+            case 'e': case 'E':
+            case 'g': case 'G':
+            case 'a': case 'A': {
+                float v;
+                ok = ok && end - a >= (ptrdiff_t)sizeof(v);
+                if (ok) {
+                    memcpy(&v, a, sizeof(v));
+                    a += sizeof(v);
+                    c.spec[c.specLen++] = c.conversion;
+                    c.spec[c.specLen] = '\0';
+                    w = printArg(dst, room, c.spec, c.stars, star, (double)v);
+                }
+                break;
+            }
+            case 's': {
+                ok = ok && a < end && end - a - 1 >= *a;
+                if (ok) {
+                    char text[256];
+                    uint8_t slen = *a++;
+                    memcpy(text, a, slen);
+                    text[slen] = '\0';
+                    a += slen;
+                    c.spec[c.specLen++] = 's';
+                    c.spec[c.specLen] = '\0';
+                    w = printArg(dst, room, c.spec, c.stars, star, (const char*)text);
+                }
+                break;
+            }
+            case 'n':
+                break;
+            default:
+                ok = false;
+                break;
+        }
+
+        if (!ok || w < 0) {
+            // Arguments ended early (truncated record): mark the cut and stop
+            w = snprintf(dst, room, "...");
+            n += (size_t)w < room ? (size_t)w : room - 1;
+            break;
+        }
+        n += (size_t)w < room ? (size_t)w : room - 1;
+    }
+
+    out[n] = '\0';
+    return n;
+}
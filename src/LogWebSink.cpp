@@ -0,0 +1,226 @@
+#include "../include/LogWebSink.h"
+#include "../include/Logger.h"
+#include <ArduinoJson.h>
+
+static const char* const LEVEL_NAMES[] = { "NONE", "CRITICAL", "ERROR", "WARNING", "INFO", "DEBUG" };
+
+LogWebSink::LogWebSink() : _ws(LOG_WS_PATH), _level(0), _clientCount(0), _droppedClients(0) {
+    memset(_clients, 0, sizeof(_clients));
+    for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+        _buffers[i].owner = 0;
+        _buffers[i].stalledSince = 0;
+        _buffers[i].length = 0;
+    }
+    _ws.onEvent([this](AsyncWebSocket* server, AsyncWebSocketClient* client, AwsEventType type,
+                       void* arg, uint8_t* data, size_t len) {
+        (void)server;
+        this->_onEvent(client, type, arg, data, len);
+    });
+}
+
+// Web server task
+void LogWebSink::_onEvent(AsyncWebSocketClient* client, AwsEventType type, void* arg, uint8_t* data, size_t len) {
+    switch (type) {
+        case WS_EVT_CONNECT: {
+            bool added = false;
+            portENTER_CRITICAL(&_lock);
+            for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+                if (_clients[i].id == 0) {
+                    _clients[i].id = client->id();
+                    _clients[i].level = LOG_WS_DEFAULT_LEVEL;
+                    _clients[i].tagToken = 0;
+                    _clients[i].tag[0] = '\0';
+                    _clientCount++;
+                    _updateLevel();
+                    added = true;
+                    break;
+                }
+            }
+            portEXIT_CRITICAL(&_lock);
+            if (!added) {
+                client->close(1013, "Too many log clients");
+                return;
+            }
+            client->text("# Log stream, level INFO, all tags. Send {\"level\":\"DEBUG\",\"tag\":\"NetMgr\"} to filter.");
+            LOGI("WebLog", "Log client %lu connected from %s", (unsigned long)client->id(),
+                 client->remoteIP().toString().c_str());
+            break;
+        }
+        case WS_EVT_DISCONNECT:
+            portENTER_CRITICAL(&_lock);
+            for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+                if (_clients[i].id == client->id()) {
+                    _clients[i].id = 0;
+                    _clientCount--;
+                    _updateLevel();
+                    break;
+                }
+            }
+            portEXIT_CRITICAL(&_lock);
+            break;
+        case WS_EVT_DATA: {
+            // Filters are small single-frame text messages
+            AwsFrameInfo* info = (AwsFrameInfo*)arg;
+            char text[128];
+            if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT || len >= sizeof(text)) {
+                client->text("# Filter must be a single JSON text message");
+                return;
+            }
+            memcpy(text, data, len);
+            text[len] = '\0';
+            StaticJsonDocument<128> doc;
+            if (deserializeJson(doc, text)) {
+                client->text("# Invalid filter JSON");
+                return;
+            }
+            _setFilter(client, doc["level"].as<const char*>(), doc["tag"].as<const char*>());
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// levelName/tag nullptr: keep the current value
+void LogWebSink::_setFilter(AsyncWebSocketClient* client, const char* levelName, const char* tag) {
+    int level = -1;
+    if (levelName != nullptr) {
+        for (size_t i = 0; i < sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0]); i++) {
+            if (strcasecmp(levelName, LEVEL_NAMES[i]) == 0) {
+                level = (int)i;
+            }
+        }
+        if (level < 0) {
+            client->text("# Unknown level, use NONE, CRITICAL, ERROR, WARNING, INFO or DEBUG");
+            return;
+        }
+    }
+    uint16_t tagToken = (tag != nullptr && tag[0] != '\0') ? LogToken::hash(tag) : 0;
+
+    Client current;
+    memset(&current, 0, sizeof(current));
+    portENTER_CRITICAL(&_lock);
+    for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+        if (_clients[i].id == client->id()) {
+            if (level >= 0) {
+                _clients[i].level = (uint8_t)level;
+            }
+            if (tag != nullptr) {
+                _clients[i].tagToken = tagToken;
+                strlcpy(_clients[i].tag, tag, LOG_WS_TAG_MAX);
+            }
+            current = _clients[i];
+            _updateLevel();
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    char reply[96];
+    snprintf(reply, sizeof(reply), "# Filter: level %s, %s%s", LEVEL_NAMES[current.level],
+             current.tagToken != 0 ? "tag " : "all tags", current.tagToken != 0 ? current.tag : "");
+    client->text(reply);
+}
+
+void LogWebSink::_updateLevel() {
+    uint8_t level = 0;
+    for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+        if (_clients[i].id != 0 && _clients[i].level > level) {
+            level = _clients[i].level;
+        }
+    }
+    _level = level;
+}
+
+bool LogWebSink::wants(uint8_t level, uint16_t tagToken) const {
+    (void)tagToken; // Per-client tag filters are applied in send()
+    uint8_t maxLevel = _level;
+    return maxLevel != 0 && level <= maxLevel;
+}
+
+void LogWebSink::send(uint8_t level, uint16_t tagToken, const char* line, size_t len) {
+    Client clients[LOG_WS_MAX_CLIENTS];
+    portENTER_CRITICAL(&_lock);
+    memcpy(clients, _clients, sizeof(clients));
+    portEXIT_CRITICAL(&_lock);
+
+    for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+        const Client& c = clients[i];
+        Buffer& buffer = _buffers[i];
+        if (c.id == 0) {
+            continue;
+        }
+        if (buffer.owner != c.id) {
+            buffer.owner = c.id; // New client in this slot: start clean
+            buffer.length = 0;
+            buffer.stalledSince = 0;
+        }
+        if (level > c.level || (c.tagToken != 0 && c.tagToken != tagToken)) {
+            continue;
+        }
+        if (len + 1 > LOG_WS_BUFFER) {
+            continue;
+        }
+        if (buffer.length + len + 1 > LOG_WS_BUFFER && !_flushClient(i, c.id)) {
+            continue; // Client is behind: the line is dropped, flush() decides when to give up
+        }
+        memcpy(buffer.data + buffer.length, line, len);
+        buffer.length += len;
+        buffer.data[buffer.length++] = '\n';
+    }
+}
+
+// Returns false if the client's queue is full. Stalls longer than LOG_WS_STALL_MS
+// disconnect the client.
+bool LogWebSink::_flushClient(size_t index, uint32_t id) {
+    Buffer& buffer = _buffers[index];
+    if (buffer.length == 0) {
+        return true;
+    }
+    AsyncWebSocketClient* client = _ws.client(id);
+    if (client == nullptr) {
+        buffer.length = 0; // Gone; the disconnect event frees the slot
+        return true;
+    }
+    if (client->queueIsFull()) {
+        unsigned long now = millis();
+        if (buffer.stalledSince == 0) {
+            buffer.stalledSince = now | 1;
+        } else if (now - buffer.stalledSince >= LOG_WS_STALL_MS) {
+            _drop(index, id);
+        }
+        return false;
+    }
+    client->text(buffer.data, buffer.length - 1); // Without the last '\n'; the library copies it
+    buffer.length = 0;
+    buffer.stalledSince = 0;
+    return true;
+}
+
+void LogWebSink::_drop(size_t index, uint32_t id) {
+    AsyncWebSocketClient* client = _ws.client(id);
+    if (client != nullptr) {
+        client->close(1008, "Log client too slow");
+    }
+    _buffers[index].length = 0;
+    _buffers[index].stalledSince = 0;
+    _droppedClients++;
+    LOGW("WebLog", "Log client %lu dropped, it could not take data for %d ms", (unsigned long)id, LOG_WS_STALL_MS);
+}
+
+void LogWebSink::flush() {
+    for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+        if (_buffers[i].length > 0) {
+            _flushClient(i, _buffers[i].owner);
+        }
+    }
+}
+
+bool LogWebSink::hasPending() const {
+    for (size_t i = 0; i < LOG_WS_MAX_CLIENTS; i++) {
+        if (_buffers[i].length > 0) {
+            return true;
+        }
+    }
+    return false;
+}
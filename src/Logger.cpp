@@ -1,14 +1,46 @@
 #include "../include/Logger.h" // Path to Logger.h
 #include <time.h>               // To use time() for Unix timestamp
 #include <stdarg.h>             // To use va_list, va_start, va_end for logf function
+#include <limits.h>
 
 // Define the global AppLogger variable
 Logger AppLogger;
 
+static_assert((LOG_RING_SLOTS & (LOG_RING_SLOTS - 1)) == 0, "LOG_RING_SLOTS must be a power of two");
+static_assert(LOG_BATCH_FRAME_MAX + 64 <= MQTT_BUFFER_SIZE, "Log frames must fit the MQTT buffer with the topic");
+
 // extern const char* API_KEY; // REMOVED
 
 Logger::Logger() : _networkManager(nullptr), _serialLogLevel(LOG_LEVEL_NONE), _mqttLogLevel(LOG_LEVEL_NONE), _apiKey("") { // MODIFIED: Initialize _apiKey
-    // Default constructor
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++) {
+        _ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    _head = 0;
+    _tail = 0;
+    _drainTask = nullptr;
+    _mqttFormat = LOG_MQTT_JSON;
+    _queued = 0;
+    _dropped = 0;
+    _truncated = 0;
+    _maxDepth = 0;
+    _frames = 0;
+    _frameBytes = 0;
+    _batchLen = 0;
+    _batchCount = 0;
+    _batchFormat = LOG_MQTT_JSON;
+    _batchStarted = 0;
+    _batchSeq = 0;
+    _flushRequested = false;
+    _storeDirtySince = 0;
+    _lastReplay = 0;
+    _stored = 0;
+    _replayed = 0;
+    _replaySkipped = 0;
+    _storeLost = 0;
+    _perfWindowStart = 0;
+    _perfThresholdMs = LOG_PERF_THRESHOLD_MS;
+    _perfWindowMs = LOG_PERF_WINDOW_MS;
+    _suppressed = 0;
 }
 
 void Logger::begin(NetworkManager* networkManager, LogLevel initialSerialLogLevel, LogLevel initialMqttLogLevel) {
@@ -19,27 +51,36 @@ void Logger::begin(NetworkManager* networkManager, LogLevel initialSerialLogLeve
     // Store API key from NetworkManager - MODIFIED
     if (_networkManager) {
         _apiKey = _networkManager->getApiKey();
-        if (Serial && _serialLogLevel >= LOG_LEVEL_DEBUG) {
-             Serial.println(String(millis()) + " [DEBUG] [Logger]: API Key loaded via NetworkManager. Length: " + String(_apiKey.length()));
-        }
     } else {
         _apiKey = ""; // Set to empty if networkManager is null
-        if (Serial && _serialLogLevel >= LOG_LEVEL_WARNING) {
-             Serial.println(String(millis()) + " [WARNING] [Logger]: NetworkManager not available during Logger init, API Key not set.");
-        }
     }
-    
-    // Log Logger initialization message (will only appear if Serial is configured for INFO level or higher)
-    // and Serial.begin() has been called.
-    if (_serialLogLevel >= LOG_LEVEL_INFO && Serial) {
-         Serial.println(String(millis()) + " [INFO] [Logger]: Logger initialized. Serial LogLevel: " + levelToString(_serialLogLevel) + ", MQTT LogLevel: " + levelToString(_mqttLogLevel));
-         if (_mqttLogLevel > LOG_LEVEL_NONE) {
-            if (_networkManager && _networkManager->isConnected()) {
-                Serial.println(String(millis()) + " [INFO] [Logger]: MQTT logging active.");
-            } else {
-                Serial.println(String(millis()) + " [WARNING] [Logger]: MQTT logging configured, but NetworkManager not available or not connected at init.");
-            }
-         }
+
+    // Opened before the drain task starts, which is its only user afterwards
+    if (_drainTask == nullptr) {
+        _store.begin();
+        _perfWindowStart = millis();
+    }
+
+    // Logging never waits on Serial or the network: producers fill the ring, this task empties it
+    if (_drainTask == nullptr &&
+        xTaskCreatePinnedToCore(_drainTaskCode, "LogDrain", LOG_DRAIN_STACK_SIZE, this,
+                                LOG_DRAIN_PRIORITY, &_drainTask, LOG_DRAIN_CORE) != pdPASS) {
+        Serial.println("[CRITICAL] [Logger]: Failed to create log drain task");
+        return;
+    }
+
+    if (_networkManager) {
+        debug("Logger", "API Key loaded via NetworkManager. Length: " + String(_apiKey.length()));
+    } else {
+        warning("Logger", "NetworkManager not available during Logger init, API Key not set.");
+    }
+    info("Logger", String("Logger initialized. Serial LogLevel: ") + levelToString(_serialLogLevel) +
+         ", MQTT LogLevel: " + levelToString(_mqttLogLevel) + ", ring slots: " + String(LOG_RING_SLOTS));
+    if (_store.isReady()) {
+        info("Logger", "Flash log store ready, " + String(_store.getStats().sectors) + " sectors" +
+                       (_store.hasPending() ? ", undelivered logs will be replayed" : ""));
+    } else {
+        warning("Logger", "No '" LOG_STORE_PARTITION "' partition, logs are dropped while MQTT is down");
     }
 }
 
@@ -64,101 +105,753 @@ void Logger::debug(const String& tag, const String& message) {
     log(LOG_LEVEL_DEBUG, tag, message);
 }
 
-// Main log function, handles LogEntry creation and calls processLogEntry
-void Logger::log(LogLevel level, const String& tag, const String& message) {
-    // Only process if the message's log level is important enough to be recorded
-    // by at least one target (Serial or MQTT)
-    bool shouldLogSerial = (level <= _serialLogLevel && _serialLogLevel != LOG_LEVEL_NONE);
-    bool shouldLogMqtt = (level <= _mqttLogLevel && _mqttLogLevel != LOG_LEVEL_NONE);
+// Unix time if NTP is synced, otherwise millis()
+static uint32_t logTimestamp() {
+    time_t now = time(nullptr);
+    return now > 1000000000L ? (uint32_t)now : millis();
+}
 
-    if (!shouldLogSerial && !shouldLogMqtt) {
-        return; // No target wants to log at this level
+// Claim the next free slot and fill the header. Returns nullptr (and counts a drop)
+// when the ring is full; the caller never waits for the drain task.
+LogRecord* Logger::_claim(LogLevel level, const char* tag, uint16_t tagToken, uint8_t flags, uint32_t& position) {
+    uint32_t pos = _head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &_ring[pos & (LOG_RING_SLOTS - 1)];
+        uint32_t seq = slot->sequence.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            _dropped++;
+            return nullptr;
+        } else {
+            pos = _head.load(std::memory_order_relaxed);
+        }
     }
 
-    LogEntry entry;
-    // Prefer Unix time if NTP is synced, otherwise use millis()
-    if (time(nullptr) > 1000000000L) { // Basic check if NTP has run
-        entry.timestamp = time(nullptr);
-    } else {
-        entry.timestamp = millis(); // Use millis() as a fallback
+    LogRecord& record = slot->record;
+    record.timestamp = logTimestamp();
+    record.freeHeap = ESP.getFreeHeap();
+    record.value = 0;
+    record.format = nullptr;
+    record.token = 0;
+    record.tagToken = tagToken;
+    record.length = 0;
+    record.level = (uint8_t)level;
+    record.coreId = (uint8_t)xPortGetCoreID();
+    record.flags = flags;
+    // Logs raised while the drain task publishes (e.g. publish failures) must not feed back into MQTT
+    if (_drainTask != nullptr && xTaskGetCurrentTaskHandle() == _drainTask) {
+        record.flags |= LOG_FLAG_NO_MQTT;
+    }
+    strlcpy(record.tag, tag, LOG_TAG_MAX);
+
+    position = pos;
+    return &record;
+}
+
+void Logger::_commit(uint32_t position) {
+    Slot& slot = _ring[position & (LOG_RING_SLOTS - 1)];
+    if (slot.record.flags & LOG_FLAG_TRUNCATED) {
+        _truncated++;
+    }
+    slot.sequence.store(position + 1, std::memory_order_release);
+    _queued++;
+
+    uint32_t depth = position + 1 - _tail.load(std::memory_order_relaxed);
+    uint32_t seen = _maxDepth.load();
+    while (depth > seen && !_maxDepth.compare_exchange_weak(seen, depth)) {
     }
-    entry.level = level;
-    entry.tag = tag;
-    entry.message = message;
 
-    processLogEntry(entry); // Send the entry to the common processing function
+    if (_drainTask != nullptr) {
+        xTaskNotifyGive(_drainTask);
+    }
+}
+
+// Drain task only
+bool Logger::_pop(LogRecord& out) {
+    uint32_t pos = _tail.load(std::memory_order_relaxed);
+    Slot& slot = _ring[pos & (LOG_RING_SLOTS - 1)];
+    uint32_t seq = slot.sequence.load(std::memory_order_acquire);
+    if ((int32_t)(seq - (pos + 1)) < 0) {
+        return false; // Empty, or the next record is still being written
+    }
+    out = slot.record;
+    slot.sequence.store(pos + LOG_RING_SLOTS, std::memory_order_release);
+    _tail.store(pos + 1, std::memory_order_relaxed);
+    return true;
+}
+
+// Main log function: copies the message into a ring slot and returns
+void Logger::log(LogLevel level, const String& tag, const String& message) {
+    uint16_t tagToken = LogToken::hash(tag.c_str());
+    if (!enabled(level, tagToken)) {
+        return; // No target wants to log at this level
+    }
+
+    uint32_t position;
+    LogRecord* record = _claim(level, tag.c_str(), tagToken, 0, position);
+    if (record == nullptr) {
+        return;
+    }
+    if (strlcpy(record->message, message.c_str(), LOG_MESSAGE_MAX) >= LOG_MESSAGE_MAX) {
+        record->flags |= LOG_FLAG_TRUNCATED;
+    }
+    _commit(position);
 }
 
 // Log function with printf-style formatting
 void Logger::logf(LogLevel level, const String& tag, const char* format, ...) {
     // Similar to log function, check level first
-    bool shouldLogSerial = (level <= _serialLogLevel && _serialLogLevel != LOG_LEVEL_NONE);
-    bool shouldLogMqtt = (level <= _mqttLogLevel && _mqttLogLevel != LOG_LEVEL_NONE);
-
-    if (!shouldLogSerial && !shouldLogMqtt) {
+    uint16_t tagToken = LogToken::hash(tag.c_str());
+    if (!enabled(level, tagToken)) {
         return;
     }
+    uint32_t position;
+    LogRecord* record = _claim(level, tag.c_str(), tagToken, 0, position);
+    if (record == nullptr) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    // The format may not outlive the call, so logf stores formatted text
+    int written = vsnprintf(record->message, LOG_MESSAGE_MAX, format, args);
+    va_end(args);
+    if (written >= LOG_MESSAGE_MAX) {
+        record->flags |= LOG_FLAG_TRUNCATED;
+    }
+    _commit(position);
+}
 
-    char buffer[256]; // Buffer for the formatted string, be careful with size
+// Macro path: keeps the literal format and only binary-encodes the arguments
+void Logger::write(LogLevel level, const char* tag, uint16_t tagToken, uint16_t token, const char* format, ...) {
+    if (!enabled(level, tagToken)) {
+        return;
+    }
+    uint32_t position;
+    LogRecord* record = _claim(level, tag, tagToken, 0, position);
+    if (record == nullptr) {
+        return;
+    }
+    bool truncated;
     va_list args;
     va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args); // Format the string
+    record->length = LogToken::encodeArgs((uint8_t*)record->message, LOG_MESSAGE_MAX, format, args, truncated);
     va_end(args);
+    record->format = format;
+    record->token = token;
+    if (truncated) {
+        record->flags |= LOG_FLAG_TRUNCATED;
+    }
+    _commit(position);
+}
+
+void Logger::_drainTaskCode(void* parameter) {
+    Logger* self = static_cast<Logger*>(parameter);
+    LogRecord record;
+    uint32_t reportedDrops = 0;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, self->_nextWakeup());
+        while (self->_pop(record)) {
+            self->processLogEntry(record);
+        }
+        self->_web.flush();
+        LogLimitReport report;
+        while (self->_limiter.poll(millis(), report)) {
+            self->_emitReport(report);
+        }
+        bool flushRequested = self->_flushRequested.load();
+        if (self->_batchCount > 0 &&
+            (flushRequested || millis() - self->_batchStarted >= LOG_BATCH_INTERVAL_MS)) {
+            self->_flushBatch();
+        }
+        if (self->_storeDirtySince != 0 &&
+            (flushRequested || millis() - self->_storeDirtySince >= LOG_STORE_FLUSH_MS)) {
+            self->_store.flush();
+            self->_storeDirtySince = 0;
+        }
+        self->_replay();
+        if (self->_perf.hasData() && millis() - self->_perfWindowStart >= self->_perfWindowMs) {
+            self->_publishPerfSummary();
+        }
+        if (flushRequested) {
+            self->_flushRequested = false; // Only after the frame went out; flush() waits for this
+        }
 
-    log(level, tag, String(buffer)); // Call the main log function with the formatted string
+        // Report losses from the drain side, where logging cannot overflow the ring again
+        uint32_t dropped = self->_dropped.load();
+        if (dropped != reportedDrops && Serial) {
+            Serial.printf("%lu [WARNING] [Logger]: Log ring overflow, %lu records dropped so far\n",
+                          (unsigned long)millis(), (unsigned long)dropped);
+            reportedDrops = dropped;
+        }
+    }
 }
 
-// Internal function to handle sending logs to destinations (Serial, MQTT)
-void Logger::processLogEntry(const LogEntry& entry) {
-    // 1. Log to Serial
-    if (entry.level <= _serialLogLevel && _serialLogLevel != LOG_LEVEL_NONE && Serial) { // Check if Serial is ready
-        String logString = String(entry.timestamp) + " [" + levelToString(entry.level) + "]";
-        if (!entry.tag.isEmpty()) {
-            logString += " [" + entry.tag + "]";
+// Sleep until new records arrive, or until the pending MQTT frame, the store buffer or
+// the next replay step is due
+TickType_t Logger::_nextWakeup() {
+    unsigned long now = millis();
+    unsigned long wait = ULONG_MAX;
+    if (_batchCount > 0) {
+        unsigned long age = now - _batchStarted;
+        wait = age >= LOG_BATCH_INTERVAL_MS ? 0 : LOG_BATCH_INTERVAL_MS - age;
+    }
+    if (_storeDirtySince != 0) {
+        unsigned long age = now - _storeDirtySince;
+        unsigned long due = age >= LOG_STORE_FLUSH_MS ? 0 : LOG_STORE_FLUSH_MS - age;
+        wait = due < wait ? due : wait;
+    }
+    if (_store.hasPending()) {
+        // Polled while disconnected too, so replay starts soon after the broker comes back
+        unsigned long age = now - _lastReplay;
+        unsigned long due = age >= LOG_REPLAY_INTERVAL_MS ? 0 : LOG_REPLAY_INTERVAL_MS - age;
+        wait = due < wait ? due : wait;
+    }
+    if (_web.hasPending()) {
+        wait = LOG_WS_RETRY_MS < wait ? LOG_WS_RETRY_MS : wait; // Client queue was full
+    }
+    unsigned long limiterDue = _limiter.nextPoll(now);
+    wait = limiterDue < wait ? limiterDue : wait;
+    if (_perf.hasData()) {
+        unsigned long age = now - _perfWindowStart;
+        unsigned long due = age >= _perfWindowMs ? 0 : _perfWindowMs - age;
+        if (due == 0 && !(_networkManager && _networkManager->isConnected())) {
+            // The summary waits for the broker: poll like replay instead of spinning
+            due = LOG_REPLAY_INTERVAL_MS;
+        }
+        wait = due < wait ? due : wait;
+    }
+    return wait == ULONG_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait);
+}
+
+// Internal function to handle a record from the ring: flood control, then the outputs; drain task only
+void Logger::processLogEntry(const LogRecord& entry) {
+    char text[LOG_MESSAGE_MAX * 2];
+    const char* message = _messageText(entry, text, sizeof(text));
+
+    // Floods (a flapping broker, a failing sensor in a loop) are collapsed before they
+    // reach any output. Perf events are aggregated instead; CRITICAL is never held back.
+    if (!(entry.flags & LOG_FLAG_PERF) && entry.level != LOG_LEVEL_CRITICAL) {
+        LogLimitReport repeat;
+        bool allowed = _limiter.allow(entry.level, entry.tag, entry.format != nullptr ? entry.token : 0,
+                                      message, millis(), repeat);
+        if (repeat.count > 0) {
+            _emitReport(repeat);
+        }
+        if (!allowed) {
+            _suppressed++;
+            return;
+        }
+    }
+    _emit(entry, message);
+}
+
+// Summary of suppressed records, sent like a record of their level and tag
+void Logger::_emitReport(const LogLimitReport& report) {
+    LogRecord record;
+    record.timestamp = logTimestamp();
+    record.freeHeap = ESP.getFreeHeap();
+    record.value = report.count;
+    record.format = nullptr;
+    record.token = 0;
+    record.tagToken = LogToken::hash(report.tag);
+    record.length = 0;
+    record.level = report.level;
+    record.coreId = (uint8_t)xPortGetCoreID();
+    record.flags = 0;
+    strlcpy(record.tag, report.tag, LOG_TAG_MAX);
+    if (report.repeated) {
+        snprintf(record.message, LOG_MESSAGE_MAX, "Last message repeated %lu times in %lus",
+                 (unsigned long)report.count, (unsigned long)(report.durationMs / 1000));
+    } else {
+        snprintf(record.message, LOG_MESSAGE_MAX, "Suppressed %lu messages like '%s' in %lus",
+                 (unsigned long)report.count, report.text, (unsigned long)(report.durationMs / 1000));
+    }
+    _emit(record, record.message);
+}
+
+// Send one record to Serial, the live log clients and MQTT; drain task only
+void Logger::_emit(const LogRecord& entry, const char* message) {
+    LogLevel level = (LogLevel)entry.level;
+    uint32_t tagSlot = _tagLevels.find(entry.tagToken);
+    uint8_t serialLevel = LogTagLevels::level(tagSlot, LOG_TARGET_SERIAL, _serialLogLevel);
+    uint8_t mqttLevel = LogTagLevels::level(tagSlot, LOG_TARGET_MQTT, _mqttLogLevel);
+
+    // 1. Log to Serial and the live log clients (same line)
+    bool toSerial = level <= serialLevel && serialLevel != LOG_LEVEL_NONE && Serial; // Check if Serial is ready
+    if (toSerial || _web.wants(level, entry.tagToken)) {
+        char line[LOG_TAG_MAX + LOG_MESSAGE_MAX * 2 + 96];
+        int len = snprintf(line, sizeof(line), "%lu [%s]", (unsigned long)entry.timestamp, levelToString(level));
+        if (entry.tag[0] != '\0') {
+            len += snprintf(line + len, sizeof(line) - len, " [%s]", entry.tag);
+        }
+        if (entry.flags & LOG_FLAG_PERF) {
+            // Perf records: message holds the event name, then '\0' and the optional details
+            const char* details = entry.message + strlen(entry.message) + 1;
+            len += snprintf(line + len, sizeof(line) - len,
+                            " [Core:%u, Heap:%lu]: PERF: Event='%s', Duration=%lums, Success=%s",
+                            entry.coreId, (unsigned long)entry.freeHeap, entry.message,
+                            (unsigned long)entry.value, (entry.flags & LOG_FLAG_SUCCESS) ? "true" : "false");
+            if (details[0] != '\0' && len < (int)sizeof(line)) {
+                snprintf(line + len, sizeof(line) - len, ", Details='%s'", details);
+            }
+        } else {
+            snprintf(line + len, sizeof(line) - len, ": %s", message);
+        }
+        if (toSerial) {
+            Serial.println(line); // Send to Serial Monitor
+        }
+        _web.send(level, entry.tagToken, line, strnlen(line, sizeof(line)));
+    }
+
+    // 2. Perf events go into the window summary; only slow ones are also sent on their own
+    const LogRecord* mqttEntry = &entry;
+    LogRecord slow;
+    if (entry.flags & LOG_FLAG_PERF) {
+        _perf.add(entry.token, entry.tag, entry.message, entry.value, (entry.flags & LOG_FLAG_SUCCESS) != 0);
+        if (entry.value < _perfThresholdMs) {
+            return;
         }
-        logString += ": " + entry.message;
-        Serial.println(logString); // Send to Serial Monitor
+        slow = entry;
+        slow.level = LOG_LEVEL_WARNING;
+        mqttEntry = &slow;
+        level = LOG_LEVEL_WARNING;
     }
 
-    // 2. Log via MQTT
-    if (entry.level <= _mqttLogLevel && _mqttLogLevel != LOG_LEVEL_NONE) {
+    // 3. Log via MQTT
+    if (level <= mqttLevel && mqttLevel != LOG_LEVEL_NONE && !(entry.flags & LOG_FLAG_NO_MQTT)) {
         if (_networkManager && _networkManager->isConnected()) {
-            String jsonPayload = formatToJson(entry);
-            // NetworkManager::publish should be designed to not block for too long
-            // or have a retry/queue mechanism if high reliability for MQTT logs is needed.
-            _networkManager->publish(_mqttLogTopic, jsonPayload.c_str());
+            _appendBatch(*mqttEntry, message);
+        } else {
+            _storeRecord(*mqttEntry, message); // Sent by _replay() once MQTT is back
         }
-        // No else here to avoid loop logging when MQTT is disconnected
     }
 }
 
-// Function to convert LogEntry to JSON string for MQTT
-String Logger::formatToJson(const LogEntry& entry) {
-    StaticJsonDocument<512> doc; // JSON size, adjust if more fields are needed
-    
-    // Add API key for authentication - MODIFIED
-    if (!_apiKey.isEmpty()) {
-        doc["api_key"] = _apiKey; // ArduinoJson handles String type
+// One JSON message per window on _mqttPerfTopic, split over several messages if the
+// events do not fit in one frame:
+//   {"api_key":"..","window_ms":60000,"untracked":0,"events":[{"tag":"Core0",
+//    "event":"SensorReadOperation","count":30,"failures":0,"min_ms":12,"max_ms":15,
+//    "mean_ms":13,"p50_ms":13,"p90_ms":15,"p99_ms":15}, ...]}
+void Logger::_publishPerfSummary() {
+    if (!_networkManager || !_networkManager->isConnected()) {
+        return; // The window keeps growing until the summary can be sent
     }
-    
+
+    char* frame = (char*)_frame;
+    unsigned long windowMs = millis() - _perfWindowStart;
+    size_t n = 0;
+    size_t events = 0;
+    for (size_t i = 0; i <= _perf.size(); i++) {
+        char item[256];
+        size_t len = 0;
+        if (i < _perf.size()) {
+            const LogPerfEvent& event = _perf.at(i);
+            if (event.count == 0) {
+                continue;
+            }
+            StaticJsonDocument<384> doc;
+            doc["tag"] = (const char*)event.tag;
+            doc["event"] = (const char*)event.name;
+            doc["count"] = event.count;
+            doc["failures"] = event.failures;
+            doc["min_ms"] = event.min;
+            doc["max_ms"] = event.max;
+            doc["mean_ms"] = (uint32_t)(event.total / event.count);
+            doc["p50_ms"] = LogPerf::percentile(event, 50);
+            doc["p90_ms"] = LogPerf::percentile(event, 90);
+            doc["p99_ms"] = LogPerf::percentile(event, 99);
+            len = serializeJson(doc, item, sizeof(item));
+            if (len == 0 || len >= sizeof(item)) {
+                continue;
+            }
+        }
+
+        // Publish the open message when this item does not fit, or after the last item
+        if (events > 0 && (i == _perf.size() || n + 1 + len + 3 > sizeof(_frame))) {
+            frame[n++] = ']';
+            frame[n++] = '}';
+            frame[n] = '\0';
+            _networkManager->publish(_mqttPerfTopic, frame);
+            n = 0;
+            events = 0;
+        }
+        if (i == _perf.size()) {
+            break;
+        }
+
+        if (events == 0) {
+            if (_apiKey.isEmpty()) {
+                n = snprintf(frame, sizeof(_frame), "{\"window_ms\":%lu,\"untracked\":%lu,\"events\":[",
+                             windowMs, (unsigned long)_perf.untracked());
+            } else {
+                n = snprintf(frame, sizeof(_frame), "{\"api_key\":\"%s\",\"window_ms\":%lu,\"untracked\":%lu,\"events\":[",
+                             _apiKey.c_str(), windowMs, (unsigned long)_perf.untracked());
+            }
+        } else {
+            frame[n++] = ',';
+        }
+        memcpy(frame + n, item, len);
+        n += len;
+        events++;
+    }
+
+    _perf.reset();
+    _perfWindowStart = millis();
+}
+
+// Stored entry: the record with its text already rendered, so replay does not depend on
+// format strings of the running firmware:
+//   u8 head (as in binary frames), varint timestamp, varint freeHeap, varint value,
+//   u8 len + tag, u8 len + message (perf: event name), u8 len + perf details
+static size_t putString(uint8_t* out, size_t cap, const char* s) {
+    if (cap == 0) {
+        return 0;
+    }
+    size_t len = strlen(s);
+    len = len < cap - 1 ? len : cap - 1;
+    len = len < 255 ? len : 255;
+    out[0] = (uint8_t)len;
+    memcpy(out + 1, s, len);
+    return len + 1;
+}
+
+void Logger::_storeRecord(const LogRecord& entry, const char* message) {
+    if (!_store.isReady()) {
+        return;
+    }
+    uint8_t data[LOG_STORE_ENTRY_MAX];
+    size_t n = 0;
+    uint8_t head = entry.level & 0x07;
+    if (entry.flags & LOG_FLAG_PERF)      head |= 0x08;
+    if (entry.flags & LOG_FLAG_SUCCESS)   head |= 0x10;
+    if (entry.flags & LOG_FLAG_TRUNCATED) head |= 0x20;
+    if (entry.coreId)                     head |= 0x40;
+    data[n++] = head;
+    n += LogToken::writeVarint(data + n, sizeof(data) - n, entry.timestamp);
+    n += LogToken::writeVarint(data + n, sizeof(data) - n, entry.freeHeap);
+    n += LogToken::writeVarint(data + n, sizeof(data) - n, entry.value);
+    n += putString(data + n, sizeof(data) - n, entry.tag);
+    if (entry.flags & LOG_FLAG_PERF) {
+        n += putString(data + n, sizeof(data) - n, entry.message);
+        n += putString(data + n, sizeof(data) - n, entry.message + strlen(entry.message) + 1);
+    } else {
+        n += putString(data + n, sizeof(data) - n, message);
+        n += putString(data + n, sizeof(data) - n, "");
+    }
+
+    if (!_store.append(data, n)) {
+        return;
+    }
+    _stored++;
+    _storeLost = _store.getStats().lostSectors;
+    if (entry.level <= LOG_LEVEL_ERROR) {
+        _store.flush(); // Errors often come right before a reset
+        _storeDirtySince = 0;
+    } else if (_storeDirtySince == 0) {
+        _storeDirtySince = millis() | 1;
+    }
+}
+
+static bool getString(const uint8_t*& p, const uint8_t* end, char* out, size_t cap) {
+    if (p >= end || end - p - 1 < *p) {
+        return false;
+    }
+    size_t len = *p++;
+    size_t copy = len < cap - 1 ? len : cap - 1;
+    memcpy(out, p, copy);
+    out[copy] = '\0';
+    p += len;
+    return true;
+}
+
+bool Logger::_loadRecord(const uint8_t* data, size_t len, LogRecord& out) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    uint64_t timestamp, freeHeap, value;
+    if (p >= end) {
+        return false;
+    }
+    uint8_t head = *p++;
+    if (!LogToken::readVarint(p, end, timestamp) || !LogToken::readVarint(p, end, freeHeap) ||
+        !LogToken::readVarint(p, end, value) || !getString(p, end, out.tag, LOG_TAG_MAX) ||
+        !getString(p, end, out.message, LOG_MESSAGE_MAX - 1)) {
+        return false;
+    }
+    // Perf details follow the event name after its '\0', as in live records
+    size_t nameLen = strlen(out.message);
+    if (!getString(p, end, out.message + nameLen + 1, LOG_MESSAGE_MAX - nameLen - 1)) {
+        return false;
+    }
+
+    out.timestamp = (uint32_t)timestamp;
+    out.freeHeap = (uint32_t)freeHeap;
+    out.value = (uint32_t)value;
+    out.format = nullptr;
+    out.length = 0;
+    out.level = head & 0x07;
+    out.coreId = (head & 0x40) ? 1 : 0;
+    out.flags = LOG_FLAG_REPLAYED;
+    if (head & 0x08) out.flags |= LOG_FLAG_PERF;
+    if (head & 0x10) out.flags |= LOG_FLAG_SUCCESS;
+    if (head & 0x20) out.flags |= LOG_FLAG_TRUNCATED;
+    out.token = (out.flags & LOG_FLAG_PERF) ? LogToken::hash(out.message) : 0;
+    out.tagToken = LogToken::hash(out.tag);
+    return true;
+}
+
+// Send up to LOG_REPLAY_BATCH stored records as one frame, at most every
+// LOG_REPLAY_INTERVAL_MS so a long backlog does not crowd out live logs.
+// Entries are marked as sent only after the frame was published.
+void Logger::_replay() {
+    if (!_store.hasPending() || millis() - _lastReplay < LOG_REPLAY_INTERVAL_MS) {
+        return;
+    }
+    _lastReplay = millis();
+    if (!_networkManager || !_networkManager->isConnected()) {
+        return;
+    }
+    _flushBatch(); // Replayed records travel in frames of their own
+
+    uint32_t addresses[LOG_REPLAY_BATCH];
+    size_t count = 0;
+    uint8_t data[LOG_STORE_ENTRY_MAX];
+    size_t len;
+    uint32_t address;
+    LogRecord record;
+    while (count < LOG_REPLAY_BATCH && _store.readNext(data, sizeof(data), len, address)) {
+        if (!_loadRecord(data, len, record)) {
+            _store.markSent(address); // Unreadable, never retried
+            _replaySkipped++;
+            continue;
+        }
+        if (!_appendBatch(record, record.message)) {
+            if (_batchCount > 0) {
+                _store.seek(address); // Frame full: first record of the next step
+                break;
+            }
+            // Rejected by an empty frame (cannot be formatted, or larger than a frame):
+            // it would never fit, so drop it instead of stalling the records behind it
+            _store.markSent(address);
+            _replaySkipped++;
+            continue;
+        }
+        addresses[count++] = address;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    if (_flushBatch()) {
+        for (size_t i = 0; i < count; i++) {
+            _store.markSent(addresses[i]);
+        }
+        _replayed += count;
+    } else {
+        _store.seek(addresses[0]); // Retried on the next step
+    }
+}
+
+// Function to convert a record to a JSON object for MQTT (the API key is sent once per frame)
+size_t Logger::formatToJson(const LogRecord& entry, const char* message, char* out, size_t cap) {
+    StaticJsonDocument<512> doc; // JSON size, adjust if more fields are needed
+
     doc["timestamp"] = entry.timestamp;
-    doc["level_num"] = static_cast<int>(entry.level); // Send numeric level
-    doc["level_str"] = levelToString(entry.level);   // and string level for readability
-    doc["tag"] = entry.tag;
-    doc["message"] = entry.message;
-    
-    // --- NEW: Add Core ID and Free Heap ---
-    doc["core_id"] = xPortGetCoreID();
-    doc["free_heap"] = ESP.getFreeHeap();
+    doc["level_num"] = entry.level;                              // Send numeric level
+    doc["level_str"] = levelToString((LogLevel)entry.level);    // and string level for readability
+    doc["tag"] = (const char*)entry.tag;
+    if (entry.flags & LOG_FLAG_PERF) {
+        // Differentiate performance logs with a "type" field and structured metrics
+        const char* details = entry.message + strlen(entry.message) + 1;
+        doc["type"] = "performance";
+        doc["event_name"] = (const char*)entry.message;
+        doc["duration_ms"] = entry.value;
+        doc["success"] = (entry.flags & LOG_FLAG_SUCCESS) != 0;
+        if (details[0] != '\0') {
+            doc["details"] = details;
+        }
+    } else {
+        doc["message"] = message;
+    }
+
+    // --- NEW: Add Core ID and Free Heap (captured when the entry was logged) ---
+    doc["core_id"] = entry.coreId;
+    doc["free_heap"] = entry.freeHeap;
     // --- END NEW ---
+    if (entry.flags & LOG_FLAG_REPLAYED) {
+        doc["replayed"] = true; // Logged while MQTT was down, sent from the flash log store
+    }
 
-    String output;
-    serializeJson(doc, output); // Convert JSON object to string
-    return output;
+    size_t len = serializeJson(doc, out, cap); // Convert JSON object to string
+    return len < cap ? len : 0;                  // 0: did not fit
+}
+
+const char* Logger::_messageText(const LogRecord& entry, char* buffer, size_t size) {
+    if (entry.format == nullptr) {
+        return entry.message;
+    }
+    LogToken::format(buffer, size, entry.format, (const uint8_t*)entry.message, entry.length);
+    return buffer;
+}
+
+// One tokenized entry of a binary frame body (layout in Logger.h)
+size_t Logger::_encodeBinary(const LogRecord& entry, uint8_t* out, size_t cap) {
+    size_t n = 0;
+    uint8_t head = entry.level & 0x07;
+    if (entry.flags & LOG_FLAG_PERF)      head |= 0x08;
+    if (entry.flags & LOG_FLAG_SUCCESS)   head |= 0x10;
+    if (entry.flags & LOG_FLAG_TRUNCATED) head |= 0x20;
+    if (entry.coreId)                     head |= 0x40;
+    if (entry.flags & LOG_FLAG_REPLAYED)  head |= 0x80;
+    out[n++] = head;
+    n += LogToken::writeVarint(out + n, cap - n, entry.timestamp);
+    out[n++] = entry.tagToken & 0xFF;
+    out[n++] = entry.tagToken >> 8;
+    out[n++] = entry.token & 0xFF;
+    out[n++] = entry.token >> 8;
+
+    size_t lengthPos = n++;
+    size_t argStart = n;
+    if (entry.flags & LOG_FLAG_PERF) {
+        const char* details = entry.message + strlen(entry.message) + 1;
+        n += LogToken::writeVarint(out + n, cap - n, entry.value);
+        n += LogToken::writeVarint(out + n, cap - n, entry.freeHeap);
+        size_t len = strlen(details);
+        len = len < cap - n ? len : cap - n;
+        memcpy(out + n, details, len);
+        n += len;
+    } else if (entry.format != nullptr) {
+        memcpy(out + n, entry.message, entry.length);
+        n += entry.length;
+    } else {
+        size_t len = strlen(entry.message); // Plain text record, token 0
+        memcpy(out + n, entry.message, len);
+        n += len;
+    }
+    out[lengthPos] = (uint8_t)(n - argStart);
+    return n;
+}
+
+// Largest frame body that still leaves room for the frame header
+size_t Logger::_batchLimit() const {
+    size_t header = _apiKey.length() + 48; // JSON: {"api_key":"...","seq":4294967295,"logs":[ ... ]}
+    return header < LOG_BATCH_FRAME_MAX ? LOG_BATCH_FRAME_MAX - header : 0;
+}
+
+// Returns false if the record was not added. Replayed records never trigger a flush:
+// _replay() publishes their frame itself, so it knows which entries went out.
+bool Logger::_appendBatch(const LogRecord& entry, const char* message) {
+    bool replayed = (entry.flags & LOG_FLAG_REPLAYED) != 0;
+    LogMqttFormat format = _mqttFormat;
+    if (_batchCount > 0 && format != _batchFormat) {
+        _flushBatch(); // Format switched: send what was collected in the old one
+    }
+
+    char item[512];
+    size_t len = format == LOG_MQTT_BINARY
+                     ? _encodeBinary(entry, (uint8_t*)item, LOG_BINARY_ENTRY_MAX)
+                     : formatToJson(entry, message, item, sizeof(item));
+    if (len == 0) {
+        return false;
+    }
+    size_t separator = (format == LOG_MQTT_JSON && _batchCount > 0) ? 1 : 0;
+    if (_batchLen + separator + len > _batchLimit()) {
+        if (replayed) {
+            return false;
+        }
+        _flushBatch();
+        separator = 0;
+    }
+    if (_batchLen + len > _batchLimit()) {
+        return false; // Larger than a whole frame
+    }
+
+    if (_batchCount == 0) {
+        _batchStarted = millis();
+        _batchFormat = format;
+    }
+    if (separator) {
+        _batch[_batchLen++] = ',';
+    }
+    memcpy(_batch + _batchLen, item, len);
+    _batchLen += len;
+    _batchCount++;
+
+    // Errors are not held back for the batch interval
+    if (entry.level <= LOG_LEVEL_ERROR && !replayed) {
+        _flushBatch();
+    }
+    return true;
+}
+
+// Publish the pending frame in one message. The sequence number advances even if the
+// publish fails, so the receiver can tell lost frames from quiet periods.
+bool Logger::_flushBatch() {
+    if (_batchCount == 0) {
+        return false;
+    }
+
+    bool published = false;
+    if (_networkManager && _networkManager->isConnected()) {
+        size_t n = 0;
+        if (_batchFormat == LOG_MQTT_BINARY) {
+            size_t keyLen = _apiKey.length() < LOG_API_KEY_MAX ? _apiKey.length() : LOG_API_KEY_MAX;
+            _frame[n++] = LOG_BINARY_MAGIC;
+            _frame[n++] = LOG_BINARY_VERSION;
+            size_t flagsPos = n++;
+            _frame[flagsPos] = 0;
+            _frame[n++] = (uint8_t)keyLen;
+            memcpy(_frame + n, _apiKey.c_str(), keyLen);
+            n += keyLen;
+            n += LogToken::writeVarint(_frame + n, sizeof(_frame) - n, _batchSeq);
+
+            size_t body = 0;
+#if LOG_BATCH_COMPRESS
+            body = LogCompress::compress(_batch, _batchLen, _frame + n, sizeof(_frame) - n);
+            if (body > 0) {
+                _frame[flagsPos] |= LOG_BINARY_FLAG_COMPRESSED;
+            }
+#endif
+            if (body == 0) {
+                memcpy(_frame + n, _batch, _batchLen);
+                body = _batchLen;
+            }
+            n += body;
+            published = _networkManager->publish(_mqttBinaryLogTopic, _frame, n);
+        } else {
+            char* frame = (char*)_frame;
+            if (_apiKey.isEmpty()) {
+                n = snprintf(frame, sizeof(_frame), "{\"seq\":%lu,\"logs\":[", (unsigned long)_batchSeq);
+            } else {
+                n = snprintf(frame, sizeof(_frame), "{\"api_key\":\"%s\",\"seq\":%lu,\"logs\":[",
+                             _apiKey.c_str(), (unsigned long)_batchSeq);
+            }
+            memcpy(frame + n, _batch, _batchLen);
+            n += _batchLen;
+            frame[n++] = ']';
+            frame[n++] = '}';
+            frame[n] = '\0';
+            published = _networkManager->publish(_mqttLogTopic, frame);
+        }
+        if (published) {
+            _frames++;
+            _frameBytes += n;
+        }
+    }
+
+    _batchSeq++;
+    _batchLen = 0;
+    _batchCount = 0;
+    return published;
 }
 
 // Function to convert LogLevel enum to string for display
-String Logger::levelToString(LogLevel level) {
+const char* Logger::levelToString(LogLevel level) {
     switch (level) {
         case LOG_LEVEL_CRITICAL: return "CRITICAL";
         case LOG_LEVEL_ERROR:    return "ERROR";
@@ -174,18 +867,39 @@ String Logger::levelToString(LogLevel level) {
 void Logger::setSerialLogLevel(LogLevel level) {
     LogLevel oldLevel = _serialLogLevel;
     _serialLogLevel = level;
-    if (Serial && oldLevel != _serialLogLevel) { // Only log if Serial is ready and level changed
-      // Log this message using Serial.println itself to ensure it always appears on change
-      Serial.println(String(millis()) + " [INFO] [Logger]: Serial log level changed from " + levelToString(oldLevel) + " to " + levelToString(_serialLogLevel));
+    if (oldLevel != level) {
+        // Always shown: the change is reported at CRITICAL so no level filters it out
+        log(LOG_LEVEL_CRITICAL, "Logger", String("Serial log level changed from ") + levelToString(oldLevel) + " to " + levelToString(level));
     }
 }
 
 void Logger::setMqttLogLevel(LogLevel level) {
     LogLevel oldLevel = _mqttLogLevel;
     _mqttLogLevel = level;
-    if (Serial && oldLevel != _mqttLogLevel) { // Only log if Serial is ready and level changed
-      Serial.println(String(millis()) + " [INFO] [Logger]: MQTT log level changed from " + levelToString(oldLevel) + " to " + levelToString(_mqttLogLevel));
+    if (oldLevel != level) {
+        log(LOG_LEVEL_CRITICAL, "Logger", String("MQTT log level changed from ") + levelToString(oldLevel) + " to " + levelToString(level));
+    }
+}
+
+bool Logger::setTagLevel(const String& tag, LogTarget target, LogLevel level) {
+    const char* targetName = target == LOG_TARGET_SERIAL ? "Serial" : "MQTT";
+    if (!_tagLevels.set(LogToken::hash(tag.c_str()), target, (uint8_t)level)) {
+        log(LOG_LEVEL_WARNING, "Logger", String("No room for another per-tag level, ") + tag + " not changed");
+        return false;
     }
+    log(LOG_LEVEL_CRITICAL, "Logger", String(targetName) + " log level for tag " + tag + " set to " + levelToString(level));
+    return true;
+}
+
+void Logger::clearTagLevel(const String& tag, LogTarget target) {
+    _tagLevels.set(LogToken::hash(tag.c_str()), target, LOG_TAG_LEVEL_UNSET);
+    log(LOG_LEVEL_CRITICAL, "Logger", String(target == LOG_TARGET_SERIAL ? "Serial" : "MQTT") +
+                                      " log level for tag " + tag + " follows the global level again");
+}
+
+void Logger::clearTagLevels() {
+    _tagLevels.clear();
+    log(LOG_LEVEL_CRITICAL, "Logger", "All per-tag log levels cleared");
 }
 
 LogLevel Logger::getSerialLogLevel() const {
@@ -196,77 +910,90 @@ LogLevel Logger::getMqttLogLevel() const {
     return _mqttLogLevel;
 }
 
-// --- NEW: Performance Logging Function Implementation ---
-void Logger::perf(const String& tag, const String& eventName, unsigned long durationMs, bool success, const String& details) {
-    // Performance logs are typically INFO or DEBUG level. Let's use INFO.
-    // You can make the level a parameter if more flexibility is needed.
-    LogLevel level = LOG_LEVEL_INFO;
+void Logger::setMqttFormat(LogMqttFormat format) {
+    if (_mqttFormat != format) {
+        _mqttFormat = format;
+        log(LOG_LEVEL_CRITICAL, "Logger", String("MQTT log format changed to ") + (format == LOG_MQTT_BINARY ? "binary" : "json"));
+    }
+}
 
-    bool shouldLogSerial = (level <= _serialLogLevel && _serialLogLevel != LOG_LEVEL_NONE);
-    bool shouldLogMqtt = (level <= _mqttLogLevel && _mqttLogLevel != LOG_LEVEL_NONE);
+LogMqttFormat Logger::getMqttFormat() const {
+    return _mqttFormat;
+}
 
-    if (!shouldLogSerial && !shouldLogMqtt) {
-        return; // No target wants to log at this level
+void Logger::setPerfThreshold(uint32_t thresholdMs) {
+    if (_perfThresholdMs != thresholdMs) {
+        _perfThresholdMs = thresholdMs;
+        log(LOG_LEVEL_CRITICAL, "Logger", "Perf threshold changed to " + String(thresholdMs) + " ms");
     }
+}
 
-    // Create the main message part
-    String perfMessage = "PERF: Event='" + eventName + "', Duration=" + String(durationMs) + "ms, Success=" + (success ? "true" : "false");
-    if (!details.isEmpty()) {
-        perfMessage += ", Details='" + details + "'";
+void Logger::setPerfWindow(uint32_t windowMs) {
+    windowMs = windowMs < 1000 ? 1000 : windowMs;
+    if (_perfWindowMs != windowMs) {
+        _perfWindowMs = windowMs;
+        log(LOG_LEVEL_CRITICAL, "Logger", "Perf summary window changed to " + String(windowMs) + " ms");
     }
+}
 
-    // For Serial, just print the composed message
-    if (shouldLogSerial && Serial) {
-        LogEntry entry;
-        if (time(nullptr) > 1000000000L) {
-            entry.timestamp = time(nullptr);
-        } else {
-            entry.timestamp = millis();
-        }
-        entry.level = level;
-        entry.tag = tag; // Use the provided tag
-        entry.message = perfMessage;
-
-        // Directly format for serial to include core_id and free_heap contextually for this specific log
-        String logString = String(entry.timestamp) + " [" + levelToString(entry.level) + "]";
-        logString += " [" + entry.tag + "]";
-        logString += " [Core:" + String(xPortGetCoreID()) + ", Heap:" + String(ESP.getFreeHeap()) + "]"; // Add context here too
-        logString += ": " + entry.message;
-        Serial.println(logString);
-    }
-
-    // For MQTT, create a structured JSON payload
-    if (shouldLogMqtt && _networkManager && _networkManager->isConnected()) {
-        StaticJsonDocument<512> doc; // Adjust size as needed
-        
-        // Add API key for authentication - MODIFIED
-        if (!_apiKey.isEmpty()) { 
-            doc["api_key"] = _apiKey; // ArduinoJson handles String type
-        }
-        
-        if (time(nullptr) > 1000000000L) {
-            doc["timestamp"] = time(nullptr);
-        } else {
-            doc["timestamp"] = millis();
-        }
-        doc["level_num"] = static_cast<int>(level);
-        doc["level_str"] = levelToString(level); // Or a dedicated "PERF" level string
-        doc["tag"] = tag;
-        // Differentiate performance logs, e.g., by adding a "type" field or specific structure
-        doc["type"] = "performance";
-        doc["event_name"] = eventName;
-        doc["duration_ms"] = durationMs;
-        doc["success"] = success;
-        if (!details.isEmpty()) {
-            doc["details"] = details;
-        }
-        doc["core_id"] = xPortGetCoreID();
-        doc["free_heap"] = ESP.getFreeHeap();
+void Logger::flush(uint32_t timeoutMs) {
+    unsigned long start = millis();
+    _flushRequested = true;
+    if (_drainTask != nullptr) {
+        xTaskNotifyGive(_drainTask);
+    }
+    while ((_tail.load() != _head.load() || _flushRequested) && millis() - start < timeoutMs) {
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+}
+
+LoggerStats Logger::getStats() const {
+    LoggerStats stats;
+    stats.queued = _queued.load();
+    stats.dropped = _dropped.load();
+    stats.truncated = _truncated.load();
+    stats.depth = _head.load() - _tail.load();
+    stats.maxDepth = _maxDepth.load();
+    stats.frames = _frames.load();
+    stats.frameBytes = _frameBytes.load();
+    stats.stored = _stored.load();
+    stats.replayed = _replayed.load();
+    stats.replaySkipped = _replaySkipped.load();
+    stats.storeLost = _storeLost.load();
+    stats.suppressed = _suppressed.load();
+    stats.webClients = _web.clients();
+    stats.webDropped = _web.droppedClients();
+    return stats;
+}
+
+// --- NEW: Performance Logging Function Implementation ---
+void Logger::perf(const String& tag, const String& eventName, unsigned long durationMs, bool success, const String& details) {
+    writePerf(tag.c_str(), LogToken::hash(eventName.c_str()), eventName.c_str(), durationMs, success, details.c_str());
+}
+// --- END NEW ---
 
-        String mqttPayload;
-        serializeJson(doc, mqttPayload);
-        _networkManager->publish(_mqttLogTopic, mqttPayload.c_str()); // Assuming _mqttLogTopic is your general log topic
-                                                                    // Consider a dedicated topic for performance logs if volume is high.
+void Logger::writePerf(const char* tag, uint16_t token, const char* eventName, unsigned long durationMs, bool success, const char* details) {
+    // Performance logs are typically INFO or DEBUG level. Let's use INFO.
+    LogLevel level = LOG_LEVEL_INFO;
+    if (!perfEnabled()) {
+        return; // Neither Serial nor the MQTT summary wants it
+    }
+
+    uint32_t position;
+    LogRecord* record = _claim(level, tag, LogToken::hash(tag), LOG_FLAG_PERF | (success ? LOG_FLAG_SUCCESS : 0), position);
+    if (record == nullptr) {
+        return;
+    }
+    record->value = durationMs;
+    record->token = token;
+    // Event name and details share the message buffer, separated by '\0'
+    size_t nameLen = strlcpy(record->message, eventName, LOG_MESSAGE_MAX - 1);
+    if (nameLen >= LOG_MESSAGE_MAX - 1) {
+        nameLen = LOG_MESSAGE_MAX - 2;
+        record->flags |= LOG_FLAG_TRUNCATED;
+    }
+    if (strlcpy(record->message + nameLen + 1, details, LOG_MESSAGE_MAX - nameLen - 1) >= LOG_MESSAGE_MAX - nameLen - 1) {
+        record->flags |= LOG_FLAG_TRUNCATED;
     }
+    _commit(position);
 }
-// --- END NEW --- 
\ No newline at end of file
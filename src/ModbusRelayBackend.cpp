@@ -0,0 +1,255 @@
+#include "../include/ModbusRelayBackend.h"
+#include "../include/Logger.h"
+#include <esp_timer.h>
+
+ModbusRelayBackend::ModbusRelayBackend(const ModbusRelaySlave* slaves, uint8_t slaveCount) {
+    if (slaveCount > MODBUS_RELAY_MAX_SLAVES) {
+        slaveCount = MODBUS_RELAY_MAX_SLAVES;
+    }
+    _slaveCount = slaveCount;
+    for (uint8_t i = 0; i < slaveCount; i++) {
+        SlaveState& s = _slaves[i];
+        s.config = slaves[i];
+        if (s.config.coilCount > 32) {
+            s.config.coilCount = 32;
+        }
+        s.written = 0;
+        s.resync = true;          // Lượt đầu ghi toàn bộ để đồng bộ module với trạng thái tắt
+        s.online = true;
+        s.failures = 0;
+        s.lastPollMs = 0;
+    }
+    _relayCount = 0;           // Xếp trong begin(), khi đã biết số vùng còn lại
+    _desired = 0;
+    _port = nullptr;
+    _gapUs = 0;
+    _lastFrameUs = 0;
+    _task = nullptr;
+    _writes = 0;
+    _polls = 0;
+    _timeouts = 0;
+    _crcErrors = 0;
+    _exceptions = 0;
+    _mismatches = 0;
+    _onlineMask = 0;
+}
+
+// Relay mở rộng nằm sau relay GPIO trong RelayMask: tổng số không được vượt maxRelays,
+// nếu không các bit dịch sẽ vượt độ rộng mặt nạ
+void ModbusRelayBackend::_layout(int maxRelays) {
+    _relayCount = 0;
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < _slaveCount; i++) {
+        SlaveState s = _slaves[i];
+        int room = maxRelays - _relayCount;
+        if (room <= 0 || s.config.coilCount == 0) {
+            AppLogger.error("ModbusRly", "Slave " + String(s.config.address) + " skipped: no zones left (IRRIGATION_MAX_ZONES)");
+            continue;
+        }
+        if (s.config.coilCount > room) {
+            AppLogger.error("ModbusRly", "Slave " + String(s.config.address) + " limited to " + String(room) +
+                            " of " + String(s.config.coilCount) + " relays (IRRIGATION_MAX_ZONES)");
+            s.config.coilCount = (uint8_t)room;
+        }
+        s.offset = (uint8_t)_relayCount;
+        s.coilMask = s.config.coilCount >= 32 ? 0xFFFFFFFFUL : ((1UL << s.config.coilCount) - 1);
+        _relayCount += s.config.coilCount;
+        _slaves[kept++] = s;
+    }
+    _slaveCount = kept;
+}
+
+bool ModbusRelayBackend::begin(HardwareSerial& port, uint32_t baud, int rxPin, int txPin,
+                               uint32_t stackSize, UBaseType_t priority, BaseType_t core, int maxRelays) {
+    _layout(maxRelays);
+
+    _port = &port;
+    _port->begin(baud, SERIAL_8N1, rxPin, txPin);
+    _port->setTimeout(MODBUS_RELAY_TIMEOUT_MS);
+    _gapUs = ModbusRtu::frameGapUs(baud);
+
+    uint32_t online = 0;
+    for (uint8_t i = 0; i < _slaveCount; i++) {
+        online |= 1UL << i;
+    }
+    _onlineMask = online;
+
+    if (xTaskCreatePinnedToCore(_busTask, "ModbusRelay", stackSize, this, priority, &_task, core) != pdPASS) {
+        AppLogger.critical("ModbusRly", "Failed to create Modbus bus task");
+        return false;
+    }
+
+    AppLogger.info("ModbusRly", "Initialized " + String(_slaveCount) + " modules, " +
+                   String(_relayCount) + " relays at " + String(baud) + " baud");
+    return true;
+}
+
+int ModbusRelayBackend::getRelayCount() const {
+    return _relayCount;
+}
+
+void ModbusRelayBackend::writeRelays(RelayMask onMask, RelayMask offMask) {
+    if (onMask) {
+        _desired.fetch_or(onMask);
+    }
+    if (offMask) {
+        _desired.fetch_and(~offMask);
+    }
+    if (_task) {
+        xTaskNotifyGive(_task);
+    }
+}
+
+ModbusBusStats ModbusRelayBackend::getStats() const {
+    ModbusBusStats stats;
+    stats.writes = _writes.load();
+    stats.polls = _polls.load();
+    stats.timeouts = _timeouts.load();
+    stats.crcErrors = _crcErrors.load();
+    stats.exceptions = _exceptions.load();
+    stats.mismatches = _mismatches.load();
+    stats.onlineMask = _onlineMask.load();
+    return stats;
+}
+
+void ModbusRelayBackend::_busTask(void* parameter) {
+    ModbusRelayBackend* self = static_cast<ModbusRelayBackend*>(parameter);
+    AppLogger.info("ModbusRly", "Bus task started on core " + String(xPortGetCoreID()));
+
+    for (;;) {
+        // Thức dậy khi relay thay đổi hoặc để đọc lại module; các thay đổi đến trong lúc
+        // bus bận được gom vào một lần ghi ở lượt kế tiếp
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MODBUS_RELAY_POLL_MS / 4));
+        self->_writePending();
+        self->_pollDue();
+    }
+}
+
+// Ghi một FC15 cho mỗi module có coil khác với trạng thái đã ghi
+void ModbusRelayBackend::_writePending() {
+    RelayMask desired = _desired.load();
+    for (uint8_t i = 0; i < _slaveCount; i++) {
+        SlaveState& s = _slaves[i];
+        if (s.offset >= sizeof(RelayMask) * 8) {
+            continue;   // Không có bit trong mặt nạ (_layout đã loại, giữ phòng hờ)
+        }
+        uint32_t want = (uint32_t)(desired >> s.offset) & s.coilMask;
+        if (!s.online || (!s.resync && want == s.written)) {
+            continue;
+        }
+
+        size_t len = ModbusRtu::buildWriteCoils(_request, s.config.address, s.config.firstCoil,
+                                                s.config.coilCount, want);
+        if (_transact(s, len)) {
+            s.written = want;
+            s.resync = false;
+            _writes++;
+        }
+    }
+}
+
+// Đọc lại coil của các module đến hạn, nối tiếp nhau; lệnh ghi mới được ưu tiên xen giữa
+void ModbusRelayBackend::_pollDue() {
+    for (uint8_t i = 0; i < _slaveCount; i++) {
+        SlaveState& s = _slaves[i];
+        unsigned long now = millis();
+        if (now - s.lastPollMs < MODBUS_RELAY_POLL_MS) {
+            continue;
+        }
+        s.lastPollMs = now;
+
+        size_t len = ModbusRtu::buildReadCoils(_request, s.config.address, s.config.firstCoil,
+                                               s.config.coilCount);
+        if (_transact(s, len)) {
+            _polls++;
+            uint32_t actual = 0;
+            uint8_t byteCount = _response[2];
+            for (uint8_t b = 0; b < byteCount && b < 4; b++) {
+                actual |= (uint32_t)_response[3 + b] << (8 * b);
+            }
+            actual &= s.coilMask;
+
+            // Module bị reset hoặc bị điều khiển từ nơi khác: ghi lại trạng thái mong muốn
+            if (!s.resync && actual != s.written) {
+                _mismatches++;
+                s.resync = true;
+                AppLogger.warning("ModbusRly", "Slave " + String(s.config.address) + " coil mismatch: 0x" +
+                                  String(actual, HEX) + " != 0x" + String(s.written, HEX));
+            }
+        }
+
+        if (ulTaskNotifyTake(pdTRUE, 0) > 0 || s.resync) {
+            _writePending();
+        }
+    }
+}
+
+bool ModbusRelayBackend::_transact(SlaveState& slave, size_t requestLen) {
+    size_t expected = ModbusRtu::expectedResponseLength(_request);
+
+    // Bỏ byte thừa của giao dịch trước (phản hồi muộn, nhiễu)
+    while (_port->available()) {
+        _port->read();
+    }
+
+    // Giữ khoảng lặng 3,5 ký tự sau khung trước
+    int64_t wait = _lastFrameUs + _gapUs - esp_timer_get_time();
+    if (wait > 0) {
+        delayMicroseconds((uint32_t)wait);
+    }
+
+    _port->write(_request, requestLen);
+    _port->flush();   // Chờ phát xong; mạch RS485 trên board tự đảo chiều
+
+    bool responded = false;
+    bool ok = false;
+    size_t got = _port->readBytes(_response, 2);
+    if (got == 2) {
+        size_t total = (_response[1] & 0x80) ? 5 : expected;
+        got += _port->readBytes(_response + 2, total - 2);
+        if (got < total) {
+            _timeouts++;
+        } else if (!ModbusRtu::checkCrc(_response, total) || _response[0] != _request[0] ||
+                   (_response[1] & 0x7F) != _request[1]) {
+            _crcErrors++;
+        } else if (_response[1] & 0x80) {
+            _exceptions++;
+            responded = true;
+            AppLogger.warning("ModbusRly", "Slave " + String(slave.config.address) + " exception " +
+                              String(_response[2]) + " for function " + String(_request[1]));
+        } else {
+            responded = true;
+            ok = true;
+        }
+    } else {
+        _timeouts++;
+    }
+    _lastFrameUs = esp_timer_get_time();
+
+    _markResult(slave, responded);
+    return ok;
+}
+
+void ModbusRelayBackend::_markResult(SlaveState& slave, bool ok) {
+    uint32_t bit = 1UL << (&slave - _slaves);
+    if (ok) {
+        slave.failures = 0;
+        if (!slave.online) {
+            slave.online = true;
+            slave.resync = true;
+            _onlineMask.fetch_or(bit);
+            AppLogger.info("ModbusRly", "Slave " + String(slave.config.address) + " back online");
+        }
+        return;
+    }
+
+    if (slave.failures < 255) {
+        slave.failures++;
+    }
+    if (slave.online && slave.failures >= MODBUS_RELAY_OFFLINE_AFTER) {
+        slave.online = false;
+        _onlineMask.fetch_and(~bit);
+        AppLogger.error("ModbusRly", "Slave " + String(slave.config.address) + " offline after " +
+                        String(slave.failures) + " failed requests");
+    }
+}
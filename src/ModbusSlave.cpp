@@ -0,0 +1,326 @@
+#include "../include/ModbusSlave.h"
+#include "../include/Logger.h"
+#include <math.h>
+
+#define MODBUS_SLAVE_MAP_VERSION 1
+
+// Giá trị báo cảm biến chưa có dữ liệu (NaN) trong thanh ghi có dấu
+#define MODBUS_VALUE_INVALID 0x8000
+
+// Trường dữ liệu của các thanh ghi chung
+enum ModbusField : uint8_t {
+    FIELD_NONE = 0,
+    FIELD_MAP_VERSION,
+    FIELD_ZONE_COUNT,
+    FIELD_RELAY_BITS_0,
+    FIELD_RELAY_BITS_1,
+    FIELD_RELAY_BITS_2,
+    FIELD_RELAY_BITS_3,
+    FIELD_STATUS_VERSION,
+    FIELD_UPTIME_MIN,
+    FIELD_TEMPERATURE,
+    FIELD_HUMIDITY,
+    FIELD_HEAT_INDEX,
+    FIELD_RAIN,
+    FIELD_LIGHT,
+    FIELD_ET0
+};
+
+// Địa chỉ -> trường (chỉ số = địa chỉ thanh ghi, xem MODBUS_REG_* trong ModbusSlave.h);
+// địa chỉ FIELD_NONE trả ngoại lệ ILLEGAL_ADDRESS
+static const uint8_t FIXED_FIELDS[MODBUS_REG_FIXED_COUNT] = {
+    FIELD_MAP_VERSION, FIELD_ZONE_COUNT,                                              // 0-1
+    FIELD_RELAY_BITS_0, FIELD_RELAY_BITS_1, FIELD_RELAY_BITS_2, FIELD_RELAY_BITS_3,   // 2-5
+    FIELD_STATUS_VERSION, FIELD_UPTIME_MIN,                                           // 6-7
+    FIELD_NONE, FIELD_NONE, FIELD_NONE, FIELD_NONE,                                   // 8-11
+    FIELD_NONE, FIELD_NONE, FIELD_NONE, FIELD_NONE,                                   // 12-15
+    FIELD_TEMPERATURE, FIELD_HUMIDITY, FIELD_HEAT_INDEX, FIELD_RAIN,                  // 16-19
+    FIELD_LIGHT, FIELD_ET0,                                                           // 20-21
+};
+static_assert(MODBUS_REG_ET0 == 21 && MODBUS_REG_STATUS_VER == 6, "FIXED_FIELDS out of sync with ModbusSlave.h");
+
+static uint16_t scaled(float value, float scale) {
+    if (isnan(value)) {
+        return MODBUS_VALUE_INVALID;
+    }
+    return (uint16_t)(int16_t)lroundf(value * scale);
+}
+
+ModbusSlave::ModbusSlave(RelayManager& relayManager, ActuationArbiter& arbiter, EnvironmentManager& envManager)
+    : _relayManager(relayManager), _arbiter(arbiter), _envManager(envManager) {
+    _port = nullptr;
+    _address = 1;
+    _gapUs = 0;
+    _task = nullptr;
+    _zoneCount = 0;
+    _imageVersion = 0;
+    _lastRefresh = 0;
+    memset(_image, 0, sizeof(_image));
+    memset(_durationSec, 0, sizeof(_durationSec));
+    _requests = 0;
+    _exceptions = 0;
+    _crcErrors = 0;
+    _writes = 0;
+}
+
+bool ModbusSlave::begin(HardwareSerial& port, uint32_t baud, int rxPin, int txPin, uint8_t address,
+                        uint32_t stackSize, UBaseType_t priority, BaseType_t core) {
+    _port = &port;
+    _address = address;
+    _port->begin(baud, SERIAL_8N1, rxPin, txPin);
+    _port->setTimeout(MODBUS_SLAVE_BYTE_TIMEOUT_MS);
+    _gapUs = ModbusRtu::frameGapUs(baud);
+    _zoneCount = _relayManager.getRelayCount();
+    _refresh(true);
+
+    if (xTaskCreatePinnedToCore(_slaveTask, "ModbusSlave", stackSize, this, priority, &_task, core) != pdPASS) {
+        AppLogger.critical("ModbusSlv", "Failed to create Modbus slave task");
+        return false;
+    }
+
+    AppLogger.info("ModbusSlv", "Listening as slave " + String(address) + " at " + String(baud) + " baud, " +
+                   String(_zoneCount) + " zones");
+    return true;
+}
+
+ModbusSlaveStats ModbusSlave::getStats() const {
+    ModbusSlaveStats stats;
+    stats.requests = _requests.load();
+    stats.exceptions = _exceptions.load();
+    stats.crcErrors = _crcErrors.load();
+    stats.writes = _writes.load();
+    return stats;
+}
+
+void ModbusSlave::_slaveTask(void* parameter) {
+    ModbusSlave* self = static_cast<ModbusSlave*>(parameter);
+
+    for (;;) {
+        size_t len = self->_readFrame();
+        if (len == 0) {
+            continue;
+        }
+
+        size_t responseLen = self->_handle(len);
+        if (responseLen > 0) {
+            // Master chỉ nhận phản hồi sau khoảng lặng kết thúc khung yêu cầu
+            delayMicroseconds(self->_gapUs);
+            self->_port->write(self->_response, responseLen);
+            self->_port->flush();
+        }
+    }
+}
+
+// Dựng lại ảnh thanh ghi từ snapshot relay (không khóa) và giá trị môi trường
+void ModbusSlave::_refresh(bool force) {
+    uint32_t version = _relayManager.getStatusVersion();
+    unsigned long now = millis();
+    if (!force && version == _imageVersion && now - _lastRefresh < MODBUS_SLAVE_REFRESH_MS) {
+        return;
+    }
+
+    static RelayStatus status[IRRIGATION_MAX_ZONES];  // Chỉ task slave dùng, giữ ngoài stack
+    int count = _relayManager.getSnapshot(status, _zoneCount, &version);
+    int64_t nowUs = DeadlineTimer::nowUs();
+
+    uint16_t relayBits[4] = {0, 0, 0, 0};
+    for (int i = 0; i < count; i++) {
+        uint16_t* zone = &_image[MODBUS_REG_FIXED_COUNT + i * MODBUS_REG_ZONE_STRIDE];
+        uint32_t remaining = 0;
+        if (status[i].state && status[i].endTime > nowUs) {
+            remaining = (uint32_t)((status[i].endTime - nowUs + 999999) / 1000000);
+        }
+        if (status[i].state) {
+            relayBits[i / 16] |= 1u << (i % 16);
+        }
+        zone[MODBUS_ZONE_REG_STATE] = status[i].state ? 1 : 0;
+        zone[MODBUS_ZONE_REG_DURATION] = _durationSec[i];
+        zone[MODBUS_ZONE_REG_REMAINING] = remaining > 0xFFFF ? 0xFFFF : (uint16_t)remaining;
+        zone[MODBUS_ZONE_REG_SOIL] = scaled(_envManager.getSoilMoisture(i + 1), 10.0f);
+    }
+
+    for (int address = 0; address < MODBUS_REG_FIXED_COUNT; address++) {
+        uint16_t value = 0;
+        switch (FIXED_FIELDS[address]) {
+            case FIELD_MAP_VERSION:    value = MODBUS_SLAVE_MAP_VERSION; break;
+            case FIELD_ZONE_COUNT:     value = (uint16_t)_zoneCount; break;
+            case FIELD_RELAY_BITS_0:   value = relayBits[0]; break;
+            case FIELD_RELAY_BITS_1:   value = relayBits[1]; break;
+            case FIELD_RELAY_BITS_2:   value = relayBits[2]; break;
+            case FIELD_RELAY_BITS_3:   value = relayBits[3]; break;
+            case FIELD_STATUS_VERSION: value = (uint16_t)version; break;
+            case FIELD_UPTIME_MIN:     value = (uint16_t)(now / 60000UL); break;
+            case FIELD_TEMPERATURE:    value = scaled(_envManager.getTemperature(), 10.0f); break;
+            case FIELD_HUMIDITY:       value = scaled(_envManager.getHumidity(), 10.0f); break;
+            case FIELD_HEAT_INDEX:     value = scaled(_envManager.getHeatIndex(), 10.0f); break;
+            case FIELD_RAIN:           value = _envManager.isRaining() ? 1 : 0; break;
+            case FIELD_LIGHT: {
+                int light = _envManager.getLightLevel();
+                value = light < 0 ? 0 : (light > 0xFFFF ? 0xFFFF : (uint16_t)light);
+                break;
+            }
+            case FIELD_ET0:            value = scaled(_envManager.getEt0(), 100.0f); break;
+            default: break;
+        }
+        _image[address] = value;
+    }
+
+    _imageVersion = version;
+    _lastRefresh = now;
+}
+
+// Độ dài khung được suy ra từ mã hàm nên không cần đo khoảng lặng giữa các byte
+size_t ModbusSlave::_readFrame() {
+    if (_port->readBytes(_request, 1) != 1) {
+        return 0;  // Bus rảnh
+    }
+
+    size_t len = 8;
+    bool ok = _port->readBytes(_request + 1, 7) == 7;
+    if (ok && (_request[1] == MODBUS_FC_WRITE_MULTIPLE_REGISTERS || _request[1] == MODBUS_FC_WRITE_MULTIPLE_COILS)) {
+        len = 9 + _request[6];
+        ok = len <= MODBUS_RTU_MAX_FRAME && _port->readBytes(_request + 8, len - 8) == len - 8;
+    }
+
+    if (!ok || !ModbusRtu::checkCrc(_request, len)) {
+        _crcErrors++;
+        // Bỏ phần còn lại cho đến khi bus im lặng để bắt đầu lại từ khung kế tiếp
+        while (_port->readBytes(_response, sizeof(_response)) > 0) {
+        }
+        return 0;
+    }
+    return len;
+}
+
+int ModbusSlave::_imageIndex(uint16_t address) const {
+    if (address < MODBUS_REG_FIXED_COUNT) {
+        return FIXED_FIELDS[address] != FIELD_NONE ? address : -1;
+    }
+    if (address >= MODBUS_REG_ZONE_BASE && address < MODBUS_REG_ZONE_BASE + _zoneCount * MODBUS_REG_ZONE_STRIDE) {
+        return MODBUS_REG_FIXED_COUNT + (address - MODBUS_REG_ZONE_BASE);
+    }
+    return -1;
+}
+
+size_t ModbusSlave::_handle(size_t len) {
+    uint8_t slave = _request[0];
+    bool broadcast = slave == 0;
+    if (slave != _address && !broadcast) {
+        return 0;
+    }
+    _requests++;
+
+    uint8_t function = _request[1];
+    uint16_t start = ModbusRtu::readU16(&_request[2]);
+    uint8_t exception = 0;
+    size_t responseLen = 0;
+
+    switch (function) {
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS: {
+            uint16_t count = ModbusRtu::readU16(&_request[4]);
+            if (broadcast) {
+                return 0;
+            }
+            if (count < 1 || count > 125) {
+                exception = MODBUS_EX_ILLEGAL_VALUE;
+                break;
+            }
+            _refresh(false);
+            for (uint16_t k = 0; k < count; k++) {
+                int index = _imageIndex(start + k);
+                if (index < 0) {
+                    exception = MODBUS_EX_ILLEGAL_ADDRESS;
+                    break;
+                }
+                ModbusRtu::writeU16(&_response[3 + 2 * k], _image[index]);
+            }
+            if (!exception) {
+                _response[0] = _address;
+                _response[1] = function;
+                _response[2] = (uint8_t)(2 * count);
+                responseLen = ModbusRtu::appendCrc(_response, 3 + 2 * count);
+            }
+            break;
+        }
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            exception = _write(start, &_request[4], 1);
+            if (!exception) {
+                memcpy(_response, _request, 6);  // Phản hồi lặp lại yêu cầu
+                responseLen = ModbusRtu::appendCrc(_response, 6);
+            }
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
+            uint16_t count = ModbusRtu::readU16(&_request[4]);
+            if (count < 1 || count > 123 || _request[6] != 2 * count) {
+                exception = MODBUS_EX_ILLEGAL_VALUE;
+                break;
+            }
+            exception = _write(start, &_request[7], count);
+            if (!exception) {
+                memcpy(_response, _request, 6);
+                responseLen = ModbusRtu::appendCrc(_response, 6);
+            }
+            break;
+        }
+        default:
+            exception = MODBUS_EX_ILLEGAL_FUNCTION;
+            break;
+    }
+
+    if (exception) {
+        _exceptions++;
+        responseLen = ModbusRtu::buildException(_response, _address, function, exception);
+    }
+    return broadcast ? 0 : responseLen;
+}
+
+// Ghi thanh ghi vùng. Kiểm tra toàn bộ trước để lệnh không bị áp dụng một nửa; các vùng
+// trong cùng một yêu cầu được gửi xuống bộ phân xử trong một lần.
+uint8_t ModbusSlave::_write(uint16_t address, const uint8_t* values, uint16_t count) {
+    for (uint16_t k = 0; k < count; k++) {
+        uint16_t reg = address + k;
+        if (reg < MODBUS_REG_ZONE_BASE) {
+            return MODBUS_EX_ILLEGAL_ADDRESS;
+        }
+        int zone = (reg - MODBUS_REG_ZONE_BASE) / MODBUS_REG_ZONE_STRIDE;
+        int field = (reg - MODBUS_REG_ZONE_BASE) % MODBUS_REG_ZONE_STRIDE;
+        if (zone >= _zoneCount || (field != MODBUS_ZONE_REG_STATE && field != MODBUS_ZONE_REG_DURATION)) {
+            return MODBUS_EX_ILLEGAL_ADDRESS;
+        }
+        if (field == MODBUS_ZONE_REG_STATE && ModbusRtu::readU16(&values[2 * k]) > 1) {
+            return MODBUS_EX_ILLEGAL_VALUE;
+        }
+    }
+
+    // Thời lượng được ghi trước, để một yêu cầu FC16 {trạng thái, thời lượng} dùng ngay giá trị mới
+    RelayMask zones = 0;
+    RelayMask states = 0;
+    for (uint16_t k = 0; k < count; k++) {
+        uint16_t reg = address + k;
+        int zone = (reg - MODBUS_REG_ZONE_BASE) / MODBUS_REG_ZONE_STRIDE;
+        int field = (reg - MODBUS_REG_ZONE_BASE) % MODBUS_REG_ZONE_STRIDE;
+        uint16_t value = ModbusRtu::readU16(&values[2 * k]);
+        if (field == MODBUS_ZONE_REG_DURATION) {
+            _durationSec[zone] = value;
+        } else {
+            zones |= (RelayMask)1 << zone;
+            if (value) {
+                states |= (RelayMask)1 << zone;
+            }
+        }
+    }
+
+    if (zones) {
+        unsigned long durationsMs[IRRIGATION_MAX_ZONES];
+        for (int i = 0; i < _zoneCount; i++) {
+            durationsMs[i] = (unsigned long)_durationSec[i] * 1000UL;
+        }
+        _arbiter.command(SOURCE_MANUAL, zones, states, durationsMs);
+        _writes++;
+        AppLogger.info("ModbusSlv", "Zone command: mask 0x" + String(zones, HEX) + ", on 0x" + String(states, HEX));
+    }
+
+    _refresh(true);
+    return 0;
+}
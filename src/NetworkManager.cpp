@@ -1,5 +1,8 @@
 #include "../include/NetworkManager.h"
 #include "../include/Logger.h"
+#include "../include/DecisionTrace.h"
+#include "../include/CommandQueue.h"
+#include "../include/FlightRecorder.h"
 // SPIFFS đã được include trong .h, nhưng để rõ ràng có thể thêm ở đây nếu muốn.
 // #include <SPIFFS.h> 
 #include <Preferences.h> // THÊM VÀO: Thư viện Preferences cho NVS
@@ -34,6 +37,9 @@ NetworkManager::NetworkManager() :
     _currentNtpServerIndex = 0;
     _wifiConnectionState = WIFI_STATE_DISCONNECTED; 
     _wifiConnectStartTime = 0; 
+    _flightNetState = 0xFF; // Chưa ghi: lần loop đầu tiên luôn ghi trạng thái
+    _task = nullptr;
+    _mqttMutex = nullptr;
 
     // NTP variables
     _lastNtpSyncAttempt = 0;
@@ -71,10 +77,12 @@ NetworkManager::NetworkManager() :
     snprintf(_clientId, sizeof(_clientId), "ESP32Client-%06X-%u", random_id, timestamp % 1000000);
 }
 
-bool NetworkManager::begin(const char* initial_ssid, const char* initial_password) {
+void NetworkManager::begin(const char* initial_ssid, const char* initial_password) {
     AppLogger.info("NetMgr", "NetworkManager::begin() called.");
     AppLogger.info("NetMgr", "Generated MQTT Client ID: " + String(_clientId));
 
+    _mqttMutex = xSemaphoreCreateMutex();
+
     if (!_preferences.begin("net-config", false)) {
         AppLogger.warning("NetMgr", "NVM: Failed to initialize Preferences.");
     } else {
@@ -113,6 +121,8 @@ bool NetworkManager::begin(const char* initial_ssid, const char* initial_passwor
     _server.on("/save", HTTP_POST, [this](AsyncWebServerRequest *request){ this->_handleSave(request); });
     _server.on("/getconfig", HTTP_GET, [this](AsyncWebServerRequest *request){ this->_handleGetConfig(request); });
     _server.on("/getsysteminfo", HTTP_GET, [this](AsyncWebServerRequest *request){ this->_handleGetSystemInfo(request); });
+    _server.on("/trace", HTTP_GET, [this](AsyncWebServerRequest *request){ this->_handleGetTrace(request); });
+    _server.addHandler(AppLogger.webSocket()); // Live log tail at ws://<device>/ws/logs
     _server.on("/favicon.ico", HTTP_GET, [](AsyncWebServerRequest *request){ request->send(204); });
     _server.onNotFound([this](AsyncWebServerRequest *request){ this->_handleNotFound(request); });
 
@@ -122,63 +132,59 @@ bool NetworkManager::begin(const char* initial_ssid, const char* initial_passwor
     _server.begin();
     AppLogger.info("NetMgr", "AsyncWebServer started on port " + String(WEB_SERVER_PORT) + ".");
 
+    // NTP and MQTT client settings do not need WiFi. The network task completes the WiFi
+    // connection and then connects MQTT; nothing here waits for either.
+    _timeClient.setTimeOffset(7 * 3600); // GMT+7
+    if (!_ntpServerList.empty()) {
+        _timeClient.setPoolServerName(_ntpServerList[_currentNtpServerIndex].c_str());
+    }
+    _mqttClient.setClient(_wifiClient);
+    _mqttClient.setServer(_mqttServer, _mqttPort);
+    _mqttClient.setKeepAlive(60);
+    _mqttClient.setSocketTimeout(10); 
+    _mqttClient.setBufferSize(MQTT_BUFFER_SIZE); // Default is 256; scales with IRRIGATION_MAX_ZONES
+
     if (strlen(_targetSsid) > 0) {
-        AppLogger.info("NetMgr", "Attempting initial WiFi connection to '" + String(_targetSsid) + "'...");
+        AppLogger.info("NetMgr", "Starting WiFi connection to '" + String(_targetSsid) + "'. The network task completes it and connects MQTT.");
         _isAttemptingWifiReconnect = true; 
         _initiateWifiConnection(_targetSsid, _targetPassword); 
-
-        unsigned long connectionAttemptStartTime = millis();
-        AppLogger.info("NetMgr", "Waiting for initial WiFi connection (max " + String(WIFI_CONNECT_TIMEOUT_MS / 1000) + "s). This involves internal loop calls.");
-        
-        while (_wifiConnectionState == WIFI_STATE_CONNECTING && (millis() - connectionAttemptStartTime < WIFI_CONNECT_TIMEOUT_MS)) {
-            this->loop(); // Process WiFi state, does not process MQTT/NTP yet in this specific context
-            delay(50);  
-        }
-
-        if (_wifiConnectionState == WIFI_STATE_CONNECTED) {
-            AppLogger.info("NetMgr", "Initial WiFi connection successful.");
-            
-            // Configure NTP Client (will attempt sync in loop())
-            _timeClient.setTimeOffset(7 * 3600); // GMT+7
-            if (!_ntpServerList.empty()) {
-                _timeClient.setPoolServerName(_ntpServerList[_currentNtpServerIndex].c_str());
-                _timeClient.begin(); // Initialize UDP for NTP, first time
-            }
-            _lastNtpSyncAttempt = 0; // Trigger immediate sync attempt in loop()
-            AppLogger.info("NetMgr", "NTP client configured. Sync will be attempted in main loop.");
-
-            // Configure MQTT Client
-            _mqttClient.setClient(_wifiClient);
-            _mqttClient.setServer(_mqttServer, _mqttPort);
-            _mqttClient.setKeepAlive(60);
-            _mqttClient.setSocketTimeout(10); 
-            _mqttClient.setBufferSize(1024); // Default is 256, ensure this matches PubSubClient.h MQTT_MAX_PACKET_SIZE if changed
-
-            AppLogger.info("NetMgr", "Attempting initial MQTT connection...");
-            if (_connectMqtt()) { 
-                AppLogger.info("NetMgr", "Initial MQTT connection successful.");
-            } else {
-                AppLogger.error("NetMgr", "Initial MQTT connection failed. Will retry in main loop.");
-            }
-        } else {
-            AppLogger.warning("NetMgr", "Initial WiFi connection failed within timeout. Final State: " + String(_wifiConnectionState) + ". Retries/Portal will be handled by main loop.");
-            _isAttemptingWifiReconnect = true; 
-            _nextWifiRetryTime = millis(); 
-            _wifiConnectionState = WIFI_STATE_DISCONNECTED; 
-             _wifiRetryCount = 0; // Reset for new series of attempts by loop()
-            _currentWifiRetryIntervalMs = INITIAL_RETRY_INTERVAL_MS;
-        }
     } else {
         AppLogger.info("NetMgr", "No SSID configured. Requesting Config Portal start via loop.");
         _wifiConnectionState = WIFI_STATE_START_PORTAL_PENDING; 
         _isAttemptingWifiReconnect = false; 
     }
-    return _wifiConnected && _mqttConnected; 
+}
+
+bool NetworkManager::startTask(const char* taskName, uint32_t stackSize, UBaseType_t priority, BaseType_t core) {
+    if (xTaskCreatePinnedToCore(_taskCode, taskName, stackSize, this, priority, &_task, core) != pdPASS) {
+        AppLogger.critical("NetMgr", "Failed to create network task");
+        return false;
+    }
+    AppLogger.info("NetMgr", "Network task started on core " + String(core));
+    return true;
+}
+
+void NetworkManager::_taskCode(void* parameter) {
+    NetworkManager* self = static_cast<NetworkManager*>(parameter);
+    for (;;) {
+        self->loop();
+        vTaskDelay(pdMS_TO_TICKS(NET_TASK_INTERVAL_MS));
+    }
+}
+
+bool NetworkManager::_lockMqtt(TickType_t wait) {
+    return _mqttMutex == nullptr || xSemaphoreTake(_mqttMutex, wait) == pdTRUE;
+}
+
+void NetworkManager::_unlockMqtt() {
+    if (_mqttMutex != nullptr) {
+        xSemaphoreGive(_mqttMutex);
+    }
 }
 
 void NetworkManager::_initiateWifiConnection(const char* ssid_to_connect, const char* password_to_connect) {
     if (_wifiConnectionState == WIFI_STATE_CONNECTING && (millis() - _wifiConnectStartTime < WIFI_CONNECT_TIMEOUT_MS)) {
-        AppLogger.debug("NetMgr", "WiFi connection attempt already in progress.");
+        LOGD("NetMgr", "WiFi connection attempt already in progress.");
         return; 
     }
 
@@ -233,7 +239,7 @@ bool NetworkManager::_connectMqtt() {
     AppLogger.info("NetMgr", "MQTT: Attempting connection to " + String(_mqttServer) + ":" + String(_mqttPort) + " as " + String(_clientId));
     _isAttemptingMqttReconnect = true; // Mark that we are trying
 
-    // PubSubClient connect() is blocking
+    // PubSubClient connect() is blocking; it only runs in the network task
     bool connected = _mqttClient.connect(_clientId); 
     
     if (connected) {
@@ -288,7 +294,7 @@ void NetworkManager::_handleWifiDisconnect() {
 
 void NetworkManager::_handleMqttDisconnect() {
     if (!_wifiConnected) { 
-        AppLogger.debug("NetMgr", "MQTT: Disconnected, but WiFi is also down. WiFi handler will manage MQTT state.");
+        LOGD("NetMgr", "MQTT: Disconnected, but WiFi is also down. WiFi handler will manage MQTT state.");
         _isAttemptingMqttReconnect = false; 
         _mqttConnected = false;
         return;
@@ -303,6 +309,7 @@ void NetworkManager::_handleMqttDisconnect() {
 
 void NetworkManager::loop() {
     unsigned long currentTime = millis();
+    AppLogger.webSocket()->cleanupClients(LOG_WS_MAX_CLIENTS); // Free closed live log clients
 
     // --- Config Portal Activation ---
     if (_wifiConnectionState == WIFI_STATE_START_PORTAL_PENDING && !_configPortalActive) {
@@ -379,6 +386,9 @@ void NetworkManager::loop() {
     } // end if (!_configPortalActive)
 
     // --- MQTT Connection Management ---
+    // The lock is held through a blocking connect as well. Publishers see isConnected() == false
+    // meanwhile and return at once; they never wait for the broker.
+    _lockMqtt(portMAX_DELAY);
     if (_wifiConnected && !_configPortalActive) {
         if (!_mqttClient.connected()) {
             if (_isAttemptingMqttReconnect && currentTime >= _nextMqttRetryTime) { 
@@ -414,6 +424,7 @@ void NetworkManager::loop() {
         _mqttClient.disconnect();
         _isAttemptingMqttReconnect = false; 
     }
+    _unlockMqtt();
 
     // --- NTP Time Sync Update ---
     if(_wifiConnected && !_configPortalActive && !_ntpServerList.empty()) {
@@ -454,33 +465,58 @@ void NetworkManager::loop() {
             // _timeClient.update(); 
         }
     }
+
+    _recordNetworkState();
+}
+
+// Ghi vào hộp đen mỗi khi trạng thái WiFi/MQTT/portal đổi
+void NetworkManager::_recordNetworkState() {
+    uint8_t state = (_wifiConnected ? FLIGHT_NET_WIFI : 0) |
+                    (_mqttConnected ? FLIGHT_NET_MQTT : 0) |
+                    (_configPortalActive ? FLIGHT_NET_PORTAL : 0);
+    if (state != _flightNetState) {
+        _flightNetState = state;
+        FlightLog.recordNetwork(state, WiFi.status(), _mqttClient.state());
+    }
 }
 
 bool NetworkManager::publish(const char* topic, const char* payload) {
+    return publish(topic, (const uint8_t*)payload, strlen(payload));
+}
+
+bool NetworkManager::publish(const char* topic, const uint8_t* payload, size_t payloadLen) {
     if (!isConnected()) {
-        AppLogger.warning("NetMgr", "MQTT: Cannot publish, network not fully connected. Topic: " + String(topic));
+        LOGW("NetMgr", "MQTT: Cannot publish, network not fully connected. Topic: %s", topic);
         return false;
     }
 
-    int currentState = _mqttClient.state();
-    AppLogger.debug("NetMgr", "MQTT: Attempting to publish. Topic: '" + String(topic) + "', Payload len: " + String(strlen(payload)) + ", Current MQTT State: " + String(currentState));
+    LOGD("NetMgr", "MQTT: Attempting to publish. Topic: '%s', Payload len: %u, Current MQTT State: %d",
+         topic, (unsigned)payloadLen, _mqttClient.state());
 
-    // Check payload size against the buffer size (1024 in this case)
-    // PubSubClient's default MQTT_MAX_PACKET_SIZE is 256. If setBufferSize(1024) was used, this check is against that.
+    // Check payload size against the buffer size set with setBufferSize(MQTT_BUFFER_SIZE)
+    // PubSubClient's default MQTT_MAX_PACKET_SIZE is 256.
     const int mqttOverheadEstimate = 50; // Estimate for topic name, QoS, etc.
-    if (strlen(payload) > (1024 - mqttOverheadEstimate)) { 
-         AppLogger.warning("NetMgr", "MQTT: Payload for topic '" + String(topic) + "' might be too large for buffer (1024 bytes). Length: " + String(strlen(payload)));
+    if (payloadLen > (MQTT_BUFFER_SIZE - mqttOverheadEstimate)) { 
+         LOGW("NetMgr", "MQTT: Payload for topic '%s' might be too large for buffer (%d bytes). Length: %u",
+              topic, (int)MQTT_BUFFER_SIZE, (unsigned)payloadLen);
     }
     
-    bool success = _mqttClient.publish(topic, payload);
+    // The caller has already consumed its change flag, so a live connection is never skipped:
+    // keep waiting while connected and give up only once the network task reports it lost.
+    while (!_lockMqtt(pdMS_TO_TICKS(NET_PUBLISH_LOCK_MS))) {
+        if (!isConnected()) {
+            LOGW("NetMgr", "MQTT: Connection lost while waiting for the client. Topic: %s", topic);
+            return false;
+        }
+    }
+    bool success = _mqttClient.publish(topic, payload, payloadLen);
 
     if (!success) {
-        int stateAfterFail = _mqttClient.state();
-        AppLogger.error("NetMgr", "MQTT: Publish failed! Topic: '" + String(topic) + "', MQTT State after fail: " + String(stateAfterFail));
+        LOGE("NetMgr", "MQTT: Publish failed! Topic: '%s', MQTT State after fail: %d", topic, _mqttClient.state());
 
         // If publish fails, assume connection is compromised and disconnect to allow robust reconnection.
         if (_mqttConnected) { // Only if we previously thought we were connected
-            AppLogger.warning("NetMgr", "MQTT: Publish failure detected. Forcing MQTT disconnect and scheduling reconnect.");
+            LOGW("NetMgr", "MQTT: Publish failure detected. Forcing MQTT disconnect and scheduling reconnect.");
             _mqttClient.disconnect(); // This sets PubSubClient state to MQTT_DISCONNECTED (-1) and closes socket.
             _mqttConnected = false; // Update our manager's state
             
@@ -491,31 +527,38 @@ bool NetworkManager::publish(const char* topic, const char* payload) {
             _currentMqttRetryIntervalMs = INITIAL_RETRY_INTERVAL_MS;
         }
     }
+    _unlockMqtt();
     // AppLogger.debug("NetMgr", "MQTT: Publishing to: " + String(topic)); 
     return success;
 }
 
 bool NetworkManager::subscribe(const char* topic) {
     if (topic == nullptr || strlen(topic) == 0) return false;
+    // The topic list and the client are shared with the network task
+    _lockMqtt(portMAX_DELAY);
+    bool result = true; // Added to list, will be subscribed when MQTT connects
+    bool known = false;
     // Add to list for resubscription on reconnect
     for (const String& existingTopic : _subscriptionTopics) {
         if (existingTopic.equals(topic)) {
             // AppLogger.debug("NetMgr", "Topic already in subscription list: " + String(topic));
             // Still attempt to subscribe if MQTT is connected, in case initial subscribe failed
-            if (_mqttClient.connected()) {
-                return _mqttClient.subscribe(topic);
-            }
-            return false; // Not connected, will be subscribed on connect
+            known = true;
+            result = _mqttClient.connected() && _mqttClient.subscribe(topic); // Not connected: subscribed on connect
+            break;
         }
     }
-    _subscriptionTopics.push_back(String(topic));
-    AppLogger.info("NetMgr", "Added to subscription list: " + String(topic));
+    if (!known) {
+        _subscriptionTopics.push_back(String(topic));
+        AppLogger.info("NetMgr", "Added to subscription list: " + String(topic));
 
-    if (_mqttClient.connected()) {
-        AppLogger.debug("NetMgr", "Attempting to subscribe immediately: " + String(topic));
-        return _mqttClient.subscribe(topic);
+        if (_mqttClient.connected()) {
+            LOGD("NetMgr", "Attempting to subscribe immediately: %s", topic);
+            result = _mqttClient.subscribe(topic);
+        }
     }
-    return true; // Added to list, will be subscribed when MQTT connects
+    _unlockMqtt();
+    return result;
 }
 
 void NetworkManager::setCallback(MqttCallback callback) {
@@ -781,7 +824,7 @@ void NetworkManager::_handleGetConfig(AsyncWebServerRequest *request) {
 
 // NEW: Handler for /getsysteminfo
 void NetworkManager::_handleGetSystemInfo(AsyncWebServerRequest *request) {
-    StaticJsonDocument<512> doc; // Adjust size as needed
+    StaticJsonDocument<1024> doc; // Adjust size as needed (includes command queue and logger counters)
 
     uint64_t chipId = ESP.getEfuseMac();
     char deviceIdStr[18]; // 17 chars for MAC + null terminator
@@ -815,6 +858,34 @@ void NetworkManager::_handleGetSystemInfo(AsyncWebServerRequest *request) {
     doc["maxAllocHeap"] = ESP.getMaxAllocHeap();
     doc["chipRevision"] = ESP.getChipRevision();
     doc["cpuFreqMHz"] = ESP.getCpuFreqMHz();
+
+    // Hàng đợi lệnh MQTT: lệnh bị bỏ khi worker không theo kịp
+    CommandQueueStats cmdStats = MqttCommands.getStats();
+    JsonObject cmdQueue = doc.createNestedObject("commandQueue");
+    cmdQueue["received"] = cmdStats.received;
+    cmdQueue["processed"] = cmdStats.processed;
+    cmdQueue["dropped"] = cmdStats.dropped;
+    cmdQueue["oversized"] = cmdStats.oversized;
+    cmdQueue["depth"] = cmdStats.depth;
+    cmdQueue["maxDepth"] = cmdStats.maxDepth;
+
+    // Log ring: records dropped when the drain task falls behind
+    LoggerStats logStats = AppLogger.getStats();
+    JsonObject logger = doc.createNestedObject("logger");
+    logger["queued"] = logStats.queued;
+    logger["dropped"] = logStats.dropped;
+    logger["truncated"] = logStats.truncated;
+    logger["depth"] = logStats.depth;
+    logger["maxDepth"] = logStats.maxDepth;
+    logger["frames"] = logStats.frames;
+    logger["frameBytes"] = logStats.frameBytes;
+    logger["stored"] = logStats.stored;
+    logger["replayed"] = logStats.replayed;
+    logger["replaySkipped"] = logStats.replaySkipped;
+    logger["storeLost"] = logStats.storeLost;
+    logger["suppressed"] = logStats.suppressed;
+    logger["webClients"] = logStats.webClients;
+    logger["webDropped"] = logStats.webDropped;
     // Add uptime if desired
     // unsigned long uptimeMillis = millis();
     // unsigned long uptimeSeconds = uptimeMillis / 1000;
@@ -828,6 +899,19 @@ void NetworkManager::_handleGetSystemInfo(AsyncWebServerRequest *request) {
     AppLogger.info("WebServer", "Sent system info.");
 }
 
+// Handler for /trace: scheduler decision records, newest last. Optional ?limit=N
+void NetworkManager::_handleGetTrace(AsyncWebServerRequest *request) {
+    size_t limit = DECISION_TRACE_CAPACITY;
+    if (request->hasParam("limit")) {
+        long requested = request->getParam("limit")->value().toInt();
+        if (requested > 0 && requested < DECISION_TRACE_CAPACITY) {
+            limit = requested;
+        }
+    }
+    String jsonResponse = SchedulerTrace.toJson(nullptr, limit);
+    request->send(200, "application/json", jsonResponse);
+}
+
 // Renamed from _loadCredentials and expanded
 bool NetworkManager::_loadNetworkConfig() {
     // Load WiFi SSID
@@ -1,35 +1,90 @@
 #include "../include/RelayManager.h"
 #include "../include/Logger.h"
+#include "../include/LatencyMonitor.h"
+#include "../include/FlightRecorder.h"
 #include <time.h>
+#include "soc/gpio_struct.h"
 
 RelayManager::RelayManager() {
     _relayPins = nullptr;
     _numRelays = 0;
+    _numLocal = 0;
+    _expansion = nullptr;
     _relayStatus = nullptr;
+    _snapshot = nullptr;
     _mutex = xSemaphoreCreateMutex();
     _statusChanged = false;
+    _seq = 0;
+    _allMask = 0;
+    _staggerMs = 0;
+    _nextActivationSlot = 0;
+    _pendingOnMask = 0;
+    _workerTask = nullptr;
+    memset(_gpioBit, 0, sizeof(_gpioBit));
+    memset(_gpioBank1, 0, sizeof(_gpioBank1));
+    memset(_pendingAt, 0, sizeof(_pendingAt));
+    memset(_pendingEnd, 0, sizeof(_pendingEnd));
 }
 
-void RelayManager::begin(const int* relayPins, int numRelays) {
+void RelayManager::begin(const int* relayPins, int numRelays, RelayExpansion* expansion) {
+    int total = numRelays + (expansion ? expansion->getRelayCount() : 0);
+    if (total > IRRIGATION_MAX_ZONES) {
+        AppLogger.error("RelayMgr", "ERROR: Too many relays, limited to " + String(IRRIGATION_MAX_ZONES));
+        total = IRRIGATION_MAX_ZONES;
+        if (numRelays > total) {
+            numRelays = total;
+        }
+    }
+    
     // Lưu tham chiếu đến các chân GPIO
     _relayPins = relayPins;
-    _numRelays = numRelays;
+    _numLocal = numRelays;
+    _numRelays = total;
+    _expansion = total > numRelays ? expansion : nullptr;
     
     // Khởi tạo mảng trạng thái
-    _relayStatus = new RelayStatus[numRelays];
+    _relayStatus = new RelayStatus[total];
+    _snapshot = new RelayStatus[total];
     
     // Khởi tạo tất cả các relay ở trạng thái tắt
+    _allMask = 0;
     for (int i = 0; i < _numRelays; i++) {
-        pinMode(_relayPins[i], OUTPUT);
-        digitalWrite(_relayPins[i], LOW);
         _relayStatus[i].state = false;
         _relayStatus[i].endTime = 0;
+        memset(&_relayStatus[i].pattern, 0, sizeof(RelayPattern));
+        _allMask |= (RelayMask)1 << i;
+        
+        if (i < _numLocal) {
+            pinMode(_relayPins[i], OUTPUT);
+            digitalWrite(_relayPins[i], LOW);
+            
+            // Tính trước bit trong thanh ghi set/clear tương ứng với chân
+            _gpioBank1[i] = _relayPins[i] >= 32;
+            _gpioBit[i] = 1UL << (_relayPins[i] & 31);
+        }
     }
+    _publish(_allMask);
+    
+    _deadline.begin("relay_deadline", _onDeadline, this);
+    _usage.begin(_numRelays);
     
     // Đánh dấu có thay đổi để gửi trạng thái ban đầu
     _statusChanged = true;
     
-    AppLogger.info("RelayMgr", "Initialized with " + String(_numRelays) + " relays");
+    AppLogger.info("RelayMgr", "Initialized with " + String(_numRelays) + " relays (" +
+                   String(_numRelays - _numLocal) + " on expansion backend)");
+}
+
+int RelayManager::getRelayCount() const {
+    return _numRelays;
+}
+
+void RelayManager::setInrushStagger(unsigned long intervalMs) {
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        _staggerMs = intervalMs;
+        xSemaphoreGive(_mutex);
+    }
+    AppLogger.info("RelayMgr", "Inrush stagger set to " + String(intervalMs) + " ms");
 }
 
 void RelayManager::setRelay(int relayIndex, bool state, unsigned long duration) {
@@ -39,39 +94,191 @@ void RelayManager::setRelay(int relayIndex, bool state, unsigned long duration)
         return;
     }
     
+    int64_t deadlines[IRRIGATION_MAX_ZONES];
+    deadlines[relayIndex] = duration > 0 ? DeadlineTimer::afterMs(duration) : 0;
+    RelayMask bit = (RelayMask)1 << relayIndex;
+    setRelaysUntil(bit, state ? bit : 0, deadlines);
+}
+
+void RelayManager::setWorkerTask(TaskHandle_t task) {
+    _workerTask = task;
+}
+
+// Chạy trong task esp_timer: chỉ đánh thức task điều khiển relay
+void RelayManager::_onDeadline(void* arg) {
+    RelayManager* self = static_cast<RelayManager*>(arg);
+    if (self->_workerTask != nullptr) {
+        xTaskNotifyGive(self->_workerTask);
+    } else {
+        self->update();
+    }
+}
+
+void RelayManager::setRelays(RelayMask mask, RelayMask stateMask, const unsigned long* durations) {
+    // Quy đổi thời lượng sang hạn chót tuyệt đối với cùng một mốc thời gian
+    int64_t now = DeadlineTimer::nowUs();
+    int64_t deadlines[IRRIGATION_MAX_ZONES];
+    for (int i = 0; i < _numRelays; i++) {
+        unsigned long duration = durations ? durations[i] : 0;
+        if ((mask & ((RelayMask)1 << i)) && duration > 0) {
+            deadlines[i] = now + (int64_t)duration * 1000;
+        } else {
+            deadlines[i] = 0;
+        }
+    }
+    setRelaysUntil(mask, stateMask, deadlines);
+}
+
+void RelayManager::setRelaysUntil(RelayMask mask, RelayMask stateMask, const int64_t* deadlinesUs) {
+    mask &= _allMask;
+    if (mask == 0) {
+        return;
+    }
+    
+    RelayMask onMask = 0;        // Relay bật ngay trong lần ghi này
+    RelayMask offMask = 0;       // Relay tắt trong lần ghi này
+    RelayMask deferredMask = 0;  // Relay chờ đến lượt bật do giãn cách
+    RelayMask changedMask = 0;   // Relay có trạng thái hoặc thời gian thay đổi
+    RelayMask limitedMask = 0;   // Relay bị chặn do hết hạn mức ngày
+    
     // Lấy mutex trước khi truy cập dữ liệu dùng chung
     if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
-        bool stateChanged = (_relayStatus[relayIndex].state != state);
-        bool durationChanged = (state && _relayStatus[relayIndex].endTime != millis() + duration && duration > 0);
+        int64_t now = DeadlineTimer::nowUs();
+        int64_t staggerUs = (int64_t)_staggerMs * 1000;
+        RelayMask pending = _pendingOnMask.load(std::memory_order_relaxed);
         
-        if (state) {
-            // Bật relay
-            digitalWrite(_relayPins[relayIndex], HIGH);
-            _relayStatus[relayIndex].state = true;
+        for (int i = 0; i < _numRelays; i++) {
+            RelayMask bit = (RelayMask)1 << i;
+            if (!(mask & bit)) {
+                continue;
+            }
             
-            // Nếu có thời gian, thiết lập thời điểm kết thúc
-            if (duration > 0) {
-                _relayStatus[relayIndex].endTime = millis() + duration;
-                AppLogger.info("RelayMgr", "Relay " + String(relayIndex + 1) + " turned ON for " + String(duration / 1000) + " seconds");
+            if (stateMask & bit) {
+                int64_t endTime = deadlinesUs ? deadlinesUs[i] : 0;
+                
+                // Giới hạn theo hạn mức bật trong ngày của vùng
+                uint32_t budget = _usage.remainingToday(i, now);
+                if (budget == 0) {
+                    limitedMask |= bit;
+                    pending &= ~bit;
+                    if (_relayStatus[i].state) {
+                        offMask |= bit;
+                        changedMask |= bit;
+                    }
+                    _disengage(i);
+                    continue;
+                }
+                if (budget != RELAY_USAGE_UNLIMITED) {
+                    // Với mẫu xung chỉ pha bật tiêu hạn mức
+                    const RelayPattern& pattern = _relayStatus[i].pattern;
+                    int64_t cap = pattern.onMs > 0 ? _patternBudgetEnd(pattern, now, (int64_t)budget * 1000000)
+                                                   : now + (int64_t)budget * 1000000;
+                    if (endTime == 0 || endTime > cap) {
+                        endTime = cap;
+                    }
+                }
+                
+                if (_relayStatus[i].state) {
+                    // Đang bật: chỉ cập nhật thời điểm kết thúc
+                    if (_relayStatus[i].endTime != endTime) {
+                        _relayStatus[i].endTime = endTime;
+                        changedMask |= bit;
+                    }
+                    continue;
+                }
+                
+                if (pending & bit) {
+                    // Đang chờ bật: giữ lượt, cập nhật thời điểm kết thúc
+                    _pendingEnd[i] = endTime;
+                    continue;
+                }
+                
+                // Chuyển từ tắt sang bật: xếp lượt theo chính sách giãn cách
+                int64_t slot = now;
+                if (staggerUs > 0 && _nextActivationSlot > now) {
+                    slot = _nextActivationSlot;
+                }
+                if (staggerUs > 0) {
+                    _nextActivationSlot = slot + staggerUs;
+                }
+                
+                if (slot == now) {
+                    _engage(i, endTime, now);
+                    onMask |= bit;
+                    changedMask |= bit;
+                } else {
+                    _pendingAt[i] = slot;
+                    _pendingEnd[i] = endTime;
+                    pending |= bit;
+                    deferredMask |= bit;
+                }
             } else {
-                _relayStatus[relayIndex].endTime = 0;
-                AppLogger.info("RelayMgr", "Relay " + String(relayIndex + 1) + " turned ON indefinitely");
+                // Tắt relay và hủy lượt bật đang chờ (cùng mẫu xung đã đặt cho lượt đó)
+                if (pending & bit) {
+                    pending &= ~bit;
+                    memset(&_relayStatus[i].pattern, 0, sizeof(RelayPattern));
+                }
+                if (_relayStatus[i].state) {
+                    _disengage(i);
+                    offMask |= bit;
+                    changedMask |= bit;
+                }
             }
-        } else {
-            // Tắt relay
-            digitalWrite(_relayPins[relayIndex], LOW);
-            _relayStatus[relayIndex].state = false;
-            _relayStatus[relayIndex].endTime = 0;
-            AppLogger.info("RelayMgr", "Relay " + String(relayIndex + 1) + " turned OFF");
         }
         
-        // Đánh dấu có sự thay đổi nếu trạng thái hoặc thời gian thay đổi
-        if (stateChanged || durationChanged) {
+        _pendingOnMask.store(pending, std::memory_order_relaxed);
+        
+        if (changedMask) {
+            _commit(onMask, offMask, changedMask);
             _statusChanged = true;
         }
+        _rearm();
         
         xSemaphoreGive(_mutex);
     }
+    
+    // Ghi log sau khi nhả mutex để không kéo dài vùng găng
+    if (onMask) {
+        AppLogger.info("RelayMgr", "Relays ON: " + _maskToList(onMask));
+    }
+    if (offMask) {
+        AppLogger.info("RelayMgr", "Relays OFF: " + _maskToList(offMask));
+    }
+    if (deferredMask) {
+        AppLogger.info("RelayMgr", "Relays queued for staggered start: " + _maskToList(deferredMask));
+    }
+    if (limitedMask) {
+        AppLogger.warning("RelayMgr", "Daily limit reached, activation blocked: " + _maskToList(limitedMask));
+    }
+}
+
+void RelayManager::setDailyLimit(int relayIndex, uint32_t seconds) {
+    if (relayIndex < 0 || relayIndex >= _numRelays) {
+        AppLogger.error("RelayMgr", "ERROR: Invalid relay index: " + String(relayIndex));
+        return;
+    }
+    _usage.setDailyLimit(relayIndex, seconds);
+    
+    // Áp hạn mức mới cho relay đang bật: gửi lại cùng hạn chót để bị cắt theo hạn mức
+    RelayStatus status = _readSnapshot(relayIndex);
+    if (status.state) {
+        int64_t deadlines[IRRIGATION_MAX_ZONES];
+        deadlines[relayIndex] = status.endTime;
+        RelayMask bit = (RelayMask)1 << relayIndex;
+        setRelaysUntil(bit, bit, deadlines);
+    }
+}
+
+uint32_t RelayManager::getDailyLimit(int relayIndex) {
+    RelayUsageRecord rec;
+    if (!_usage.getStats(relayIndex, rec, DeadlineTimer::nowUs())) {
+        return 0;
+    }
+    return rec.dailyLimitSec;
+}
+
+void RelayManager::flushUsageIfDue() {
+    _usage.flushIfDue();
 }
 
 void RelayManager::turnOn(int relayIndex, unsigned long duration) {
@@ -82,19 +289,122 @@ void RelayManager::turnOff(int relayIndex) {
     setRelay(relayIndex, false, 0);
 }
 
-bool RelayManager::getState(int relayIndex) {
-    if (relayIndex < 0 || relayIndex >= _numRelays) {
-        return false;
+// Ghi GPIO và công bố trạng thái cho bên đọc. Bên ghi đã giữ _mutex; spinlock chỉ
+// bao quanh vài lệnh ghi thanh ghi/bộ nhớ để bên đọc ở core kia không phải chờ lâu,
+// và bên đọc không bao giờ thấy snapshot lệch so với mức chân GPIO.
+void RelayManager::_commit(RelayMask onMask, RelayMask offMask, RelayMask publishMask, RelayMask pulseMask) {
+    uint32_t set0 = 0, set1 = 0, clr0 = 0, clr1 = 0;
+    for (int i = 0; i < _numLocal; i++) {
+        RelayMask bit = (RelayMask)1 << i;
+        if (onMask & bit) {
+            if (_gpioBank1[i]) set1 |= _gpioBit[i]; else set0 |= _gpioBit[i];
+        } else if (offMask & bit) {
+            if (_gpioBank1[i]) clr1 |= _gpioBit[i]; else clr0 |= _gpioBit[i];
+        }
     }
     
-    bool state = false;
+    portENTER_CRITICAL(&_seqLock);
+    if (set0) GPIO.out_w1ts = set0;
+    if (set1) GPIO.out1_w1ts.val = set1;
+    if (clr0) GPIO.out_w1tc = clr0;
+    if (clr1) GPIO.out1_w1tc.val = clr1;
     
-    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
-        state = _relayStatus[relayIndex].state;
-        xSemaphoreGive(_mutex);
+    _seq.fetch_add(1, std::memory_order_relaxed);     // Lẻ: đang ghi
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < _numRelays; i++) {
+        if (publishMask & ((RelayMask)1 << i)) {
+            _snapshot[i] = _relayStatus[i];
+        }
+    }
+    _seq.fetch_add(1, std::memory_order_release);     // Chẵn: ổn định
+    portEXIT_CRITICAL(&_seqLock);
+    
+    // Relay mở rộng: backend chỉ ghi nhận trạng thái mong muốn rồi tự ghi xuống bus
+    if (_expansion) {
+        RelayMask extOn = onMask >> _numLocal;
+        RelayMask extOff = offMask >> _numLocal;
+        if (extOn | extOff) {
+            _expansion->writeRelays(extOn, extOff);
+        }
+    }
+    
+    if (onMask | offMask) {
+        _usage.onSwitch(onMask, offMask, DeadlineTimer::nowUs(), pulseMask);
+        ActuationLatency.markGpioWrite();
+        FlightLog.recordRelays(onMask, offMask);
+    }
+}
+
+// Công bố snapshot không kèm ghi GPIO
+void RelayManager::_publish(RelayMask mask) {
+    _commit(0, 0, mask);
+}
+
+String RelayManager::_maskToList(RelayMask mask) {
+    String list;
+    for (int i = 0; i < _numRelays; i++) {
+        if (mask & ((RelayMask)1 << i)) {
+            if (list.length() > 0) {
+                list += ",";
+            }
+            list += String(i + 1);
+        }
+    }
+    return list;
+}
+
+int RelayManager::getSnapshot(RelayStatus* out, int maxRelays, uint32_t* version) {
+    int count = maxRelays < _numRelays ? maxRelays : _numRelays;
+    if (count <= 0 || _snapshot == nullptr) {
+        return 0;
+    }
+    
+    uint32_t begin;
+    uint32_t end;
+    do {
+        // Chờ bên ghi hoàn tất (chỉ vài lệnh, bên ghi không thể bị ngắt giữa chừng)
+        do {
+            begin = _seq.load(std::memory_order_acquire);
+        } while (begin & 1);
+        
+        for (int i = 0; i < count; i++) {
+            out[i] = _snapshot[i];
+        }
+        
+        std::atomic_thread_fence(std::memory_order_acquire);
+        end = _seq.load(std::memory_order_relaxed);
+    } while (begin != end);
+    
+    if (version) {
+        *version = begin >> 1;
+    }
+    return count;
+}
+
+// Đọc nhất quán trạng thái của một relay
+RelayStatus RelayManager::_readSnapshot(int relayIndex) {
+    RelayStatus status;
+    uint32_t begin;
+    do {
+        do {
+            begin = _seq.load(std::memory_order_acquire);
+        } while (begin & 1);
+        status = _snapshot[relayIndex];
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while (_seq.load(std::memory_order_relaxed) != begin);
+    return status;
+}
+
+uint32_t RelayManager::getStatusVersion() const {
+    return _seq.load(std::memory_order_acquire) >> 1;
+}
+
+bool RelayManager::getState(int relayIndex) {
+    if (relayIndex < 0 || relayIndex >= _numRelays) {
+        return false;
     }
     
-    return state;
+    return _readSnapshot(relayIndex).state;
 }
 
 unsigned long RelayManager::getRemainingTime(int relayIndex) {
@@ -102,159 +412,304 @@ unsigned long RelayManager::getRemainingTime(int relayIndex) {
         return 0;
     }
     
-    unsigned long remaining = 0;
+    RelayStatus status = _readSnapshot(relayIndex);
     
-    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
-        if (_relayStatus[relayIndex].endTime > 0) {
-            unsigned long currentTime = millis();
-            
-            if (_relayStatus[relayIndex].endTime > currentTime) {
-                remaining = _relayStatus[relayIndex].endTime - currentTime;
-            }
+    unsigned long remaining = 0;
+    if (status.state && status.endTime > 0) {
+        int64_t remainingUs = status.endTime - DeadlineTimer::nowUs();
+        if (remainingUs > 0) {
+            remaining = (unsigned long)((remainingUs + 999) / 1000);
         }
-        
-        xSemaphoreGive(_mutex);
     }
     
     return remaining;
 }
 
 void RelayManager::update() {
+    if (_snapshot == nullptr) {
+        return;
+    }
+    
+    RelayMask onMask = 0;
+    RelayMask offMask = 0;
+    RelayMask patternDoneMask = 0;   // Relay tắt do mẫu xung chạy đủ số chu kỳ
+    RelayMask phaseOnMask = 0;       // Chuyển sang pha bật của mẫu xung
+    RelayMask phaseOffMask = 0;      // Chuyển sang pha nghỉ của mẫu xung
+    
     if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
-        unsigned long currentTime = millis();
-        bool anyRelayChanged = false;
+        int64_t currentTime = DeadlineTimer::nowUs();
+        RelayMask pending = _pendingOnMask.load(std::memory_order_relaxed);
         
         for (int i = 0; i < _numRelays; i++) {
-            // Kiểm tra nếu relay đang bật và có thời gian
-            if (_relayStatus[i].state && _relayStatus[i].endTime > 0) {
-                // Kiểm tra nếu đã hết thời gian
-                if (currentTime >= _relayStatus[i].endTime) {
-                    // Tắt relay
-                    digitalWrite(_relayPins[i], LOW);
-                    _relayStatus[i].state = false;
-                    _relayStatus[i].endTime = 0;
-                    anyRelayChanged = true;
-                    
-                    AppLogger.info("RelayMgr", "Auto turned OFF relay " + String(i + 1) + " (timer expired)");
+            RelayMask bit = (RelayMask)1 << i;
+            
+            // Relay đến lượt bật theo giãn cách
+            if ((pending & bit) && currentTime >= _pendingAt[i]) {
+                pending &= ~bit;
+                // Bỏ qua nếu thời lượng đã hết trước khi đến lượt
+                if (_pendingEnd[i] == 0 || currentTime < _pendingEnd[i]) {
+                    _engage(i, _pendingEnd[i], currentTime);
+                    onMask |= bit;
+                }
+                continue;
+            }
+            
+            if (!_relayStatus[i].state) {
+                continue;
+            }
+            
+            // Kiểm tra nếu relay đang bật, có thời gian và đã hết thời gian
+            if (_relayStatus[i].endTime > 0 && currentTime >= _relayStatus[i].endTime) {
+                _disengage(i);
+                offMask |= bit;
+                continue;
+            }
+            
+            // Chuyển pha của mẫu xung, dùng chung timer với hạn chót relay
+            RelayPattern& pattern = _relayStatus[i].pattern;
+            if (pattern.running && currentTime >= pattern.phaseEnd) {
+                if (pattern.phaseOn) {
+                    pattern.cycle++;
+                    if (pattern.repeat > 0 && pattern.cycle >= pattern.repeat) {
+                        _disengage(i);
+                        patternDoneMask |= bit;
+                        continue;
+                    }
+                    pattern.phaseOn = false;
+                    pattern.phaseEnd += (int64_t)pattern.offMs * 1000;
+                    phaseOffMask |= bit;
+                } else {
+                    pattern.phaseOn = true;
+                    pattern.phaseEnd += (int64_t)pattern.onMs * 1000;
+                    phaseOnMask |= bit;
+                }
+                // Giữ nhịp theo mốc ban đầu; chỉ đồng bộ lại nếu bị trễ quá một pha
+                if (pattern.phaseEnd <= currentTime) {
+                    pattern.phaseEnd = currentTime + (int64_t)(pattern.phaseOn ? pattern.onMs : pattern.offMs) * 1000;
                 }
             }
         }
         
-        // Đánh dấu có sự thay đổi nếu có relay nào đó tự động tắt
-        if (anyRelayChanged) {
+        _pendingOnMask.store(pending, std::memory_order_relaxed);
+        
+        // Đánh dấu có sự thay đổi nếu có relay nào đó tự động bật/tắt hoặc đổi pha
+        RelayMask gpioOn = onMask | phaseOnMask;
+        RelayMask gpioOff = offMask | patternDoneMask | phaseOffMask;
+        if (gpioOn || gpioOff) {
+            _commit(gpioOn, gpioOff, gpioOn | gpioOff, phaseOnMask | phaseOffMask);
             _statusChanged = true;
         }
+        _rearm();
         
         xSemaphoreGive(_mutex);
     }
+    
+    if (onMask) {
+        AppLogger.info("RelayMgr", "Staggered start relays ON: " + _maskToList(onMask));
+    }
+    if (offMask) {
+        AppLogger.info("RelayMgr", "Auto turned OFF relays " + _maskToList(offMask) + " (timer expired)");
+    }
+    if (patternDoneMask) {
+        AppLogger.info("RelayMgr", "Auto turned OFF relays " + _maskToList(patternDoneMask) + " (pattern completed)");
+    }
+    if (phaseOnMask || phaseOffMask) {
+        LOGD("RelayMgr", "Pattern phase ON: [%s] OFF: [%s]", _maskToList(phaseOnMask).c_str(), _maskToList(phaseOffMask).c_str());
+    }
 }
 
-String RelayManager::getStatusJson(const char* apiKey) {
-    // Tạo JSON document
-    StaticJsonDocument<512> doc;
+// Thời điểm relay chạy theo mẫu xung dùng hết budgetUs thời gian bật, tính từ pha hiện tại
+// (mẫu chưa chạy thì bắt đầu bằng pha bật tại now)
+int64_t RelayManager::_patternBudgetEnd(const RelayPattern& pattern, int64_t now, int64_t budgetUs) {
+    int64_t onUs = (int64_t)pattern.onMs * 1000;
+    int64_t offUs = (int64_t)pattern.offMs * 1000;
+    int64_t cycleStart = now;
+    if (pattern.running) {
+        int64_t phaseLeft = pattern.phaseEnd > now ? pattern.phaseEnd - now : 0;
+        if (pattern.phaseOn) {
+            if (budgetUs <= phaseLeft) {
+                return now + budgetUs;
+            }
+            budgetUs -= phaseLeft;
+            cycleStart = now + phaseLeft + offUs;
+        } else {
+            cycleStart = now + phaseLeft;
+        }
+    }
+    // Từ đầu một pha bật: các xung đầy đủ, rồi phần lẻ của xung cuối
+    int64_t pulses = budgetUs / onUs;
+    int64_t rest = budgetUs % onUs;
+    if (rest == 0) {
+        return cycleStart + pulses * onUs + (pulses - 1) * offUs;
+    }
+    return cycleStart + pulses * (onUs + offUs) + rest;
+}
+
+void RelayManager::_engage(int relayIndex, int64_t endTime, int64_t now) {
+    RelayStatus& status = _relayStatus[relayIndex];
+    status.state = true;
+    status.endTime = endTime;
     
-    // Thêm API key và timestamp
-    doc["api_key"] = apiKey;
-    doc["timestamp"] = (uint32_t)time(NULL);
+    // Mẫu đã được đặt trước lần bật này bắt đầu bằng pha bật
+    RelayPattern& pattern = status.pattern;
+    if (pattern.onMs > 0) {
+        pattern.running = true;
+        pattern.phaseOn = true;
+        pattern.cycle = 0;
+        pattern.phaseEnd = now + (int64_t)pattern.onMs * 1000;
+    }
+}
+
+void RelayManager::_disengage(int relayIndex) {
+    RelayStatus& status = _relayStatus[relayIndex];
+    status.state = false;
+    status.endTime = 0;
+    memset(&status.pattern, 0, sizeof(RelayPattern));
+}
+
+void RelayManager::setPattern(int relayIndex, uint32_t onMs, uint32_t offMs, uint16_t repeat) {
+    if (relayIndex < 0 || relayIndex >= _numRelays) {
+        AppLogger.error("RelayMgr", "ERROR: Invalid relay index: " + String(relayIndex));
+        return;
+    }
+    if (onMs > 0 && offMs == 0) {
+        AppLogger.warning("RelayMgr", "Pattern without off time ignored for relay " + String(relayIndex + 1));
+        return;
+    }
     
-    // Tạo mảng relays
-    JsonArray relays = doc.createNestedArray("relays");
+    RelayMask bit = (RelayMask)1 << relayIndex;
+    RelayMask onMask = 0;
     
     if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
-        unsigned long currentTime = millis();
+        RelayStatus& status = _relayStatus[relayIndex];
+        RelayPattern& pattern = status.pattern;
+        bool outputOff = status.state && pattern.running && !pattern.phaseOn;
         
-        // Thêm thông tin cho mỗi relay
-        for (int i = 0; i < _numRelays; i++) {
-            JsonObject relay = relays.createNestedObject();
-            relay["id"] = i + 1;
-            relay["state"] = _relayStatus[i].state;
-            
-            // Tính thời gian còn lại
-            unsigned long remaining = 0;
-            if (_relayStatus[i].endTime > currentTime) {
-                remaining = _relayStatus[i].endTime - currentTime;
+        memset(&pattern, 0, sizeof(RelayPattern));
+        pattern.onMs = onMs;
+        pattern.offMs = offMs;
+        pattern.repeat = onMs > 0 ? repeat : 0;
+        
+        if (status.state) {
+            // Relay đang bật: bắt đầu mẫu mới (hoặc bật liên tục) ngay
+            _engage(relayIndex, status.endTime, DeadlineTimer::nowUs());
+            if (outputOff) {
+                onMask = bit;
             }
-            
-            relay["remaining"] = remaining;
         }
         
+        _commit(onMask, 0, bit, onMask);  // Mẫu mới bắt đầu lại từ pha bật: không phải lần bật mới
+        _statusChanged = true;
+        _rearm();
+        
         xSemaphoreGive(_mutex);
     }
     
-    // Chuyển JSON document thành chuỗi
-    String payload;
-    serializeJson(doc, payload);
-    
-    return payload;
+    if (onMs > 0) {
+        AppLogger.info("RelayMgr", "Relay " + String(relayIndex + 1) + " pattern: " + String(onMs) + " ms on / " +
+                       String(offMs) + " ms off, repeat " + (repeat > 0 ? String(repeat) : String("until stopped")));
+    } else {
+        AppLogger.info("RelayMgr", "Relay " + String(relayIndex + 1) + " pattern cleared");
+    }
 }
 
-bool RelayManager::processCommand(const char* json) {
-    // Parse JSON
-    DynamicJsonDocument doc(512);
-    DeserializationError error = deserializeJson(doc, json);
-    
-    if (error) {
-        AppLogger.error("RelayMgr", "JSON parsing failed: " + String(error.c_str()));
-        return false;
+// Đặt timer theo hạn chót sớm nhất còn lại, hủy nếu không còn relay hẹn giờ
+void RelayManager::_rearm() {
+    int64_t earliest = 0;
+    RelayMask pending = _pendingOnMask.load(std::memory_order_relaxed);
+    for (int i = 0; i < _numRelays; i++) {
+        int64_t deadline = 0;
+        if (pending & ((RelayMask)1 << i)) {
+            deadline = _pendingAt[i];
+        } else if (_relayStatus[i].state) {
+            deadline = _relayStatus[i].endTime;
+            const RelayPattern& pattern = _relayStatus[i].pattern;
+            if (pattern.running && (deadline == 0 || pattern.phaseEnd < deadline)) {
+                deadline = pattern.phaseEnd;
+            }
+        }
+        if (deadline > 0 && (earliest == 0 || deadline < earliest)) {
+            earliest = deadline;
+        }
     }
     
-    // Kiểm tra nếu có trường relays
-    if (!doc.containsKey("relays")) {
-        AppLogger.error("RelayMgr", "Command missing 'relays' field");
-        return false;
+    if (earliest > 0) {
+        _deadline.armAt(earliest);
+    } else {
+        _deadline.cancel();
     }
+}
+
+String RelayManager::getStatusJson(const char* apiKey) {
+    // Tạo JSON document: mỗi relay tối đa 10 trường cộng đối tượng pattern 6 trường
+    DynamicJsonDocument doc(JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(IRRIGATION_MAX_ZONES) +
+                            IRRIGATION_MAX_ZONES * (JSON_OBJECT_SIZE(10) + JSON_OBJECT_SIZE(6)));
     
-    JsonArray relays = doc["relays"];
-    bool anyChanges = false;
+    // Thêm API key và timestamp
+    doc["api_key"] = apiKey;
+    doc["timestamp"] = (uint32_t)time(NULL);
     
-    // Xử lý mỗi relay trong danh sách
-    for (JsonObject relay : relays) {
-        // Kiểm tra nếu có id và state
-        if (relay.containsKey("id") && relay.containsKey("state")) {
-            int id = relay["id"];
-            bool state = relay["state"];
-            unsigned long duration = 0;
-            
-            // Kiểm tra nếu có duration
-            if (relay.containsKey("duration") && state) {
-                duration = relay["duration"];
-                // Convert seconds to milliseconds if needed
-                if (duration < 10000) {
-                    duration *= 1000;
-                }
-            }
-            
-            // Điều khiển relay (0-based index, nhưng id là 1-based)
-            if (id >= 1 && id <= _numRelays) {
-                int relayIndex = id - 1;
-                
-                // Kiểm tra xem có sự thay đổi không trước khi cập nhật
-                bool currentState = _relayStatus[relayIndex].state;
-                unsigned long currentEndTime = _relayStatus[relayIndex].endTime;
-                bool willChange = (currentState != state) || 
-                                (state && duration > 0 && 
-                                 (currentEndTime == 0 || currentEndTime != millis() + duration));
-                
-                if (willChange) {
-                    setRelay(relayIndex, state, duration);
-                    anyChanges = true;
-                }
-            } else {
-                AppLogger.error("RelayMgr", "Invalid relay ID: " + String(id));
+    // Tạo mảng relays
+    JsonArray relays = doc.createNestedArray("relays");
+    
+    // Đọc snapshot nhất quán, không chặn luồng điều khiển relay
+    static RelayStatus status[IRRIGATION_MAX_ZONES];  // Chỉ Core0 gọi, giữ ngoài stack
+    uint32_t version = 0;
+    int count = getSnapshot(status, _numRelays, &version);
+    doc["version"] = version;
+    
+    int64_t currentTime = DeadlineTimer::nowUs();
+    
+    // Thêm thông tin cho mỗi relay
+    for (int i = 0; i < count; i++) {
+        JsonObject relay = relays.createNestedObject();
+        relay["id"] = i + 1;
+        // state theo mức trên chân relay; pulsing báo relay vẫn đang bật theo mẫu xung
+        relay["state"] = status[i].outputOn();
+        
+        // Tính thời gian còn lại
+        unsigned long remaining = 0;
+        if (status[i].state && status[i].endTime > currentTime) {
+            remaining = (unsigned long)((status[i].endTime - currentTime + 999) / 1000);
+        }
+        
+        relay["remaining"] = remaining;
+        
+        // Mẫu xung đang chạy và pha hiện tại
+        const RelayPattern& pattern = status[i].pattern;
+        if (status[i].state && pattern.running) {
+            relay["pulsing"] = true;
+            JsonObject p = relay.createNestedObject("pattern");
+            p["on"] = pattern.onMs / 1000.0;
+            p["off"] = pattern.offMs / 1000.0;
+            p["repeat"] = pattern.repeat;
+            p["cycle"] = pattern.cycle;
+            p["phase"] = pattern.phaseOn ? "on" : "off";
+            p["phase_remaining"] = pattern.phaseEnd > currentTime
+                                   ? (unsigned long)((pattern.phaseEnd - currentTime + 999) / 1000) : 0UL;
+        }
+        
+        // Thống kê thời gian chạy (giây)
+        RelayUsageRecord usage;
+        if (_usage.getStats(i, usage, currentTime)) {
+            relay["on_total"] = (uint32_t)(usage.totalMs / 1000);
+            relay["switches"] = usage.switches;
+            relay["today"] = usage.dayMs / 1000;
+            relay["week"] = usage.weekMs / 1000;
+            if (usage.dailyLimitSec > 0) {
+                relay["daily_max"] = usage.dailyLimitSec;
             }
         }
     }
     
-    return anyChanges;
+    // Chuyển JSON document thành chuỗi
+    String payload;
+    serializeJson(doc, payload);
+    
+    return payload;
 }
 
 bool RelayManager::hasStatusChangedAndReset() {
-    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
-        bool changed = _statusChanged;
-        _statusChanged = false; // Reset cờ
-        xSemaphoreGive(_mutex);
-        return changed;
-    }
-    // Fallback nếu không lấy được mutex
-    return true;
+    // Đọc và reset cờ trong một thao tác nguyên tử, không cần mutex
+    return _statusChanged.exchange(false);
 } 
\ No newline at end of file
@@ -0,0 +1,203 @@
+#include "../include/RelayUsage.h"
+#include "../include/Logger.h"
+#include <time.h>
+
+static const char* USAGE_NVS_NAMESPACE = "relay-usage";
+static const char* USAGE_NVS_KEY = "records";
+
+RelayUsage::RelayUsage() {
+    _numRelays = 0;
+    _records = nullptr;
+    _onSinceUs = nullptr;
+    _changes = 0;
+    _savedChanges = 0;
+    _flushMutex = nullptr;
+    _lastFlush = 0;
+}
+
+void RelayUsage::begin(int numRelays) {
+    _numRelays = numRelays;
+    _records = new RelayUsageRecord[numRelays];
+    _onSinceUs = new int64_t[numRelays];
+    _flushMutex = xSemaphoreCreateMutex();
+
+    for (int i = 0; i < numRelays; i++) {
+        _records[i] = { 0, 0, 0, 0, -1, -1, 0 };
+        _onSinceUs[i] = 0;
+    }
+
+    if (!_preferences.begin(USAGE_NVS_NAMESPACE, false)) {
+        AppLogger.warning("RelayUsage", "NVM: Failed to open namespace, usage will not persist");
+        return;
+    }
+
+    size_t expected = sizeof(RelayUsageRecord) * numRelays;
+    if (_preferences.getBytesLength(USAGE_NVS_KEY) == expected) {
+        _preferences.getBytes(USAGE_NVS_KEY, _records, expected);
+        AppLogger.info("RelayUsage", "Loaded usage statistics for " + String(numRelays) + " relays");
+    } else {
+        AppLogger.info("RelayUsage", "No stored usage statistics, starting from zero");
+    }
+    _lastFlush = millis();
+}
+
+// Số ngày/tuần theo giờ địa phương; false nếu chưa đồng bộ thời gian
+bool RelayUsage::_currentKeys(int32_t& dayKey, int32_t& weekKey) {
+    time_t now = time(NULL);
+    if (now < 1000000000L) {
+        return false;
+    }
+    struct tm t;
+    localtime_r(&now, &t);
+
+    // Số ngày kể từ 1970-01-01 (thuật toán days-from-civil)
+    int y = t.tm_year + 1900;
+    int m = t.tm_mon + 1;
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + t.tm_mday - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    dayKey = era * 146097 + doe - 719468;
+
+    // 1970-01-01 là thứ Năm: dịch 3 ngày để tuần bắt đầu từ thứ Hai
+    weekKey = (dayKey + 3) / 7;
+    return true;
+}
+
+void RelayUsage::_rollover(RelayUsageRecord& rec, int32_t dayKey, int32_t weekKey) {
+    if (rec.dayKey != dayKey) {
+        rec.dayKey = dayKey;
+        rec.dayMs = 0;
+        _changes++;
+    }
+    if (rec.weekKey != weekKey) {
+        rec.weekKey = weekKey;
+        rec.weekMs = 0;
+        _changes++;
+    }
+}
+
+void RelayUsage::onSwitch(RelayMask onMask, RelayMask offMask, int64_t nowUs, RelayMask pulseMask) {
+    if (_records == nullptr || (onMask | offMask) == 0) {
+        return;
+    }
+
+    int32_t dayKey = -1;
+    int32_t weekKey = -1;
+    bool haveTime = _currentKeys(dayKey, weekKey);
+
+    portENTER_CRITICAL(&_lock);
+    for (int i = 0; i < _numRelays; i++) {
+        RelayMask bit = (RelayMask)1 << i;
+        RelayUsageRecord& rec = _records[i];
+        if (haveTime) {
+            _rollover(rec, dayKey, weekKey);
+        }
+
+        if (onMask & bit) {
+            if (!(pulseMask & bit)) {
+                rec.switches++;
+            }
+            _onSinceUs[i] = nowUs;
+            _changes++;
+        } else if ((offMask & bit) && _onSinceUs[i] != 0) {
+            uint32_t elapsedMs = (uint32_t)((nowUs - _onSinceUs[i]) / 1000);
+            rec.totalMs += elapsedMs;
+            rec.dayMs += elapsedMs;
+            rec.weekMs += elapsedMs;
+            _onSinceUs[i] = 0;
+            _changes++;
+        }
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+uint32_t RelayUsage::remainingToday(int relayIndex, int64_t nowUs) {
+    if (_records == nullptr || relayIndex < 0 || relayIndex >= _numRelays) {
+        return RELAY_USAGE_UNLIMITED;
+    }
+
+    RelayUsageRecord rec;
+    if (!getStats(relayIndex, rec, nowUs) || rec.dailyLimitSec == 0) {
+        return RELAY_USAGE_UNLIMITED;
+    }
+
+    uint32_t usedSec = rec.dayMs / 1000;
+    return usedSec >= rec.dailyLimitSec ? 0 : rec.dailyLimitSec - usedSec;
+}
+
+void RelayUsage::setDailyLimit(int relayIndex, uint32_t seconds) {
+    if (_records == nullptr || relayIndex < 0 || relayIndex >= _numRelays) {
+        return;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    _records[relayIndex].dailyLimitSec = seconds;
+    _changes++;
+    portEXIT_CRITICAL(&_lock);
+
+    // Cấu hình hiếm khi thay đổi, lưu ngay
+    flushIfDue(true);
+    AppLogger.info("RelayUsage", "Relay " + String(relayIndex + 1) + " daily limit: " +
+                   (seconds > 0 ? String(seconds) + " s" : String("none")));
+}
+
+bool RelayUsage::getStats(int relayIndex, RelayUsageRecord& out, int64_t nowUs) {
+    if (_records == nullptr || relayIndex < 0 || relayIndex >= _numRelays) {
+        return false;
+    }
+
+    int32_t dayKey = -1;
+    int32_t weekKey = -1;
+    bool haveTime = _currentKeys(dayKey, weekKey);
+
+    portENTER_CRITICAL(&_lock);
+    if (haveTime) {
+        _rollover(_records[relayIndex], dayKey, weekKey);
+    }
+    out = _records[relayIndex];
+    int64_t onSince = _onSinceUs[relayIndex];
+    portEXIT_CRITICAL(&_lock);
+
+    // Cộng phần thời gian của lần bật đang diễn ra
+    if (onSince != 0 && nowUs > onSince) {
+        uint32_t runningMs = (uint32_t)((nowUs - onSince) / 1000);
+        out.totalMs += runningMs;
+        out.dayMs += runningMs;
+        out.weekMs += runningMs;
+    }
+    return true;
+}
+
+// Gọi từ Core0 (định kỳ) và từ command worker (setDailyLimit): mutex bảo đảm chỉ một
+// bên chụp và ghi tại một thời điểm, bản cũ không thể ghi đè lên bản mới hơn
+void RelayUsage::flushIfDue(bool force) {
+    if (_records == nullptr || _flushMutex == nullptr || _changes == _savedChanges) {
+        return;
+    }
+    if (!force && millis() - _lastFlush < RELAY_USAGE_FLUSH_INTERVAL) {
+        return;
+    }
+
+    xSemaphoreTake(_flushMutex, portMAX_DELAY);
+    // Chép ra ngoài vùng khóa, ghi NVS một khối duy nhất
+    size_t size = sizeof(RelayUsageRecord) * _numRelays;
+    RelayUsageRecord* copy = new RelayUsageRecord[_numRelays];
+    portENTER_CRITICAL(&_lock);
+    memcpy(copy, _records, size);
+    uint32_t changes = _changes;
+    portEXIT_CRITICAL(&_lock);
+
+    // Bên gọi trước có thể vừa ghi xong chính bản này
+    if (changes != _savedChanges) {
+        if (_preferences.putBytes(USAGE_NVS_KEY, copy, size) != size) {
+            AppLogger.error("RelayUsage", "NVM: Failed to store usage statistics");
+        } else {
+            _savedChanges = changes;    // Thay đổi sau lúc chụp vẫn chờ lần ghi sau
+        }
+        _lastFlush = millis();
+    }
+    delete[] copy;
+    xSemaphoreGive(_flushMutex);
+}
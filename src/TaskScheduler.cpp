@@ -1,10 +1,13 @@
 #include "../include/TaskScheduler.h"
+#include "../include/DecisionTrace.h"
 
-TaskScheduler::TaskScheduler(RelayManager& relayManager, EnvironmentManager& envManager) 
-    : _relayManager(relayManager), _envManager(envManager) {
+TaskScheduler::TaskScheduler(ActuationArbiter& arbiter, EnvironmentManager& envManager) 
+    : _arbiter(arbiter), _envManager(envManager) {
     _mutex = xSemaphoreCreateMutex();
     _lastCheckTime = 0;
     _scheduleStatusChanged = false;
+    _deadlineDue = false;
+    _restoredZones = 0;
 }
 
 void TaskScheduler::begin() {
@@ -12,8 +15,10 @@ void TaskScheduler::begin() {
         // Khởi tạo danh sách lịch rỗng
         _tasks.clear();
         _activeZonesBits.reset(); // Xóa tất cả các bit (tất cả zone không hoạt động)
+        _restoredZones = 0;
         _earliestNextCheckTime = 0;
         _scheduleStatusChanged = true; // Đánh dấu có thay đổi để gửi trạng thái ban đầu
+        _completionTimer.begin("task_deadline", _onCompletionDeadline, this);
         
         Serial.println("TaskScheduler initialized");
         
@@ -39,6 +44,8 @@ bool TaskScheduler::addOrUpdateTask(const IrrigationTask& task) {
             IrrigationTask newTask = task;
             newTask.state = IDLE;
             newTask.start_time = 0;
+            newTask.run_seconds = 0;
+            newTask.end_us = 0;
             // Tính thời gian chạy kế tiếp
             newTask.next_run = calculateNextRunTime(newTask);
             
@@ -69,6 +76,7 @@ bool TaskScheduler::deleteTask(int taskId) {
             // Nếu lịch đang chạy thì dừng lại
             if (it->state == RUNNING) {
                 stopTask(*it);
+                SchedulerTrace.record(TRACE_DELETED, it->id);
             }
             
             // Xóa lịch
@@ -93,18 +101,21 @@ bool TaskScheduler::deleteTask(int taskId) {
 }
 
 String TaskScheduler::getTasksJson(const char* apiKey) {
-    StaticJsonDocument<2048> doc;
-    
-    // Thêm API key
-    doc["api_key"] = apiKey;
-    
-    // Thêm timestamp hiện tại
-    doc["timestamp"] = (uint32_t)time(NULL);
-    
-    // Tạo mảng tasks
-    JsonArray tasks = doc.createNestedArray("tasks");
+    String jsonString;
     
     if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        // Dung lượng theo số lịch và số vùng tối đa (mảng zones lớn dần theo IRRIGATION_MAX_ZONES)
+        DynamicJsonDocument doc(JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(_tasks.size()) + _tasks.size() * TASK_JSON_SIZE);
+        
+        // Thêm API key
+        doc["api_key"] = apiKey;
+        
+        // Thêm timestamp hiện tại
+        doc["timestamp"] = (uint32_t)time(NULL);
+        
+        // Tạo mảng tasks
+        JsonArray tasks = doc.createNestedArray("tasks");
+        
         // Thêm từng task vào JSON
         for (const auto& task : _tasks) {
             JsonObject taskObj = tasks.createNestedObject();
@@ -130,6 +141,10 @@ String TaskScheduler::getTasksJson(const char* apiKey) {
             }
             
             taskObj["priority"] = task.priority;
+            taskObj["et_adjust"] = task.et_adjust;
+            if (task.state == RUNNING) {
+                taskObj["run_seconds"] = task.run_seconds;
+            }
             
             // Thêm thông tin trạng thái
             switch (task.state) {
@@ -159,13 +174,12 @@ String TaskScheduler::getTasksJson(const char* apiKey) {
             }
         }
         
+        // Chuyển JSON thành chuỗi
+        serializeJson(doc, jsonString);
+        
         xSemaphoreGive(_mutex);
     }
     
-    // Chuyển JSON thành chuỗi
-    String jsonString;
-    serializeJson(doc, jsonString);
-    
     return jsonString;
 }
 
@@ -228,7 +242,7 @@ void TaskScheduler::addSensorConditionToJson(JsonDocument& doc, JsonObject& task
 }
 
 bool TaskScheduler::processCommand(const char* json) {
-    DynamicJsonDocument doc(2048);
+    DynamicJsonDocument doc(1024 + 4 * TASK_JSON_SIZE);
     DeserializationError error = deserializeJson(doc, json);
     
     if (error) {
@@ -298,6 +312,9 @@ bool TaskScheduler::processCommand(const char* json) {
         // Độ ưu tiên (mặc định là 5 nếu không có)
         task.priority = taskJson.containsKey("priority") ? taskJson["priority"] : 5;
         
+        // Điều chỉnh thời lượng theo ET0 (mặc định tắt)
+        task.et_adjust = taskJson.containsKey("et_adjust") ? taskJson["et_adjust"] : false;
+        
         // Khởi tạo các giá trị mặc định cho điều kiện cảm biến
         task.sensor_condition.enabled = false;
         task.sensor_condition.temperature_check = false;
@@ -315,6 +332,8 @@ bool TaskScheduler::processCommand(const char* json) {
         // Trạng thái mặc định
         task.state = IDLE;
         task.start_time = 0;
+        task.run_seconds = 0;
+        task.end_us = 0;
         
         // Thêm hoặc cập nhật task
         if (addOrUpdateTask(task)) {
@@ -420,9 +439,10 @@ bool TaskScheduler::processDeleteCommand(const char* json) {
 
 void TaskScheduler::update() {
     unsigned long currentMillis = millis();
+    bool deadlineDue = _deadlineDue.exchange(false);
     
-    // Giới hạn tần suất kiểm tra (mỗi giây)
-    if (currentMillis - _lastCheckTime < 1000) {
+    // Giới hạn tần suất kiểm tra (mỗi giây), trừ khi có lịch đến hạn chót kết thúc
+    if (!deadlineDue && currentMillis - _lastCheckTime < 1000) {
         return;
     }
     _lastCheckTime = currentMillis;
@@ -433,7 +453,7 @@ void TaskScheduler::update() {
         time(&now);
         
         // Kiểm tra nếu chưa đến thời điểm sớm nhất cần kiểm tra
-        if (_earliestNextCheckTime != 0 && now < _earliestNextCheckTime) {
+        if (!deadlineDue && _earliestNextCheckTime != 0 && now < _earliestNextCheckTime) {
             // Chưa đến thời điểm cần kiểm tra, thoát sớm
             xSemaphoreGive(_mutex);
             return;
@@ -445,10 +465,23 @@ void TaskScheduler::update() {
         bool anyStateChanged = false;
         
         // 1. Cập nhật trạng thái lịch đang chạy
+        int64_t nowUs = DeadlineTimer::nowUs();
+        
+        // Vùng khôi phục hết bận cùng lúc lease của nó hết hạn
+        for (int i = 0; i < IRRIGATION_MAX_ZONES && _restoredZones != 0; i++) {
+            RelayMask bit = (RelayMask)1 << i;
+            if ((_restoredZones & bit) && _restoredEndUs[i] > 0 && nowUs >= _restoredEndUs[i]) {
+                _restoredZones &= ~bit;
+                _activeZonesBits.reset(i);
+            }
+        }
+        
         for (auto& task : _tasks) {
             if (task.state == RUNNING) {
-                // Kiểm tra nếu đã hoàn thành
-                if (now - task.start_time >= task.duration * 60) {
+                // Kiểm tra nếu đã hoàn thành (cùng hạn chót với lease relay của lịch)
+                bool finished = task.end_us > 0 ? nowUs >= task.end_us
+                                                : now - task.start_time >= (time_t)task.run_seconds;
+                if (finished) {
                     stopTask(task);
                     
                     // Đánh dấu thay đổi trạng thái
@@ -460,6 +493,7 @@ void TaskScheduler::update() {
                     
                     // Tính thời gian chạy kế tiếp
                     task.next_run = calculateNextRunTime(task);
+                    SchedulerTrace.record(TRACE_COMPLETED, task.id, task.run_seconds);
                     
                     Serial.println("Task " + String(task.id) + " completed, next run at: " + 
                                    String(ctime(&task.next_run)));
@@ -481,6 +515,7 @@ void TaskScheduler::update() {
             // Nếu đến giờ chạy
             if (isDayMatch && isTimeMatch) {
                 Serial.println("Task " + String(task.id) + " scheduled time match");
+                SchedulerTrace.record(TRACE_TIME_MATCH, task.id);
                 
                 // Kiểm tra điều kiện cảm biến
                 if (!checkSensorConditions(task)) {
@@ -516,6 +551,9 @@ void TaskScheduler::update() {
                                         }
                                         
                                         runningTask.next_run = calculateNextRunTime(runningTask);
+                                        SchedulerTrace.record(TRACE_PREEMPTED, runningTask.id,
+                                                              runningTask.priority, task.priority,
+                                                              task.id, zoneId);
                                         
                                         Serial.println("Preempted task " + String(runningTask.id) + 
                                                      " due to higher priority task");
@@ -525,6 +563,18 @@ void TaskScheduler::update() {
                         } else {
                             // Không đủ ưu tiên để chạy
                             canStart = false;
+                            
+                            // Ghi lại lịch đang giữ vùng này
+                            for (const auto& runningTask : _tasks) {
+                                if (runningTask.state == RUNNING &&
+                                    std::find(runningTask.zones.begin(), runningTask.zones.end(),
+                                              zoneId) != runningTask.zones.end()) {
+                                    SchedulerTrace.record(TRACE_BLOCKED_PRIORITY, task.id,
+                                                          task.priority, runningTask.priority,
+                                                          runningTask.id, zoneId);
+                                    break;
+                                }
+                            }
                             Serial.println("Task " + String(task.id) + 
                                           " cannot start, lower priority than running tasks");
                             break;
@@ -535,6 +585,7 @@ void TaskScheduler::update() {
                 // Nếu có thể chạy
                 if (canStart) {
                     startTask(task);
+                    SchedulerTrace.record(TRACE_STARTED, task.id, task.run_seconds);
                     
                     // Đánh dấu thay đổi trạng thái
                     TaskState oldState = task.state;
@@ -553,11 +604,75 @@ void TaskScheduler::update() {
         
         // Tính toán lại thời điểm sớm nhất cần kiểm tra sau khi cập nhật
         recomputeEarliestNextCheckTime();
+        _rearmCompletion();
         
         xSemaphoreGive(_mutex);
     }
 }
 
+// Chạy trong task esp_timer: chỉ đánh dấu để vòng lặp Core0 gọi update() ngay
+void TaskScheduler::_onCompletionDeadline(void* arg) {
+    static_cast<TaskScheduler*>(arg)->_deadlineDue = true;
+}
+
+void TaskScheduler::notifyRestoredZones(RelayMask zones) {
+    if (zones == 0) {
+        return;
+    }
+    
+    // Đọc hạn chót từ bộ phân xử trước khi khóa _mutex (startTask khóa theo thứ tự ngược lại)
+    int64_t endUs[IRRIGATION_MAX_ZONES];
+    for (int i = 0; i < IRRIGATION_MAX_ZONES; i++) {
+        ZoneLease lease;
+        if (!(zones & ((RelayMask)1 << i)) || !_arbiter.getLease(SOURCE_SCHEDULE, i, lease)) {
+            zones &= ~((RelayMask)1 << i);
+            continue;
+        }
+        endUs[i] = lease.hasExpiry ? lease.expiresAt : 0;
+    }
+    
+    if (xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        for (int i = 0; i < IRRIGATION_MAX_ZONES; i++) {
+            if (zones & ((RelayMask)1 << i)) {
+                // Vùng bận đến khi lease hết hạn, lịch khác không chạy chồng lên
+                _activeZonesBits.set(i);
+                _restoredEndUs[i] = endUs[i];
+                SchedulerTrace.record(TRACE_RESUMED, -1, 0, 0, -1, i + 1);
+            }
+        }
+        _restoredZones |= zones;
+        _rearmCompletion();
+        _scheduleStatusChanged = true;
+        xSemaphoreGive(_mutex);
+    }
+    
+    Serial.println("Scheduler: resumed irrigation zones after restart (mask 0x" + String(zones, HEX) + ")");
+}
+
+bool TaskScheduler::isDeadlineDue() const {
+    return _deadlineDue.load();
+}
+
+void TaskScheduler::_rearmCompletion() {
+    int64_t earliest = 0;
+    for (const auto& task : _tasks) {
+        if (task.state == RUNNING && task.end_us > 0 && (earliest == 0 || task.end_us < earliest)) {
+            earliest = task.end_us;
+        }
+    }
+    for (int i = 0; i < IRRIGATION_MAX_ZONES && _restoredZones != 0; i++) {
+        int64_t end = _restoredEndUs[i];
+        if ((_restoredZones & ((RelayMask)1 << i)) && end > 0 && (earliest == 0 || end < earliest)) {
+            earliest = end;
+        }
+    }
+    if (earliest > 0) {
+        _completionTimer.armAt(earliest);
+    } else {
+        _completionTimer.cancel();
+    }
+}
+
 bool TaskScheduler::checkSensorConditions(const IrrigationTask& task) {
     if (!task.sensor_condition.enabled) {
         return true; // Không kích hoạt điều kiện cảm biến, luôn cho phép chạy
@@ -571,6 +686,8 @@ bool TaskScheduler::checkSensorConditions(const IrrigationTask& task) {
         if (temp < condition.min_temperature || temp > condition.max_temperature) {
             Serial.println("Task " + String(task.id) + 
                          " skipped due to temperature out of range: " + String(temp) + "°C");
+            SchedulerTrace.record(TRACE_SKIP_TEMPERATURE, task.id, temp,
+                                  temp < condition.min_temperature ? condition.min_temperature : condition.max_temperature);
             return false;
         }
     }
@@ -581,6 +698,8 @@ bool TaskScheduler::checkSensorConditions(const IrrigationTask& task) {
         if (humidity < condition.min_humidity || humidity > condition.max_humidity) {
             Serial.println("Task " + String(task.id) + 
                          " skipped due to humidity out of range: " + String(humidity) + "%");
+            SchedulerTrace.record(TRACE_SKIP_HUMIDITY, task.id, humidity,
+                                  humidity < condition.min_humidity ? condition.min_humidity : condition.max_humidity);
             return false;
         }
     }
@@ -594,6 +713,8 @@ bool TaskScheduler::checkSensorConditions(const IrrigationTask& task) {
                 Serial.println("Task " + String(task.id) + 
                              " skipped due to soil moisture above threshold: " + 
                              String(moisture) + "% in zone " + String(zoneId));
+                SchedulerTrace.record(TRACE_SKIP_SOIL_MOISTURE, task.id, moisture,
+                                      condition.min_soil_moisture, -1, zoneId);
                 return false;
             }
         }
@@ -603,6 +724,7 @@ bool TaskScheduler::checkSensorConditions(const IrrigationTask& task) {
     if (condition.rain_check && condition.skip_when_raining) {
         if (_envManager.isRaining()) {
             Serial.println("Task " + String(task.id) + " skipped due to rain");
+            SchedulerTrace.record(TRACE_SKIP_RAIN, task.id, 1);
             return false;
         }
     }
@@ -613,6 +735,8 @@ bool TaskScheduler::checkSensorConditions(const IrrigationTask& task) {
         if (light < condition.min_light || light > condition.max_light) {
             Serial.println("Task " + String(task.id) + 
                          " skipped due to light level out of range: " + String(light) + " lux");
+            SchedulerTrace.record(TRACE_SKIP_LIGHT, task.id, light,
+                                  light < condition.min_light ? condition.min_light : condition.max_light);
             return false;
         }
     }
@@ -621,16 +745,42 @@ bool TaskScheduler::checkSensorConditions(const IrrigationTask& task) {
 }
 
 void TaskScheduler::startTask(IrrigationTask& task) {
+    uint32_t baseSeconds = (uint32_t)task.duration * 60;
+    task.run_seconds = 0;
+    
+    // Gom các vùng để bật cùng lúc qua một lần ghi relay; hạn chót của lease và
+    // của lịch tính từ cùng một mốc thời gian
+    RelayMask zones = 0;
+    int64_t startUs = DeadlineTimer::nowUs();
+    int64_t deadlinesUs[IRRIGATION_MAX_ZONES];
+    
     // Bật relay cho mỗi vùng
     for (uint8_t zoneId : task.zones) {
-        if (zoneId >= 1 && zoneId <= 6) {
+        if (isValidZoneId(zoneId)) {
             uint8_t relayIndex = zoneId - 1;
-            _relayManager.turnOn(relayIndex, task.duration * 60 * 1000);
+            
+            // Thời lượng của vùng, nhân hệ số ET0 nếu lịch có bật điều chỉnh
+            uint32_t zoneSeconds = baseSeconds;
+            if (task.et_adjust) {
+                float scale = _envManager.getDurationScale(zoneId);
+                zoneSeconds = (uint32_t)(baseSeconds * scale + 0.5f);
+                Serial.println("Task " + String(task.id) + " zone " + String(zoneId) +
+                               " ET0 scale " + String(scale) + " -> " + String(zoneSeconds) + "s");
+            }
+            if (zoneSeconds > task.run_seconds) {
+                task.run_seconds = zoneSeconds;
+            }
+            
+            zones |= (RelayMask)1 << relayIndex;
+            deadlinesUs[relayIndex] = startUs + (int64_t)zoneSeconds * 1000000;
             
             // Đánh dấu bit tương ứng với zone đang hoạt động (dùng 0-based index)
             _activeZonesBits.set(zoneId - 1);
         }
     }
+    _arbiter.acquireManyUntil(SOURCE_SCHEDULE, zones, true, deadlinesUs);
+    _restoredZones &= ~zones;   // Lease khôi phục đã được lịch này ghi đè
+    task.end_us = startUs + (int64_t)task.run_seconds * 1000000;
     
     // Cập nhật thông tin
     task.start_time = time(NULL);
@@ -646,22 +796,27 @@ void TaskScheduler::startTask(IrrigationTask& task) {
 }
 
 void TaskScheduler::stopTask(IrrigationTask& task) {
+    RelayMask zones = 0;
+    
     // Tắt relay cho mỗi vùng
     for (uint8_t zoneId : task.zones) {
-        if (zoneId >= 1 && zoneId <= 6) {
+        if (isValidZoneId(zoneId)) {
             uint8_t relayIndex = zoneId - 1;
-            _relayManager.turnOff(relayIndex);
+            zones |= (RelayMask)1 << relayIndex;
             
             // Reset bit tương ứng với zone đang hoạt động (dùng 0-based index)
             _activeZonesBits.reset(zoneId - 1);
         }
     }
+    // Chỉ trả lease của lịch; vùng đang được bật thủ công vẫn giữ nguyên
+    _arbiter.releaseMany(SOURCE_SCHEDULE, zones);
+    task.end_us = 0;
     
     Serial.println("Stopped irrigation task " + String(task.id));
 }
 
 bool TaskScheduler::isZoneBusy(uint8_t zoneId) {
-    if (zoneId >= 1 && zoneId <= 6) {
+    if (isValidZoneId(zoneId)) {
         // Kiểm tra bit tương ứng với zone (dùng 0-based index)
         return _activeZonesBits.test(zoneId - 1);
     }
@@ -3,9 +3,17 @@
 #include "../include/SensorManager.h"
 #include "../include/NetworkManager.h"
 #include "../include/RelayManager.h"
+#include "../include/ActuationArbiter.h"
 #include "../include/TaskScheduler.h"
 #include "../include/EnvironmentManager.h"
 #include "../include/Logger.h"
+#include "../include/DecisionTrace.h"
+#include "../include/FlightRecorder.h"
+#include "../include/CommandQueue.h"
+#include "../include/LatencyMonitor.h"
+#include "../include/ModbusRelayBackend.h"
+#include "../include/ModbusSlave.h"
+#include <atomic>
 #include <time.h>
 #include <Preferences.h>
 #include <nvs_flash.h>
@@ -16,6 +24,11 @@ static const char* JSON_KEY_ZONE = "zone";
 static const char* JSON_KEY_VALUE = "value";
 static const char* JSON_KEY_RAIN = "rain";
 static const char* JSON_KEY_LIGHT = "light";
+static const char* JSON_KEY_ET0 = "et0";
+static const char* JSON_KEY_LATITUDE = "latitude";
+static const char* JSON_KEY_REFERENCE = "reference";
+static const char* JSON_KEY_CROP_COEFFICIENT = "crop_coefficient";
+static const char* JSON_KEY_KC = "kc";
 static const char* JSON_KEY_TARGET = "target";
 static const char* JSON_KEY_LEVEL = "level";
 static const char* JSON_KEY_SERIAL = "serial";
@@ -25,12 +38,26 @@ static const char* JSON_KEY_ERROR = "ERROR";
 static const char* JSON_KEY_WARNING = "WARNING";
 static const char* JSON_KEY_INFO = "INFO";
 static const char* JSON_KEY_DEBUG = "DEBUG";
+static const char* JSON_KEY_FORMAT = "format";
+static const char* JSON_KEY_BINARY = "binary";
+static const char* JSON_KEY_JSON = "json";
+static const char* JSON_KEY_PERF = "perf";
+static const char* JSON_KEY_TAG = "tag";
+static const char* JSON_KEY_DEFAULT = "DEFAULT";
+static const char* JSON_KEY_ALL_TAGS = "*";
+static const char* JSON_KEY_THRESHOLD_MS = "threshold_ms";
+static const char* JSON_KEY_WINDOW_S = "window_s";
+static const char* JSON_KEY_LIMIT = "limit";
+static const char* JSON_KEY_RELAYS = "relays";
+static const char* JSON_KEY_ID = "id";
+static const char* JSON_KEY_DAILY_MAX = "daily_max";
 
 // Function prototypes
 void Core0TaskCode(void * parameter);
 void Core1TaskCode(void * parameter);
 void printLocalTime();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
+void handleMqttCommand(const char* topic, char* message, unsigned int length);
 
 // Core task definitions
 TaskHandle_t core0Task;  // Preemptive tasks: sensors, MQTT, scheduling
@@ -44,6 +71,9 @@ TaskHandle_t core1Task;  // Non-preemptive tasks: irrigation control
 // Stack sizes
 #define STACK_SIZE_CORE0 8192
 #define STACK_SIZE_CORE1 4096
+#define STACK_SIZE_CMD_WORKER 6144
+#define STACK_SIZE_MODBUS 4096
+#define STACK_SIZE_NETWORK 6144
 
 // Relay pin definitions
 const int relayPins[] = {
@@ -58,6 +88,43 @@ const int relayPins[] = {
 // Number of relays
 const int numRelays = 6;
 
+// Delay between relay activations to limit pump/valve inrush current (0 = disabled)
+#ifndef RELAY_INRUSH_STAGGER_MS
+#define RELAY_INRUSH_STAGGER_MS 0
+#endif
+
+// Extra relay modules over RS485 Modbus RTU on UART1 (0 = disabled).
+// Expansion relays are numbered after the GPIO relays; raise IRRIGATION_MAX_ZONES to cover them.
+#ifndef RELAY_EXPANSION_MODBUS
+#define RELAY_EXPANSION_MODBUS 0
+#endif
+#ifndef RELAY_EXPANSION_BAUD
+#define RELAY_EXPANSION_BAUD 9600
+#endif
+
+#if RELAY_EXPANSION_MODBUS
+// Expansion modules: {slave address, relay count, first coil}
+const ModbusRelaySlave relayExpansionSlaves[] = {
+  {1, 8, 0}
+};
+ModbusRelayBackend relayExpansion(relayExpansionSlaves, sizeof(relayExpansionSlaves) / sizeof(relayExpansionSlaves[0]));
+#endif
+
+// Modbus RTU slave on UART1 for a local PLC/SCADA (0 = disabled)
+#ifndef MODBUS_SLAVE_ENABLED
+#define MODBUS_SLAVE_ENABLED 0
+#endif
+#ifndef MODBUS_SLAVE_ADDRESS
+#define MODBUS_SLAVE_ADDRESS 1
+#endif
+#ifndef MODBUS_SLAVE_BAUD
+#define MODBUS_SLAVE_BAUD 9600
+#endif
+
+#if MODBUS_SLAVE_ENABLED && RELAY_EXPANSION_MODBUS
+#error "UART1 is shared: enable either RELAY_EXPANSION_MODBUS or MODBUS_SLAVE_ENABLED"
+#endif
+
 // WiFi and MQTT configuration
 // const char* WIFI_SSID = "2.4 KariS";  // Sẽ không dùng trực tiếp nữa, NetworkManager sẽ xử lý
 // const char* WIFI_PASSWORD = "12123402";  // Sẽ không dùng trực tiếp nữa
@@ -72,10 +139,23 @@ const char* MQTT_TOPIC_STATUS = "irrigation/esp32_6relay/status";
 const char* MQTT_TOPIC_SCHEDULE = "irrigation/esp32_6relay/schedule";
 const char* MQTT_TOPIC_SCHEDULE_STATUS = "irrigation/esp32_6relay/schedule/status";
 const char* MQTT_TOPIC_ENV_CONTROL = "irrigation/esp32_6relay/environment";
+const char* MQTT_TOPIC_RELAY_CONFIG = "irrigation/esp32_6relay/relay/config";
 
 // Add a new MQTT topic for log configuration
 const char* MQTT_TOPIC_LOG_CONFIG = "irrigation/esp32_6relay/logconfig";
 
+// Scheduler decision trace: request on /trace, response on /trace/data
+const char* MQTT_TOPIC_TRACE = "irrigation/esp32_6relay/trace";
+const char* MQTT_TOPIC_TRACE_DATA = "irrigation/esp32_6relay/trace/data";
+const size_t TRACE_MQTT_DEFAULT_RECORDS = 16;  // Upper bound; the reply is also cut to fit the MQTT buffer
+std::atomic<size_t> pendingTraceRequest(0);  // Trace records requested by the command worker, published by Core0
+
+// Flight recorder events from before the last reset, published once after boot
+const char* MQTT_TOPIC_FLIGHT = "irrigation/esp32_6relay/flight";
+
+// Actuation latency percentiles, published periodically
+const char* MQTT_TOPIC_LATENCY = "irrigation/esp32_6relay/latency";
+
 // NTP configuration
 const char* NTP_SERVER = "pool.ntp.org";
 const char* TZ_INFO = "Asia/Ho_Chi_Minh";  // Vietnam timezone
@@ -84,14 +164,20 @@ const char* TZ_INFO = "Asia/Ho_Chi_Minh";  // Vietnam timezone
 SensorManager sensorManager;
 NetworkManager networkManager;
 RelayManager relayManager;
+ActuationArbiter actuationArbiter(relayManager);
 EnvironmentManager envManager(sensorManager);
-TaskScheduler taskScheduler(relayManager, envManager);
+TaskScheduler taskScheduler(actuationArbiter, envManager);
+#if MODBUS_SLAVE_ENABLED
+ModbusSlave modbusSlave(relayManager, actuationArbiter, envManager);
+#endif
 
 // Time tracking variables
 unsigned long lastSensorReadTime = 0;
 const unsigned long sensorReadInterval = 30000;  // Read sensors and send data every 30 seconds
 unsigned long lastForcedStatusReportTime = 0;
 const unsigned long forcedStatusReportInterval = 5 * 60 * 1000;  // Force status update every 5 minutes
+unsigned long lastLatencyReportTime = 0;
+const unsigned long latencyReportInterval = 60 * 1000;  // Publish actuation latency percentiles every minute
 unsigned long lastEnvUpdateTime = 0;
 const unsigned long envUpdateInterval = 2000;  // Update environment readings every 2 seconds
 
@@ -118,20 +204,20 @@ void printLocalTime() {
                 " (Day of week: " + String(timeinfo.tm_wday) + ")");
 }
 
-// MQTT callback function
+// MQTT callback function - runs inside networkManager.loop(), only copies the message into a queue slot
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
-  // Convert payload to string
-  char message[length + 1];
-  memcpy(message, payload, length);
-  message[length] = '\0';
-  
-  AppLogger.debug("MQTTCallbk", "Received MQTT message on topic: " + String(topic));
-  AppLogger.debug("MQTTCallbk", "Payload: " + String(message));
+  MqttCommands.enqueue(topic, payload, length);
+}
+
+// Command worker - processes queued MQTT messages outside the network loop
+void handleMqttCommand(const char* topic, char* message, unsigned int length) {
+  LOGD("MQTTCallbk", "Received MQTT message on topic: %s", topic);
+  LOGD("MQTTCallbk", "Payload: %s", message);
   
   // Process message based on topic
   if (strcmp(topic, MQTT_TOPIC_CONTROL) == 0) {
-    // Process relay control command - không publish ngay, để do phát hiện thay đổi
-    relayManager.processCommand(message);
+    // Process relay control command through the arbiter (manual/rule leases) - không publish ngay, để do phát hiện thay đổi
+    actuationArbiter.processCommand(message);
   }
   else if (strcmp(topic, MQTT_TOPIC_SCHEDULE) == 0) {
     // Process scheduling command - không publish ngay, để do phát hiện thay đổi
@@ -139,7 +225,7 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
   }
   else if (strcmp(topic, MQTT_TOPIC_ENV_CONTROL) == 0) {
     // Process environment control command
-    StaticJsonDocument<256> doc; // Ước tính kích thước đủ cho payload này
+    StaticJsonDocument<384> doc; // Ước tính kích thước đủ cho payload này (kể cả cấu hình ET0)
     DeserializationError error = deserializeJson(doc, message);
     
     if (error) {
@@ -167,6 +253,22 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       envManager.setLightLevel(lightLevel);
       AppLogger.info("MQTTCallbk", "Manual light level update: " + String(lightLevel));
     }
+    
+    // Cấu hình ước tính ET0
+    if (doc.containsKey(JSON_KEY_ET0)) {
+      JsonObject et0 = doc[JSON_KEY_ET0];
+      if (et0.containsKey(JSON_KEY_LATITUDE)) {
+        envManager.setLatitude(et0[JSON_KEY_LATITUDE].as<float>());
+      }
+      if (et0.containsKey(JSON_KEY_REFERENCE)) {
+        envManager.setReferenceEt0(et0[JSON_KEY_REFERENCE].as<float>());
+      }
+    }
+    
+    if (doc.containsKey(JSON_KEY_CROP_COEFFICIENT)) {
+      JsonObject crop = doc[JSON_KEY_CROP_COEFFICIENT];
+      envManager.setCropCoefficient(crop[JSON_KEY_ZONE], crop[JSON_KEY_KC].as<float>());
+    }
   }
   else if (strcmp(topic, MQTT_TOPIC_LOG_CONFIG) == 0) {
     // Process log configuration command
@@ -180,10 +282,57 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       return;
     }
 
-    const char* target = doc[JSON_KEY_TARGET]; // "serial" or "mqtt"
+    const char* target = doc[JSON_KEY_TARGET]; // "serial", "mqtt" or "perf"
     const char* levelStr = doc[JSON_KEY_LEVEL];  // "NONE", "CRITICAL", "ERROR", "WARNING", "INFO", "DEBUG"
+    const char* formatStr = doc[JSON_KEY_FORMAT]; // "json" or "binary" (tokenized), mqtt target only
+    const char* tagStr = doc[JSON_KEY_TAG];       // Optional: level for this tag only ("DEFAULT" removes it)
+
+    if (target && strcmp(target, JSON_KEY_PERF) == 0) {
+      // {"target":"perf","threshold_ms":500,"window_s":60}, both optional
+      if (doc.containsKey(JSON_KEY_THRESHOLD_MS)) {
+        AppLogger.setPerfThreshold(doc[JSON_KEY_THRESHOLD_MS].as<uint32_t>());
+      }
+      if (doc.containsKey(JSON_KEY_WINDOW_S)) {
+        AppLogger.setPerfWindow(doc[JSON_KEY_WINDOW_S].as<uint32_t>() * 1000UL);
+      }
+      return;
+    }
+
+    if (target && formatStr && strcmp(target, JSON_KEY_MQTT) == 0) {
+      if (strcmp(formatStr, JSON_KEY_BINARY) == 0) {
+        AppLogger.setMqttFormat(LOG_MQTT_BINARY);
+      } else if (strcmp(formatStr, JSON_KEY_JSON) == 0) {
+        AppLogger.setMqttFormat(LOG_MQTT_JSON);
+      } else {
+        AppLogger.warning("MQTTCallbk", "Invalid log format: " + String(formatStr));
+      }
+      if (!levelStr) {
+        return;
+      }
+    }
+
+    if (tagStr && levelStr && strcmp(tagStr, JSON_KEY_ALL_TAGS) == 0 && strcmp(levelStr, JSON_KEY_DEFAULT) == 0) {
+      AppLogger.clearTagLevels(); // {"tag":"*","level":"DEFAULT"}: back to the global levels
+      return;
+    }
 
     if (target && levelStr) {
+      if (tagStr) {
+        LogTarget logTarget;
+        if (strcmp(target, JSON_KEY_SERIAL) == 0) {
+          logTarget = LOG_TARGET_SERIAL;
+        } else if (strcmp(target, JSON_KEY_MQTT) == 0) {
+          logTarget = LOG_TARGET_MQTT;
+        } else {
+          AppLogger.warning("MQTTCallbk", "Invalid log config target: " + String(target));
+          return;
+        }
+        if (strcmp(levelStr, JSON_KEY_DEFAULT) == 0) {
+          AppLogger.clearTagLevel(tagStr, logTarget);
+          return;
+        }
+      }
+
       LogLevel newLevel = LOG_LEVEL_NONE; // Default
       if (strcmp(levelStr, JSON_KEY_CRITICAL) == 0) newLevel = LOG_LEVEL_CRITICAL;
       else if (strcmp(levelStr, JSON_KEY_ERROR) == 0) newLevel = LOG_LEVEL_ERROR;
@@ -191,7 +340,9 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       else if (strcmp(levelStr, JSON_KEY_INFO) == 0) newLevel = LOG_LEVEL_INFO;
       else if (strcmp(levelStr, JSON_KEY_DEBUG) == 0) newLevel = LOG_LEVEL_DEBUG;
 
-      if (strcmp(target, JSON_KEY_SERIAL) == 0) {
+      if (tagStr) {
+        AppLogger.setTagLevel(tagStr, strcmp(target, JSON_KEY_SERIAL) == 0 ? LOG_TARGET_SERIAL : LOG_TARGET_MQTT, newLevel);
+      } else if (strcmp(target, JSON_KEY_SERIAL) == 0) {
         AppLogger.setSerialLogLevel(newLevel);
         // AppLogger.setSerialLogLevel already logs this change
       } else if (strcmp(target, JSON_KEY_MQTT) == 0) {
@@ -204,16 +355,50 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
       AppLogger.warning("MQTTCallbk", "Log config command missing 'target' or 'level' field.");
     }
   }
+  else if (strcmp(topic, MQTT_TOPIC_RELAY_CONFIG) == 0) {
+    // Per-relay configuration: {"relays": [{"id": 1, "daily_max": 3600}]}
+    DynamicJsonDocument doc(JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(IRRIGATION_MAX_ZONES) +
+                            IRRIGATION_MAX_ZONES * JSON_OBJECT_SIZE(2));
+    DeserializationError error = deserializeJson(doc, message);
+    
+    if (error) {
+      AppLogger.error("MQTTCallbk", "Relay config JSON parsing failed: " + String(error.c_str()));
+      return;
+    }
+    
+    JsonArray relays = doc[JSON_KEY_RELAYS];
+    for (JsonObject relay : relays) {
+      int id = relay[JSON_KEY_ID] | 0;
+      if (id < 1 || id > relayManager.getRelayCount()) {
+        AppLogger.warning("MQTTCallbk", "Relay config: invalid relay ID " + String(id));
+        continue;
+      }
+      if (relay.containsKey(JSON_KEY_DAILY_MAX)) {
+        relayManager.setDailyLimit(id - 1, relay[JSON_KEY_DAILY_MAX].as<uint32_t>());
+      }
+    }
+  }
+  else if (strcmp(topic, MQTT_TOPIC_TRACE) == 0) {
+    // Process decision trace query, payload is optional: {"limit": N}
+    size_t limit = TRACE_MQTT_DEFAULT_RECORDS;
+    StaticJsonDocument<64> doc;
+    if (length > 0 && !deserializeJson(doc, message) && doc.containsKey(JSON_KEY_LIMIT)) {
+      int requested = doc[JSON_KEY_LIMIT];
+      if (requested > 0) {
+        limit = min((size_t)requested, TRACE_MQTT_DEFAULT_RECORDS);
+      }
+    }
+    // Publishing stays on Core0 with the rest of the MQTT traffic
+    pendingTraceRequest = limit;
+  }
 }
 
-// Core 0 Task - Handles sensors, network, MQTT (preemptive)
+// Core 0 Task - Handles sensors, MQTT publishing, scheduling (preemptive)
+// WiFi/MQTT connections are kept by the network task, so a dead broker never stalls this loop
 void Core0TaskCode(void * parameter) {
   AppLogger.info("Core0", "Task started on core " + String(xPortGetCoreID()));
   
   for(;;) {
-    // Maintain network connection
-    networkManager.loop();
-    
     unsigned long currentTime = millis();
     
     // Read data from sensors and send to MQTT server
@@ -230,9 +415,8 @@ void Core0TaskCode(void * parameter) {
           envManager.setCurrentHumidity(sensorManager.getHumidity());
           envManager.setCurrentHeatIndex(sensorManager.getHeatIndex());
           
-          AppLogger.debug("Core0", "Sensors read: T=" + String(sensorManager.getTemperature()) +
-                          "°C, H=" + String(sensorManager.getHumidity()) +
-                          "%, HI=" + String(sensorManager.getHeatIndex()) + "°C");
+          LOGD("Core0", "Sensors read: T=%.2f°C, H=%.2f%%, HI=%.2f°C", sensorManager.getTemperature(),
+               sensorManager.getHumidity(), sensorManager.getHeatIndex());
           
           if (networkManager.isConnected()) {
             // Use API Key from NetworkManager
@@ -242,10 +426,10 @@ void Core0TaskCode(void * parameter) {
             unsigned long mqttPublishStartTime = millis();
             bool mqttSuccess = networkManager.publish(MQTT_TOPIC_SENSORS, payload.c_str());
             unsigned long mqttPublishDuration = millis() - mqttPublishStartTime;
-            AppLogger.perf("Core0", "MQTTSensorDataPublish", mqttPublishDuration, mqttSuccess);
+            LOG_PERF("Core0", "MQTTSensorDataPublish", mqttPublishDuration, mqttSuccess);
             
             if (mqttSuccess) {
-              AppLogger.debug("Core0", "Sensor data published to MQTT successfully.");
+              LOGD("Core0", "Sensor data published to MQTT successfully.");
             } else {
               AppLogger.error("Core0", "Failed to publish sensor data to MQTT.");
             }
@@ -260,7 +444,7 @@ void Core0TaskCode(void * parameter) {
         }
         
         unsigned long sensorReadDuration = millis() - sensorReadStartTime;
-        AppLogger.perf("Core0", "SensorReadOperation", sensorReadDuration, readSuccess);
+        LOG_PERF("Core0", "SensorReadOperation", sensorReadDuration, readSuccess);
         
         // Release mutex after accessing sensor data
         xSemaphoreGive(sensorDataMutex);
@@ -274,11 +458,13 @@ void Core0TaskCode(void * parameter) {
       
       if (relayManager.hasStatusChangedAndReset() || forcedReport) {
         String statusPayload = relayManager.getStatusJson(apiKey.c_str()); // Use retrieved API Key
-        networkManager.publish(MQTT_TOPIC_STATUS, statusPayload.c_str());
+        if (networkManager.publish(MQTT_TOPIC_STATUS, statusPayload.c_str())) {
+          ActuationLatency.markStatusPublished();
+        }
         if (forcedReport) {
-          AppLogger.debug("Core0", "Relay status published to MQTT (forced report)");
+          LOGD("Core0", "Relay status published to MQTT (forced report)");
         } else {
-          AppLogger.debug("Core0", "Relay status published to MQTT");
+          LOGD("Core0", "Relay status published to MQTT");
         }
       }
       
@@ -290,9 +476,37 @@ void Core0TaskCode(void * parameter) {
         String schedulePayload = taskScheduler.getTasksJson(apiKeyForScheduler.c_str()); // Use retrieved API Key
         networkManager.publish(MQTT_TOPIC_SCHEDULE_STATUS, schedulePayload.c_str());
         if (forcedReport) {
-          AppLogger.debug("Core0", "Schedule status published to MQTT (forced report)");
+          LOGD("Core0", "Schedule status published to MQTT (forced report)");
         } else {
-          AppLogger.debug("Core0", "Schedule status published to MQTT");
+          LOGD("Core0", "Schedule status published to MQTT");
+        }
+      }
+      
+      // Publish actuation latency percentiles for the last interval
+      if (currentTime - lastLatencyReportTime >= latencyReportInterval) {
+        lastLatencyReportTime = currentTime;
+        String latencyPayload = ActuationLatency.toJson(apiKey.c_str());
+        networkManager.publish(MQTT_TOPIC_LATENCY, latencyPayload.c_str());
+      }
+      
+      // Trả lời yêu cầu truy vết quyết định do command worker chuyển sang
+      size_t traceLimit = pendingTraceRequest.exchange(0);
+      if (traceLimit > 0) {
+        // Oldest records are dropped until the reply fits the MQTT buffer (fixed header, topic length and topic included)
+        size_t traceBytes = MQTT_BUFFER_SIZE - 7 - strlen(MQTT_TOPIC_TRACE_DATA);
+        String tracePayload = SchedulerTrace.toJson(apiKey.c_str(), traceLimit, traceBytes);
+        networkManager.publish(MQTT_TOPIC_TRACE_DATA, tracePayload.c_str());
+      }
+      
+      // Gửi hộp đen của lần chạy trước (một lần sau khởi động, thử lại nếu publish lỗi)
+      if (FlightLog.hasDump()) {
+        bool sent = true;
+        for (size_t page = 0; page < FlightLog.dumpPages() && sent; page++) {
+          String flightPayload = FlightLog.dumpJson(apiKey.c_str(), page);
+          sent = networkManager.publish(MQTT_TOPIC_FLIGHT, flightPayload.c_str());
+        }
+        if (sent) {
+          FlightLog.markDumped();
         }
       }
       
@@ -302,14 +516,20 @@ void Core0TaskCode(void * parameter) {
       }
     }
     
+    // Persist relay run-time statistics (batched, at most every few minutes)
+    relayManager.flushUsageIfDue();
+    
+    // Timed leases from the flash fallback wait for a valid clock after a power loss
+    taskScheduler.notifyRestoredZones(actuationArbiter.restoreDeferred());
+    
     // Check and update irrigation schedules - Event-driven approach
     time_t current_time_for_scheduler;
     time(&current_time_for_scheduler);
     time_t next_check = taskScheduler.getEarliestNextCheckTime();
     
-    if (next_check == 0 || current_time_for_scheduler >= next_check) {
+    if (next_check == 0 || current_time_for_scheduler >= next_check || taskScheduler.isDeadlineDue()) {
       // Nếu next_check là 0 (chưa có lịch, hoặc cần tính toán lại lần đầu)
-      // hoặc đã đến/qua thời điểm kiểm tra
+      // hoặc đã đến/qua thời điểm kiểm tra, hoặc có lịch đến hạn chót kết thúc
       taskScheduler.update();
     }
     
@@ -366,11 +586,14 @@ void Core1TaskCode(void * parameter) {
   AppLogger.info("Core1", "Task started on core " + String(xPortGetCoreID()));
   
   for(;;) {
+    // Sleep until an esp_timer deadline (relay end, staggered start or lease expiry) fires
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    
+    // Expire arbiter leases first so a lower-priority lease can take over before the relay timer fires
+    actuationArbiter.update();
+    
     // Update relay manager to handle timer-based relay control
     relayManager.update();
-    
-    // This is a non-preemptive task, so we can have longer delay
-    vTaskDelay(100 / portTICK_PERIOD_MS);
   }
 }
 
@@ -415,6 +638,10 @@ void setup() {
   // placing AppLogger.begin() here is fine.
   AppLogger.begin(&networkManager, LOG_LEVEL_DEBUG, LOG_LEVEL_INFO); 
 
+  // Flight recorder in RTC memory: keep what the previous run recorded before it reset,
+  // then start recording this run (before any relay, scheduler or network activity)
+  FlightLog.begin();
+
   // THÊM VÀO: Khởi tạo và đọc cấu hình từ NVS (ví dụ)
   // preferences.begin("app-config", false); // false = read/write, true = read-only
   // String storedSsid = preferences.getString("wifi_ssid", WIFI_SSID);
@@ -428,11 +655,8 @@ void setup() {
   // Initialize NetworkManager FIRST
   // Pass empty strings for initial SSID/password to allow NVS loading or portal activation.
   // MQTT server and port are no longer passed here; NetworkManager loads them.
-  if (!networkManager.begin("", "")) { 
-    AppLogger.warning("Main", "NetworkManager did not connect to WiFi/MQTT. Config Portal might be active or system will retry.");
-  } else {
-    AppLogger.info("Main", "NetworkManager initialized and connected to WiFi/MQTT successfully.");
-  }
+  // Does not wait for WiFi/MQTT: the network task started at the end of setup() connects both
+  networkManager.begin("", "");
 
   // Now that NetworkManager has loaded its config (including MQTT server, port, API key from NVS or defaults),
   // we can log them or use them. For example, if AppLogger needs the API key:
@@ -450,28 +674,58 @@ void setup() {
   GPIO_Init();
   AppLogger.info("Setup", "GPIO initialized");
   
+  // The relay worker exists before anything can arm a deadline: leases and relay timers
+  // restored in begin() wake it instead of running update() inside the esp_timer task
+  xTaskCreatePinnedToCore(
+    Core1TaskCode, "Core1Task", STACK_SIZE_CORE1, NULL, PRIORITY_MEDIUM, &core1Task, 1);
+  relayManager.setWorkerTask(core1Task);
+  actuationArbiter.setWorkerTask(core1Task);
+  
   // Initialize relay manager
   AppLogger.debug("Setup", "Initializing RelayManager...");
+#if RELAY_EXPANSION_MODBUS
+  relayExpansion.begin(Serial1, RELAY_EXPANSION_BAUD, RXD1, TXD1, STACK_SIZE_MODBUS, PRIORITY_MEDIUM, 0,
+                       IRRIGATION_MAX_ZONES - numRelays);
+  relayManager.begin(relayPins, numRelays, &relayExpansion);
+#else
   relayManager.begin(relayPins, numRelays);
+#endif
+  relayManager.setInrushStagger(RELAY_INRUSH_STAGGER_MS);
+  actuationArbiter.begin(relayManager.getRelayCount());
   
   // Initialize task scheduler
   AppLogger.debug("Setup", "Initializing TaskScheduler...");
   taskScheduler.begin();
+  taskScheduler.notifyRestoredZones(actuationArbiter.getRestoredZones(SOURCE_SCHEDULE));
   
   // Initialize sensors
   AppLogger.debug("Setup", "Initializing SensorManager...");
   sensorManager.begin();
   
+#if MODBUS_SLAVE_ENABLED
+  // Local PLC/SCADA access; reads are served from a register image, writes go through the arbiter
+  modbusSlave.begin(Serial1, MODBUS_SLAVE_BAUD, RXD1, TXD1, MODBUS_SLAVE_ADDRESS, STACK_SIZE_MODBUS, PRIORITY_MEDIUM, 0);
+#endif
+  
   // Configure NTP and MQTT subscriptions if network is connected
   // VIỆC SUBSCRIBE SẼ DO NETWORKMANAGER TỰ QUẢN LÝ SAU KHI KẾT NỐI
   // Các lệnh networkManager.subscribe() ở đây sẽ được xóa và chuyển logic vào NetworkManager
 
   // Đăng ký các topic cần thiết thông qua NetworkManager. 
   // NetworkManager sẽ lưu chúng lại và tự động subscribe/resubscribe khi kết nối MQTT.
+  // Inbound messages are copied into preallocated slots and handled by a worker on Core1
+  MqttCommands.begin(handleMqttCommand, "CmdWorker", STACK_SIZE_CMD_WORKER, PRIORITY_MEDIUM, 1);
+  networkManager.setCallback(mqttCallback);
+  
   networkManager.subscribe(MQTT_TOPIC_CONTROL);
   networkManager.subscribe(MQTT_TOPIC_SCHEDULE);
   networkManager.subscribe(MQTT_TOPIC_ENV_CONTROL);
   networkManager.subscribe(MQTT_TOPIC_LOG_CONFIG);
+  networkManager.subscribe(MQTT_TOPIC_TRACE);
+  networkManager.subscribe(MQTT_TOPIC_RELAY_CONFIG);
+
+  // Connection management (WiFi, MQTT connect/retry, NTP) runs from here on in its own task
+  networkManager.startTask("NetTask", STACK_SIZE_NETWORK, PRIORITY_MEDIUM, 0);
 
   // Đèn LED và Buzzer báo hiệu trạng thái sẽ được quản lý trong Core0TaskCode dựa trên networkManager.isConnected()
   // Bỏ các lệnh LED và Buzzer trực tiếp ở đây để tránh xung đột
@@ -490,12 +744,10 @@ void setup() {
   }
   */
 
-  // Create tasks and pin to cores
-  AppLogger.info("Setup", "Creating and pinning tasks to cores...");
+  // Create the Core0 task (Core1 was started before the relay restore)
+  AppLogger.info("Setup", "Creating and pinning Core0 task...");
   xTaskCreatePinnedToCore(
     Core0TaskCode, "Core0Task", STACK_SIZE_CORE0, NULL, PRIORITY_MEDIUM, &core0Task, 0);
-  xTaskCreatePinnedToCore(
-    Core1TaskCode, "Core1Task", STACK_SIZE_CORE1, NULL, PRIORITY_MEDIUM, &core1Task, 1);
     
   AppLogger.info("Setup", "System setup sequence completed. Tasks are running.");
   AppLogger.info("Setup", "---------------- SYSTEM READY ----------------");
@@ -508,6 +760,15 @@ void loop() {
   // THÊM VÀO: In ra Stack High Water Mark để theo dõi bộ nhớ
   // Nên thực hiện sau khi hệ thống đã chạy ổn định một thời gian để có số liệu chính xác.
   // Có thể đặt trong một điều kiện if để chỉ in định kỳ (ví dụ: mỗi 60 giây)
+  // Heap/stack low-water marks for the flight recorder (only new lows are recorded)
+  static unsigned long lastWatermarkTime = 0;
+  if (millis() - lastWatermarkTime >= FLIGHT_WATERMARK_INTERVAL_MS) {
+    lastWatermarkTime = millis();
+    FlightLog.recordWatermark(FLIGHT_WM_HEAP, ESP.getMinFreeHeap(), ESP.getFreeHeap(), FLIGHT_HEAP_STEP);
+    FlightLog.recordWatermark(FLIGHT_WM_CORE0_STACK, uxTaskGetStackHighWaterMark(core0Task) * sizeof(StackType_t), 0, FLIGHT_STACK_STEP);
+    FlightLog.recordWatermark(FLIGHT_WM_CORE1_STACK, uxTaskGetStackHighWaterMark(core1Task) * sizeof(StackType_t), 0, FLIGHT_STACK_STEP);
+  }
+
   static unsigned long lastStackCheckTime = 0;
   if (millis() - lastStackCheckTime > 60000) { // Mỗi 60 giây
     lastStackCheckTime = millis();
@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+"""Build the token dictionary for tokenized MQTT logs.
+
+Scans src/ and include/ for LOG*() / LOG_PERF() / AppLogger calls and maps the
+16-bit tokens the firmware computes (FNV-1a folded to 16 bits, see
+include/LogToken.h) back to format strings, tags and perf event names:
+
+    python3 tools/log_dictionary.py -o log_dictionary.json
+
+Exits with status 1 if two different strings share a token. As a PlatformIO
+pre-script (extra_scripts = pre:tools/log_dictionary.py) it writes
+log_dictionary.json into the build directory on every build.
+"""
+
+import argparse
+import json
+import os
+import re
+import sys
+
+SOURCE_DIRS = ("src", "include")
+SOURCE_EXTENSIONS = (".cpp", ".h")
+
+FORMAT_CALL = re.compile(r"\bLOG[CEWID]\s*\(")
+PERF_CALL = re.compile(r"\b(?:LOG_PERF|AppLogger\.perf)\s*\(")
+TAG_CALL = re.compile(r"\bAppLogger\.(?:critical|error|warning|info|debug|log|logf)\s*\(")
+STRING = re.compile(r'"((?:[^"\\\n]|\\.)*)"')
+ESCAPES = {"n": 10, "t": 9, "r": 13, "\\": 92, '"': 34, "'": 39, "a": 7, "b": 8, "f": 12, "v": 11}
+
+
+def token(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    folded = ((h >> 16) ^ h) & 0xFFFF
+    return folded or 1
+
+
+def unescape(literal):
+    """C string literal body -> bytes, as the compiler stores it (UTF-8 source)."""
+    out = bytearray()
+    raw = literal.encode("utf-8")
+    i = 0
+    while i < len(raw):
+        c = raw[i]
+        if c != 0x5C:
+            out.append(c)
+            i += 1
+            continue
+        e = chr(raw[i + 1])
+        if e == "x":
+            m = re.match(rb"[0-9a-fA-F]+", raw[i + 2:])
+            out.append(int(m.group(0), 16) & 0xFF)
+            i += 2 + len(m.group(0))
+        elif e in "01234567":
+            m = re.match(rb"[0-7]{1,3}", raw[i + 1:])
+            out.append(int(m.group(0), 8) & 0xFF)
+            i += 1 + len(m.group(0))
+        else:
+            out.append(ESCAPES.get(e, ord(e)))
+            i += 2
+    return bytes(out)
+
+
+def read_strings(text, pos):
+    """Adjacent string literals starting at pos (after whitespace); returns (bytes, end) or (None, pos)."""
+    parts = []
+    while True:
+        m = re.compile(r"\s*").match(text, pos)
+        pos_ws = m.end()
+        m = STRING.match(text, pos_ws)
+        if not m:
+            break
+        parts.append(unescape(m.group(1)))
+        pos = m.end()
+    return (b"".join(parts), pos) if parts else (None, pos)
+
+
+def skip_argument(text, pos):
+    """Position of the comma that ends the argument starting at pos, or -1."""
+    depth = 0
+    while pos < len(text):
+        c = text[pos]
+        if c == '"':
+            m = STRING.match(text, pos)
+            pos = m.end() if m else pos + 1
+            continue
+        if c in "([{":
+            depth += 1
+        elif c in ")]}":
+            if depth == 0:
+                return -1
+            depth -= 1
+        elif c == "," and depth == 0:
+            return pos
+        pos += 1
+    return -1
+
+
+def strip_comments(text):
+    def blank(m):
+        s = m.group(0)
+        return s if s.startswith('"') else re.sub(r"[^\n]", " ", s)
+    return re.sub(r'"(?:[^"\\\n]|\\.)*"|//[^\n]*|/\*.*?\*/', blank, text, flags=re.S)
+
+
+def scan(root):
+    tables = {"formats": {}, "tags": {}, "events": {}}
+    collisions = []
+
+    def add(kind, data, where):
+        t = token(data)
+        text = data.decode("utf-8", errors="replace")
+        seen = tables[kind].get(t)
+        if seen is not None and seen != text:
+            collisions.append("%s token 0x%04x: %r and %r (%s)" % (kind, t, seen, text, where))
+        tables[kind][t] = text
+
+    for directory in SOURCE_DIRS:
+        for dirpath, _, files in os.walk(os.path.join(root, directory)):
+            for name in sorted(files):
+                if not name.endswith(SOURCE_EXTENSIONS):
+                    continue
+                path = os.path.join(dirpath, name)
+                with open(path, encoding="utf-8") as f:
+                    text = strip_comments(f.read())
+                where = os.path.relpath(path, root)
+
+                for m in FORMAT_CALL.finditer(text):
+                    tag, _ = read_strings(text, m.end())
+                    if tag is not None:
+                        add("tags", tag, where)
+                    comma = skip_argument(text, m.end())
+                    if comma >= 0:
+                        fmt, _ = read_strings(text, comma + 1)
+                        if fmt is not None:
+                            add("formats", fmt, where)
+                for m in PERF_CALL.finditer(text):
+                    tag, _ = read_strings(text, m.end())
+                    if tag is not None:
+                        add("tags", tag, where)
+                    comma = skip_argument(text, m.end())
+                    if comma >= 0:
+                        event, _ = read_strings(text, comma + 1)
+                        if event is not None:
+                            add("events", event, where)
+                for m in TAG_CALL.finditer(text):
+                    pos = m.end()
+                    if text[m.start():m.end()].rstrip("( \t").endswith(("log", "logf")):
+                        comma = skip_argument(text, pos)  # Skip the level argument
+                        if comma < 0:
+                            continue
+                        pos = comma + 1
+                    tag, _ = read_strings(text, pos)
+                    if tag is not None:
+                        add("tags", tag, where)
+
+    dictionary = {"version": 1}
+    for kind, table in tables.items():
+        dictionary[kind] = {"0x%04x" % t: s for t, s in sorted(table.items())}
+    return dictionary, collisions
+
+
+def write(root, output):
+    dictionary, collisions = scan(root)
+    with open(output, "w", encoding="utf-8") as f:
+        json.dump(dictionary, f, indent=2, ensure_ascii=False)
+        f.write("\n")
+    for c in collisions:
+        print("log_dictionary: collision, " + c, file=sys.stderr)
+    return dictionary, collisions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-o", "--output", default="log_dictionary.json")
+    parser.add_argument("--root", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir))
+    args = parser.parse_args()
+    dictionary, collisions = write(os.path.abspath(args.root), args.output)
+    print("%s: %d formats, %d tags, %d events" % (args.output, len(dictionary["formats"]),
+                                                 len(dictionary["tags"]), len(dictionary["events"])))
+    sys.exit(1 if collisions else 0)
+
+
+try:
+    Import("env")  # noqa: F821 - defined when run by PlatformIO/SCons
+except NameError:
+    if __name__ == "__main__":
+        main()
+else:
+    _build_dir = env.subst("$BUILD_DIR")  # noqa: F821
+    os.makedirs(_build_dir, exist_ok=True)
+    _, _collisions = write(env.subst("$PROJECT_DIR"), os.path.join(_build_dir, "log_dictionary.json"))  # noqa: F821
+    if _collisions:
+        env.Exit(1)  # noqa: F821
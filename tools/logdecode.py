@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+"""Decode tokenized binary log frames into text lines.
+
+Reads one frame per line as hex, as printed by mosquitto_sub, decompresses it
+if needed and writes its entries in the firmware's Serial format, reporting
+gaps in the frame sequence numbers:
+
+    mosquitto_sub -h <broker> -t irrigation/esp32_6relay/logs/bin -F %x | \\
+        python3 tools/logdecode.py --dict .pio/build/esp32-s3-devkitc-1/log_dictionary.json
+
+The dictionary comes from tools/log_dictionary.py; it must match the firmware
+that produced the frames. Frame layout: see LOG_BINARY_* in include/Logger.h.
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+MAGIC = 0x4C
+VERSION = 2
+FLAG_COMPRESSED = 0x01
+LEVELS = {1: "CRITICAL", 2: "ERROR", 3: "WARNING", 4: "INFO", 5: "DEBUG"}
+CONVERSION = re.compile(r"%(?P<flags>[-+ #0]*)(?P<width>\*|\d+)?(?:\.(?P<prec>\*|\d*))?"
+                        r"(?P<len>hh|h|ll|l|j|z|t|L)?(?P<conv>[diouxXcspfFeEgGaAn%])")
+
+
+class Truncated(Exception):
+    pass
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def byte(self):
+        if self.pos >= len(self.data):
+            raise Truncated()
+        self.pos += 1
+        return self.data[self.pos - 1]
+
+    def bytes(self, n):
+        if self.pos + n > len(self.data):
+            raise Truncated()
+        self.pos += n
+        return self.data[self.pos - n:self.pos]
+
+    def u16(self):
+        return struct.unpack("<H", self.bytes(2))[0]
+
+    def varint(self):
+        value = shift = 0
+        while True:
+            b = self.byte()
+            value |= (b & 0x7F) << shift
+            if not b & 0x80:
+                return value
+            shift += 7
+
+    def signed(self):
+        v = self.varint()
+        return (v >> 1) ^ -(v & 1)
+
+    def rest(self):
+        return self.bytes(len(self.data) - self.pos)
+
+
+def decompress(data):
+    """Byte-aligned LZSS from include/LogCompress.h."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        control = data[i]
+        i += 1
+        for bit in range(8):
+            if i >= len(data):
+                break
+            if control & (1 << bit):
+                if i + 1 >= len(data):
+                    raise Truncated()
+                offset = (data[i] | (data[i + 1] >> 4) << 8) + 1
+                length = (data[i + 1] & 0x0F) + 3
+                i += 2
+                if offset > len(out):
+                    raise ValueError("bad match offset")
+                for _ in range(length):
+                    out.append(out[-offset])
+            else:
+                out.append(data[i])
+                i += 1
+    return bytes(out)
+
+
+def render(fmt, args):
+    """printf-style rendering of LogToken-encoded arguments (include/LogToken.h)."""
+    r = Reader(args)
+    out = []
+    pos = 0
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        conv = m.group("conv")
+        if conv == "%":
+            out.append("%")
+            continue
+        try:
+            width = str(r.signed()) if m.group("width") == "*" else (m.group("width") or "")
+            prec = m.group("prec")
+            if prec == "*":
+                prec = str(r.signed())
+            spec = "%" + m.group("flags") + width + ("." + prec if prec is not None else "")
+            if conv in "di":
+                out.append((spec + "d") % r.signed())
+            elif conv in "uoxX":
+                out.append((spec + ("d" if conv == "u" else conv)) % r.varint())
+            elif conv == "c":
+                out.append((spec + "c") % chr(r.varint()))
+            elif conv == "p":
+                out.append("0x%x" % r.varint())
+            elif conv in "fFeEgGaA":
+                value = struct.unpack("<f", r.bytes(4))[0]
+                out.append((spec + (conv if conv not in "aA" else "e")) % value)
+            elif conv == "s":
+                out.append((spec + "s") % r.bytes(r.byte()).decode("utf-8", errors="replace"))
+        except Truncated:
+            out.append("...")
+            return "".join(out)
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+def decode_entry(r, dictionary):
+    head = r.byte()
+    timestamp = r.varint()
+    tag_token = r.u16()
+    token = r.u16()
+    args = r.bytes(r.byte())
+
+    level = LEVELS.get(head & 0x07, "UNKNOWN")
+    tag = dictionary["tags"].get("0x%04x" % tag_token, "tag:%04x" % tag_token)
+    line = "%d [%s] [%s]" % (timestamp, level, tag)
+
+    if head & 0x08:
+        a = Reader(args)
+        duration, heap = a.varint(), a.varint()
+        details = a.rest().decode("utf-8", errors="replace")
+        event = dictionary["events"].get("0x%04x" % token, "event:%04x" % token)
+        line += " [Core:%d, Heap:%d]: PERF: Event='%s', Duration=%dms, Success=%s" % (
+            1 if head & 0x40 else 0, heap, event, duration, "true" if head & 0x10 else "false")
+        if details:
+            line += ", Details='%s'" % details
+    elif token == 0:
+        line += ": " + args.decode("utf-8", errors="replace")
+    else:
+        fmt = dictionary["formats"].get("0x%04x" % token)
+        if fmt is None:
+            line += ": <unknown format %04x> %s" % (token, args.hex())
+        else:
+            line += ": " + render(fmt, args)
+    if head & 0x20:
+        line += " [truncated]"
+    if head & 0x80:
+        line += " [replayed]"
+    return line
+
+
+def decode_frame(data, dictionary):
+    """Returns (sequence, lines)."""
+    r = Reader(data)
+    if r.byte() != MAGIC or r.byte() != VERSION:
+        raise ValueError("not a version %d log frame" % VERSION)
+    flags = r.byte()
+    r.bytes(r.byte())  # API key
+    sequence = r.varint()
+    body = r.rest()
+    if flags & FLAG_COMPRESSED:
+        body = decompress(body)
+    b = Reader(body)
+    lines = []
+    while b.pos < len(body):
+        lines.append(decode_entry(b, dictionary))
+    return sequence, lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--dict", required=True, help="log_dictionary.json from tools/log_dictionary.py")
+    parser.add_argument("input", nargs="?", type=argparse.FileType("r"), default=sys.stdin)
+    args = parser.parse_args()
+
+    with open(args.dict, encoding="utf-8") as f:
+        dictionary = json.load(f)
+
+    expected = None
+    for text in args.input:
+        text = text.strip()
+        if not text:
+            continue
+        try:
+            sequence, lines = decode_frame(bytes.fromhex(text), dictionary)
+            if expected is not None and sequence != expected:
+                print("-- %d frame(s) missing or device restarted (seq %d, expected %d)" % (
+                    (sequence - expected) & 0xFFFFFFFF, sequence, expected), file=sys.stderr)
+            expected = (sequence + 1) & 0xFFFFFFFF
+            for line in lines:
+                print(line, flush=True)
+        except (ValueError, Truncated) as e:
+            print("bad frame (%s): %s" % (e or "truncated", text), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+"""Modbus RTU relay-module simulator on a pseudo terminal.
+
+Creates a pty, prints its path and answers as one or more relay modules
+(coils only: FC01, FC05, FC15). Used to exercise the RS485 relay-expansion
+backend without hardware, e.g. bridged to a USB-RS485 adapter:
+
+    python3 tools/modbus_slave_sim.py --slave 1:8 --slave 2:16
+    socat /dev/ttyUSB0,raw,b9600 <printed pty path>,raw
+
+--drop and --delay inject missing and late responses to check timeouts,
+offline detection and resynchronisation.
+"""
+
+import argparse
+import os
+import random
+import select
+import sys
+import termios
+import time
+import tty
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def with_crc(frame):
+    crc = crc16(frame)
+    return bytes(frame) + bytes([crc & 0xFF, crc >> 8])
+
+
+def exception(slave, function, code):
+    return with_crc([slave, function | 0x80, code])
+
+
+class RelayModule:
+    def __init__(self, address, coils):
+        self.address = address
+        self.coils = [False] * coils
+
+    def handle(self, pdu):
+        function = pdu[0]
+        if function == 0x01 and len(pdu) == 5:
+            start = (pdu[1] << 8) | pdu[2]
+            count = (pdu[3] << 8) | pdu[4]
+            if count == 0 or start + count > len(self.coils):
+                return exception(self.address, function, 0x02)
+            data = bytearray((count + 7) // 8)
+            for i in range(count):
+                if self.coils[start + i]:
+                    data[i // 8] |= 1 << (i % 8)
+            return with_crc([self.address, function, len(data)] + list(data))
+        if function == 0x05 and len(pdu) == 5:
+            addr = (pdu[1] << 8) | pdu[2]
+            if addr >= len(self.coils):
+                return exception(self.address, function, 0x02)
+            self.coils[addr] = pdu[3] == 0xFF
+            return with_crc([self.address] + list(pdu))
+        if function == 0x0F and len(pdu) >= 6:
+            start = (pdu[1] << 8) | pdu[2]
+            count = (pdu[3] << 8) | pdu[4]
+            data = pdu[6:6 + pdu[5]]
+            if count == 0 or start + count > len(self.coils) or len(data) < (count + 7) // 8:
+                return exception(self.address, function, 0x02)
+            for i in range(count):
+                self.coils[start + i] = bool(data[i // 8] & (1 << (i % 8)))
+            return with_crc([self.address] + list(pdu[:5]))
+        return exception(self.address, function, 0x01)
+
+    def state(self):
+        return "".join("1" if c else "0" for c in self.coils)
+
+
+def parse_slave(text):
+    address, coils = text.split(":")
+    return RelayModule(int(address), int(coils))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--slave", action="append", type=parse_slave, required=True,
+                        help="module as address:coil_count (repeatable)")
+    parser.add_argument("--gap-ms", type=float, default=4.0, help="silence that ends a request frame")
+    parser.add_argument("--drop", type=float, default=0.0, help="probability of not answering a request")
+    parser.add_argument("--delay-ms", type=float, default=0.0, help="extra delay before each response")
+    args = parser.parse_args()
+
+    modules = {m.address: m for m in args.slave}
+    master, slave = os.openpty()
+    tty.setraw(master)
+    tty.setraw(slave)
+    attrs = termios.tcgetattr(slave)
+    attrs[3] &= ~termios.ECHO
+    termios.tcsetattr(slave, termios.TCSANOW, attrs)
+    print("Modbus simulator on %s (modules: %s)" % (os.ttyname(slave), ", ".join(
+        "%d:%d" % (m.address, len(m.coils)) for m in args.slave)), flush=True)
+
+    buf = bytearray()
+    while True:
+        ready, _, _ = select.select([master], [], [], args.gap_ms / 1000.0 if buf else None)
+        if ready:
+            buf += os.read(master, 256)
+            continue
+
+        frame, buf = bytes(buf), bytearray()
+        if len(frame) < 4 or crc16(frame[:-2]) != (frame[-2] | (frame[-1] << 8)):
+            print("bad frame: %s" % frame.hex(" "), file=sys.stderr)
+            continue
+        module = modules.get(frame[0])
+        if module is None:
+            continue
+        if random.random() < args.drop:
+            print("slave %d: dropped %s" % (module.address, frame.hex(" ")))
+            continue
+        if args.delay_ms:
+            time.sleep(args.delay_ms / 1000.0)
+        response = module.handle(frame[1:-2])
+        os.write(master, response)
+        print("slave %d: %s -> %s  coils=%s" % (module.address, frame.hex(" "), response.hex(" "), module.state()),
+              flush=True)
+
+
+if __name__ == "__main__":
+    main()